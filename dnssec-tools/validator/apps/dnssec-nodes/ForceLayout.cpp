@@ -0,0 +1,210 @@
+#include "ForceLayout.h"
+
+// how hard every node pushes the others away
+static const qreal repulsion = 150.0;
+
+// a group of nodes whose cell is smaller than this share of its distance
+// is treated as a single node
+static const qreal theta = 0.7;
+
+// nodes closer together than this share a quadtree cell
+static const qreal minCellSize = 0.5;
+
+namespace {
+    struct Cell {
+        qreal cx, cy, half; // the square covered by the cell
+        qreal sx, sy;       // the sum of the positions of its bodies
+        int   count;
+        int   body;         // the only body of a leaf, or -1
+        int   child[4];     // indexes of the quadrants' cells, or -1
+    };
+}
+
+static int newCell(QVector<Cell> &cells, qreal cx, qreal cy, qreal half)
+{
+    Cell cell;
+
+    cell.cx = cx;
+    cell.cy = cy;
+    cell.half = half;
+    cell.sx = cell.sy = 0;
+    cell.count = 0;
+    cell.body = -1;
+    for (int q = 0; q < 4; q++)
+        cell.child[q] = -1;
+    cells.append(cell);
+    return cells.size() - 1;
+}
+
+static int childCell(QVector<Cell> &cells, int parent, qreal x, qreal y)
+{
+    int q = (x >= cells[parent].cx ? 1 : 0) + (y >= cells[parent].cy ? 2 : 0);
+
+    if (cells[parent].child[q] < 0) {
+        qreal half = cells[parent].half / 2;
+        qreal cx = cells[parent].cx + ((q & 1) ? half : -half);
+        qreal cy = cells[parent].cy + ((q & 2) ? half : -half);
+        int child = newCell(cells, cx, cy, half);
+        cells[parent].child[q] = child;
+    }
+    return cells[parent].child[q];
+}
+
+static void insertBody(QVector<Cell> &cells,
+                       const QVector<ForceLayout::Body> &bodies, int i)
+{
+    qreal x = bodies[i].x, y = bodies[i].y;
+    int   c = 0;
+
+    for (;;) {
+        cells[c].sx += x;
+        cells[c].sy += y;
+        cells[c].count++;
+
+        if (cells[c].count == 1) {
+            cells[c].body = i;
+            return;
+        }
+        if (cells[c].half < minCellSize) {
+            // too close to split; the cell keeps them all
+            cells[c].body = -1;
+            return;
+        }
+        if (cells[c].body >= 0) {
+            // move the leaf's body down a level before adding this one
+            int   other = cells[c].body;
+            int   child = childCell(cells, c, bodies[other].x, bodies[other].y);
+
+            cells[c].body = -1;
+            cells[child].sx = bodies[other].x;
+            cells[child].sy = bodies[other].y;
+            cells[child].count = 1;
+            cells[child].body = other;
+        }
+        c = childCell(cells, c, x, y);
+    }
+}
+
+ForceLayout::ForceLayout(QObject *parent) :
+    QThread(parent), m_bodies(), m_edges(), m_bounds(), m_positions()
+{
+}
+
+ForceLayout::~ForceLayout()
+{
+    wait();
+}
+
+bool ForceLayout::startStep(const QVector<Body> &bodies, const QVector<int> &edges,
+                            const QRectF &bounds)
+{
+    if (isRunning())
+        return false;
+
+    m_bodies = bodies;
+    m_edges = edges;
+    m_bounds = bounds;
+    start(QThread::LowPriority);
+    return true;
+}
+
+void ForceLayout::run()
+{
+    step(m_bodies, m_edges, m_bounds, m_positions);
+}
+
+void ForceLayout::step(const QVector<Body> &bodies, const QVector<int> &edges,
+                       const QRectF &bounds, QVector<QPointF> &positions)
+{
+    int n = bodies.size();
+    QVector<qreal> xvel(n, 0), yvel(n, 0);
+    QVector<Cell>  cells;
+    QVector<int>   stack;
+
+    positions.resize(n);
+    if (n == 0)
+        return;
+
+    //
+    // Build a quadtree over a square around all of the bodies
+    //
+    qreal minX = bodies[0].x, maxX = bodies[0].x;
+    qreal minY = bodies[0].y, maxY = bodies[0].y;
+    for (int i = 1; i < n; i++) {
+        minX = qMin(minX, bodies[i].x);
+        maxX = qMax(maxX, bodies[i].x);
+        minY = qMin(minY, bodies[i].y);
+        maxY = qMax(maxY, bodies[i].y);
+    }
+    cells.reserve(2 * n);
+    newCell(cells, (minX + maxX) / 2, (minY + maxY) / 2,
+            qMax(maxX - minX, maxY - minY) / 2 + 1);
+    for (int i = 0; i < n; i++)
+        insertBody(cells, bodies, i);
+
+    //
+    // Sum up all forces pushing each body away
+    //
+    for (int i = 0; i < n; i++) {
+        if (bodies[i].fixed)
+            continue;
+
+        stack.resize(0);
+        stack.append(0);
+        while (!stack.isEmpty()) {
+            const Cell &cell = cells[stack.last()];
+            stack.resize(stack.size() - 1);
+
+            qreal dx = bodies[i].x - cell.sx / cell.count;
+            qreal dy = bodies[i].y - cell.sy / cell.count;
+            qreal distance2 = dx * dx + dy * dy;
+
+            bool leaf = (cell.child[0] < 0 && cell.child[1] < 0 &&
+                         cell.child[2] < 0 && cell.child[3] < 0);
+            if (!leaf && 4 * cell.half * cell.half >= theta * theta * distance2) {
+                // too close to be treated as one; look at the quadrants
+                for (int q = 0; q < 4; q++) {
+                    if (cell.child[q] >= 0)
+                        stack.append(cell.child[q]);
+                }
+                continue;
+            }
+            if (cell.body == i)
+                continue;
+
+            double l = 2.0 * distance2;
+            if (l > 0) {
+                xvel[i] += cell.count * (dx * repulsion) / l;
+                yvel[i] += cell.count * (dy * repulsion) / l;
+            }
+        }
+    }
+
+    //
+    // Now subtract all forces pulling bodies together
+    //
+    for (int e = 0; e + 1 < edges.size(); e += 2) {
+        int a = edges[e], b = edges[e + 1];
+        qreal dx = bodies[a].x - bodies[b].x;
+        qreal dy = bodies[a].y - bodies[b].y;
+
+        xvel[a] -= dx / bodies[a].weight;
+        yvel[a] -= dy / bodies[a].weight;
+        xvel[b] += dx / bodies[b].weight;
+        yvel[b] += dy / bodies[b].weight;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (bodies[i].fixed) {
+            positions[i] = QPointF(bodies[i].x, bodies[i].y);
+            continue;
+        }
+        if (qAbs(xvel[i]) < 0.1 && qAbs(yvel[i]) < 0.1)
+            xvel[i] = yvel[i] = 0;
+
+        qreal x = bodies[i].x + xvel[i];
+        qreal y = bodies[i].y + yvel[i];
+        positions[i] = QPointF(qMin(qMax(x, bounds.left() + 10), bounds.right() - 10),
+                               qMin(qMax(y, bounds.top() + 10), bounds.bottom() - 10));
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef FORCELAYOUT_H
+#define FORCELAYOUT_H
+
+#include <QThread>
+#include <QVector>
+#include <QPointF>
+#include <QRectF>
+
+//
+// Implementation note:
+//   Each node of the springy layout used to sum the push of every other
+//   node in the scene itself, which made a frame O(n^2).  This works out
+//   a whole step at once, over plain arrays copied out of the scene, and
+//   approximates the push of far away groups of nodes by that of their
+//   centre with a quadtree (Barnes-Hut), which makes it O(n log n).  The
+//   step runs in this thread; the graph copies the positions back into
+//   its nodes once finished() is emitted.
+
+class ForceLayout : public QThread
+{
+    Q_OBJECT
+public:
+    explicit ForceLayout(QObject *parent = 0);
+    ~ForceLayout();
+
+    struct Body {
+        qreal x, y;
+        qreal weight;   // the pull of a body's edges is divided by this
+        bool  fixed;    // pushes the others, but doesn't move itself
+    };
+
+    // Start working out the next positions of bodies; edges holds pairs
+    // of indexes into bodies.  Returns false if a step is still running.
+    bool startStep(const QVector<Body> &bodies, const QVector<int> &edges,
+                   const QRectF &bounds);
+
+    // The positions worked out by the last step, in the order of its bodies
+    QVector<QPointF> positions() const { return m_positions; }
+
+    static void step(const QVector<Body> &bodies, const QVector<int> &edges,
+                     const QRectF &bounds, QVector<QPointF> &positions);
+
+private:
+    void run();
+
+    QVector<Body>     m_bodies;
+    QVector<int>      m_edges;
+    QRectF            m_bounds;
+    QVector<QPointF>  m_positions;
+};
+
+#endif // FORCELAYOUT_H
@@ -3,6 +3,9 @@
 #include "graphwidget.h"
 
 #include <QtCore/QSettings>
+#include <QtCore/QFileInfo>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QVarLengthArray>
 #include <QtGui/QColor>
 
 #include <qdebug.h>
@@ -22,8 +25,18 @@
 #define UNBOUND_ANGLE_MATCH "<([^ ]+) ([A-Z0-9]+) IN>"
 #define UNBOUND_MATCH       "([^ ]+) ([A-Z0-9]+) IN"
 
+// How much of a log file to read before letting the event loop run again
+#define READ_CHUNK_SIZE (4 * 1024 * 1024)
+
+// How much of the start of a log file identifies it
+#define HEAD_SIZE 4096
+
+// How often to look for rotated files, which file change notices miss,
+// and to save how far into each we have read
+#define CHECK_INTERVAL 5000
+
 LogWatcher::LogWatcher(GraphWidget *parent)
-    : m_graphWidget(parent), m_timer(0),
+    : m_graphWidget(parent), m_logFileNames(), m_logFiles(), m_timer(0), m_fileWatcher(0), m_parseScheduled(false),
 
       // libval regexps
       m_validatedRegexp("Validation result for " QUERY_MATCH ": VAL_SUCCESS:"),
@@ -60,45 +73,67 @@ LogWatcher::LogWatcher(GraphWidget *parent)
       //m_unboundAnswerResponseRegexp(UNBOUND_PAREN_MATCH "answer_response"),
       //m_unboundProvenNSECRegexp(UNBOUND_MATCH "nonexistence proof\\(s\\) found"),
 
-      m_regexpList()
+      m_regexpList(), m_prefilters(), m_prefilterLiterals(), m_pinsecurePrefilter("Setting proof status for ")
 {
     m_nodeList = m_graphWidget->nodeList();
 
     // libval regexps
-    m_regexpList.push_back(RegexpData(m_validatedRegexp,          DNSData::VALIDATED, "green") );
-    m_regexpList.push_back(RegexpData(m_validatedChainPartRegexp, DNSData::VALIDATED, "green") );
-    m_regexpList.push_back(RegexpData(m_cryptoSuccessRegexp,      DNSData::VALIDATED, "green") );
-    m_regexpList.push_back(RegexpData(m_lookingUpRegexp,          DNSData::UNKNOWN,   "black") );
-    m_regexpList.push_back(RegexpData(m_bogusRegexp,              DNSData::FAILED,    "red") );
-    m_regexpList.push_back(RegexpData(m_trustedRegexp,            DNSData::TRUSTED,   "brown") );
-    m_regexpList.push_back(RegexpData(m_pinsecure2Regexp,         DNSData::TRUSTED,   "brown"));
-    m_regexpList.push_back(RegexpData(m_dneRegexp,                DNSData::VALIDATED | DNSData::DNE,   "green"));
-    m_regexpList.push_back(RegexpData(m_maybeDneRegexp,           DNSData::DNE,       "brown"));
-    m_regexpList.push_back(RegexpData(m_ignoreValidationRegexp,   DNSData::IGNORE,    "brown"));
+    addRegexp(m_validatedRegexp,          DNSData::VALIDATED, "green", "Validation result for ");
+    addRegexp(m_validatedChainPartRegexp, DNSData::VALIDATED, "green", "status=VAL_AC_VERIFIED:");
+    addRegexp(m_cryptoSuccessRegexp,      DNSData::VALIDATED, "green", "Verified a RRSIG for ");
+    addRegexp(m_lookingUpRegexp,          DNSData::UNKNOWN,   "black", "looking for {");
+    addRegexp(m_bogusRegexp,              DNSData::FAILED,    "red", "Validation result for ");
+    addRegexp(m_trustedRegexp,            DNSData::TRUSTED,   "brown", "Validation result for ");
+    addRegexp(m_pinsecure2Regexp,         DNSData::TRUSTED,   "brown", "Setting authentication chain status for ");
+    addRegexp(m_dneRegexp,                DNSData::VALIDATED | DNSData::DNE,   "green", "VAL_NONEXISTENT_");
+    addRegexp(m_maybeDneRegexp,           DNSData::DNE,       "brown", "_NOCHAIN:");
+    addRegexp(m_ignoreValidationRegexp,   DNSData::IGNORE,    "brown", "already set to VAL_IGNORE_VALIDATION");
 
     // bind regexps
-    m_regexpList.push_back(RegexpData(m_bindBogusRegexp,          DNSData::FAILED,    "red"));
-    m_regexpList.push_back(RegexpData(m_bindValidatedRegex,       DNSData::VALIDATED, "green"));
-    m_regexpList.push_back(RegexpData(m_bindQueryRegexp,          DNSData::UNKNOWN,   "black"));
-    m_regexpList.push_back(RegexpData(m_bindPIRegexp,             DNSData::TRUSTED,   "brown"));
-    m_regexpList.push_back(RegexpData(m_bindTrustedAnswerRegexp,  DNSData::TRUSTED,   "brown"));
-    m_regexpList.push_back(RegexpData(m_bindAnswerResponseRegexp, DNSData::UNKNOWN,   "brown"));
+    addRegexp(m_bindBogusRegexp,          DNSData::FAILED,    "red", "failed to verify");
+    addRegexp(m_bindValidatedRegex,       DNSData::VALIDATED, "green", "verify rdataset");
+    addRegexp(m_bindQueryRegexp,          DNSData::UNKNOWN,   "black", "): query");
+    addRegexp(m_bindPIRegexp,             DNSData::TRUSTED,   "brown", "proveunsecure");
+    addRegexp(m_bindTrustedAnswerRegexp,  DNSData::TRUSTED,   "brown", "dsfetched");
+    addRegexp(m_bindAnswerResponseRegexp, DNSData::UNKNOWN,   "brown", "): answer_response");
     // Unfortunately, this catches missing servers and stuff and doesn't mark *only* non-existance
-    // m_regexpList.push_back(RegexpData(m_bindNoAnswerResponseRegexp, DNSData::DNE,   "brown"));
-    m_regexpList.push_back(RegexpData(m_bindDNERegexp,            DNSData::DNE,       "brown"));
-    m_regexpList.push_back(RegexpData(m_bindProvenNSECRegexp,     DNSData::DNE | DNSData::VALIDATED,   "brown"));
+    // addRegexp(m_bindNoAnswerResponseRegexp, DNSData::DNE,   "brown", "): noanswer_response");
+    addRegexp(m_bindDNERegexp,            DNSData::DNE,       "brown", "): nonexistence validation OK");
+    addRegexp(m_bindProvenNSECRegexp,     DNSData::DNE | DNSData::VALIDATED,   "brown", "nonexistence proof(s) found");
 
     // unbound regexps
-    m_regexpList.push_back(RegexpData(m_unboundBogusRegexp,          DNSData::FAILED,    "red"));
-    m_regexpList.push_back(RegexpData(m_unboundValidatedRegex,       DNSData::VALIDATED, "green"));
-    m_regexpList.push_back(RegexpData(m_unboundQueryRegexp,          DNSData::UNKNOWN,   "black"));
-    m_regexpList.push_back(RegexpData(m_unboundPIRegexp,             DNSData::TRUSTED,   "brown"));
-    m_regexpList.push_back(RegexpData(m_unboundTrustedAnswerRegexp,  DNSData::TRUSTED,   "brown"));
-    m_regexpList.push_back(RegexpData(m_unboundAnswerResponseRegexp, DNSData::UNKNOWN,   "brown"));
+    addRegexp(m_unboundBogusRegexp,          DNSData::FAILED,    "red", "validation failure <");
+    addRegexp(m_unboundValidatedRegex,       DNSData::VALIDATED, "green", "validation success ");
+    addRegexp(m_unboundQueryRegexp,          DNSData::UNKNOWN,   "black", "resolving");
+    // These have no patterns yet, and an empty QRegExp matches every line
+    // addRegexp(m_unboundPIRegexp,             DNSData::TRUSTED,   "brown", "");
+    // addRegexp(m_unboundTrustedAnswerRegexp,  DNSData::TRUSTED,   "brown", "");
+    // addRegexp(m_unboundAnswerResponseRegexp, DNSData::UNKNOWN,   "brown", "");
     // Unfortunately, this catches missing servers and stuff and doesn't mark *only* non-existance
-    // m_regexpList.push_back(RegexpData(m_unboundNoAnswerResponseRegexp, DNSData::DNE,   "brown"));
-    m_regexpList.push_back(RegexpData(m_unboundDNERegexp,            DNSData::DNE,       "brown"));
-    m_regexpList.push_back(RegexpData(m_unboundProvenNSECRegexp,     DNSData::DNE | DNSData::VALIDATED,   "brown"));
+    // addRegexp(m_unboundNoAnswerResponseRegexp, DNSData::DNE,   "brown", "");
+    // addRegexp(m_unboundDNERegexp,            DNSData::DNE,       "brown", "");
+    // addRegexp(m_unboundProvenNSECRegexp,     DNSData::DNE | DNSData::VALIDATED,   "brown", "");
+}
+
+LogWatcher::~LogWatcher()
+{
+    while (!m_logFiles.isEmpty()) {
+        LogFileState *state = m_logFiles.takeFirst();
+        saveCheckpoint(state);
+        delete state;
+    }
+}
+
+void LogWatcher::addRegexp(const QRegExp &regexp, int status, const QString &colorName, const QString &literal)
+{
+    int prefilter = m_prefilterLiterals.indexOf(literal);
+
+    if (prefilter < 0) {
+        prefilter = m_prefilters.count();
+        m_prefilterLiterals.push_back(literal);
+        m_prefilters.push_back(QStringMatcher(literal));
+    }
+    m_regexpList.push_back(RegexpData(regexp, status, colorName, prefilter));
 }
 
 
@@ -111,11 +146,20 @@ bool LogWatcher::parseLogMessage(QString logMessage) {
 
     // qDebug() << logMessage;
 
+    // most lines contain none of the literals, and those are far cheaper
+    // to look for than running the regexps; -1 means not looked for yet
+    QVarLengthArray<int, 32> hasLiteral(m_prefilters.count());
+    for (int p = 0; p < hasLiteral.size(); p++)
+        hasLiteral[p] = -1;
+
     // loop through all the registered regexps and mark them appropriately
     QList< RegexpData >::const_iterator i = m_regexpList.constBegin();
     QList< RegexpData >::const_iterator last = m_regexpList.constEnd();
     while (i != last) {
-        if ((*i).regexp.indexIn(logMessage) > -1) {
+        int &found = hasLiteral[(*i).prefilter];
+        if (found < 0)
+            found = (m_prefilters[(*i).prefilter].indexIn(logMessage) > -1);
+        if (found && (*i).regexp.indexIn(logMessage) > -1) {
             if (m_graphWidget && !m_graphWidget->showNsec3() && (*i).regexp.cap(2) == "NSEC3")
                 return false;
             if ((*i).regexp.cap(2) == "NSEC")
@@ -131,7 +175,7 @@ bool LogWatcher::parseLogMessage(QString logMessage) {
     }
 
     // This one can't be put in the normal list since it remarks the data type as DS
-    if (m_pinsecureRegexp.indexIn(logMessage) > -1) {
+    if (m_pinsecurePrefilter.indexIn(logMessage) > -1 && m_pinsecureRegexp.indexIn(logMessage) > -1) {
         nodeName = m_pinsecureRegexp.cap(1);
         // XXX: need the query type
         //result.setRecordType(m_validatedRegexp.cap(2));
@@ -157,64 +201,179 @@ bool LogWatcher::parseLogMessage(QString logMessage) {
 
 void LogWatcher::parseLogFile(const QString &fileToOpen, bool skipToEnd) {
     QString fileName = fileToOpen;
-    QFile       *logFile;
-    QTextStream *logStream;
+    LogFileState *state;
 
     if (fileName.length() == 0)
         return;
 
     // qDebug() << "Trying to open: " << fileName;
 
-    // start the timer to keep reading/trying the log file
+    // Changes are noticed through the file watcher (inotify on linux);
+    // the timer only looks for files that were rotated or recreated
     if (!m_timer) {
+        m_fileWatcher = new QFileSystemWatcher(this);
+        connect(m_fileWatcher, SIGNAL(fileChanged(QString)), this, SLOT(parseTillEnd()));
+
         m_timer = new QTimer(this);
-        connect(m_timer, SIGNAL(timeout()), this, SLOT(parseTillEnd()));
-        m_timer->start(1000);
+        connect(m_timer, SIGNAL(timeout()), this, SLOT(checkLogFiles()));
+        m_timer->start(CHECK_INTERVAL);
     }
 
-    logFile = new QFile(fileName);
-    if (!logFile->exists() || !logFile->open(QIODevice::ReadOnly | QIODevice::Text)) {
-        delete logFile;
-        logFile = 0;
+    state = new LogFileState(fileName);
+    if (!openLogFile(state)) {
+        delete state;
         return;
     }
 
-    logStream = new QTextStream(logFile);
-
     m_logFileNames.push_back(fileToOpen);
-    m_logFiles.push_back(logFile);
-    m_logStreams.push_back(logStream);
-
-    // QFile doesn't implement a file watcher, so this won't work:
-    // connect(logFile, SIGNAL(readyRead()), this, SLOT(parseTillEnd()));
+    m_logFiles.push_back(state);
 
     // qDebug() << "Opened: " << fileName;
 
-    // if requested, skip to the end of the file
-    if (skipToEnd)
-        logStream->seek(logStream->device()->bytesAvailable());
+    // if requested, skip to the end of the file; or at least to where we
+    // were last time, so whatever was logged in between isn't missed
+    if (skipToEnd) {
+        state->offset = state->file.size();
+        loadCheckpoint(state);
+    }
 
     parseTillEnd();
 }
 
+bool LogWatcher::openLogFile(LogFileState *state) {
+    if (state->file.isOpen())
+        state->file.close();
+
+    if (!state->file.exists() || !state->file.open(QIODevice::ReadOnly))
+        return false;
+
+    state->offset = 0;
+    state->partial.clear();
+    state->headLength = qMin(state->file.size(), (qint64) HEAD_SIZE);
+    state->headHash = QCryptographicHash::hash(state->file.read(state->headLength), QCryptographicHash::Md5);
+
+    if (m_fileWatcher && !m_fileWatcher->files().contains(state->name))
+        m_fileWatcher->addPath(state->name);
+    return true;
+}
+
+// Does the file still start the way it did when we opened it?
+bool LogWatcher::sameLogFile(LogFileState *state) {
+    QFile current(state->name);
+
+    if (!current.open(QIODevice::ReadOnly) || current.size() < state->headLength)
+        return false;
+    return QCryptographicHash::hash(current.read(state->headLength), QCryptographicHash::Md5) == state->headHash;
+}
+
+void LogWatcher::loadCheckpoint(LogFileState *state) {
+    QSettings settings("DNSSEC-Tools", "dnssec-nodes");
+    QString key = QCryptographicHash::hash(state->name.toUtf8(), QCryptographicHash::Md5).toHex();
+
+    settings.beginGroup("logCheckpoints");
+    settings.beginGroup(key);
+    qint64     offset = settings.value("offset", -1).toLongLong();
+    qint64     headLength = settings.value("headLength", -1).toLongLong();
+    QByteArray headHash = settings.value("headHash").toByteArray();
+    settings.endGroup();
+    settings.endGroup();
+
+    if (offset < 0 || offset > state->file.size() || headLength != state->headLength || headHash != state->headHash)
+        return;
+    state->offset = offset;
+}
+
+void LogWatcher::saveCheckpoint(LogFileState *state) {
+    qint64 offset = state->offset - state->partial.size();
+
+    // every QSettings rewrites the settings file; skip it if nothing moved
+    if (offset == state->savedOffset)
+        return;
+
+    QSettings settings("DNSSEC-Tools", "dnssec-nodes");
+    QString key = QCryptographicHash::hash(state->name.toUtf8(), QCryptographicHash::Md5).toHex();
+
+    settings.beginGroup("logCheckpoints");
+    settings.beginGroup(key);
+    settings.setValue("fileName", state->name);
+    settings.setValue("offset", offset);
+    settings.setValue("headLength", state->headLength);
+    settings.setValue("headHash", state->headHash);
+    settings.endGroup();
+    settings.endGroup();
+    state->savedOffset = offset;
+}
+
 void LogWatcher::parseTillEnd() {
     bool newData = false;
-
-    foreach(QTextStream *logStream, m_logStreams) {
-        while (!logStream->atEnd()) {
-            QString line = logStream->readLine();
-            if (parseLogMessage(line))
+    bool moreToRead = false;
+
+    m_parseScheduled = false;
+
+    foreach(LogFileState *state, m_logFiles) {
+        if (!state->file.isOpen())
+            continue;
+
+        // the file was truncated underneath us; start over
+        if (state->file.size() < state->offset && !openLogFile(state))
+            continue;
+
+        if (!state->file.seek(state->offset))
+            continue;
+
+        // read a piece at a time, so a large file doesn't hang the display
+        QByteArray chunk = state->file.read(READ_CHUNK_SIZE);
+        if (chunk.isEmpty())
+            continue;
+        state->offset += chunk.size();
+        if (state->offset < state->file.size())
+            moreToRead = true;
+
+        int start = 0, end;
+        while ((end = chunk.indexOf('\n', start)) >= 0) {
+            QByteArray line = chunk.mid(start, end - start);
+            if (!state->partial.isEmpty()) {
+                line.prepend(state->partial);
+                state->partial.clear();
+            }
+            if (line.endsWith('\r'))
+                line.chop(1);
+            if (parseLogMessage(QString::fromLocal8Bit(line.constData(), line.size())))
                 newData = true;
+            start = end + 1;
         }
+        // keep the rest until the line is finished
+        state->partial.append(chunk.mid(start));
     }
     if (newData)
         emit dataChanged();
+
+    if (moreToRead && !m_parseScheduled) {
+        m_parseScheduled = true;
+        QTimer::singleShot(0, this, SLOT(parseTillEnd()));
+    }
 }
 
-void LogWatcher::reReadLogFile() {
-    while (!m_logStreams.isEmpty())
-        delete m_logStreams.takeFirst();
+void LogWatcher::checkLogFiles() {
+    foreach(LogFileState *state, m_logFiles) {
+        // log rotation leaves us reading a file nobody writes to anymore
+        if (!sameLogFile(state)) {
+            if (!openLogFile(state))
+                state->file.close(); // gone for now; try again later
+        } else if (!state->file.isOpen()) {
+            openLogFile(state);
+        }
+    }
+
+    parseTillEnd();
 
+    // a busy log changes far more often than is worth writing down;
+    // the destructor saves wherever we finally got to
+    foreach(LogFileState *state, m_logFiles)
+        saveCheckpoint(state);
+}
+
+void LogWatcher::reReadLogFile() {
     while (!m_logFiles.isEmpty())
         delete m_logFiles.takeFirst();
 
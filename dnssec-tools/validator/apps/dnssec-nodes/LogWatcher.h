@@ -9,6 +9,9 @@
 #include <QtCore/QTimer>
 #include <QtCore/QList>
 #include <QtCore/QPair>
+#include <QtCore/QByteArray>
+#include <QtCore/QStringMatcher>
+#include <QtCore/QFileSystemWatcher>
 
 #include "NodeList.h"
 #include "DNSData.h"
@@ -18,10 +21,25 @@ class NodeList;
 
 class RegexpData {
 public:
-    RegexpData(QRegExp r, int s, QString c) : regexp(r), status(s), colorName(c) { }
+    RegexpData(QRegExp r, int s, QString c, int p) : regexp(r), status(s), colorName(c), prefilter(p) { }
     QRegExp         regexp;
     int             status;
     QString         colorName;
+    int             prefilter;  // index of a literal any match must contain
+};
+
+// How far into a log file we've read, and what it started with so that a
+// rotated or truncated file can be told apart from one that grew.
+class LogFileState {
+public:
+    LogFileState(const QString &n) : name(n), file(n), offset(0), partial(), headLength(0), headHash(), savedOffset(-1) { }
+    QString         name;
+    QFile           file;
+    qint64          offset;     // of the first byte not yet read
+    QByteArray      partial;    // the start of a line still being written
+    qint64          headLength;
+    QByteArray      headHash;
+    qint64          savedOffset; // as last written by saveCheckpoint()
 };
 
 class LogWatcher : public QObject
@@ -30,6 +48,7 @@ class LogWatcher : public QObject
 
 public:
     LogWatcher(GraphWidget *parent = 0);
+    ~LogWatcher();
 
     void parseLogFile(const QString &fileToOpen, bool skipToEnd = false);
     bool parseLogMessage(QString logMessage);
@@ -39,19 +58,27 @@ public:
 public slots:
     void parseTillEnd();
     void reReadLogFile();
+    void checkLogFiles();
 
 signals:
     void dataChanged();
 
 private:
+    void addRegexp(const QRegExp &regexp, int status, const QString &colorName, const QString &literal);
+    bool openLogFile(LogFileState *state);
+    bool sameLogFile(LogFileState *state);
+    void loadCheckpoint(LogFileState *state);
+    void saveCheckpoint(LogFileState *state);
+
     GraphWidget         *m_graphWidget;
     NodeList            *m_nodeList;
 
     QStringList          m_logFileNames;
-    QList<QFile *>       m_logFiles;
-    QList<QTextStream *> m_logStreams;
+    QList<LogFileState *> m_logFiles;
 
     QTimer              *m_timer;
+    QFileSystemWatcher  *m_fileWatcher;
+    bool                 m_parseScheduled;
 
     // libval regexps
     QRegExp    m_validatedRegexp;
@@ -88,6 +115,11 @@ private:
     QRegExp    m_unboundProvenNSECRegexp;
 
     QList< RegexpData > m_regexpList;
+
+    // literals that lines must contain for the regexps to bother with them
+    QList< QStringMatcher > m_prefilters;
+    QStringList             m_prefilterLiterals;
+    QStringMatcher          m_pinsecurePrefilter;
 };
 
 #endif // LOGWATCHER_H
@@ -12,6 +12,7 @@
 #endif /* ! __MINGW_GCC */
 #include <QtGui/QAction>
 #include <QFileDialog>
+#include <QMutexLocker>
 
 typedef u_int32_t tcp_seq;
 
@@ -27,6 +28,19 @@ typedef u_int32_t tcp_seq;
 #define TYPE_TCP 6
 
 #define UDP_HEADER_SIZE 8
+#define IPV6_HEADER_SIZE 40
+
+/* how often queued up events are handed to the graph, in ms */
+#define DELIVERY_INTERVAL 250
+
+/* how many distinct events may wait for delivery before new ones are dropped */
+#define MAX_QUEUED_EVENTS 10000
+
+/* how many packets to read per pcap_dispatch() call */
+#define DISPATCH_COUNT 256
+
+/* the kernel capture buffer; a small one overflows quickly on a busy server */
+#define CAPTURE_BUFFER_SIZE (4 * 1024 * 1024)
 
 /* Ethernet header */
 struct sniff_ethernet {
@@ -96,9 +110,16 @@ struct sniff_udp {
 };
 
 PcapWatcher::PcapWatcher(QObject *parent) :
-    QThread(parent), m_mapper(), m_filterString("port 53"), m_pcapHandle(0), m_timer(),
+    QThread(parent), m_mapper(), m_filterString("port 53"), m_pcapHandle(0), m_offline(false),
+    m_stopCapture(0), m_eventLock(), m_events(), m_eventIndex(), m_droppedEvents(0), m_timer(),
     m_fileName(""), m_deviceName(""), m_animatePlayback(false)
 {
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(deliverEvents()));
+}
+
+PcapWatcher::~PcapWatcher()
+{
+    closeDevice();
 }
 
 void PcapWatcher::setupDeviceMenu(QMenu *menu)
@@ -145,6 +166,7 @@ void PcapWatcher::setupDeviceMenu(QMenu *menu)
 void PcapWatcher::openDevice()
 {
     bpf_u_int32 mask, net;
+    int         rc;
     m_fileName = QString();
     qDebug() << "opening device: " << deviceName();
 
@@ -156,7 +178,7 @@ void PcapWatcher::openDevice()
         return;
     }
 
-    m_pcapHandle = pcap_open_live(m_deviceName.toLatin1().data(), BUFSIZ, 1, 100, m_errorBuffer);
+    m_pcapHandle = pcap_create(m_deviceName.toLatin1().data(), m_errorBuffer);
     if (!m_pcapHandle) {
         // TODO: do something on error
         qWarning() << "failed to open the device: " << QString(m_errorBuffer);
@@ -164,18 +186,25 @@ void PcapWatcher::openDevice()
         return;
     }
 
-    if (m_filterString.length() > 0) {
-        if (pcap_compile(m_pcapHandle, &m_filterCompiled, m_filterString.toLatin1().data(), 1, mask) < -1) {
-            emit failedToOpenDevice(tr("failed to parse the filter: %s").arg(pcap_geterr(m_pcapHandle)));
-            return;
-        }
+    pcap_set_snaplen(m_pcapHandle, 65535);
+    pcap_set_promisc(m_pcapHandle, 1);
+    pcap_set_timeout(m_pcapHandle, 100);
+    pcap_set_buffer_size(m_pcapHandle, CAPTURE_BUFFER_SIZE);
+    if ((rc = pcap_activate(m_pcapHandle)) < 0) {
+        QString errMsg = (rc == PCAP_ERROR) ? QString(pcap_geterr(m_pcapHandle)) : QString(pcap_statustostr(rc));
+        qWarning() << "failed to open the device: " << errMsg;
+        emit failedToOpenDevice(errMsg);
+        pcap_close(m_pcapHandle);
+        m_pcapHandle = 0;
+        return;
     }
 
-    if (pcap_setfilter(m_pcapHandle, &m_filterCompiled) < -1) {
-        emit failedToOpenDevice(tr("failed to install the filter: %s").arg(pcap_geterr(m_pcapHandle)));
+    if (!setupFilter(mask))
         return;
-    }
-    m_timer.singleShot(100, this, SLOT(processPackets()));
+
+    m_offline = false;
+    start();
+    m_timer.start(DELIVERY_INTERVAL);
 }
 
 void PcapWatcher::openFile(const QString &fileNameToOpenIn, bool animatePlayback) {
@@ -204,143 +233,259 @@ void PcapWatcher::openFile(const QString &fileNameToOpenIn, bool animatePlayback
         return;
     }
 
-    if (m_filterString.length() > 0) {
-        if (pcap_compile(m_pcapHandle, &m_filterCompiled, m_filterString.toLatin1().data(), 1, mask) < -1) {
-            emit failedToOpenDevice(tr("failed to parse the filter: %s").arg(pcap_geterr(m_pcapHandle)));
-            return;
-        }
+    if (!setupFilter(mask))
+        return;
+
+    m_offline = true;
+    start();
+    m_timer.start(DELIVERY_INTERVAL);
+}
+
+bool PcapWatcher::setupFilter(bpf_u_int32 mask)
+{
+    if (m_filterString.length() == 0)
+        return true;
+
+    if (pcap_compile(m_pcapHandle, &m_filterCompiled, m_filterString.toLatin1().data(), 1, mask) < 0) {
+        emit failedToOpenDevice(tr("failed to parse the filter: %s").arg(pcap_geterr(m_pcapHandle)));
+        return false;
     }
 
-    if (pcap_setfilter(m_pcapHandle, &m_filterCompiled) < -1) {
+    if (pcap_setfilter(m_pcapHandle, &m_filterCompiled) < 0) {
         emit failedToOpenDevice(tr("failed to install the filter: %s").arg(pcap_geterr(m_pcapHandle)));
-        return;
+        pcap_freecode(&m_filterCompiled);
+        return false;
     }
-    m_timer.singleShot(100, this, SLOT(processPackets()));
+    pcap_freecode(&m_filterCompiled);
+    return true;
 }
 
 void PcapWatcher::run() {
-    connect(&m_timer, SIGNAL(timeout()), this, SLOT(processPackets()));
-    exec();
+    if (!m_pcapHandle)
+        return;
+
+    while (!m_stopCapture.loadAcquire()) {
+        int count = pcap_dispatch(m_pcapHandle, DISPATCH_COUNT, &PcapWatcher::handlePacket, (u_char *) this);
+        if (count < 0) {
+            if (count == -1)
+                qWarning() << "failed to read packets: " << QString(pcap_geterr(m_pcapHandle));
+            break; /* an error, or closeDevice() broke the loop */
+        }
+        if (count == 0 && m_offline)
+            break; /* end of the dump file */
+    }
 }
 
 void PcapWatcher::closeDevice()
 {
     if (m_pcapHandle) {
+        m_stopCapture.storeRelease(1);
+        pcap_breakloop(m_pcapHandle);
+        wait();
+        m_stopCapture.storeRelease(0);
+
         pcap_close(m_pcapHandle);
         m_pcapHandle = 0;
     }
+
+    // hand on whatever was caught before the device was closed
+    deliverEvents();
+    m_timer.stop();
 }
 
-void PcapWatcher::processPackets()
+void PcapWatcher::handlePacket(u_char *user, const struct pcap_pkthdr *header, const u_char *packet)
 {
-    const u_char       *packet;
-    struct pcap_pkthdr  header;
+    PcapWatcher *watcher = (PcapWatcher *) user;
+    bpf_u_int32  caplen = header->caplen;
     unsigned int size_ip;
     unsigned int size_tcp;
+    unsigned int protocol;
 
     const struct sniff_ethernet *ethernet; /* The ethernet header */
     const struct sniff_ip *ip; /* The IP header */
+    const struct sniff_ipv6 *ip6; /* The IPv6 header */
     const struct sniff_tcp *tcp; /* The TCP header */
-    const struct sniff_udp *udp; /* The TCP header */
     const u_char *payload; /* Packet payload */
     size_t        payload_len;
 
-    if (m_pcapHandle) {
-        // process packets received from pcap
-        while(NULL != (packet = pcap_next(m_pcapHandle, &header))) {
-            int             rrnum = 0;
-            ns_msg          handle;
-            ns_rr           rr;
-
-            udp = 0;
-            tcp = 0;
-            /* received a packet, now decode it */
-            ethernet = (struct sniff_ethernet*)(packet);
-
-            if (ntohs(ethernet->ether_type) == TYPE_IPv4) {
-                ip = (struct sniff_ip*)(packet + SIZE_ETHERNET);
-                size_ip = IP_HL(ip)*4;
-                if (size_ip < 20) {
-                    printf("   * Invalid IP header length: %u bytes\n", size_ip);
-                    continue;
-                }
-                if (ip->ip_p == TYPE_UDP) {
-                    udp = (struct sniff_udp *) (packet + SIZE_ETHERNET + size_ip);
-                } else if (ip->ip_p == TYPE_TCP) {
-                    tcp = (struct sniff_tcp *) (packet + SIZE_ETHERNET + size_ip);
-                }
-            } else if (ntohs(ethernet->ether_type) == TYPE_IPv6) {
-                /* XXX: ipv6 */
-                continue;
-            } else {
-                /* The magical other protocols */
-                continue;
-            }
+    if (caplen < SIZE_ETHERNET)
+        return;
 
-            /* TCP processing */
-            /* XXX: UDP */
-            if (tcp) {
-                tcp = (struct sniff_tcp*) (packet + SIZE_ETHERNET + size_ip);
-                size_tcp = TH_OFF(tcp)*4;
-                if (size_tcp < 20) {
-                    printf("   * Invalid TCP header length: %u bytes\n", size_tcp);
-                    continue;
-                }
-                payload = (u_char *)(packet + SIZE_ETHERNET + size_ip + size_tcp);
-                payload_len = header.len - (SIZE_ETHERNET + size_ip + size_tcp);
-            } else if (udp) {
-                udp = (struct sniff_udp *) (packet + SIZE_ETHERNET + size_ip);
-                payload = (u_char *)(packet + SIZE_ETHERNET + size_ip + UDP_HEADER_SIZE);
-                payload_len = header.len - (SIZE_ETHERNET + size_ip + UDP_HEADER_SIZE);
-            } else {
-                qWarning() << "unknown protocol (shouldn't get here)";
-                continue;
-            }
+    /* received a packet, now decode it */
+    ethernet = (struct sniff_ethernet*)(packet);
 
-            if (ns_initparse(payload, payload_len, &handle) < 0) {
-                qWarning() << tr("Fatal internal error: failed to init parser");
-                continue;
-            }
+    if (ntohs(ethernet->ether_type) == TYPE_IPv4) {
+        if (caplen < SIZE_ETHERNET + 20)
+            return;
+        ip = (struct sniff_ip*)(packet + SIZE_ETHERNET);
+        size_ip = IP_HL(ip)*4;
+        if (size_ip < 20 || caplen < SIZE_ETHERNET + size_ip) {
+            qWarning() << "Invalid IP header length: " << size_ip;
+            return;
+        }
+        if (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK))
+            return; /* fragments don't carry a whole message */
+        protocol = ip->ip_p;
+    } else if (ntohs(ethernet->ether_type) == TYPE_IPv6) {
+        if (caplen < SIZE_ETHERNET + IPV6_HEADER_SIZE)
+            return;
+        ip6 = (struct sniff_ipv6*)(packet + SIZE_ETHERNET);
+        if (IPV6_VERSION(ip6) != 6)
+            return;
+        /* extension headers are rare in DNS traffic and are skipped over */
+        size_ip = IPV6_HEADER_SIZE;
+        protocol = ip6->ip_nxt;
+    } else {
+        /* The magical other protocols */
+        return;
+    }
 
-            int rcode = libsres_msg_getflag(handle, ns_f_rcode);
-            DNSData::Status status = libsres_msg_getflag(handle, ns_f_ad) ?
-                        DNSData::AD_VERIFIED :
-                        (libsres_msg_getflag(handle, ns_f_aa) ? DNSData::AUTHORATATIVE : DNSData::UNKNOWN);
+    payload = packet + SIZE_ETHERNET + size_ip;
+    payload_len = caplen - (SIZE_ETHERNET + size_ip);
 
-            if (rcode == ns_r_servfail) {
-                /* handle SERVFAIL error cases */
-                if (!ns_parserr(&handle, ns_s_qd, rrnum, &rr)) {
-                    /* the first (only) question should be the name we're failing on */
-                    emit addNodeData(ns_rr_name(rr), DNSData(p_sres_type(ns_rr_type(rr)), DNSData::SERVFAIL_RCODE), "SERVFAIL caught");
-                }
-            } else if (rcode == ns_r_nxdomain) {
-                /* handle SERVFAIL error cases */
-                if (!ns_parserr(&handle, ns_s_qd, rrnum, &rr)) {
-                    /* the first (only) question should be the name we're failing on */
-                    emit addNodeData(ns_rr_name(rr), DNSData(p_sres_type(ns_rr_type(rr)), DNSData::DNE), "NXDomain caught");
-                }
-            } else {
-                /* handle normal responses */
-                for (;;) {
-                    if (ns_parserr(&handle, ns_s_an, rrnum, &rr)) {
-                        if (errno != ENODEV) {
-                            /* parse error */
-                            qWarning() << tr("failed to parse a returned additional RRSET");
-                            continue;
-                        }
-                        break; /* out of data */
-                    }
-
-                    QString data = DNSResources::rrDataToQString(rr, ns_msg_base(handle), ns_msg_size(handle));
-                    emit addNodeData(ns_rr_name(rr), DNSData(p_sres_type(ns_rr_type(rr)), status, QStringList(data)), "Data collected from network draffic");
-
-                    rrnum++;
+    if (protocol == TYPE_TCP) {
+        if (payload_len < 20)
+            return;
+        tcp = (struct sniff_tcp*) payload;
+        size_tcp = TH_OFF(tcp)*4;
+        if (size_tcp < 20 || payload_len < size_tcp) {
+            qWarning() << "Invalid TCP header length: " << size_tcp;
+            return;
+        }
+        payload += size_tcp;
+        payload_len -= size_tcp;
+
+        /* messages over TCP are prefixed by their length; only segments
+           starting a message are looked at */
+        if (payload_len < 2)
+            return;
+        size_t msg_len = (payload[0] << 8) | payload[1];
+        payload += 2;
+        payload_len -= 2;
+        if (msg_len < payload_len)
+            payload_len = msg_len;
+    } else if (protocol == TYPE_UDP) {
+        if (payload_len < UDP_HEADER_SIZE)
+            return;
+        payload += UDP_HEADER_SIZE;
+        payload_len -= UDP_HEADER_SIZE;
+    } else {
+        return;
+    }
+
+    watcher->processMessage(payload, payload_len);
+}
+
+void PcapWatcher::processMessage(const u_char *payload, size_t payload_len)
+{
+    int             rrnum = 0;
+    ns_msg          handle;
+    ns_rr           rr;
+
+    if (ns_initparse(payload, payload_len, &handle) < 0)
+        return; /* not a DNS message, or only part of one */
+
+    if (!libsres_msg_getflag(handle, ns_f_qr))
+        return; /* queries carry nothing to show */
+
+    int rcode = libsres_msg_getflag(handle, ns_f_rcode);
+    DNSData::Status status = libsres_msg_getflag(handle, ns_f_ad) ?
+                DNSData::AD_VERIFIED :
+                (libsres_msg_getflag(handle, ns_f_aa) ? DNSData::AUTHORATATIVE : DNSData::UNKNOWN);
+
+    if (rcode == ns_r_servfail) {
+        /* handle SERVFAIL error cases */
+        if (!ns_parserr(&handle, ns_s_qd, rrnum, &rr)) {
+            /* the first (only) question should be the name we're failing on */
+            queueEvent(ns_rr_name(rr), ns_rr_type(rr), DNSData::SERVFAIL_RCODE);
+        }
+    } else if (rcode == ns_r_nxdomain) {
+        /* handle SERVFAIL error cases */
+        if (!ns_parserr(&handle, ns_s_qd, rrnum, &rr)) {
+            /* the first (only) question should be the name we're failing on */
+            queueEvent(ns_rr_name(rr), ns_rr_type(rr), DNSData::DNE);
+        }
+    } else {
+        /* handle normal responses */
+        for (;;) {
+            if (ns_parserr(&handle, ns_s_an, rrnum, &rr)) {
+                if (errno != ENODEV) {
+                    /* parse error */
+                    qWarning() << tr("failed to parse a returned additional RRSET");
                 }
+                break; /* out of data */
             }
+
+            QString data = DNSResources::rrDataToQString(rr, ns_msg_base(handle), ns_msg_size(handle));
+            queueEvent(ns_rr_name(rr), ns_rr_type(rr), status, data);
+
+            rrnum++;
         }
+    }
+}
+
+void PcapWatcher::queueEvent(const char *name, quint16 type, int status, const QString &data)
+{
+    QByteArray  key(name);
+    QMutexLocker locker(&m_eventLock);
+
+    key.append('\0');
+    key.append((const char *) &type, sizeof(type));
+    key.append((const char *) &status, sizeof(status));
+
+    QHash<QByteArray, int>::const_iterator found = m_eventIndex.constFind(key);
+    if (found != m_eventIndex.constEnd()) {
+        PcapEvent &event = m_events[found.value()];
+        if (data.length() > 0 && !event.data.contains(data))
+            event.data.append(data);
+        return;
+    }
+
+    if (m_events.count() >= MAX_QUEUED_EVENTS) {
+        m_droppedEvents++;
+        return;
+    }
+
+    PcapEvent event;
+    event.name = name;
+    event.type = type;
+    event.status = status;
+    if (data.length() > 0)
+        event.data.append(data);
+
+    m_eventIndex.insert(key, m_events.count());
+    m_events.append(event);
+}
 
+void PcapWatcher::deliverEvents()
+{
+    QVector<PcapEvent> events;
+    int                dropped;
+
+    {
+        QMutexLocker locker(&m_eventLock);
+        events.swap(m_events);
+        m_eventIndex.clear();
+        dropped = m_droppedEvents;
+        m_droppedEvents = 0;
+    }
+
+    if (dropped > 0)
+        qWarning() << "dropped" << dropped << "captured records; the graph couldn't keep up";
 
-        // wait a while till the next packet
-        m_timer.singleShot(100, this, SLOT(processPackets()));
+    foreach (const PcapEvent &event, events) {
+        QString nodeName = QString::fromLatin1(event.name);
+        QString type = p_sres_type(event.type);
+
+        if (event.status == DNSData::SERVFAIL_RCODE)
+            emit addNodeData(nodeName, DNSData(type, DNSData::SERVFAIL_RCODE), "SERVFAIL caught");
+        else if (event.status == DNSData::DNE)
+            emit addNodeData(nodeName, DNSData(type, DNSData::DNE), "NXDomain caught");
+        else
+            emit addNodeData(nodeName, DNSData(type, event.status, event.data), "Data collected from network draffic");
     }
+
+    // a dump file has been read to its end
+    if (!isRunning() && events.isEmpty())
+        m_timer.stop();
 }
@@ -9,6 +9,10 @@
 #include <QTimer>
 #include <QSignalMapper>
 #include <QMenu>
+#include <QMutex>
+#include <QVector>
+#include <QHash>
+#include <QAtomicInt>
 
 #include "DNSData.h"
 
@@ -16,14 +20,25 @@
 
 //
 // Implemantation note:
-//   This switches back and forth between the pcap loop and the Qt loop, switching
-//   ever 100ms to give both event loops time to do things
+//   Packets are read with pcap_dispatch() in this thread and decoded
+//   straight away into PcapEvents, which are queued up under m_eventLock.
+//   Events for the same name, type and status are folded together while
+//   they wait.  A timer in the GUI thread picks up the queue a few times
+//   a second and hands it on to the graph.
+
+struct PcapEvent {
+    QByteArray  name;
+    quint16     type;
+    int         status;
+    QStringList data;
+};
 
 class PcapWatcher : public QThread
 {
     Q_OBJECT
 public:
     explicit PcapWatcher(QObject *parent = 0);
+    ~PcapWatcher();
 
     void     setupDeviceMenu(QMenu *menu);
 
@@ -37,17 +52,29 @@ public slots:
     void     openDevice();
     void     openFile(const QString &fileNameToOpen = "", bool animatePlayback = false);
     void     closeDevice();
-    void     processPackets();
-    
+    void     deliverEvents();
+
 private:
     void run();
 
+    static void handlePacket(u_char *user, const struct pcap_pkthdr *header, const u_char *packet);
+    void     processMessage(const u_char *payload, size_t payload_len);
+    void     queueEvent(const char *name, quint16 type, int status, const QString &data = QString());
+    bool     setupFilter(bpf_u_int32 mask);
+
     QSignalMapper       m_mapper;
 
     QString             m_filterString;
     struct bpf_program  m_filterCompiled;
     pcap_t             *m_pcapHandle;
     char                m_errorBuffer[PCAP_ERRBUF_SIZE];
+    bool                m_offline;
+    QAtomicInt          m_stopCapture;
+
+    QMutex              m_eventLock;
+    QVector<PcapEvent>  m_events;       // waiting to be delivered, in arrival order
+    QHash<QByteArray, int> m_eventIndex; // name, type and status -> m_events index
+    int                 m_droppedEvents;
 
     QTimer              m_timer;
 
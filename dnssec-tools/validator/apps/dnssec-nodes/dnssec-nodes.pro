@@ -30,7 +30,8 @@ HEADERS += \
     FilterEditorWindow.h \
     filtersAndEffects.h \
     Filters/LogicalAndOr.h \
-    Effects/SetSize.h
+    Effects/SetSize.h \
+    ForceLayout.h
 
 SOURCES += \
         edge.cpp \
@@ -62,7 +63,8 @@ SOURCES += \
     ValidateViewBox.cpp \
     FilterEditorWindow.cpp \
     Filters/LogicalAndOr.cpp \
-    Effects/SetSize.cpp
+    Effects/SetSize.cpp \
+    ForceLayout.cpp
 
 BINDIR = $$PREFIX/bin
 DATADIR =$$PREFIX/share
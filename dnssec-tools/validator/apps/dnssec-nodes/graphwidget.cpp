@@ -50,6 +50,7 @@
 
 #include "LogWatcher.h"
 #include "NodeList.h"
+#include "ForceLayout.h"
 #ifdef WITH_PCAP
 #include "PcapWatcher.h"
 #endif
@@ -99,7 +100,7 @@ void val_collect_logs(struct val_log *logp, int level, const char *buf)
 }
 
 GraphWidget::GraphWidget(QWidget *parent, QLineEdit *editor, QTabWidget *tabs, const QString &fileName, QHBoxLayout *infoBox)
-    : QGraphicsView(parent), timerId(0), m_editor(editor),
+    : QGraphicsView(parent), timerId(0), m_forceLayout(new ForceLayout(this)), m_layoutNodes(), m_layoutStepping(false), m_editor(editor),
       m_nodeScale(2), m_localScale(false), m_lockNodes(false), m_shownsec3(false),
       m_timer(0),
       m_layoutType(springyLayout), m_childSize(30), m_lookupType(1), m_animateNodeMovements(true),
@@ -111,6 +112,10 @@ GraphWidget::GraphWidget(QWidget *parent, QLineEdit *editor, QTabWidget *tabs, c
     , m_pcapWatcher(new PcapWatcher())
 #endif
 {
+    connect(m_forceLayout, SIGNAL(finished()), this, SLOT(forceLayoutDone()));
+
+    // nodes move on every frame, which would keep an index busy; the
+    // layout doesn't query the scene for them
     myScene = new QGraphicsScene(this);
     myScene->setItemIndexMethod(QGraphicsScene::NoIndex);
     myScene->setSceneRect(-300, -300, 600, 600);
@@ -157,7 +162,6 @@ GraphWidget::GraphWidget(QWidget *parent, QLineEdit *editor, QTabWidget *tabs, c
     connect(m_pcapWatcher, SIGNAL(addNodeData(QString, DNSData, QString)), m_nodeList, SLOT(addNodesData(QString,DNSData, QString)));
     connect(m_pcapWatcher, SIGNAL(addNodeData(QString,DNSData,QString)), this, SLOT(doLookupFromServFail(QString,DNSData,QString)));
     connect(this, SIGNAL(openPcapDevice()), m_pcapWatcher, SLOT(openDevice()));
-    m_pcapWatcher->start();
 #endif
 }
 
@@ -267,9 +271,11 @@ void GraphWidget::timerEvent(QTimerEvent *event)
             nodes << node;
     }
 
-    if (m_layoutType == springyLayout)
-        foreach (Node *node, nodes)
-            node->calculateForces();
+    // the next positions are worked out in the background, and picked
+    // up by forceLayoutDone().  The thread stops before that slot runs,
+    // so ask m_layoutStepping rather than the thread whether it is done
+    if (m_layoutType == springyLayout && !m_layoutStepping)
+        startForceLayout(nodes);
 
     bool itemsMoved = false;
     foreach (Node *node, nodes) {
@@ -278,12 +284,75 @@ void GraphWidget::timerEvent(QTimerEvent *event)
         }
     }
 
-    if (!itemsMoved) {
+    if (!itemsMoved && !m_layoutStepping) {
         killTimer(timerId);
         timerId = 0;
     }
 }
 
+void GraphWidget::startForceLayout(const QList<Node *> &nodes)
+{
+    QVector<ForceLayout::Body> bodies(nodes.count());
+    QVector<int>               edges;
+    QHash<Node *, int>         index;
+
+    for(int i = 0; i < nodes.count(); i++) {
+        Node *node = nodes[i];
+        index[node] = i;
+        bodies[i].x = node->pos().x();
+        bodies[i].y = node->pos().y();
+        bodies[i].weight = (node->edges().count() + 1) * m_nodeScale;
+        bodies[i].fixed = (scene()->mouseGrabberItem() == node);
+    }
+
+    // every edge is in the list of both of its nodes
+    foreach (Node *node, nodes) {
+        foreach (Edge *edge, node->edges()) {
+            if (edge->sourceNode() != node || !index.contains(edge->destNode()))
+                continue;
+            edges << index[node] << index[edge->destNode()];
+        }
+    }
+
+    if (m_forceLayout->startStep(bodies, edges, scene()->sceneRect())) {
+        m_layoutNodes = nodes;
+        m_layoutStepping = true;
+    }
+}
+
+void GraphWidget::forceLayoutDone()
+{
+    QVector<QPointF> positions = m_forceLayout->positions();
+    QSet<Node *>     current;
+    bool             moved = false;
+
+    if (m_layoutType != springyLayout || positions.count() != m_layoutNodes.count()) {
+        m_layoutNodes.clear();
+        m_layoutStepping = false;
+        return;
+    }
+
+    // nodes may have come and gone while the step was worked out
+    foreach (QGraphicsItem *item, scene()->items()) {
+        if (Node *node = qgraphicsitem_cast<Node *>(item))
+            current << node;
+    }
+
+    for(int i = 0; i < m_layoutNodes.count(); i++) {
+        Node *node = m_layoutNodes[i];
+        if (!current.contains(node) || scene()->mouseGrabberItem() == node)
+            continue;
+        if (positions[i] != node->pos())
+            moved = true;
+        node->setNewPos(positions[i]);
+    }
+    m_layoutNodes.clear();
+    m_layoutStepping = false;
+
+    if (moved)
+        itemMoved();
+}
+
 void GraphWidget::wheelEvent(QWheelEvent *event)
 {
     scaleView(pow((double)2, -event->delta() / 240.0));
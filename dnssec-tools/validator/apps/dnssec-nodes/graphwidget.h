@@ -69,6 +69,7 @@ class LogWatcher;
 class NodeList;
 class PcapWatcher;
 class DNSData;
+class ForceLayout;
 
 //! [0]
 class GraphWidget : public QGraphicsView
@@ -170,6 +171,8 @@ public slots:
     void about();
     void help();
 
+    void forceLayoutDone();
+
 signals:
     void openPcapDevice();
 
@@ -182,7 +185,12 @@ protected:
     void scaleView(qreal scaleFactor);
 
 private:
+    void startForceLayout(const QList<Node *> &nodes);
+
     int timerId;
+    ForceLayout  *m_forceLayout;
+    QList<Node *> m_layoutNodes;   // the nodes of the step being worked out
+    bool          m_layoutStepping; // until forceLayoutDone() has run
 
     QGraphicsScene *myScene;
     QLineEdit   *m_editor;
@@ -83,7 +83,6 @@ public:
     QString fqdn() { return m_fqdn; }
 
     void setNewPos(QPointF pos);
-    void calculateForces();
     bool advance();
 
     QRectF boundingRect() const;
@@ -91,7 +91,7 @@ query_async_test(int async, int burst_max, int inflight_max, int numq)
         if (timeout.tv_sec == LONG_MAX)
             timeout.tv_sec = 0;
         else {
-            gettimeofday(&now, NULL);
+            res_gettime(&now);
             if (timeout.tv_sec > now.tv_sec)
                 timeout.tv_sec -= now.tv_sec;
             else
@@ -125,13 +125,13 @@ query_async_test(int async, int burst_max, int inflight_max, int numq)
 
         fflush(stdout);
         ready = select(nfds, &activefds, NULL, NULL, &timeout);
-        gettimeofday(&now, NULL);
+        res_gettime(&now);
         printf("%d fds @ %ld\n", ready, now.tv_sec);
         if (ready < 0 && errno == EINTR)
             continue;
 
         if (ready == 0) {
-            gettimeofday(&now, NULL);
+            res_gettime(&now);
             now.tv_usec = 0;
             printf("timeout @ %ld\n", now.tv_sec);
 
@@ -211,10 +211,17 @@ main(int argc, char** argv)
     int burst = atoi(argv[2]);
     int flight = atoi(argv[3]);
     int numq = atoi(argv[4]);
+    int stats = (argc > 5) ? atoi(argv[5]) : 0;
 
     res_set_debug_level(7);
 
+    if (stats)
+        res_io_stats_enable(1);
+
     query_async_test(async, burst, flight, numq);
 
+    if (stats)
+        res_io_stats_dump(stdout);
+
     return 0;
 }
@@ -2,19 +2,43 @@
 #include "QDNSItemModel.h"
 
 QDNSItemModel::QDNSItemModel(QObject *parent) 
-    : QStandardItemModel(parent), m_securityItem(0), m_istrusted(unknown)
+    : QStandardItemModel(parent)
 {
+    QStringList headers;
+    headers << QString("Name") << QString("Type") << QString("TTL")
+            << QString("Data") << QString("Time");
+    setColumnCount(numColumns);
+    setHorizontalHeaderLabels(headers);
 }
 
 QDNSItemModel::~QDNSItemModel()
 {
 }
 
-void QDNSItemModel::setSecurityStatus(QStandardItem *item,
+// Add a row for a new lookup at the top; its results become its children
+QStandardItem *QDNSItemModel::addLookup(const QString &name,
+                                        const QString &type)
+{
+    QList<QStandardItem *> row;
+    row << new QStandardItem(name) << new QStandardItem(type)
+        << new QStandardItem() << new QStandardItem("pending")
+        << new QStandardItem();
+    row[nameColumn]->setData(unknown, securityStatusRole);
+    insertRow(0, row);
+    return row[nameColumn];
+}
+
+void QDNSItemModel::setSecurityStatus(QStandardItem *lookup,
                                       securityStatus istrusted)
 {
-    m_securityItem = item;
-    m_istrusted = istrusted;
+    lookup->setData(istrusted, securityStatusRole);
+}
+
+void QDNSItemModel::setLookupTime(QStandardItem *lookup, int msecs)
+{
+    QStandardItem *time = item(lookup->row(), timeColumn);
+    if (time)
+        time->setText(QString("%1 msec").arg(msecs));
 }
 
 QVariant QDNSItemModel::data(const QModelIndex &index, int role) const
@@ -26,13 +50,23 @@ QVariant QDNSItemModel::data(const QModelIndex &index, int role) const
 #endif
 
     if (role == CHANGEROLE) {
-        if (m_istrusted == validated)
+        // everything below a lookup is colored by that lookup's status
+        QModelIndex top = index;
+        while (top.parent().isValid())
+            top = top.parent();
+        QVariant status =
+            QStandardItemModel::data(top.sibling(top.row(), nameColumn),
+                                     securityStatusRole);
+        securityStatus istrusted =
+            status.isValid() ? (securityStatus) status.toInt() : unknown;
+
+        if (istrusted == validated)
             return QColor(150,255,150);
-        if (m_istrusted == trusted)
+        if (istrusted == trusted)
             return QColor(255,255,150);
-        if (m_istrusted == bad)
+        if (istrusted == bad)
             return QColor(255,150,150);
-        if (m_istrusted == unknown)
+        if (istrusted == unknown)
             return QColor(255,255,255);
     }
 
@@ -17,16 +17,17 @@ class QDNSItemModel : public QStandardItemModel
     virtual ~QDNSItemModel();
 
     enum securityStatus { validated, trusted, bad, unknown };
+    enum columns { nameColumn, typeColumn, ttlColumn, dataColumn,
+                   timeColumn, numColumns };
+    enum roles { securityStatusRole = Qt::UserRole + 1 };
 
-    void setSecurityStatus(QStandardItem *item, securityStatus istrusted);
+    QStandardItem *addLookup(const QString &name, const QString &type);
+    void setSecurityStatus(QStandardItem *lookup, securityStatus istrusted);
+    void setLookupTime(QStandardItem *lookup, int msecs);
     QVariant data(const QModelIndex &index, int role) const;
 
 public slots:
     void emitChanges();
-
-  private:
-    QStandardItem *m_securityItem;
-    securityStatus m_istrusted;
 };
 
 #endif /* QDNSITEMMODEL_H */
@@ -57,11 +57,16 @@ void val_collect_logs(struct val_log *logp, int level, const char *buf)
 
 
 Lookup::Lookup(QWidget *parent)
-    : QMainWindow(parent), found(false), m_queryType(ns_t_a), val_ctx(0)
+    : QMainWindow(parent), found(false), m_queryType(ns_t_a), val_ctx(0),
+      m_requests(), m_pollNotifier(0), m_socketNotifiers(), m_alarmTimer(0)
 {
     QWidget *widget = new QWidget();
     //labels = new QLabel[fields];
 
+    m_alarmTimer = new QTimer(this);
+    m_alarmTimer->setSingleShot(true);
+    connect(m_alarmTimer, SIGNAL(timeout()), this, SLOT(asyncDataAvailable()));
+
     loadPreferences();
     createMainWidgets();
     createMenus();
@@ -257,13 +262,14 @@ Lookup::createMenus() {
 void
 Lookup::init_libval() {
     //val_log_add_cb(NULL, 99, &val_qdebug);
+
+    // keep one context for the life of the tool, so that lookups share
+    // the keys and answers that it has already validated
     if (val_ctx)
-        val_free_context(val_ctx);
+        return;
 
     // create a validator context
     val_create_context("lookup", &val_ctx);
-    if (m_logLocation.length() > 0)
-        val_log_add_optarg(QString("7:file:" + m_logLocation).toLatin1().data(), 0);
 
     // capture our own log messages
     val_log_add_cb(NULL, 99, &val_collect_logs);
@@ -276,6 +282,19 @@ QSize Lookup::sizeHint()
 
 Lookup::~Lookup()
 {
+    foreach(LookupRequest *request, m_requests) {
+#ifndef VAL_NO_ASYNC
+        if (request->status)
+            val_async_cancel(val_ctx, request->status,
+                             VAL_AS_CANCEL_NO_CALLBACKS);
+#endif
+        delete request;
+    }
+    m_requests.clear();
+
+    delete m_pollNotifier;
+    qDeleteAll(m_socketNotifiers);
+
     if (val_ctx)
         val_free_context(val_ctx);
 }
@@ -283,44 +302,203 @@ Lookup::~Lookup()
 void
 Lookup::dolookup()
 {
+    LookupRequest *request = new LookupRequest();
+#ifdef VAL_NO_ASYNC
+    u_char buf[4096];
     val_status_t val_status;
-    struct addrinfo *aitop = NULL;
     int ret;
-    u_char buf[4096];
-    char printbuf[4096];
-    int columns = 4;
-    QTime start, stop;
+#else
+    int retval;
+#endif
+
+    request->lookup = this;
+    request->name = lookupline->text();
+    request->type = m_queryType;
 
-    val_log_strings.clear();
-    m_answers->clear();
-    m_answers->setColumnCount(columns);
-    QStringList headers;
-    headers << QString("Name") << QString("Type") << QString("TTL") << QString("Data");
-    m_answers->setHorizontalHeaderLabels(headers);
+    // the captured logs are shared by the lookups in flight
+    if (m_requests.isEmpty())
+        val_log_strings.clear();
+    request->firstLog = val_log_strings.count();
 
+    request->item = m_answers->addLookup(request->name,
+                                         QString(p_type(m_queryType)));
     busy();
 
     // perform the lookup
-    start = QTime::currentTime();
-    ret = val_res_query(val_ctx, lookupline->text().toUtf8(), ns_c_in,
+    request->started.start();
+#ifdef VAL_NO_ASYNC
+    ret = val_res_query(val_ctx, request->name.toUtf8(), ns_c_in,
                         m_queryType, buf, sizeof(buf), &val_status);
-    stop = QTime::currentTime();
+    finishLookup(request, ret, buf, val_status);
+#else
+    request->status = 0;
+    retval = val_async_submit(val_ctx, request->name.toUtf8(), ns_c_in,
+                              m_queryType, 0, &Lookup::asyncCallback,
+                              request, &request->status);
+    if (retval != VAL_NO_ERROR) {
+        request->status = 0;
+        request->item->appendRow(new QStandardItem(QString("Error: ") +
+                                                   p_val_err(retval)));
+        finishLookup(request, -1, NULL, VAL_DNS_ERROR);
+        return;
+    }
+
+    m_requests.push_back(request);
+    updateWatchedSockets();
+#endif
+}
+
+#ifndef VAL_NO_ASYNC
+int
+Lookup::asyncCallback(val_async_status *as, int event, val_context_t *ctx,
+                      void *cb_data, val_cb_params_t *cbp)
+{
+    LookupRequest *request = (LookupRequest *) cb_data;
+    QByteArray     answer(NS_MAXMSG, 0);
+    u_char        *buf = (u_char *) answer.data();
+    size_t         len = 0;
+    val_status_t   val_status = VAL_DNS_ERROR;
+    int            ret = -1;
+
+    Q_UNUSED(as);
+    Q_UNUSED(ctx);
+
+    // libval releases the request, and its results, once we return
+    request->status = 0;
+
+    if (event != VAL_AS_EVENT_COMPLETED) {
+        request->lookup->m_requests.removeOne(request);
+        delete request;
+        return VAL_NO_ERROR;
+    }
+
+    // build the same response that val_res_query() would return
+    if (cbp->retval == VAL_NO_ERROR &&
+        compose_answer_buf(cbp->name, cbp->type_h, cbp->class_h,
+                           cbp->results, buf, answer.size(), &len,
+                           &val_status) == VAL_NO_ERROR) {
+        HEADER *hp = (HEADER *) buf;
+
+        if (len > (size_t) answer.size())
+            len = answer.size();
+        if (hp->rcode == ns_r_noerror && (hp->ancount != 0 || hp->tc))
+            ret = len;
+    }
+
+    request->lookup->finishLookup(request, ret, buf, val_status);
+    return VAL_NO_ERROR;
+}
+#endif
+
+void
+Lookup::asyncDataAvailable()
+{
+#ifndef VAL_NO_ASYNC
+    struct timeval tv;
+
+    // handle whatever is ready without blocking the event loop; this
+    // returns the number of requests still pending, so don't loop on it
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    if (!m_requests.isEmpty())
+        val_async_check_wait(val_ctx, NULL, NULL, &tv, 0);
+
+    updateWatchedSockets();
+#endif
+}
+
+void
+Lookup::updateWatchedSockets()
+{
+#ifndef VAL_NO_ASYNC
+    struct timeval tv;
+    fd_set         fds;
+    int            nfds = 0, fd;
+
+    m_alarmTimer->stop();
+
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+
+    // libval can give us a single descriptor for all of its sockets...
+    if (!m_pollNotifier && !m_requests.isEmpty() &&
+        val_async_poll_info(val_ctx, &fd, NULL) == VAL_NO_ERROR) {
+        m_pollNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+        connect(m_pollNotifier, SIGNAL(activated(int)),
+                this, SLOT(asyncDataAvailable()));
+    }
+
+    FD_ZERO(&fds);
+    if (m_pollNotifier) {
+        m_pollNotifier->setEnabled(!m_requests.isEmpty());
+        if (!m_requests.isEmpty())
+            val_async_poll_info(val_ctx, &fd, &tv);
+    } else if (!m_requests.isEmpty()) {
+        // ...or else we watch each of the sockets it is waiting on
+        val_async_select_info(val_ctx, &fds, &nfds, &tv);
+        for (fd = 0; fd < nfds; fd++) {
+            if (FD_ISSET(fd, &fds) && !m_socketNotifiers.contains(fd)) {
+                QSocketNotifier *notifier =
+                    new QSocketNotifier(fd, QSocketNotifier::Read, this);
+                m_socketNotifiers[fd] = notifier;
+                connect(notifier, SIGNAL(activated(int)),
+                        this, SLOT(asyncDataAvailable()));
+            }
+        }
+    }
+
+    foreach(fd, m_socketNotifiers.keys()) {
+        if (fd < nfds && FD_ISSET(fd, &fds))
+            continue;
+        // we may be called from this notifier's own signal
+        QSocketNotifier *notifier = m_socketNotifiers.take(fd);
+        notifier->setEnabled(false);
+        notifier->deleteLater();
+    }
+
+    // wake up for retransmissions and timeouts as well
+    if (!m_requests.isEmpty())
+        m_alarmTimer->start(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+#endif
+}
+
+void
+Lookup::finishLookup(LookupRequest *request, int ret, const u_char *buf,
+                     val_status_t val_status)
+{
+    m_requests.removeOne(request);
+
+    showResults(request, ret, buf);
+    setSecurityStatus(request, val_status);
+    m_answers->setLookupTime(request->item, request->started.elapsed());
+
+    //m_answerView->setHeaderHidden(true);
+    m_answerView->setRootIsDecorated(false);
+    m_answerView->setExpanded(request->item->index(), true);
+    m_answers->emitChanges();
+    for(int i = 0 ; i < QDNSItemModel::numColumns; i++) {
+        m_answerView->resizeColumnToContents(i);
+    }
+
+    vlayout->invalidate();
+
+    delete request;
+    pruneLookups(maxLookups);
+    if (m_requests.isEmpty())
+        unbusy();
+}
+
+void
+Lookup::showResults(LookupRequest *request, int ret, const u_char *buf)
+{
+    char printbuf[4096];
 
     // do something with the results
     if (ret <= 0) {
         QStandardItem *answers = new QStandardItem("Results");
-        m_answers->appendRow(answers);
+        request->item->appendRow(answers);
         answers->appendRow(new QStandardItem("No Answer Data"));
         m_answerView->setExpanded(answers->index(), true);
-
-        if (!val_istrusted(val_status)) {
-            // untrusted error for host
-        }
- 	if (!val_istrusted(val_status)) {
-            // untrusted for ip address
-        }
-
-        setSecurityStatus(val_status);
     } else {
 
         ns_msg          handle;
@@ -332,7 +510,6 @@ Lookup::dolookup()
 
         if (ns_initparse(buf, ret, &handle) < 0) {
             // Error
-            unbusy();
             return;
         }
 
@@ -358,7 +535,7 @@ Lookup::dolookup()
         results->appendRow(sections[ns_s_an]);
         results->appendRow(sections[ns_s_ns]);
         results->appendRow(sections[ns_s_ar]);
-        m_answers->appendRow(results);
+        request->item->appendRow(results);
 
         QStandardItem *theRealAnswer = 0;
 
@@ -374,7 +551,6 @@ Lookup::dolookup()
                                 printbuf, sizeof(printbuf));
                 if (n < 0) {
                     // error
-                    unbusy();
                     return;
                 }
 
@@ -402,7 +578,7 @@ Lookup::dolookup()
                 dataItems[rrType]->appendRow(newRow);
                 dataItems[rrType]->setColumnCount(newRow.count());
 
-                if (iter.key() == ns_s_an && m_queryType == ns_rr_type(rr)) {
+                if (iter.key() == ns_s_an && request->type == ns_rr_type(rr)) {
                     // remember that this is the real answer so we can expand it later
                     theRealAnswer = dataItems[rrType];
                     qDebug() << " found the answer";
@@ -411,8 +587,6 @@ Lookup::dolookup()
                 rrnum++;
             }
         }
-        
-        setSecurityStatus(val_status);
 
         m_answerView->setExpanded(results->index(), true);
         m_answerView->setExpanded(sections[ns_s_an]->index(), true);
@@ -420,52 +594,39 @@ Lookup::dolookup()
             m_answerView->setExpanded(theRealAnswer->index(), true);
             qDebug() << "Expanding" << theRealAnswer->index();
         }
-
     }
-
-    m_answers->appendRow(new QStandardItem(QString("Time: %1 msec").arg(start.msecsTo(stop))));
-
-    //m_answerView->setHeaderHidden(true);
-    m_answerView->setRootIsDecorated(false);
-    m_answers->emitChanges();
-    for(int i = 0 ; i < columns; i++) {
-        m_answerView->resizeColumnToContents(i);
-    }
-
-    vlayout->invalidate();
-
-    val_freeaddrinfo(aitop);
-    unbusy();
 }
 
-void Lookup::setSecurityStatus(int val_status) {
+void Lookup::setSecurityStatus(LookupRequest *request, int val_status) {
+    QStandardItem *securityStatus;
+    QStandardItem *summary = m_answers->item(request->item->row(),
+                                             QDNSItemModel::dataColumn);
+
     //
     // Set the security results into the display
     //
     QStandardItem *security = new QStandardItem("Security");
-    m_answers->appendRow(security);
+    request->item->appendRow(security);
 
     if (val_isvalidated(val_status)) {
-        m_securityStatus =
-            new QStandardItem("Status: Validated");
-        m_answers->setSecurityStatus(m_securityStatus,
+        securityStatus = new QStandardItem("Status: Validated");
+        m_answers->setSecurityStatus(request->item,
                                      QDNSItemModel::validated);
         m_resultsIcon->setPixmap(m_validated);
     #ifndef BROKENBACKGROUND
         m_answerView->setStyleSheet("QTreeView { background-color: #96ff96; }");
     #endif
     } else if (val_istrusted(val_status)) {
-        m_securityStatus =
-            new QStandardItem("Status: Trusted");
-        m_answers->setSecurityStatus(m_securityStatus,
+        securityStatus = new QStandardItem("Status: Trusted");
+        m_answers->setSecurityStatus(request->item,
                                      QDNSItemModel::trusted);
         m_resultsIcon->setPixmap(m_trusted);
     #ifndef BROKENBACKGROUND
         m_answerView->setStyleSheet("QTreeView { background-color: #ffff96; }");
     #endif
     } else {
-        m_securityStatus = new QStandardItem("Status: Bogus");
-        m_answers->setSecurityStatus(m_securityStatus,
+        securityStatus = new QStandardItem("Status: Bogus");
+        m_answers->setSecurityStatus(request->item,
                                      QDNSItemModel::bad);
         m_resultsIcon->setPixmap(m_bad);
     #ifndef BROKENBACKGROUND
@@ -473,11 +634,13 @@ void Lookup::setSecurityStatus(int val_status) {
     #endif
     }
 
-    security->appendRow(m_securityStatus);
+    security->appendRow(securityStatus);
     security->appendRow(new QStandardItem(QString("code: ") + QString(p_val_status(val_status))));
+    if (summary)
+        summary->setText(securityStatus->text());
 
     QStandardItem *logs = new QStandardItem("Logs");
-    m_answers->appendRow(logs);
+    request->item->appendRow(logs);
     QStandardItem *interesting = new QStandardItem("Interesting");
     logs->appendRow(interesting);
 
@@ -491,7 +654,8 @@ void Lookup::setSecurityStatus(int val_status) {
     QString lastInterestingString;
     QList<QPair<int, QString> >::iterator logEnd = val_log_strings.end();
 
-    for(QList<QPair<int, QString> >::iterator start = val_log_strings.begin();
+    for(QList<QPair<int, QString> >::iterator start =
+            val_log_strings.begin() + request->firstLog;
         start != logEnd; start++) {
         QList<QStandardItem *> newRow;
         int level = (*start).first;
@@ -535,19 +699,30 @@ void Lookup::setSecurityStatus(int val_status) {
 
 void Lookup::unbusy() {
     setCursor(Qt::ArrowCursor);
-    gobutton->setEnabled(true);
 }
 
 void Lookup::busy() {
-    setCursor(Qt::WaitCursor);
-    gobutton->setDisabled(true);
+    // lookups run in the background, so the window stays usable
+    setCursor(Qt::BusyCursor);
+}
+
+// Drop the oldest finished lookups, so that at most keep of them are listed
+void Lookup::pruneLookups(int keep) {
+    for(int row = m_answers->rowCount() - 1;
+        row >= 0 && m_answers->rowCount() > keep; row--) {
+        bool pending = false;
+        foreach(LookupRequest *request, m_requests) {
+            if (request->item->row() == row)
+                pending = true;
+        }
+        if (!pending)
+            m_answers->removeRow(row);
+    }
 }
 
 void Lookup::entryTextChanged(const QString &newtext) {
     Q_UNUSED(newtext);
-    m_answers->clear();
-    m_answers->setSecurityStatus(m_securityStatus,
-                                 QDNSItemModel::unknown);
+    pruneLookups(0);
 #ifndef BROKENBACKGROUND
     m_answerView->setStyleSheet("QTreeView { background-color: #ffffff; }");
 #endif
@@ -577,6 +752,10 @@ void Lookup::showPreferences()
 void Lookup::loadPreferences()
 {
     QSettings settings("DNSSEC-Tools", "Lookup");
-    m_logLocation = settings.value("logPath", "").toString();
+    QString logLocation = settings.value("logPath", "").toString();
+
     init_libval();
+    if (logLocation.length() > 0 && logLocation != m_logLocation)
+        val_log_add_optarg(QString("7:file:" + logLocation).toLatin1().data(), 0);
+    m_logLocation = logLocation;
 }
@@ -13,6 +13,11 @@
 #include <QSize>
 #include <QSignalMapper>
 #include <QMainWindow>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QTime>
+#include <QList>
+#include <QMap>
 
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
@@ -26,6 +31,22 @@
 
 #include "QDNSItemModel.h"
 
+class Lookup;
+
+// A lookup in flight; passed to libval as the callback data
+struct LookupRequest
+{
+    Lookup           *lookup;
+    QString           name;
+    int               type;
+    QTime             started;
+    int               firstLog;
+    QStandardItem    *item;
+#ifndef VAL_NO_ASYNC
+    val_async_status *status;
+#endif
+};
+
 class Lookup : public QMainWindow
 {
     Q_OBJECT
@@ -53,9 +74,21 @@ protected slots:
     QSize sizeHint();
     void entryTextChanged(const QString &newtext);
 
-    void setSecurityStatus(int val_status);
+    void asyncDataAvailable();
+    void updateWatchedSockets();
 
 private:
+#ifndef VAL_NO_ASYNC
+    static int asyncCallback(val_async_status *as, int event,
+                             val_context_t *ctx, void *cb_data,
+                             val_cb_params_t *cbp);
+#endif
+    void finishLookup(LookupRequest *request, int ret, const u_char *buf,
+                      val_status_t val_status);
+    void showResults(LookupRequest *request, int ret, const u_char *buf);
+    void setSecurityStatus(LookupRequest *request, int val_status);
+    void pruneLookups(int keep);
+
     QLineEdit          *lookupline;
     QPushButton        *gobutton;
     QGridLayout        *gridLayout;
@@ -63,12 +96,12 @@ private:
     QVBoxLayout        *vlayout;
     QTreeView          *m_answerView;
     QDNSItemModel      *m_answers;
-    QStandardItem      *m_securityStatus;
 
     // Icons
     QPixmap             m_validated, m_trusted, m_bad, m_unknown;
 
     static const int  fields = 4;
+    static const int  maxLookups = 20;
     QLabel           *labels[fields];
     QLabel           *values[fields];
     QLabel            *m_resultsIcon;
@@ -82,6 +115,12 @@ private:
 
     // libval settings
     val_context_t *val_ctx;
+
+    // lookups in flight, and the sockets and timer that drive them
+    QList<LookupRequest *>        m_requests;
+    QSocketNotifier              *m_pollNotifier;
+    QMap<int, QSocketNotifier *>  m_socketNotifiers;
+    QTimer                       *m_alarmTimer;
 };
 
 #endif
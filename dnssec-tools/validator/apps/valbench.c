@@ -0,0 +1,1030 @@
+/*
+ * Copyright 2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ *
+ * A load generator and throughput benchmark for the asynchronous
+ * libval interface.
+ *
+ * Query names are replayed from a corpus file (or made up), either in
+ * order or drawn from a Zipf distribution, and a fixed number of them
+ * is kept in flight with val_async_submit(). At the end the query rate,
+ * latency percentiles, cache hit ratio and CPU time per query are
+ * reported.
+ *
+ * With -A the queries go to a stand-in name server that this program
+ * runs in a child process. It answers every question with made up
+ * data, or from a recording of earlier upstream traffic (-R), so that a
+ * run doesn't depend on the network and results can be compared from
+ * one release to the next.
+ */
+
+#include "validator/validator-config.h"
+#include <validator/validator.h>
+#include <validator/resolver.h>
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#include <math.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define	NAME	"valbench"
+#define	VERS	"version: 1.0"
+#define	DTVERS	"DNSSEC-Tools Version: 1.8"
+
+#define VB_DEFAULT_INFLIGHT   10
+#define VB_DEFAULT_NAMES      1000
+#define VB_STAND_IN_TTL       300
+#define VB_STAND_IN_PENDING   4096
+
+#ifdef HAVE_GETOPT_LONG
+// Program options
+static struct option prog_options[] = {
+    {"help", 0, 0, 'h'},
+    {"file", 1, 0, 'f'},
+    {"count", 1, 0, 'n'},
+    {"inflight", 1, 0, 'I'},
+    {"zipf", 1, 0, 'z'},
+    {"seed", 1, 0, 'S'},
+    {"type", 1, 0, 't'},
+    {"no-dnssec", 0, 0, 'N'},
+    {"stand-in", 1, 0, 'A'},
+    {"stand-in-delay", 1, 0, 'D'},
+    {"stand-in-loss", 1, 0, 'L'},
+    {"replay", 1, 0, 'R'},
+    {"record", 1, 0, 'W'},
+    {"serve", 0, 0, 's'},
+    {"output", 1, 0, 'o'},
+    {"resolv-conf", 1, 0, 'r'},
+    {"dnsval-conf", 1, 0, 'v'},
+    {"root-hints", 1, 0, 'i'},
+    {"Version", 0, 0, 'V'},
+    {0, 0, 0, 0}
+};
+#endif
+
+struct vb_name {
+    char           *name;
+    u_int16_t       type_h;
+};
+
+struct vb_query {
+    struct timeval  start;
+    int             active;
+#ifndef VAL_NO_ASYNC
+    val_async_status *as;
+#endif
+};
+
+/* state of a benchmark run */
+static struct vb_name *names = NULL;
+static int      num_names = 0;
+static double  *zipf_cdf = NULL;
+
+static long    *latency = NULL;     /* us, one per completed query */
+static long     completed = 0;
+static long     in_flight = 0;
+static long     failed = 0;
+static long     validated = 0;
+static long     trusted = 0;
+
+static long     stats_queries = 0;
+static long     stats_cache_hits = 0;
+
+void
+usage(char *progname)
+{
+    fprintf(stderr, "Usage: %s [options] [name-file]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr,
+            "\t-h, --help               display usage and exit\n");
+    fprintf(stderr,
+            "\t-f, --file=<file>        read query names (and optionally a type)\n"
+            "\t                         from <file>, one per line\n");
+    fprintf(stderr,
+            "\t-n, --count=<number>     number of queries to send (default: one\n"
+            "\t                         per name)\n");
+    fprintf(stderr,
+            "\t-I, --inflight=<number>  queries to keep in flight (default %d)\n",
+            VB_DEFAULT_INFLIGHT);
+    fprintf(stderr,
+            "\t-z, --zipf=<exponent>    draw names from a Zipf distribution\n"
+            "\t                         instead of replaying them in order\n");
+    fprintf(stderr,
+            "\t-S, --seed=<number>      random seed for --zipf\n");
+    fprintf(stderr,
+            "\t-t, --type=<type>        record type for names without one\n"
+            "\t                         (default A)\n");
+    fprintf(stderr,
+            "\t-N, --no-dnssec          don't validate the answers\n");
+    fprintf(stderr,
+            "\t-A, --stand-in=<port>    run a stand-in name server on\n"
+            "\t                         127.0.0.1:<port> and query only it\n");
+    fprintf(stderr,
+            "\t-D, --stand-in-delay=<ms> delay stand-in answers by <ms>, or\n"
+            "\t                         by the recorded time with \"rtt\"\n");
+    fprintf(stderr,
+            "\t-L, --stand-in-loss=<percent> leave <percent> of the\n"
+            "\t                         questions to the stand-in unanswered\n");
+    fprintf(stderr,
+            "\t-R, --replay=<file>      have the stand-in answer from a\n"
+            "\t                         recording\n");
+    fprintf(stderr,
+            "\t-s, --serve              only run the stand-in, in the foreground\n");
+    fprintf(stderr,
+            "\t-W, --record=<file>      record upstream queries and responses\n");
+    fprintf(stderr,
+            "\t-o, --output=<debug-level>:<dest-type>[:<dest-options>]\n"
+            "\t          <debug-level> is 1-7, corresponding to syslog levels\n"
+            "\t          <dest-type> is one of file, net, syslog, stderr, stdout\n"
+            "\t          <dest-options> depends on <dest-type>\n"
+            "\t              file:<file-name>   (opened in append mode)\n"
+            "\t              net[:<host-name>:<host-port>] (127.0.0.1:1053\n"
+            "\t              syslog[:facility] (0-23 (default 1 USER))\n");
+    fprintf(stderr,
+            "\t-v, --dnsval-conf=<file> dnsval.conf file\n");
+    fprintf(stderr,
+            "\t-r, --resolv-conf=<file> resolv.conf file\n");
+    fprintf(stderr,
+            "\t-i, --root-hints=<file>  root.hints file\n");
+    fprintf(stderr,
+            "\t-V, --Version            display version and exit\n");
+}
+
+void
+version(void)
+{
+    fprintf(stderr, "%s: %s\n", NAME, VERS);
+    fprintf(stderr, "%s\n", DTVERS);
+}
+
+static long
+vb_usec(struct timeval *tv)
+{
+    return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+static long
+vb_elapsed(struct timeval *start)
+{
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+    return vb_usec(&now) - vb_usec(start);
+}
+
+/*
+ * Query name corpus
+ */
+
+static int
+vb_add_name(const char *name, u_int16_t type_h, int *alloced)
+{
+    struct vb_name *n;
+
+    if (num_names == *alloced) {
+        *alloced = *alloced ? *alloced * 2 : 256;
+        n = (struct vb_name *) malloc(*alloced * sizeof(struct vb_name));
+        if (NULL == n)
+            return -1;
+        if (names) {
+            memcpy(n, names, num_names * sizeof(struct vb_name));
+            free(names);
+        }
+        names = n;
+    }
+    names[num_names].name = strdup(name);
+    if (NULL == names[num_names].name)
+        return -1;
+    names[num_names].type_h = type_h;
+    num_names++;
+    return 0;
+}
+
+/*
+ * Read "name [type]" lines; blank lines and lines starting with '#'
+ * are skipped.
+ */
+static int
+vb_read_names(const char *file, u_int16_t def_type)
+{
+    FILE           *fp;
+    char            line[NS_MAXDNAME + 64];
+    char            name[NS_MAXDNAME], type[32];
+    int             alloced = 0, success, n;
+    u_int16_t       type_h;
+
+    fp = fopen(file, "r");
+    if (NULL == fp) {
+        fprintf(stderr, "Could not open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        n = sscanf(line, "%1024s %31s", name, type);
+        if (n < 1 || name[0] == '#')
+            continue;
+        type_h = def_type;
+        if (n > 1) {
+            type_h = res_nametotype(type, &success);
+            if (!success) {
+                fprintf(stderr, "Unrecognized type %s for %s\n", type, name);
+                continue;
+            }
+        }
+        if (vb_add_name(name, type_h, &alloced) < 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* made up names, for use with the stand-in server */
+static int
+vb_make_names(int count, u_int16_t def_type)
+{
+    char            name[64];
+    int             alloced = 0, i;
+
+    for (i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "q%d.bench.example", i);
+        if (vb_add_name(name, def_type, &alloced) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void
+vb_free_names(void)
+{
+    int             i;
+
+    for (i = 0; i < num_names; i++)
+        free(names[i].name);
+    free(names);
+    names = NULL;
+    num_names = 0;
+}
+
+/*
+ * The name with rank k (counting from 0) is picked with a probability
+ * proportional to 1 / (k + 1)^s.
+ */
+static int
+vb_zipf_init(double s)
+{
+    double          sum = 0;
+    int             i;
+
+    zipf_cdf = (double *) malloc(num_names * sizeof(double));
+    if (NULL == zipf_cdf)
+        return -1;
+    for (i = 0; i < num_names; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < num_names; i++)
+        zipf_cdf[i] /= sum;
+    return 0;
+}
+
+static int
+vb_next_name(long seq)
+{
+    double          u;
+    int             lo, hi, mid;
+
+    if (NULL == zipf_cdf)
+        return seq % num_names;
+
+    u = (double) random() / ((double) RAND_MAX + 1.0);
+    lo = 0;
+    hi = num_names - 1;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] <= u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Stand-in name server
+ *
+ * Every A or AAAA question is answered with an address made up from
+ * the name. Names starting with "nx" get NXDOMAIN and all other
+ * questions get an empty answer, both with an SOA record for the parent
+ * of the name. Answers can be held back for a fixed delay to mimic a
+ * remote server, and a share of the questions can be dropped.
+ */
+
+/* append a resource record whose owner is the compressed name at offset */
+static u_char *
+vb_put_rr(u_char *cp, int offset, u_int16_t type_h, u_int32_t ttl,
+          const u_char *rdata, u_int16_t rdlen)
+{
+    NS_PUT16(0xc000 | offset, cp);
+    NS_PUT16(type_h, cp);
+    NS_PUT16(ns_c_in, cp);
+    NS_PUT32(ttl, cp);
+    NS_PUT16(rdlen, cp);
+    memcpy(cp, rdata, rdlen);
+    return cp + rdlen;
+}
+
+static int
+vb_stand_in_answer(u_char *query, int qlen, u_char *resp, int rmax)
+{
+    HEADER         *hp;
+    char            name[NS_MAXDNAME];
+    u_char          rdata[22], *cp, *rp;
+    u_int16_t       type_h;
+    u_int32_t       h = 2166136261U;
+    int             len, i, parent;
+
+    if (qlen < HFIXEDSZ || qlen > rmax)
+        return -1;
+    hp = (HEADER *) query;
+    if (hp->qr || ntohs(hp->qdcount) != 1)
+        return -1;
+    len = dn_expand(query, query + qlen, query + HFIXEDSZ, name, sizeof(name));
+    if (len < 0 || HFIXEDSZ + len + QFIXEDSZ > qlen)
+        return -1;
+    cp = query + HFIXEDSZ + len;
+    NS_GET16(type_h, cp);
+
+    /* header and question, without any OPT record */
+    len = HFIXEDSZ + len + QFIXEDSZ;
+    if (len + 12 + sizeof(rdata) > rmax)
+        return -1;
+    memcpy(resp, query, len);
+    hp = (HEADER *) resp;
+    hp->qr = 1;
+    hp->aa = 1;
+    hp->ra = 1;
+    hp->tc = 0;
+    hp->ad = 0;
+    hp->rcode = ns_r_noerror;
+    hp->ancount = hp->nscount = hp->arcount = 0;
+    cp = resp + len;
+
+    for (i = 0; name[i]; i++)
+        h = (h ^ (u_char) tolower((u_char) name[i])) * 16777619U;
+
+    if (!strncasecmp(name, "nx", 2) ||
+        (type_h != ns_t_a && type_h != ns_t_aaaa)) {
+        if (!strncasecmp(name, "nx", 2))
+            hp->rcode = ns_r_nxdomain;
+        /* the parent of the question name, or the root */
+        parent = HFIXEDSZ + (resp[HFIXEDSZ] ? 1 + resp[HFIXEDSZ] : 0);
+        rp = rdata;
+        *rp++ = 0;              /* mname and rname are "." */
+        *rp++ = 0;
+        NS_PUT32(1, rp);        /* serial */
+        NS_PUT32(3600, rp);     /* refresh */
+        NS_PUT32(600, rp);      /* retry */
+        NS_PUT32(86400, rp);    /* expire */
+        NS_PUT32(VB_STAND_IN_TTL, rp);
+        cp = vb_put_rr(cp, parent, ns_t_soa, VB_STAND_IN_TTL, rdata,
+                       rp - rdata);
+        hp->nscount = htons(1);
+    } else if (type_h == ns_t_a) {
+        /* 198.18.0.0/15, set aside for benchmarking */
+        rdata[0] = 198;
+        rdata[1] = 18 + ((h >> 16) & 1);
+        rdata[2] = (h >> 8) & 0xff;
+        rdata[3] = h & 0xff;
+        cp = vb_put_rr(cp, HFIXEDSZ, type_h, VB_STAND_IN_TTL, rdata, 4);
+        hp->ancount = htons(1);
+    } else {
+        /* 2001:2::/48, likewise */
+        memset(rdata, 0, 16);
+        rdata[0] = 0x20;
+        rdata[1] = 0x01;
+        rdata[3] = 0x02;
+        rdata[12] = (h >> 24) & 0xff;
+        rdata[13] = (h >> 16) & 0xff;
+        rdata[14] = (h >> 8) & 0xff;
+        rdata[15] = h & 0xff;
+        cp = vb_put_rr(cp, HFIXEDSZ, type_h, VB_STAND_IN_TTL, rdata, 16);
+        hp->ancount = htons(1);
+    }
+    return cp - resp;
+}
+
+/*
+ * Answer from a recording made with res_io_record_start(): the most
+ * complete recorded response to the question, with the ID of the
+ * query. Questions that weren't recorded get SERVFAIL.
+ */
+static int
+vb_stand_in_replay(struct res_replay *rp, u_char *query, int qlen,
+                   u_char *resp, int rmax, const u_char **recorded,
+                   long *rtt)
+{
+    HEADER         *hp;
+    size_t          rlen;
+    int             len;
+
+    *recorded = NULL;
+    *rtt = 0;
+    if (qlen < HFIXEDSZ || ((HEADER *) query)->qr)
+        return -1;
+    if (0 == res_replay_lookup(rp, query, qlen, NULL, recorded, &rlen, rtt))
+        return rlen;
+
+    /* header and question only */
+    len = HFIXEDSZ;
+    if (ntohs(((HEADER *) query)->qdcount) == 1) {
+        len = dn_skipname(query + HFIXEDSZ, query + qlen);
+        if (len < 0 || HFIXEDSZ + len + QFIXEDSZ > qlen)
+            return -1;
+        len += HFIXEDSZ + QFIXEDSZ;
+    }
+    if (len > rmax)
+        return -1;
+    memcpy(resp, query, len);
+    hp = (HEADER *) resp;
+    hp->qr = 1;
+    hp->ra = 1;
+    hp->rcode = ns_r_servfail;
+    hp->ancount = hp->nscount = hp->arcount = 0;
+    hp->qdcount = htons(len > HFIXEDSZ ? 1 : 0);
+    return len;
+}
+
+struct vb_pending {
+    struct timeval  due;
+    struct sockaddr_storage from;
+    socklen_t       fromlen;
+    int             len;
+    u_int16_t       id;
+    const u_char   *recorded;   /* answer from the recording, or msg */
+    u_char          msg[512];
+};
+
+/*
+ * the pending answers form a heap ordered by due time, since recorded
+ * round trip times differ from answer to answer
+ */
+static void
+vb_pending_swap(struct vb_pending *pending, int i, int j)
+{
+    struct vb_pending tmp;
+
+    memcpy(&tmp, &pending[i], sizeof(tmp));
+    memcpy(&pending[i], &pending[j], sizeof(tmp));
+    memcpy(&pending[j], &tmp, sizeof(tmp));
+}
+
+static void
+vb_pending_push(struct vb_pending *pending, int count)
+{
+    int             i = count - 1, parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!timercmp(&pending[i].due, &pending[parent].due, <))
+            break;
+        vb_pending_swap(pending, i, parent);
+        i = parent;
+    }
+}
+
+static void
+vb_pending_pop(struct vb_pending *pending, int count)
+{
+    int             i = 0, child;
+
+    if (--count == 0)
+        return;
+    memcpy(&pending[0], &pending[count], sizeof(pending[0]));
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count &&
+            timercmp(&pending[child + 1].due, &pending[child].due, <))
+            child++;
+        if (!timercmp(&pending[child].due, &pending[i].due, <))
+            break;
+        vb_pending_swap(pending, i, child);
+        i = child;
+    }
+}
+
+static void
+vb_pending_send(int fd, struct vb_pending *p)
+{
+    static u_char   buf[65536];
+    const u_char   *msg = p->msg;
+
+    if (p->recorded) {
+        /* the recording keeps the ID of the original query */
+        memcpy(buf, p->recorded, p->len);
+        memcpy(buf, &p->id, sizeof(p->id));
+        msg = buf;
+    }
+    sendto(fd, msg, p->len, 0, (struct sockaddr *) &p->from, p->fromlen);
+}
+
+/*
+ * Serve questions until the parent goes away. A delay of -1 holds each
+ * replayed answer back by its recorded round trip time; loss is the
+ * share of questions, in percent, that go unanswered.
+ */
+static void
+vb_stand_in_run(int fd, long delay, int loss, struct res_replay *rp,
+                pid_t parent)
+{
+    struct vb_pending *pending;
+    int             count = 0, len, rc;
+    u_char          query[4096];
+    struct sockaddr_storage from;
+    socklen_t       fromlen;
+    struct timeval  now, tv;
+    fd_set          fds;
+    long            rtt;
+
+    pending = (struct vb_pending *)
+        malloc(VB_STAND_IN_PENDING * sizeof(struct vb_pending));
+    if (NULL == pending)
+        return;
+
+    /* wake up at least once a second to notice the parent is gone */
+    while (getppid() == parent) {
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (count) {
+            gettimeofday(&now, NULL);
+            timersub(&pending[0].due, &now, &tv);
+            if (tv.tv_sec < 0)
+                timerclear(&tv);
+        }
+        rc = select(fd + 1, &fds, NULL, NULL, &tv);
+        if (rc < 0 && errno != EINTR)
+            break;
+
+        if (rc > 0 && FD_ISSET(fd, &fds)) {
+            struct vb_pending *p = &pending[count];
+
+            fromlen = sizeof(from);
+            len = recvfrom(fd, query, sizeof(query), 0,
+                           (struct sockaddr *) &from, &fromlen);
+            if (len > 0 && loss > 0 && random() % 100 < loss)
+                len = 0;
+            rtt = 0;
+            if (len > 0 && count < VB_STAND_IN_PENDING &&
+                (p->len = rp ?
+                 vb_stand_in_replay(rp, query, len, p->msg, sizeof(p->msg),
+                                    &p->recorded, &rtt) :
+                 vb_stand_in_answer(query, len, p->msg,
+                                    sizeof(p->msg))) > 0) {
+                if (!rp)
+                    p->recorded = NULL;
+                memcpy(&p->id, query, sizeof(p->id));
+                memcpy(&p->from, &from, fromlen);
+                p->fromlen = fromlen;
+                if (delay >= 0)
+                    rtt = delay;
+                gettimeofday(&p->due, NULL);
+                p->due.tv_sec += rtt / 1000000L;
+                p->due.tv_usec += rtt % 1000000L;
+                if (p->due.tv_usec >= 1000000L) {
+                    p->due.tv_sec++;
+                    p->due.tv_usec -= 1000000L;
+                }
+                vb_pending_push(pending, ++count);
+            }
+        }
+
+        gettimeofday(&now, NULL);
+        while (count && !timercmp(&pending[0].due, &now, >)) {
+            vb_pending_send(fd, &pending[0]);
+            vb_pending_pop(pending, count--);
+        }
+    }
+    free(pending);
+}
+
+/*
+ * Bind the stand-in's socket here, so that it is ready before the
+ * first query is sent.
+ */
+static int
+vb_stand_in_socket(int port)
+{
+    struct sockaddr_in sin;
+    int             fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+        fprintf(stderr, "Could not bind to 127.0.0.1:%d: %s\n", port,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Serve the stand-in from a child process so that its CPU time isn't
+ * counted against libval.
+ */
+static pid_t
+vb_stand_in_start(int port, long delay, int loss, struct res_replay *rp)
+{
+    int             fd;
+    pid_t           pid, parent;
+
+    fd = vb_stand_in_socket(port);
+    if (fd < 0)
+        return -1;
+
+    parent = getpid();
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Could not fork: %s\n", strerror(errno));
+    } else if (0 == pid) {
+        vb_stand_in_run(fd, delay, loss, rp, parent);
+        _exit(0);
+    }
+    close(fd);
+    return pid;
+}
+
+#ifndef VAL_NO_ASYNC
+/*
+ * Benchmark
+ */
+
+static void
+vb_stats_callback(void *cb_data, const char *name, int class_h, int type_h,
+                  const val_query_stats_t *qs)
+{
+    stats_queries++;
+    if (0 == qs->vqs_count[VAL_STAT_QUERIES_SENT])
+        stats_cache_hits++;
+}
+
+static int
+vb_query_callback(val_async_status *as, int event, val_context_t *ctx,
+                  void *cb_data, val_cb_params_t *cbp)
+{
+    struct vb_query *q = (struct vb_query *) cb_data;
+
+    latency[completed++] = vb_elapsed(&q->start);
+    q->active = 0;
+    q->as = NULL;   /* released once this callback returns */
+    in_flight--;
+
+    if (VAL_AS_EVENT_COMPLETED != event || VAL_NO_ERROR != cbp->retval ||
+        NULL == cbp->results) {
+        failed++;
+        return VAL_NO_ERROR;
+    }
+    /* results and answers are released by libval when we're done */
+    if (val_isvalidated(cbp->results->val_rc_status))
+        validated++;
+    else if (val_istrusted(cbp->results->val_rc_status))
+        trusted++;
+    return VAL_NO_ERROR;
+}
+
+static int
+vb_cmp_long(const void *a, const void *b)
+{
+    long            x = *(const long *) a, y = *(const long *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+vb_percentile(double p)
+{
+    long            i;
+
+    if (0 == completed)
+        return 0;
+    i = (long) ceil(p * completed) - 1;
+    if (i < 0)
+        i = 0;
+    return latency[i] / 1000.0;
+}
+
+static void
+vb_report(long total, int max_in_flight, long usec, struct rusage *ru0,
+          struct rusage *ru1)
+{
+    long            cpu;
+
+    cpu = vb_usec(&ru1->ru_utime) - vb_usec(&ru0->ru_utime) +
+          vb_usec(&ru1->ru_stime) - vb_usec(&ru0->ru_stime);
+    qsort(latency, completed, sizeof(long), vb_cmp_long);
+
+    printf("queries:          %ld (%ld in flight, %d names)\n",
+           total, (long) max_in_flight, num_names);
+    printf("completed:        %ld (%ld validated, %ld trusted, %ld failed)\n",
+           completed, validated, trusted, failed);
+    printf("elapsed:          %.3f s\n", usec / 1e6);
+    printf("throughput:       %.1f queries/s\n",
+           usec > 0 ? completed * 1e6 / usec : 0.0);
+    printf("latency p50:      %.3f ms\n", vb_percentile(0.50));
+    printf("latency p99:      %.3f ms\n", vb_percentile(0.99));
+    printf("latency p999:     %.3f ms\n", vb_percentile(0.999));
+    printf("latency max:      %.3f ms\n",
+           completed ? latency[completed - 1] / 1000.0 : 0.0);
+    printf("cache hit ratio:  %.1f%%\n",
+           stats_queries ? 100.0 * stats_cache_hits / stats_queries : 0.0);
+    printf("cpu per query:    %.1f us\n",
+           completed ? (double) cpu / completed : 0.0);
+}
+
+static int
+vb_run(val_context_t *ctx, long total, int max_in_flight,
+       unsigned int qflags)
+{
+    struct vb_query *slots;
+    struct timeval  start, tv;
+    struct rusage   ru0, ru1;
+    long            sent = 0;
+    int             i, n, retval;
+
+    slots = (struct vb_query *) calloc(max_in_flight, sizeof(*slots));
+    latency = (long *) malloc(total * sizeof(long));
+    if (NULL == slots || NULL == latency) {
+        fprintf(stderr, "Out of memory\n");
+        free(slots);
+        return -1;
+    }
+
+    val_stats_set_callback(vb_stats_callback, NULL);
+    val_stats_enable(1);
+
+    getrusage(RUSAGE_SELF, &ru0);
+    gettimeofday(&start, NULL);
+
+    while (completed < total) {
+        /* top up to the configured number of queries in flight */
+        for (i = 0; i < max_in_flight && sent < total; i++) {
+            if (slots[i].active)
+                continue;
+            n = vb_next_name(sent);
+            slots[i].active = 1;
+            in_flight++;
+            gettimeofday(&slots[i].start, NULL);
+            retval = val_async_submit(ctx, names[n].name, ns_c_in,
+                                      names[n].type_h, qflags,
+                                      &vb_query_callback, &slots[i],
+                                      &slots[i].as);
+            sent++;
+            if (VAL_NO_ERROR != retval) {
+                fprintf(stderr, "Could not submit %s: %s\n", names[n].name,
+                        p_val_err(retval));
+                latency[completed++] = vb_elapsed(&slots[i].start);
+                slots[i].active = 0;
+                in_flight--;
+                failed++;
+            }
+        }
+        if (0 == in_flight)
+            continue;
+
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        val_async_check_wait(ctx, NULL, NULL, &tv, 0);
+    }
+
+    gettimeofday(&tv, NULL);
+    getrusage(RUSAGE_SELF, &ru1);
+    val_stats_enable(0);
+    val_stats_set_callback(NULL, NULL);
+
+    vb_report(total, max_in_flight, vb_usec(&tv) - vb_usec(&start),
+              &ru0, &ru1);
+
+    free(slots);
+    free(latency);
+    latency = NULL;
+    return 0;
+}
+#endif /* ndef VAL_NO_ASYNC */
+
+int
+main(int argc, char *argv[])
+{
+    char           *file = NULL;
+    char           *dnsval_conf = NULL, *resolv_conf = NULL, *root_hints = NULL;
+    char            nslist[64];
+    u_int16_t       type_h = ns_t_a;
+    char           *replay = NULL, *record = NULL;
+    long            total = 0, delay = 0;
+    int             max_in_flight = VB_DEFAULT_INFLIGHT;
+    int             port = 0, loss = 0, serve = 0, success, status, ret = -1;
+    unsigned int    qflags = 0;
+    double          zipf = 0;
+    val_log_t      *logp;
+    val_context_opt_t opt;
+    val_context_t  *ctx = NULL;
+    pid_t           stand_in = -1;
+    struct res_replay *rp = NULL;
+    const char     *args = "hf:n:I:z:S:t:NA:D:L:R:W:so:r:v:i:V";
+
+    while (1) {
+        int             c;
+#ifdef HAVE_GETOPT_LONG
+        int             opt_index = 0;
+#ifdef HAVE_GETOPT_LONG_ONLY
+        c = getopt_long_only(argc, argv, args, prog_options, &opt_index);
+#else
+        c = getopt_long(argc, argv, args, prog_options, &opt_index);
+#endif
+#else                           /* only have getopt */
+        c = getopt(argc, argv, args);
+#endif
+
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            return -1;
+        case 'f':
+            file = optarg;
+            break;
+        case 'n':
+            total = strtol(optarg, NULL, 10);
+            break;
+        case 'I':
+            max_in_flight = strtol(optarg, NULL, 10);
+            break;
+        case 'z':
+            zipf = strtod(optarg, NULL);
+            break;
+        case 'S':
+            srandom(strtoul(optarg, NULL, 10));
+            break;
+        case 't':
+            type_h = res_nametotype(optarg, &success);
+            if (!success) {
+                fprintf(stderr, "Unrecognized type %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'N':
+            qflags |= VAL_QUERY_DONT_VALIDATE;
+            break;
+        case 'A':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'D':
+            if (!strcmp(optarg, "rtt"))
+                delay = -1;
+            else if ((delay = strtol(optarg, NULL, 10) * 1000L) < 0)
+                delay = -2;
+            break;
+        case 'L':
+            loss = strtol(optarg, NULL, 10);
+            break;
+        case 'R':
+            replay = optarg;
+            break;
+        case 'W':
+            record = optarg;
+            break;
+        case 's':
+            serve = 1;
+            break;
+        case 'o':
+            logp = val_log_add_optarg(optarg, 1);
+            if (NULL == logp) { /* err msg already logged */
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'r':
+            resolv_conf = optarg;
+            break;
+        case 'v':
+            dnsval_conf = optarg;
+            break;
+        case 'i':
+            root_hints = optarg;
+            break;
+        case 'V':
+            version();
+            return 0;
+        default:
+            fprintf(stderr, "Invalid option %s\n", argv[optind - 1]);
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind < argc && NULL == file)
+        file = argv[optind++];
+    if (max_in_flight <= 0 || total < 0 || zipf < 0 || delay < -1 ||
+        port < 0 || port > 65535 || loss < 0 || loss > 100 ||
+        ((replay || serve) && !port) || (delay == -1 && !replay)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (replay && NULL == (rp = res_replay_open(replay))) {
+        fprintf(stderr, "Could not read recording %s\n", replay);
+        return -1;
+    }
+    if (serve) {
+        int             fd = vb_stand_in_socket(port);
+
+        if (fd < 0)
+            goto done;
+        /* until our own parent goes away */
+        vb_stand_in_run(fd, delay, loss, rp, getppid());
+        close(fd);
+        ret = 0;
+        goto done;
+    }
+    if (record && res_io_record_start(record) != 0) {
+        fprintf(stderr, "Could not write recording %s\n", record);
+        goto done;
+    }
+
+    if (file) {
+        if (vb_read_names(file, type_h) < 0)
+            goto done;
+    } else if (port) {
+        if (vb_make_names(total ? total : VB_DEFAULT_NAMES, type_h) < 0)
+            goto done;
+    } else {
+        fprintf(stderr, "Error: no query names; use -f or -A\n");
+        usage(argv[0]);
+        return -1;
+    }
+    if (0 == num_names) {
+        fprintf(stderr, "Error: no query names in %s\n", file);
+        goto done;
+    }
+    if (0 == total)
+        total = num_names;
+    if (zipf > 0 && vb_zipf_init(zipf) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+
+    memset(&opt, 0, sizeof(opt));
+    opt.vc_val_conf = dnsval_conf;
+    opt.vc_res_conf = resolv_conf;
+    opt.vc_root_conf = root_hints;
+    if (port) {
+        stand_in = vb_stand_in_start(port, delay, loss, rp);
+        if (stand_in < 0)
+            goto done;
+        /* send everything to the stand-in, as a recursive server */
+        snprintf(nslist, sizeof(nslist), "[127.0.0.1]:%d", port);
+        opt.vc_nslist = nslist;
+        opt.vc_polflags = CTX_DYN_POL_RES_OVR;
+    }
+    if (VAL_NO_ERROR != (success = val_create_context_ex(NAME, &opt, &ctx))) {
+        fprintf(stderr, "Could not create validator context: %s\n",
+                p_val_err(success));
+        goto done;
+    }
+
+#ifndef VAL_NO_ASYNC
+    ret = vb_run(ctx, total, max_in_flight, qflags);
+#else
+    fprintf(stderr, "libval was built without asynchronous support\n");
+#endif
+
+  done:
+    if (ctx)
+        val_free_context(ctx);
+    if (stand_in > 0) {
+        kill(stand_in, SIGTERM);
+        waitpid(stand_in, &status, 0);
+    }
+    res_io_record_stop();
+    res_replay_close(rp);
+    free(zipf_cdf);
+    vb_free_names();
+    return ret;
+}
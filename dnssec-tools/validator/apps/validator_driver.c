@@ -29,11 +29,13 @@
 
 #define BUFLEN 16000
 
+#define VD_DEFAULT_PORT 1153
+
 int             MAX_RESPCOUNT = 10;
 int             MAX_RESPSIZE = 8192;
 
-int             listen_fd = -1;
 int             done = 0;
+int             show_stats = 0;
 
 
 #ifdef HAVE_GETOPT_LONG
@@ -57,6 +59,10 @@ static struct option prog_options[] = {
     {"root-hints", 1, 0, 'i'},
     {"wait", 1, 0, 'w'},
     {"inflight", 1, 0, 'I'},
+    {"daemon", 0, 0, 'd'},
+    {"port", 1, 0, 'P'},
+    {"stats", 0, 0, 'Q'},
+    {"record", 1, 0, 'R'},
     {"Version", 1, 0, 'V'},
     {0, 0, 0, 0}
 };
@@ -284,7 +290,12 @@ usage(char *progname)
     printf("        -i, --root-hints=<file> Specifies a root.hints to search for root nameservers\n");
     printf("        -I, --inflight=<number> Maximum number of simultaneous queries\n");
     printf("        -m, --multi-thread=<number> Maximum number of simultaneous threads\n");
+    printf("                               (number of worker threads in daemon mode)\n");
     printf("        -w, --wait=<secs> Run tests in a loop, sleeping for specifed seconds between runs\n");
+    printf("        -d, --daemon           Run as a validating DNS proxy (UDP and TCP)\n");
+    printf("        -P, --port=<port>      Port for daemon mode (default %d)\n", VD_DEFAULT_PORT);
+    printf("        -Q, --stats            Print query statistics and latency histograms on exit\n");
+    printf("        -R, --record=<file>    Record all upstream queries and responses to <file>\n");
     printf("        -l, --label=<label-string> Specifies the policy to use during validation\n");
     printf("        -o, --output=<debug-level>:<dest-type>[:<dest-options>]\n");
     printf("              <debug-level> is 1-7, corresponding to syslog levels ALERT-DEBUG\n");
@@ -315,216 +326,760 @@ version(void)
  *
  *===========================================================================*/
 
+#ifndef VAL_NO_ASYNC
+#define VD_MAX_INFLIGHT      512    /* default queries in flight per worker */
+#define VD_MAX_WORKERS       64
+#define VD_MAX_LISTEN        2      /* one each for IPv4 and IPv6 */
+#define VD_MAX_TCP_CLIENTS   128    /* per worker */
+#define VD_TCP_IDLE_TIMEOUT  10     /* seconds */
+#define VD_UDP_BURST         64     /* datagrams read per wakeup */
+#define VD_MIN_UDP_SIZE      512
+#define VD_MAX_UDP_SIZE      4096
+#define VD_MAX_MSG_SIZE      65535
+
+struct vd_worker;
+
+struct vd_outbuf {
+    u_char              *data;
+    size_t               len;
+    size_t               off;
+    struct vd_outbuf    *next;
+};
+
+/*
+ * A TCP client connection. Queries may be pipelined, so a connection
+ * can have several queries in flight; the structure is released once
+ * the connection is closed and no query refers to it any more.
+ */
+struct vd_tcp_client {
+    int                  fd;
+    int                  refs;
+    time_t               last_active;
+    u_char               lenbuf[2];
+    size_t               lenread;
+    u_char              *msg;
+    size_t               msglen;
+    size_t               msgread;
+    struct vd_outbuf    *outq;
+    struct vd_tcp_client *next;
+};
+
+/*
+ * A client query that has been submitted to libval
+ */
+struct vd_query {
+    struct vd_worker    *worker;
+    int                  udp_fd;
+    struct vd_tcp_client *client;  /* NULL for UDP */
+    struct sockaddr_storage from;
+    socklen_t            from_len;
+    u_char              *query;     /* header and (uncompressed) question */
+    size_t               query_len;
+    size_t               max_resp;
+    char                 name[NS_MAXDNAME];
+    u_int16_t            class_h;
+    u_int16_t            type_h;
+    val_async_status    *as;
+    struct vd_query     *prev;
+    struct vd_query     *next;
+};
+
+struct vd_worker {
+    int                  id;
+    val_context_t       *context;
+    int                  udp_fd[VD_MAX_LISTEN];
+    int                  tcp_fd[VD_MAX_LISTEN];
+    int                  num_listen;
+    int                  shared_fds;
+    int                  max_in_flight;
+    int                  in_flight;
+    int                  num_clients;
+    struct vd_query     *queries;
+    struct vd_tcp_client *clients;
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+    pthread_t            tid;
+#endif
+};
+
 static int
-port_setup(u_short port)
+vd_set_nonblocking(int fd)
 {
-    int             rc;
-    struct sockaddr_in addr;
-
-    if (listen_fd > 0)
-        return listen_fd;
-
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-
-    listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (listen_fd < 0)
-        return listen_fd;
-
-    rc = bind(listen_fd, (struct sockaddr *) &addr,
-              sizeof(struct sockaddr));
-    if (0 != rc) {
-        /** xxx-rks: log err message */
-        close(listen_fd);
-        listen_fd = -1;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int
+vd_open_socket(int family, int socktype, u_short port, int reuseport)
+{
+    int             fd, on = 1;
+    struct sockaddr_storage addr;
+    socklen_t       addr_len;
+
+    memset(&addr, 0, sizeof(addr));
+    if (family == AF_INET) {
+        struct sockaddr_in *sa = (struct sockaddr_in *) &addr;
+        sa->sin_family = AF_INET;
+        sa->sin_addr.s_addr = htonl(INADDR_ANY);
+        sa->sin_port = htons(port);
+        addr_len = sizeof(struct sockaddr_in);
+    }
+#ifdef VAL_IPV6
+    else if (family == AF_INET6) {
+        struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *) &addr;
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_addr = in6addr_any;
+        sa6->sin6_port = htons(port);
+        addr_len = sizeof(struct sockaddr_in6);
+    }
+#endif
+    else
+        return -1;
+
+    fd = socket(family, socktype, 0);
+    if (fd < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if (reuseport &&
+        0 != setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+        val_log(NULL, LOG_WARNING, "validate: SO_REUSEPORT failed: %s",
+                strerror(errno));
+    }
+#endif
+#if defined(VAL_IPV6) && defined(IPV6_V6ONLY)
+    if (family == AF_INET6)
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+#endif
+
+    if (0 != bind(fd, (struct sockaddr *) &addr, addr_len) ||
+        (socktype == SOCK_STREAM && 0 != listen(fd, SOMAXCONN)) ||
+        0 != vd_set_nonblocking(fd) || fd >= FD_SETSIZE) {
+        val_log(NULL, LOG_DEBUG, "validate: cannot listen on %s/%s port %d: %s",
+                family == AF_INET ? "IPv4" : "IPv6",
+                socktype == SOCK_STREAM ? "tcp" : "udp", port,
+                strerror(errno));
+        close(fd);
         return -1;
     }
 
-    return listen_fd;
+    return fd;
 }
 
+/*
+ * Open UDP and TCP listeners for each address family.
+ * Returns the number of address families we are listening on.
+ */
 static int
-wait_for_packet(void)
+port_setup(struct vd_worker *w, u_short port, int reuseport)
 {
-    fd_set          read_fds;
-    int             rc;
+    int             families[] = { AF_INET,
+#ifdef VAL_IPV6
+                                   AF_INET6,
+#endif
+                                   -1 };
+    int             i, ufd, tfd;
+
+    w->num_listen = 0;
+    for (i = 0; families[i] != -1 && w->num_listen < VD_MAX_LISTEN; i++) {
+        ufd = vd_open_socket(families[i], SOCK_DGRAM, port, reuseport);
+        if (ufd < 0)
+            continue;
+        tfd = vd_open_socket(families[i], SOCK_STREAM, port, reuseport);
+        if (tfd < 0) {
+            close(ufd);
+            continue;
+        }
+        w->udp_fd[w->num_listen] = ufd;
+        w->tcp_fd[w->num_listen] = tfd;
+        w->num_listen++;
+    }
+
+    if (0 == w->num_listen)
+        val_log(NULL, LOG_ERR, "validate: cannot listen on port %d", port);
+
+    return w->num_listen;
+}
+
+static void
+vd_client_close(struct vd_tcp_client *c)
+{
+    struct vd_outbuf *ob;
+
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (c->msg) {
+        FREE(c->msg);
+        c->msg = NULL;
+    }
+    while (c->outq) {
+        ob = c->outq;
+        c->outq = ob->next;
+        FREE(ob->data);
+        FREE(ob);
+    }
+}
+
+/*
+ * Write as much of the pending output as the socket will take
+ */
+static int
+vd_client_flush(struct vd_tcp_client *c)
+{
+    struct vd_outbuf *ob;
+    ssize_t         rc;
+
+    while ((ob = c->outq) != NULL) {
+        rc = send(c->fd, ob->data + ob->off, ob->len - ob->off, 0);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        ob->off += rc;
+        if (ob->off < ob->len)
+            return 0;
+        c->outq = ob->next;
+        FREE(ob->data);
+        FREE(ob);
+    }
+    return 0;
+}
+
+static void
+vd_send(struct vd_query *q, u_char *buf, size_t len)
+{
+    ssize_t         rc;
+
+    if (NULL == q->client) {
+        do {
+            rc = sendto(q->udp_fd, buf, len, 0,
+                        (struct sockaddr *) &q->from, q->from_len);
+        } while (rc < 0 && errno == EINTR);
+        if (rc < 0)
+            val_log(NULL, LOG_INFO, "validate: sendto failed: %s",
+                    strerror(errno));
+        else
+            val_log(NULL, LOG_DEBUG, "sent %d bytes", (int) rc);
+    } else {
+        struct vd_outbuf *ob, **tail;
+
+        if (q->client->fd < 0)
+            return;             /* client went away */
+
+        ob = (struct vd_outbuf *) MALLOC(sizeof(struct vd_outbuf));
+        if (NULL == ob)
+            return;
+        ob->data = (u_char *) MALLOC(len + 2);
+        if (NULL == ob->data) {
+            FREE(ob);
+            return;
+        }
+        ob->data[0] = (u_char) ((len >> 8) & 0xff);
+        ob->data[1] = (u_char) (len & 0xff);
+        memcpy(ob->data + 2, buf, len);
+        ob->len = len + 2;
+        ob->off = 0;
+        ob->next = NULL;
+        for (tail = &q->client->outq; *tail; tail = &(*tail)->next)
+            ;
+        *tail = ob;
+        q->client->last_active = time(NULL);
+        if (vd_client_flush(q->client) < 0)
+            vd_client_close(q->client);
+    }
+}
+
+/*
+ * Send a response that consists only of the query header and question
+ */
+static void
+vd_send_header_only(struct vd_query *q, int rcode, int tc)
+{
+    HEADER         *hp = (HEADER *) q->query;
+
+    hp->qr = 1;
+    hp->aa = 0;
+    hp->tc = tc ? 1 : 0;
+    hp->ra = 1;
+    hp->ad = 0;
+    hp->rcode = rcode;
+    hp->qdcount = htons(q->query_len > sizeof(HEADER) ? 1 : 0);
+    hp->ancount = 0;
+    hp->nscount = 0;
+    hp->arcount = 0;
+
+    vd_send(q, q->query, q->query_len);
+}
+
+static void
+vd_send_answer(struct vd_query *q, struct val_response *resp)
+{
+    HEADER         *qhp = (HEADER *) q->query;
+    HEADER         *hp;
+
+    if (NULL == resp->vr_response || resp->vr_length < sizeof(HEADER)) {
+        vd_send_header_only(q, ns_r_servfail, 0);
+        return;
+    }
 
     /*
-     * wait for data
+     * Unless the client asked us not to check, answers that we
+     * could not trust are reported as a server failure.
      */
-    do {
-        FD_ZERO(&read_fds);
-        FD_SET(listen_fd, &read_fds);
-        rc = select(listen_fd + 1, &read_fds, NULL, NULL, NULL);
-        if (rc < 0 && errno != EINTR) {
-            break;              /* xxx-rks: more robust error handling */
-        }
-    } while (rc < 0);
+    if (!qhp->cd && !val_istrusted(resp->vr_val_status)) {
+        vd_send_header_only(q, ns_r_servfail, 0);
+        return;
+    }
 
-    return rc;
+    hp = (HEADER *) resp->vr_response;
+    if (resp->vr_length > q->max_resp) {
+        vd_send_header_only(q, hp->rcode, 1);
+        return;
+    }
+
+    hp->id = qhp->id;
+    hp->qr = 1;
+    hp->opcode = qhp->opcode;
+    hp->aa = 0;
+    hp->tc = 0;
+    hp->rd = qhp->rd;
+    hp->ra = 1;
+    hp->cd = qhp->cd;
+    hp->ad = val_isvalidated(resp->vr_val_status) ? 1 : 0;
+
+    vd_send(q, resp->vr_response, resp->vr_length);
+}
+
+static void
+vd_query_free(struct vd_query *q)
+{
+    struct vd_worker *w = q->worker;
+
+    if (q->prev)
+        q->prev->next = q->next;
+    else if (w->queries == q)
+        w->queries = q->next;
+    if (q->next)
+        q->next->prev = q->prev;
+    w->in_flight--;
+
+    if (q->client)
+        q->client->refs--;
+    if (q->query)
+        FREE(q->query);
+    FREE(q);
 }
 
 static int
-get_results(val_context_t * context, const char *desc, char *name,
-            int class_h, int type_h, u_char *response,
-            int *response_size, int trusted_only)
+vd_query_callback(val_async_status *as, int event, val_context_t *ctx,
+                  void *cb_data, val_cb_params_t *cbp)
 {
-    int             response_size_max, ret_val, err = 0;
-    struct val_result_chain *results = NULL;
+    struct vd_query *q = (struct vd_query *) cb_data;
     struct val_response resp;
 
-    if ((NULL == desc) || (NULL == name) || (NULL == response) ||
-        (NULL == response_size))
-        return -1;
+    if (NULL == q)
+        return VAL_NO_ERROR;
 
-    response_size_max = *response_size;
-    *response_size = 0;
+    /* async status is released once this callback returns */
+    q->as = NULL;
 
-    fprintf(stderr, "%s: ****START**** \n", desc);
+    if (VAL_AS_EVENT_COMPLETED == event && VAL_NO_ERROR == cbp->retval &&
+        VAL_NO_ERROR == compose_answer(q->name, q->type_h, q->class_h,
+                                       cbp->results, &resp)) {
+        val_log(ctx, LOG_INFO, "validate: {%s %s %s}: %s", q->name,
+                p_class(q->class_h), p_type(q->type_h),
+                p_val_status(resp.vr_val_status));
+        vd_send_answer(q, &resp);
+        FREE(resp.vr_response);
+    } else {
+        val_log(ctx, LOG_INFO, "validate: {%s %s %s}: no answer", q->name,
+                p_class(q->class_h), p_type(q->type_h));
+        vd_send_header_only(q, ns_r_servfail, 0);
+    }
+
+    vd_query_free(q);
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Parse a query and submit it to libval. Queries that cannot be
+ * answered are rejected with an appropriate rcode rather than dropped.
+ */
+static void
+process_packet(struct vd_worker *w, int udp_fd, struct vd_tcp_client *client,
+               struct sockaddr *from, socklen_t from_len,
+               u_char *msg, size_t msg_len)
+{
+    HEADER         *hp = (HEADER *) msg;
+    struct vd_query *q;
+    u_char          name_n[NS_MAXCDNAME];
+    const u_char   *eom = msg + msg_len;
+    const u_char   *pos;
+    size_t          name_len;
+    int             n, rcode = ns_r_noerror, retval;
+
+    if (msg_len < sizeof(HEADER) || hp->qr)
+        return;                 /* nothing we could reply to */
+
+    q = (struct vd_query *) MALLOC(sizeof(struct vd_query));
+    if (NULL == q)
+        return;
+    memset(q, 0, sizeof(struct vd_query));
+    q->worker = w;
+    q->udp_fd = udp_fd;
+    q->client = client;
+    if (client)
+        client->refs++;
+    if (from && from_len <= sizeof(q->from)) {
+        memcpy(&q->from, from, from_len);
+        q->from_len = from_len;
+    }
+    q->max_resp = client ? VD_MAX_MSG_SIZE : VD_MIN_UDP_SIZE;
+    q->next = w->queries;
+    if (w->queries)
+        w->queries->prev = q;
+    w->queries = q;
+    w->in_flight++;
 
     /*
-     * Query the validator
+     * keep a copy of the header and question for error responses
      */
-    ret_val = val_resolve_and_check(context, name, class_h, type_h, 
-                                    VAL_QUERY_AC_DETAIL, &results);
+    q->query = (u_char *) MALLOC(sizeof(HEADER) + NS_MAXCDNAME + 4);
+    if (NULL == q->query) {
+        vd_query_free(q);
+        return;
+    }
+    memcpy(q->query, msg, sizeof(HEADER));
+    q->query_len = sizeof(HEADER);
 
-    if (ret_val == VAL_NO_ERROR) {
+    if (hp->opcode != ns_o_query) {
+        rcode = ns_r_notimpl;
+        goto reject;
+    }
+    if (ntohs(hp->qdcount) != 1) {
+        rcode = ns_r_formerr;
+        goto reject;
+    }
 
-        ret_val = compose_answer(name, type_h, class_h, results, &resp);
-        val_free_result_chain(results);
+    pos = msg + sizeof(HEADER);
+    n = ns_name_unpack(msg, eom, pos, name_n, sizeof(name_n));
+    if (n < 0 || pos + n + 4 > eom ||
+        ns_name_ntop(name_n, q->name, sizeof(q->name)) < 0) {
+        rcode = ns_r_formerr;
+        goto reject;
+    }
+    pos += n;
+    VAL_GET16(q->type_h, pos);
+    VAL_GET16(q->class_h, pos);
 
-        if (VAL_NO_ERROR != ret_val) {
-            fprintf(stderr, "%s: \t", desc);
-            fprintf(stderr, "FAILED: Error in compose_answer(): %d\n",
-                    ret_val);
-        }
-        else {
-            if (resp.vr_response == NULL) {
-                fprintf(stderr, "FAILED: No response\n");
-            } else {
-                printf("DNSSEC status: %s [%d]\n",
-                       p_val_error(resp.vr_val_status), resp.vr_val_status);
-                if (val_isvalidated(resp.vr_val_status)) {
-                    printf("Validated response:\n");
-                } else if (val_istrusted(resp.vr_val_status)) {
-                    printf("Trusted but not validated response:\n");
-                } else {
-                    printf("Non-validated response:\n");
-                }
-                if (resp.vr_length > response_size_max) {
-                    err = 1;
-                }
-                else {
-                    print_response(resp.vr_response, resp.vr_length);
-                    memcpy(response, resp.vr_response, resp.vr_length);
-                    *response_size = resp.vr_length;
-                }
+    name_len = wire_name_length(name_n);
+    memcpy(q->query + sizeof(HEADER), name_n, name_len);
+    q->query_len += name_len;
+    memcpy(q->query + q->query_len, pos - 4, 4);
+    q->query_len += 4;
 
-                FREE(resp.vr_response);
-            }
+    /*
+     * look for an EDNS0 OPT record for the client's UDP payload size
+     */
+    if (NULL == client && ntohs(hp->arcount) > 0 && ntohs(hp->nscount) == 0 &&
+        ntohs(hp->ancount) == 0 && pos + 11 <= eom && pos[0] == 0) {
+        u_int16_t       opt_type, opt_size;
+        const u_char   *cp = pos + 1;
+        VAL_GET16(opt_type, cp);
+        VAL_GET16(opt_size, cp);
+        if (opt_type == ns_t_opt) {
+            if (opt_size > VD_MAX_UDP_SIZE)
+                opt_size = VD_MAX_UDP_SIZE;
+            if (opt_size > VD_MIN_UDP_SIZE)
+                q->max_resp = opt_size;
         }
+    }
 
-    } else {
-        fprintf(stderr, "%s: \t", desc);
-        fprintf(stderr, "FAILED: Error in val_resolve_and_check(): %d, %s\n",
-                ret_val, p_val_err(ret_val));
+    if (q->type_h == ns_t_axfr || q->type_h == ns_t_ixfr) {
+        rcode = ns_r_notimpl;
+        goto reject;
     }
 
-    fprintf(stderr, "%s: ****END**** \n", desc);
+    val_log(NULL, LOG_DEBUG, "validate: worker %d query {%s %s %s} via %s",
+            w->id, q->name, p_class(q->class_h), p_type(q->type_h),
+            client ? "tcp" : "udp");
+
+    retval = val_async_submit(w->context, q->name, q->class_h, q->type_h, 0,
+                              &vd_query_callback, q, &q->as);
+    if (VAL_NO_ERROR != retval) {
+        val_log(NULL, LOG_INFO, "validate: could not submit {%s %s %s}: %s",
+                q->name, p_class(q->class_h), p_type(q->type_h),
+                p_val_err(retval));
+        q->as = NULL;
+        rcode = ns_r_servfail;
+        goto reject;
+    }
+    return;
 
-    return (err != 0);          /* 0 success, 1 error */
+  reject:
+    vd_send_header_only(q, rcode, 0);
+    vd_query_free(q);
 }
 
-static int
-process_packet(val_context_t *context)
+static void
+vd_read_udp(struct vd_worker *w, int fd)
 {
-    HEADER         *query_header, *response_header;
-    u_char         *pos;
-    int             q_name_len, rc;
-    u_int16_t       type_h, class_h;
-
-    struct sockaddr from;
+    u_char          buf[VD_MAX_UDP_SIZE];
+    struct sockaddr_storage from;
     socklen_t       from_len;
+    ssize_t         rc;
+    int             i;
 
-    u_char          query[4096], response[4096];
-    int             query_size, response_size;
-
-    /*
-     * get a packet
-     */
-    from_len = sizeof(from);
-    memset(&from, 0x0, sizeof(from));
-    do {
-        rc = recvfrom(listen_fd, query, sizeof(query), 0, &from,
+    for (i = 0; i < VD_UDP_BURST && w->in_flight < w->max_in_flight; i++) {
+        from_len = sizeof(from);
+        rc = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &from,
                       &from_len);
-        if (rc < 0 && errno != EINTR) {
-            // xxx-rks: log err msg
-            break;
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            break;              /* EAGAIN, or another worker got it */
         }
-    } while (rc < 0);
-    if (rc < 0)
-        return rc;
+        process_packet(w, fd, NULL, (struct sockaddr *) &from, from_len,
+                       buf, rc);
+    }
+}
 
-    query_size = rc;
-    if (query_size < (sizeof(HEADER) + 1))
-        return -1;
+static void
+vd_accept_tcp(struct vd_worker *w, int fd)
+{
+    struct vd_tcp_client *c;
+    int             cfd;
 
-    query_header = (HEADER *) query;
+    cfd = accept(fd, NULL, NULL);
+    if (cfd < 0)
+        return;
+    if (cfd >= FD_SETSIZE || 0 != vd_set_nonblocking(cfd)) {
+        close(cfd);
+        return;
+    }
 
-    /*
-     * get query name
-     */
-    pos = &query[sizeof(HEADER)];
-    q_name_len = wire_name_length(pos);
-    pos += q_name_len;
+    c = (struct vd_tcp_client *) MALLOC(sizeof(struct vd_tcp_client));
+    if (NULL == c) {
+        close(cfd);
+        return;
+    }
+    memset(c, 0, sizeof(struct vd_tcp_client));
+    c->fd = cfd;
+    c->last_active = time(NULL);
+    c->next = w->clients;
+    w->clients = c;
+    w->num_clients++;
+}
 
-    /*
-     * get class and type
-     */
-    VAL_GET16(type_h, pos);
-    VAL_GET16(class_h, pos);
+/*
+ * Read from a TCP client, processing each complete length-prefixed
+ * message as it arrives.
+ */
+static void
+vd_read_tcp(struct vd_worker *w, struct vd_tcp_client *c)
+{
+    ssize_t         rc;
 
-    response_size = sizeof(response);
-    
-    get_results(context, "test", (char *)&query[sizeof(HEADER)], (int)class_h,
-                (int)type_h, response, &response_size, 0);
+    while (c->fd >= 0 && w->in_flight < w->max_in_flight) {
+        if (c->lenread < 2) {
+            rc = recv(c->fd, c->lenbuf + c->lenread, 2 - c->lenread, 0);
+        } else {
+            if (NULL == c->msg) {
+                c->msglen = (c->lenbuf[0] << 8) | c->lenbuf[1];
+                c->msgread = 0;
+                if (c->msglen < sizeof(HEADER) ||
+                    NULL == (c->msg = (u_char *) MALLOC(c->msglen))) {
+                    vd_client_close(c);
+                    return;
+                }
+            }
+            rc = recv(c->fd, c->msg + c->msgread, c->msglen - c->msgread, 0);
+        }
 
-    /*
-     * check to see if we need a dummy response
-     */
-    val_log(NULL, LOG_DEBUG, "XXX-RKS: handle no response");
-    if (0 == response_size) {
-        // no response; generate dummy/nxdomain response?
-        return 1;
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (rc <= 0) {
+            vd_client_close(c);
+            return;
+        }
+
+        c->last_active = time(NULL);
+        if (c->lenread < 2) {
+            c->lenread += rc;
+            continue;
+        }
+        c->msgread += rc;
+        if (c->msgread == c->msglen) {
+            u_char *msg = c->msg;
+            size_t  msglen = c->msglen;
+            c->msg = NULL;
+            c->lenread = 0;
+            process_packet(w, -1, c, NULL, 0, msg, msglen);
+            FREE(msg);
+        }
     }
+}
 
-    response_header = (HEADER*)response;
-    response_header->id = query_header->id;
+/*
+ * Drop closed or idle TCP clients that no query refers to
+ */
+static void
+vd_reap_clients(struct vd_worker *w, time_t now)
+{
+    struct vd_tcp_client *c, **prev;
+
+    for (prev = &w->clients; (c = *prev) != NULL; ) {
+        if (c->fd >= 0 && c->refs == 0 && NULL == c->outq &&
+            now - c->last_active > VD_TCP_IDLE_TIMEOUT)
+            vd_client_close(c);
+        if (c->fd < 0 && c->refs == 0) {
+            *prev = c->next;
+            w->num_clients--;
+            FREE(c);
+            continue;
+        }
+        prev = &c->next;
+    }
+}
 
-    /*
-     * send response
-     */
-    do {
-        rc = sendto(listen_fd, response, response_size, 0, &from,
-                    sizeof(from));
-        if (rc < 0 && errno != EINTR) {
-            // xxx-rks: log err msg
-            break;
+static void
+vd_worker_loop(struct vd_worker *w)
+{
+    struct vd_tcp_client *c;
+    fd_set          read_fds, write_fds;
+    struct timeval  tv;
+    int             nfds, rc, i;
+
+    while (!done) {
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+        nfds = 0;
+
+        for (i = 0; i < w->num_listen; i++) {
+            if (w->in_flight < w->max_in_flight) {
+                FD_SET(w->udp_fd[i], &read_fds);
+                if (w->udp_fd[i] >= nfds)
+                    nfds = w->udp_fd[i] + 1;
+            }
+            if (w->num_clients < VD_MAX_TCP_CLIENTS) {
+                FD_SET(w->tcp_fd[i], &read_fds);
+                if (w->tcp_fd[i] >= nfds)
+                    nfds = w->tcp_fd[i] + 1;
+            }
+        }
+        for (c = w->clients; c; c = c->next) {
+            if (c->fd < 0)
+                continue;
+            if (w->in_flight < w->max_in_flight)
+                FD_SET(c->fd, &read_fds);
+            if (c->outq)
+                FD_SET(c->fd, &write_fds);
+            if (c->fd >= nfds)
+                nfds = c->fd + 1;
+        }
+
+        /* wake up periodically to notice shutdown and idle clients */
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        val_async_select_info(w->context, &read_fds, &nfds, &tv);
+
+        rc = select(nfds, &read_fds, &write_fds, NULL, &tv);
+        if (rc < 0) {
+            if (errno != EINTR)
+                val_log(NULL, LOG_ERR, "validate: select failed: %s",
+                        strerror(errno));
+            continue;
+        }
+
+        if (rc > 0) {
+            for (i = 0; i < w->num_listen; i++) {
+                if (FD_ISSET(w->udp_fd[i], &read_fds))
+                    vd_read_udp(w, w->udp_fd[i]);
+                if (FD_ISSET(w->tcp_fd[i], &read_fds))
+                    vd_accept_tcp(w, w->tcp_fd[i]);
+            }
+            for (c = w->clients; c; c = c->next) {
+                if (c->fd >= 0 && FD_ISSET(c->fd, &write_fds) &&
+                    vd_client_flush(c) < 0)
+                    vd_client_close(c);
+                if (c->fd >= 0 && FD_ISSET(c->fd, &read_fds))
+                    vd_read_tcp(w, c);
+            }
         }
-    } while (rc < 0);
-    if (rc > 0) {
-        val_log(NULL, LOG_DEBUG, "sent %d bytes", rc);
+
+        /* process responses from upstream and any resulting callbacks */
+        val_async_check_wait(w->context, &read_fds, &nfds, NULL, 0);
+
+        vd_reap_clients(w, time(NULL));
     }
+}
 
-    return 0;                   /* no error */
+static void
+vd_worker_cleanup(struct vd_worker *w)
+{
+    struct vd_tcp_client *c;
+    int             i;
+
+    /* abandon queries that are still outstanding */
+    while (w->queries) {
+        if (w->queries->as)
+            val_async_cancel(w->context, w->queries->as,
+                             VAL_AS_CANCEL_NO_CALLBACKS);
+        w->queries->as = NULL;
+        vd_query_free(w->queries);
+    }
+    while ((c = w->clients) != NULL) {
+        w->clients = c->next;
+        vd_client_close(c);
+        FREE(c);
+    }
+    w->num_clients = 0;
+
+    if (!w->shared_fds) {
+        for (i = 0; i < w->num_listen; i++) {
+            close(w->udp_fd[i]);
+            close(w->tcp_fd[i]);
+        }
+    }
+    w->num_listen = 0;
+
+    if (w->context) {
+        val_free_context(w->context);
+        w->context = NULL;
+    }
 }
 
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+static void *
+vd_worker_thread(void *param)
+{
+    vd_worker_loop((struct vd_worker *) param);
+    return NULL;
+}
+#endif
+
+/*
+ * Run a validating DNS proxy on the given port. Each worker has its
+ * own validator context and listening sockets (bound with SO_REUSEPORT
+ * where available, so that the kernel spreads queries among them) and
+ * keeps up to max_in_flight client queries outstanding.
+ */
 static void
-endless_loop(void)
+endless_loop(const char *label, u_short port, int num_workers,
+             int max_in_flight)
 {
-    val_context_t *context;
+    struct vd_worker *workers;
+    val_context_opt_t ctx_opt;
+    int             i, reuseport;
 
     /*
      * signal handlers to exit gracefully
@@ -535,25 +1090,109 @@ endless_loop(void)
 #ifdef SIGINT
     signal(SIGINT, sig_shutdown);
 #endif
+#ifdef SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    if (num_workers < 1)
+        num_workers = 1;
+#if !defined(HAVE_PTHREAD_H) || defined(VAL_NO_THREADS)
+    if (num_workers > 1) {
+        fprintf(stderr, "Thread support not available, using one worker\n");
+        num_workers = 1;
+    }
+#endif
+    if (num_workers > VD_MAX_WORKERS) {
+        fprintf(stderr, "limiting workers to %d\n", VD_MAX_WORKERS);
+        num_workers = VD_MAX_WORKERS;
+    }
+    if (max_in_flight < 1)
+        max_in_flight = VD_MAX_INFLIGHT;
+#ifdef SO_REUSEPORT
+    reuseport = (num_workers > 1);
+#else
+    reuseport = 0;
+#endif
+
+    workers = (struct vd_worker *) calloc(num_workers,
+                                          sizeof(struct vd_worker));
+    if (NULL == workers)
+        return;
 
     /*
-     * open a port and process incoming packets
+     * open ports and create a context for each worker
      */
-    port_setup(1153);
-    if (VAL_NO_ERROR != val_create_context(NULL, &context)) {
-        val_log(NULL, LOG_ERR, "Cannot create validator context. Exiting.");
-        return;
+    for (i = 0; i < num_workers; i++) {
+        struct vd_worker *w = &workers[i];
+
+        w->id = i;
+        w->max_in_flight = max_in_flight;
+        if (i > 0 && !reuseport) {
+            /* all workers share the first worker's sockets */
+            memcpy(w->udp_fd, workers[0].udp_fd, sizeof(w->udp_fd));
+            memcpy(w->tcp_fd, workers[0].tcp_fd, sizeof(w->tcp_fd));
+            w->num_listen = workers[0].num_listen;
+            w->shared_fds = 1;
+        } else if (port_setup(w, port, reuseport) <= 0) {
+            num_workers = i;
+            break;
+        }
+
+        /*
+         * Keep the contexts private; otherwise every worker would be
+         * handed the same default context, and free it on the way out
+         */
+        memset(&ctx_opt, 0, sizeof(ctx_opt));
+        ctx_opt.vc_polflags = CTX_DYN_POL_PRIVATE;
+        if (VAL_NO_ERROR != val_create_context_ex(label, &ctx_opt,
+                                                  &w->context)) {
+            val_log(NULL, LOG_ERR, "Cannot create validator context. Exiting.");
+            num_workers = i + 1;
+            goto cleanup;
+        }
     }
+    if (num_workers == 0)
+        goto cleanup;
 
-    while (!done) {
-        wait_for_packet();
-        process_packet(context);
+    val_log(NULL, LOG_NOTICE,
+            "validate: serving port %d with %d worker(s), %d queries each",
+            port, num_workers, max_in_flight);
+
+    /*
+     * run the workers; the first one runs in this thread
+     */
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+    for (i = 1; i < num_workers; i++) {
+        if (0 != pthread_create(&workers[i].tid, NULL, vd_worker_thread,
+                                &workers[i])) {
+            val_log(NULL, LOG_ERR, "validate: cannot start worker %d", i);
+            done = 1;
+            num_workers = i;
+            break;
+        }
+    }
+#endif
+
+    vd_worker_loop(&workers[0]);
+
+#if defined(HAVE_PTHREAD_H) && !defined(VAL_NO_THREADS)
+    for (i = 1; i < num_workers; i++) {
+        pthread_join(workers[i].tid, NULL);
     }
+#endif
 
-    val_free_context(context);
+  cleanup:
+    /* release shared sockets last */
+    for (i = num_workers - 1; i >= 0; i--) {
+        vd_worker_cleanup(&workers[i]);
+    }
+    free(workers);
 
+    if (show_stats)
+        val_stats_dump(stdout);
     val_free_validator_state();
 }
+#endif /* ndef VAL_NO_ASYNC */
 
 int 
 one_test(val_context_t *context, char *name, int class_h, 
@@ -709,7 +1348,7 @@ main(int argc, char *argv[])
     // Parse the command line for a query and resolve+validate it
     int             c;
     char           *domain_name = NULL;
-    const char     *args = "c:dF:hi:I:l:m:nw:o:pr:S:st:T:v:V";
+    const char     *args = "c:dF:hi:I:l:m:nw:o:pP:QR:r:S:st:T:v:V";
     int            class_h = ns_c_in;
     int            type_h = ns_t_a;
     int             success = 0;
@@ -718,6 +1357,8 @@ main(int argc, char *argv[])
     int             num_threads = 0;
     int             max_in_flight = 1;
     int             daemon = 0;
+    int             port = VD_DEFAULT_PORT;
+    int             inflight_set = 0;
     //u_int32_t       flags = VAL_QUERY_AC_DETAIL|VAL_QUERY_NO_EDNS0_FALLBACK|VAL_QUERY_SKIP_CACHE;
     u_int32_t       flags = VAL_QUERY_AC_DETAIL;
     u_int32_t       nodnssec_flag = 0;
@@ -794,6 +1435,15 @@ main(int argc, char *argv[])
             doprint = 1;
             break;
 
+        case 'P':
+            port = atoi(optarg);
+            if (port <= 0 || port > 65535) {
+                fprintf(stderr, "Invalid port %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+
         case 'n':
             nodnssec_flag = 1;
             break;
@@ -820,6 +1470,7 @@ main(int argc, char *argv[])
         case 'I':
 #ifndef VAL_NO_ASYNC
             max_in_flight = strtol(optarg, &nextarg, 10);
+            inflight_set = 1;
 #else
             fprintf(stderr, "libval was built without asynchronous support\n");
             fprintf(stderr, "ignoring -I parameter\n");
@@ -830,6 +1481,18 @@ main(int argc, char *argv[])
             num_threads = atoi(optarg);
             break;
 
+        case 'Q':
+            show_stats = 1;
+            val_stats_enable(1);
+            break;
+
+        case 'R':
+            if (res_io_record_start(optarg) != 0) {
+                fprintf(stderr, "Cannot open recording %s\n", optarg);
+                return -1;
+            }
+            break;
+
         case 'v':
             dnsval_conf_set(optarg);
             break;
@@ -881,8 +1544,16 @@ main(int argc, char *argv[])
     }
 
     if (daemon) {
-        endless_loop();
+#ifndef VAL_NO_ASYNC
+        endless_loop(label_str, (u_short) port, num_threads,
+                     inflight_set ? max_in_flight : VD_MAX_INFLIGHT);
+        res_io_record_stop();
         return 0;
+#else
+        fprintf(stderr, "libval was built without asynchronous support\n");
+        fprintf(stderr, "daemon mode is not available\n");
+        return -1;
+#endif /* ndef VAL_NO_ASYNC */
     }
 
 #ifndef TEST_NULL_CTX_CREATION
@@ -965,7 +1636,10 @@ main(int argc, char *argv[])
 done:
     if (context)
         val_free_context(context);
+    if (show_stats)
+        val_stats_dump(stdout);
     val_free_validator_state();
+    res_io_record_stop();
 
     return rc;
 }
@@ -31,6 +31,7 @@ extern          "C" {
 #define QUERY_BAD_CACHE_TTL 60
 #define MAX_ALIAS_CHAIN_LENGTH 10       /* max length of cname/dname chain */
 #define MAX_GLUE_FETCH_DEPTH 10         /* max length of glue dependency chain */
+#define MAX_GLUE_FETCH_PARALLEL 3       /* NS names whose glue is fetched at once */
 #define IPADDR_STRING_MAX 128
 
 #ifndef LOG_EMERG
@@ -234,6 +235,8 @@ extern          "C" {
         struct rrset_rec *learned_zones;
     };
 
+    struct val_async_waiter;
+
     struct val_query_chain {
         /*
          * The refcount is to ensure that
@@ -259,16 +262,35 @@ extern          "C" {
         unsigned long qc_respondent_server_options;
         int    qc_trans_id;             //  synchronous queries only
         long   qc_last_sent;            //  last time the query was sent
+        struct timeval qc_sent_tv;      //  send time, for statistics
         struct expected_arrival *qc_ea; // asynchronous queries only
+        struct val_async_waiter *qc_waiters; // async requests waiting on it
+        int    qc_fdmapped;             //  has context socket map entries
 
         struct val_digested_auth_chain *qc_ans;
         struct val_digested_auth_chain *qc_proof;
         struct val_query_chain *qc_next;
     };
 
+    /*
+     * Domain name trie; see name_trie_insert() and friends 
+     */
+#define NAME_TRIE_MAX_LABELS    128
+
+    struct name_trie_node {
+        u_char          ntn_label[NS_MAXLABEL + 1]; /* lower case */
+        struct name_trie_node **ntn_child;
+        int             ntn_nchild;
+        int             ntn_csize;
+        void          **ntn_data;
+        int             ntn_ndata;
+        int             ntn_dsize;
+    };
+
     typedef struct policy_entry {
         u_char        zone_n[NS_MAXCDNAME];
         long            exp_ttl;
+        u_int32_t       src_hash;   /* of the text the entry was read from */
         void *          pol;
         struct policy_entry *next;
     } policy_entry_t;
@@ -338,6 +360,50 @@ extern          "C" {
         struct val_log *next;
     };
 
+/* val_log lflags */
+#define VAL_LOG_F_ASYNC         0x01    /* hand messages to the writer thread */
+
+    /*
+     * Highest level accepted by any target on the default log list, and
+     * the per-context equivalent in val_log_max_level; -1 when there are
+     * no targets.  VAL_LOG_ENABLED() lets callers skip building log
+     * arguments (hex dumps, name conversions) that nobody will see.
+     */
+    extern int      _val_log_max_level;
+#define VAL_LOG_ENABLED(ctx, lvl) \
+    (((lvl) <= _val_log_max_level) || \
+     (((ctx) != NULL) && \
+      ((lvl) <= ((const val_context_t *)(ctx))->val_log_max_level)))
+
+    int             val_log_list_max_level(val_log_t *log_head);
+    void            val_log_async_shutdown(void);
+
+    /*
+     * Query statistics (val_stats.c). The macros cost a single test of
+     * _val_stats_on while statistics are disabled.
+     */
+    extern int      _val_stats_on;
+#define VAL_STATS_COUNT(stat, n) do {                   \
+        if (_val_stats_on)                              \
+            val_stats_count((stat), (n));               \
+    } while (0)
+#define VAL_STATS_START(tv) do {                        \
+        if (_val_stats_on)                              \
+            gettimeofday(&(tv), NULL);                  \
+    } while (0)
+#define VAL_STATS_STOP(stage, tv) do {                  \
+        if (_val_stats_on && timerisset(&(tv)))         \
+            val_stats_time((stage), &(tv));             \
+    } while (0)
+
+    void            val_stats_start(val_query_stats_t *qs);
+    val_query_stats_t *val_stats_attach(val_query_stats_t *qs);
+    void            val_stats_detach(val_query_stats_t *prev);
+    void            val_stats_finish(val_query_stats_t *qs, const char *name,
+                                     int class_h, int type_h);
+    void            val_stats_count(int stat, long n);
+    void            val_stats_time(int stage, struct timeval *start);
+
     struct zone_ns_map_t {
         u_char        zone_n[NS_MAXCDNAME];
         struct name_server *nslist;
@@ -368,6 +434,12 @@ extern          "C" {
         long            ac_count;
 #endif
 
+        /*
+         * The mutex lock ensures that only one thread
+         * re-reads the configuration files at a time
+         */
+        pthread_mutex_t reload_lock;
+
         u_int32_t       ctx_flags;
 #endif
 
@@ -404,8 +476,21 @@ extern          "C" {
         char   *base_dnsval_conf;
         struct dnsval_list *dnsval_l;
         policy_entry_t **e_pol;
+        struct policy_index *e_pol_idx;
         val_global_opt_t *g_opt;
         struct val_log *val_log_targets;
+        int    val_log_max_level;
+
+        /*
+         * configuration that was re-read but could not be published
+         * yet, and the VAL_POL_GEN_* parts of it that were read; and
+         * the replaced configurations that are waiting for the queries
+         * that may still use them to finish, chained through their
+         * pol_retired (see val_refresh_context())
+         */
+        struct libval_context *pol_pending;
+        unsigned int pol_pending_parts;
+        struct libval_context *pol_retired;
         
         /* Query cache */
         struct val_query_chain *q_list;
@@ -413,6 +498,26 @@ extern          "C" {
 #ifndef VAL_NO_ASYNC
         /* in flight async queries */
         val_async_status       *as_list;
+        int                     as_count;
+
+        /* requests to check on the next pass, completed requests */
+        val_async_status       *as_ready;
+        val_async_status       *as_ready_tail;
+        val_async_status       *as_done;
+
+        /* min-heap of in flight requests, by next retry/cancel alarm */
+        val_async_status      **as_timers;
+        int                     as_timers_count;
+        int                     as_timers_size;
+
+        /* socket -> in flight query */
+        struct val_query_chain **as_fdmap;
+        int                     as_fdmap_size;
+
+        /* pollable descriptor, see val_async_poll_info() */
+        int                     as_pollfd;
+        int                     as_eventfd;
+        int                     as_signalled;
 #endif
 
         /* default flags that the context applies automatically */
@@ -434,8 +539,40 @@ extern          "C" {
 
 #define CTX_PROCESS_ALL_THREADS             0x00000001
 
+    /*
+     * parts of the configuration held by a policy generation
+     */
+#define VAL_POL_GEN_VAL                     0x00000001 /* dnsval.conf */
+#define VAL_POL_GEN_RES                     0x00000002 /* resolv.conf */
+#define VAL_POL_GEN_HINTS                   0x00000004 /* root.hints */
+
 
 #ifndef VAL_NO_ASYNC
+    /*
+     * internal async request flags; see validator.h for the others
+     */
+#define VAL_AS_READY                 0x08000000 /* on context ready queue */
+#define VAL_AS_COMPLETED             0x10000000 /* on context done queue */
+
+    /*
+     * a single pollable descriptor for async requests needs epoll and
+     * eventfd
+     */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#define VAL_ASYNC_POLLFD
+#endif
+
+    /*
+     * links an async request to an in flight query it is waiting on
+     */
+    struct val_async_waiter {
+        struct val_async_status_s     *aw_as;
+        struct val_query_chain        *aw_qc;
+        struct val_async_waiter       *aw_as_next;   /* queries of request */
+        struct val_async_waiter       *aw_qc_next;   /* requests of query */
+        struct val_async_waiter      **aw_qc_prevp;
+    };
+
     struct val_async_status_s {
         val_context_t                 *val_as_ctx;
         unsigned int                  val_as_flags;
@@ -458,7 +595,15 @@ extern          "C" {
         val_async_event_cb             val_as_result_cb;
         void                          *val_as_cb_user_ctx;
 
+        val_query_stats_t              val_as_stats;
+
+        struct val_async_waiter       *val_as_waiting;
+        struct timeval                 val_as_next_evt;
+        int                            val_as_timer; /* heap index + 1 */
+        struct val_async_status_s     *val_as_ready_next;
+
         struct val_async_status_s     *val_as_next;
+        struct val_async_status_s    **val_as_prevp;
     };
 #endif
 
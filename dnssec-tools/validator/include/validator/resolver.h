@@ -69,6 +69,7 @@
 #ifdef HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern          "C" {
@@ -88,6 +89,15 @@ struct timeval;
 #define LIBSRES_NS_STAGGER 1 /* how far apart should we stagger queries to
                                 different authoritative name servers */
 
+/*
+ * res_async_query_create() flags for hedging: asking more than one
+ * server before the first has timed out
+ */
+#define SR_HEDGE_SERVERS_MASK   0x000000ff /* servers to ask at once */
+#define SR_HEDGE_RTT            0x00000100 /* ask the next server once the
+                                              current one is slower than
+                                              usual */
+
 
 #define ZONE_USE_NOTHING        0x00000000
 #define ZONE_USE_TSIG           0x00000001
@@ -181,9 +191,33 @@ struct expected_arrival {
     int             ea_remaining_attempts;
     struct timeval  ea_next_try;
     struct timeval  ea_cancel_time;
+    struct timeval  ea_sent_time;   /* last transmission */
+    int             ea_sends;       /* transmissions to current address */
+    int             ea_readable;    /* socket reported ready by a poller */
+    int             ea_edns0_size;  /* EDNS0 size before fallback, or 0 */
+    int             ea_udp_failed;  /* on TCP since UDP went unanswered */
     struct expected_arrival *ea_next;
 };
 
+/*
+ * Upstream i/o statistics, collected once enabled with
+ * res_io_stats_enable(). Latency histograms use power-of-two
+ * microsecond buckets; see res_stats_bucket().
+ */
+#define RES_STATS_BUCKETS   24
+
+struct res_io_stats {
+    u_int64_t       rs_sent;            /* first transmissions */
+    u_int64_t       rs_retransmits;     /* later transmissions */
+    u_int64_t       rs_fallbacks;       /* EDNS0 size reductions */
+    u_int64_t       rs_tcp_switches;    /* truncated, retried over TCP */
+    u_int64_t       rs_timeouts;        /* addresses that timed out */
+    u_int64_t       rs_responses;
+    u_int64_t       rs_bytes_sent;
+    u_int64_t       rs_bytes_rcvd;
+    u_int64_t       rs_rtt_hist[RES_STATS_BUCKETS];
+};
+
 /*
  * Interfaces to the resolver 
  */
@@ -193,6 +227,12 @@ int             query_send(const char *name,
                            const unsigned short class_h,
                            struct name_server *nslist,
                            int *trans_id);
+int             query_send_flags(const char *name,
+                                 const unsigned short type_h,
+                                 const unsigned short class_h,
+                                 struct name_server *nslist,
+                                 unsigned int flags,
+                                 int *trans_id);
 int             query_queue(const char *name, const unsigned short type_h,
                             const unsigned short class_h,
                             struct name_server *pref_ns, int *trans_id);
@@ -224,6 +264,7 @@ int             get_tcp(const char *name_n,
                     unsigned char ** response, size_t * response_length);
 void            print_response(unsigned char * ans, size_t resplen);
 int             res_gettimeofday_buf(char *buf, size_t bufsize);
+void            res_gettime(struct timeval *now);
 
 struct sockaddr_storage **create_nsaddr_array(int num_addrs);
 struct name_server *create_name_server(void);
@@ -314,8 +355,41 @@ res_async_ea_is_using_stream(struct expected_arrival *ea);
 int
 res_async_ea_isset(struct expected_arrival *ea, fd_set *fds);
 
+int
+res_async_ea_sockets(struct expected_arrival *ea, int *fds, int max_fds);
+
+int
+res_async_ea_set_readable(struct expected_arrival *ea, int fd);
+
 void res_switch_all_to_tcp_tid(int trans_id);
 
+/*
+ * statistics interface
+ */
+void            res_io_stats_enable(int enable);
+void            res_io_stats_get(struct res_io_stats *stats);
+void            res_io_stats_reset(void);
+void            res_io_stats_dump(FILE *fp);
+
+/*
+ * recording and replay of upstream traffic
+ */
+struct res_replay;
+
+int             res_io_record_start(const char *path);
+void            res_io_record_stop(void);
+struct res_replay *res_replay_open(const char *path);
+void            res_replay_close(struct res_replay *rp);
+int             res_replay_lookup(const struct res_replay *rp,
+                                  const u_char *query, size_t query_length,
+                                  const struct sockaddr_storage *server,
+                                  const u_char **response,
+                                  size_t *response_length, long *rtt);
+
+int             res_stats_bucket(long usec, int nbuckets);
+void            res_stats_dump_hist(FILE *fp, const char *title,
+                                    const u_int64_t *hist, int nbuckets);
+
 /*
  * TSIG interface
  */
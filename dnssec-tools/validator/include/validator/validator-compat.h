@@ -910,6 +910,8 @@ int	ns_name_ntop(const u_char *, char *, size_t);
 int	ns_name_pton(const char *, u_char *, size_t);
 int	ns_name_unpack(const u_char *, const u_char *,
 		const u_char *, u_char *, size_t);
+int	ns_name_pack(const u_char *, u_char *, int,
+		const u_char **, const u_char **);
 int	ns_parserr(ns_msg *, ns_sect, int, ns_rr *);
 int	ns_sprintrr(const ns_msg *, const ns_rr *,
 	        const char *, const char *, char *, size_t);
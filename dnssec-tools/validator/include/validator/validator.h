@@ -84,6 +84,7 @@ struct timeval;
 #define VAL_QUERY_SEC_LEAF          0x02000000
 #define VAL_QUERY_NEEDS_REFRESH     0x04000000
 #define VAL_QUERY_IS_ITERATING      0x08000000
+#define VAL_QUERY_HEDGE             0x10000000
 
 
 #define VAL_QFLAGS_USERMASK (VAL_QUERY_AC_DETAIL |\
@@ -96,7 +97,8 @@ struct timeval;
                              VAL_QUERY_ITERATE |\
                              VAL_QUERY_SKIP_CACHE |\
                              VAL_QUERY_SKIP_ANS_CACHE |\
-                             VAL_QUERY_CHECK_ALL_RRSIGS)
+                             VAL_QUERY_CHECK_ALL_RRSIGS |\
+                             VAL_QUERY_HEDGE)
 
 #define VAL_LOG_EMERG 0
 #define VAL_LOG_ALERT 1
@@ -135,6 +137,8 @@ typedef struct val_global_opt {
     int proto;
     int timeout;
     int retry;
+    int search_parallel;
+    int hedge;
 } val_global_opt_t;
 
 /*
@@ -145,6 +149,7 @@ typedef struct val_global_opt {
 #define CTX_DYN_POL_RES_OVR  0x00000002
 #define CTX_DYN_POL_GLO_OVR  0x00000004
 #define CTX_DYN_POL_RES_NRD  0x00000008
+#define CTX_DYN_POL_PRIVATE  0x00000010
 
 typedef struct val_context_opt {
     unsigned int vc_qflags;
@@ -178,6 +183,8 @@ typedef struct val_context_opt {
 #define GOPT_PROTO "proto"
 #define GOPT_TIMEOUT "timeout"
 #define GOPT_RETRY "retry"
+#define GOPT_SEARCH_PARALLEL "search-parallel"
+#define GOPT_HEDGE "hedge"
 /* 
  * The following policies are deprecated. 
  * They are defined here for backwards compatibility
@@ -193,6 +200,7 @@ typedef struct val_context_opt {
 #define GOPT_PROTO_IPV6_STR "ipv6"
 #define GOPT_PROTO_IPV4_STR "ipv4"
 #define GOPT_PROTO_ANY_STR "any"
+#define GOPT_HEDGE_RTT_STR "rtt"
 
 #define VAL_POL_GOPT_UNSET -100
 
@@ -206,6 +214,10 @@ typedef struct val_context_opt {
 #define VAL_POL_GOPT_PROTO_IPV4 1 
 #define VAL_POL_GOPT_PROTO_IPV6 2 
 
+#define VAL_POL_GOPT_HEDGE_NONE 0
+#define VAL_POL_GOPT_HEDGE_RTT -1
+#define VAL_POL_GOPT_HEDGE_MAX 255
+
 #define ZONE_PU_TRUSTED_MSG "trusted"
 #define ZONE_PU_UNTRUSTED_MSG "untrusted"
 #define ZONE_SE_IGNORE_MSG     "ignore"
@@ -375,6 +387,52 @@ typedef struct val_context_opt {
     const char     *val_get_ns_string(struct sockaddr *serv, char *dst,
                                       size_t size);
 
+    /*
+     * from val_stats.c
+     *
+     * Per-query counters and stage timings, and latency histograms
+     * aggregated over all queries. Nothing is recorded until
+     * val_stats_enable() is called.
+     */
+#define VAL_STAT_CACHE_HITS     0   /* (sub-)queries answered from cache */
+#define VAL_STAT_QUERIES_SENT   1   /* sub-queries sent upstream */
+#define VAL_STAT_GLUE_FETCHES   2   /* of which were for missing glue */
+#define VAL_STAT_BYTES_RCVD     3   /* response bytes processed */
+#define VAL_STAT_SIGS_VERIFIED  4   /* RRSIG verifications attempted */
+#define VAL_STAT_NSEC3_HASHES   5   /* NSEC3 hashes computed */
+#define VAL_STAT_COUNTERS       6
+
+#define VAL_STAGE_TOTAL         0   /* the whole query */
+#define VAL_STAGE_UPSTREAM      1   /* waiting on upstream, summed over sub-queries */
+#define VAL_STAGE_GLUE          2   /* the part of the above spent on glue */
+#define VAL_STAGE_CRYPTO        3   /* signature verification, NSEC3 hashing */
+#define VAL_STAGES              4
+
+#define VAL_STATS_BUCKETS       24  /* power-of-two microsecond buckets */
+
+    typedef struct val_query_stats {
+        struct timeval  vqs_start;
+        unsigned long   vqs_count[VAL_STAT_COUNTERS];
+        long            vqs_usec[VAL_STAGES];
+    } val_query_stats_t;
+
+    typedef struct val_stats {
+        unsigned long long vs_queries;
+        unsigned long long vs_count[VAL_STAT_COUNTERS];
+        unsigned long long vs_usec[VAL_STAGES];
+        unsigned long long vs_hist[VAL_STAGES][VAL_STATS_BUCKETS];
+    } val_stats_t;
+
+    typedef void    (*val_stats_cb_t) (void *cb_data, const char *name,
+                                       int class_h, int type_h,
+                                       const val_query_stats_t *qs);
+
+    void            val_stats_enable(int enable);
+    void            val_stats_set_callback(val_stats_cb_t cb, void *cb_data);
+    void            val_stats_get(val_stats_t *stats);
+    void            val_stats_reset(void);
+    void            val_stats_dump(FILE *fp);
+
 
     const char     *p_ac_status(val_astatus_t valerrno);
     const char     *p_val_status(val_status_t err);
@@ -432,6 +490,8 @@ typedef struct val_context_opt {
                                     fd_set *fds,
                                     int *num_fds,
                                     struct timeval *timeout);
+    int             val_async_poll_info(val_context_t *context, int *fd,
+                                        struct timeval *timeout);
 
     /*
      * cancellation flags
@@ -453,6 +513,25 @@ typedef struct val_context_opt {
                                     fd_set *pending_desc, int *nfds,
                                     unsigned int flags);
 
+    /*
+     * batch validation
+     */
+#define VAL_BATCH_DEFAULT_WINDOW     32
+
+    typedef struct val_batch_query_s {
+        const char              *name;
+        int                      class_h;
+        int                      type_h;
+        unsigned int             flags;
+        /* filled in by val_resolve_and_check_batch() */
+        int                      retval;
+        struct val_result_chain *results;
+    } val_batch_query_t;
+
+    int             val_resolve_and_check_batch(val_context_t *context,
+                                                val_batch_query_t *queries,
+                                                int count, int max_inflight);
+
 #endif /* VAL_NO_ASYNC */
 
     /*
@@ -531,6 +610,14 @@ typedef struct val_context_opt {
                                    int class_h,
                                    struct val_result_chain *results,
                                    struct val_response *f_resp);
+    int             compose_answer_buf(const char * name,
+                                       int type_h,
+                                       int class_h,
+                                       struct val_result_chain *results,
+                                       unsigned char * answer,
+                                       size_t anslen,
+                                       size_t * resp_len,
+                                       val_status_t * val_status);
     /*
      * from val_gethostbyname.c 
      */
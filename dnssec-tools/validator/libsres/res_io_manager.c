@@ -47,6 +47,16 @@
             memcpy (a, &b, sizeof(struct timeval));                     \
     } while(0)
 
+/*
+ * Sockets handed to an epoll based caller (see res_async_ea_set_readable)
+ * may be numbered beyond what an fd_set can hold.
+ */
+#ifdef WIN32
+#define FD_INSET(s, set)    FD_ISSET((s), (set))
+#else
+#define FD_INSET(s, set)    ((s) < FD_SETSIZE && FD_ISSET((s), (set)))
+#endif
+
 
 static long     _max_fd = 0;
 static long     _open_sockets = 0;
@@ -74,8 +84,126 @@ static int      next_transaction = 0;
 #define pthread_mutex_unlock(x)
 #else
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+/*
+ * Upstream statistics; nothing is recorded (or locked) until
+ * res_io_stats_enable() is called.
+ */
+static int      stats_on = 0;
+static struct res_io_stats io_stats;
+
+#define RES_IO_STAT_ADD(field, n) do {                  \
+        if (stats_on) {                                 \
+            pthread_mutex_lock(&stats_mutex);           \
+            io_stats.field += (n);                      \
+            pthread_mutex_unlock(&stats_mutex);         \
+        }                                               \
+    } while (0)
+
+/*
+ * Alarm queue for the transaction table: a binary min-heap of the ids
+ * of transactions with active queries, ordered by the earliest retry or
+ * cancel alarm in the transaction. res_io_check() uses it to find the
+ * transactions that are due, and the next event time, without scanning
+ * the whole table. An entry is refreshed whenever the alarms of its
+ * transaction may have changed; an entry that is too early only costs a
+ * needless check. Protected by mutex.
+ */
+static int      alarm_heap[MAX_TRANSACTIONS];
+static int      alarm_count = 0;
+static int      alarm_pos[MAX_TRANSACTIONS];    /* heap index + 1, 0 if none */
+static struct timeval alarm_when[MAX_TRANSACTIONS];
+
+#define ALARM_BEFORE(i, j)                                              \
+    timercmp(&alarm_when[alarm_heap[i]], &alarm_when[alarm_heap[j]], <)
+
+static void
+_alarm_swap(int i, int j)
+{
+    int             tid = alarm_heap[i];
+
+    alarm_heap[i] = alarm_heap[j];
+    alarm_heap[j] = tid;
+    alarm_pos[alarm_heap[i]] = i + 1;
+    alarm_pos[alarm_heap[j]] = j + 1;
+}
+
+static void
+_alarm_sift(int i)
+{
+    int             child;
+
+    while (i > 0 && ALARM_BEFORE(i, (i - 1) / 2)) {
+        _alarm_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= alarm_count)
+            break;
+        if (child + 1 < alarm_count && ALARM_BEFORE(child + 1, child))
+            child++;
+        if (!ALARM_BEFORE(child, i))
+            break;
+        _alarm_swap(i, child);
+        i = child;
+    }
+}
+
+/*
+ * set the alarm time of a transaction. NULL (or a cleared time) removes
+ * the transaction from the queue.
+ */
+static void
+_alarm_set(int tid, struct timeval *when)
+{
+    int             i;
+
+    if (NULL == when || !timerisset(when)) {
+        if (0 == alarm_pos[tid])
+            return;
+        i = alarm_pos[tid] - 1;
+        alarm_pos[tid] = 0;
+        --alarm_count;
+        if (i != alarm_count) {
+            alarm_heap[i] = alarm_heap[alarm_count];
+            alarm_pos[alarm_heap[i]] = i + 1;
+            _alarm_sift(i);
+        }
+        return;
+    }
+
+    memcpy(&alarm_when[tid], when, sizeof(struct timeval));
+    if (0 == alarm_pos[tid]) {
+        i = alarm_count++;
+        alarm_heap[i] = tid;
+        alarm_pos[tid] = i + 1;
+    } else
+        i = alarm_pos[tid] - 1;
+    _alarm_sift(i);
+}
+
+/*
+ * recompute the alarm time of a transaction from its expected arrivals
+ */
+static void
+_alarm_update(int tid)
+{
+    struct expected_arrival *ea;
+    struct timeval  when;
+
+    timerclear(&when);
+    for (ea = transactions[tid]; ea; ea = ea->ea_next) {
+        if (ea->ea_remaining_attempts == -1)
+            continue;
+        UPDATE(&when, ea->ea_cancel_time);
+        UPDATE(&when, ea->ea_next_try);
+    }
+    _alarm_set(tid, &when);
+}
+
 /*
  * Find a port in the range 1024 - 65535 
  */
@@ -253,19 +381,41 @@ res_free_ea_list(struct expected_arrival *head)
 void
 set_alarm(struct timeval *tv, long delay)
 {
-    gettimeofday(tv, NULL);
+    res_gettime(tv);
     tv->tv_sec += delay;
 }
 
 void
 set_alarms(struct expected_arrival *ea, long next, long cancel)
 {
-    gettimeofday(&ea->ea_next_try, NULL);
+    res_gettime(&ea->ea_next_try);
     ea->ea_next_try.tv_sec += next;
     ea->ea_cancel_time.tv_sec = ea->ea_next_try.tv_sec + cancel;
     ea->ea_cancel_time.tv_usec = ea->ea_next_try.tv_usec;
 }
 
+/*
+ * push both alarms set by set_alarms() back by usec microseconds
+ */
+static void
+delay_alarms(struct expected_arrival *ea, long usec)
+{
+    long            cancel = ea->ea_cancel_time.tv_sec -
+                                ea->ea_next_try.tv_sec;
+
+    ea->ea_next_try.tv_sec += usec / 1000000L;
+    ea->ea_next_try.tv_usec += usec % 1000000L;
+    if (ea->ea_next_try.tv_usec >= 1000000L) {
+        ea->ea_next_try.tv_sec++;
+        ea->ea_next_try.tv_usec -= 1000000L;
+    }
+    ea->ea_cancel_time.tv_sec = ea->ea_next_try.tv_sec + cancel;
+    ea->ea_cancel_time.tv_usec = ea->ea_next_try.tv_usec;
+}
+
+/*
+ * delay is in microseconds
+ */
 static struct expected_arrival *
 res_ea_init(const char *name, const u_int16_t type_h, const u_int16_t class_h,
             u_char * signed_query, size_t signed_length,
@@ -297,7 +447,9 @@ res_ea_init(const char *name, const u_int16_t type_h, const u_int16_t class_h,
     temp->ea_response = NULL;
     temp->ea_response_length = 0;
     temp->ea_remaining_attempts = ns->ns_retry+1;
-    set_alarms(temp, delay, res_get_timeout(ns));
+    set_alarms(temp, 0, res_get_timeout(ns));
+    if (delay > 0)
+        delay_alarms(temp, delay);
     temp->ea_next = NULL;
 
     return temp;
@@ -321,7 +473,7 @@ res_io_retry_source(struct expected_arrival *ea)
     }
 
     /* bump retry time to current time */
-    gettimeofday(&ea->ea_next_try, NULL);
+    res_gettime(&ea->ea_next_try);
 }
 
 /*
@@ -342,7 +494,7 @@ res_io_reset_source(struct expected_arrival *ea)
     }
 
     /* bump cancel time to current time */
-    gettimeofday(&ea->ea_cancel_time, NULL);
+    res_gettime(&ea->ea_cancel_time);
 }
 
 /*
@@ -363,7 +515,7 @@ res_io_cancel_source(struct expected_arrival *ea)
     }
 
     /* bump cancel time to current time */
-    gettimeofday(&ea->ea_cancel_time, NULL);
+    res_gettime(&ea->ea_cancel_time);
 
     /* no more retries */
     ea->ea_remaining_attempts = -1;
@@ -439,6 +591,7 @@ res_io_send(struct expected_arrival *shipit)
         int af =  shipit->ea_ns->ns_address[i]->ss_family;
 
         shipit->ea_socket = socket(af, socket_type, 0);
+        shipit->ea_readable = 0;
         if (shipit->ea_socket == INVALID_SOCKET) {
             res_log(NULL,LOG_ERR,"libsres: ""socket() failed, errno = %d %s",
                     errno, strerror(errno));
@@ -487,6 +640,8 @@ res_io_send(struct expected_arrival *shipit)
             res_log(NULL, LOG_ERR,
                     "libsres: ""Closing socket %d, connect errno = %d",
                     shipit->ea_socket, errno);
+            res_srtt_failure(shipit->ea_ns->ns_address[i],
+                             shipit->ea_ns->ns_retrans * 1000000L);
             res_io_reset_source(shipit);
             return SR_IO_SOCKET_ERROR;
         }
@@ -523,16 +678,39 @@ res_io_send(struct expected_arrival *shipit)
         res_log(NULL, LOG_ERR, "libsres: "
                 "Closing socket %d, sending %d bytes failed (rc %d)",
                 shipit->ea_socket, shipit->ea_signed_length, bytes_sent);
+        res_srtt_failure(shipit->ea_ns->ns_address[shipit->ea_which_address],
+                         shipit->ea_ns->ns_retrans * 1000000L);
         res_io_reset_source(shipit);
         return SR_IO_SOCKET_ERROR;
     }
 
-    //delay = shipit->ea_ns->ns_retrans
-    //    << (shipit->ea_ns->ns_retry + 1 - shipit->ea_remaining_attempts--);
-    delay = shipit->ea_ns->ns_retrans;
+    if (stats_on) {
+        pthread_mutex_lock(&stats_mutex);
+        if (shipit->ea_sends > 0)
+            io_stats.rs_retransmits++;
+        else
+            io_stats.rs_sent++;
+        io_stats.rs_bytes_sent += bytes_sent;
+        pthread_mutex_unlock(&stats_mutex);
+    }
+    res_gettime(&shipit->ea_sent_time);
+
+    /*
+     * the retry delay adapts to the measured round trip time of this
+     * address, backing off exponentially with each attempt
+     */
     shipit->ea_remaining_attempts--;
-    res_log(NULL, LOG_DEBUG, "libsres: ""next try delay %d", delay);
-    set_alarms(shipit, delay, res_get_timeout(shipit->ea_ns));
+    delay = res_srtt_rto(shipit->ea_ns->ns_address[shipit->ea_which_address],
+                         shipit->ea_ns->ns_retrans, shipit->ea_sends++,
+                         shipit->ea_remaining_attempts <= 0);
+    res_log(NULL, LOG_DEBUG, "libsres: ""next try delay %ld us", delay);
+    set_alarms(shipit, 0, res_get_timeout(shipit->ea_ns));
+    shipit->ea_next_try.tv_sec += delay / 1000000L;
+    shipit->ea_next_try.tv_usec += delay % 1000000L;
+    if (shipit->ea_next_try.tv_usec >= 1000000L) {
+        shipit->ea_next_try.tv_sec++;
+        shipit->ea_next_try.tv_usec -= 1000000L;
+    }
     res_print_ea(shipit);
 
     return SR_IO_UNSET;
@@ -556,8 +734,10 @@ res_nsfallback(int transaction_id, struct timeval *closest_event,
 
     pthread_mutex_lock(&mutex);
     temp = transactions[transaction_id];
-    if (temp != NULL)
+    if (temp != NULL) {
         ret_val = res_nsfallback_ea(temp, closest_event, server);
+        _alarm_update(transaction_id);
+    }
     pthread_mutex_unlock(&mutex);
     return ret_val;
 }
@@ -640,6 +820,8 @@ res_nsfallback_ea(struct expected_arrival *ea, struct timeval *closest_event,
         for (i = 0; i < fallback_max_index; i++) {
             if (temp->ea_ns->ns_edns0_size > edns0_fallback[i]) {
                 /* try using a lower edns0 value */
+                if (0 == temp->ea_edns0_size)
+                    temp->ea_edns0_size = old_size;
                 temp->ea_ns->ns_edns0_size = edns0_fallback[i];
                 if (edns0_fallback[i] == 0) {
                     /* try without EDNS0 */
@@ -660,6 +842,41 @@ res_nsfallback_ea(struct expected_arrival *ea, struct timeval *closest_event,
     }
 
     /** didn't find a smaller size to try and were already on last attempt */
+    if (temp->ea_remaining_attempts <= 0 && NULL == server &&
+        !temp->ea_using_stream &&
+        res_srtt_responsive(temp->ea_ns->ns_address[temp->ea_which_address])) {
+        /*
+         * nothing at all came back over UDP from an address that used
+         * to answer; something in between may be dropping UDP, so give
+         * it one try over TCP with the original EDNS0 settings.
+         */
+        res_log(NULL, LOG_INFO, "libsres: "
+                "no answer over UDP for {%s %s(%d) %s(%d)}, trying TCP",
+                temp->ea_name, p_class(temp->ea_class_h), temp->ea_class_h,
+                p_type(temp->ea_type_h), temp->ea_type_h);
+        if (temp->ea_edns0_size > 0) {
+            temp->ea_ns->ns_edns0_size = temp->ea_edns0_size;
+            temp->ea_ns->ns_options |= SR_QUERY_VALIDATING_STUB_FLAGS;
+            temp->ea_edns0_size = 0;
+            if (temp->ea_signed)
+                FREE(temp->ea_signed);
+            temp->ea_signed = NULL;
+            temp->ea_signed_length = 0;
+            if (res_create_query_payload(temp->ea_ns,
+                        temp->ea_name, temp->ea_class_h, temp->ea_type_h,
+                        &temp->ea_signed,
+                        &temp->ea_signed_length) < 0) {
+                res_log(NULL, LOG_DEBUG, "libsres: "
+                        "could not create query payload");
+                return -1;
+            }
+        }
+        res_switch_to_tcp(temp);
+        temp->ea_remaining_attempts = 1;
+        temp->ea_udp_failed = 1;
+        UPDATE(closest_event, temp->ea_next_try);
+        return 1;
+    }
     if (temp->ea_remaining_attempts <= 0) {
         res_log(NULL, LOG_DEBUG, "libsres: "
                 "fallback already exhausted edns retries");
@@ -697,16 +914,34 @@ res_nsfallback_ea(struct expected_arrival *ea, struct timeval *closest_event,
         --_open_sockets;
     }
     temp->ea_socket = INVALID_SOCKET;
+    temp->ea_sends = 0;
 
     res_log(NULL, LOG_INFO, "libsres: "
             "ns fallback for {%s %s(%d) %s(%d)}, edns0 size %d > %d",
             temp->ea_name, p_class(temp->ea_class_h), temp->ea_class_h, 
             p_type(temp->ea_type_h), temp->ea_type_h,
             old_size, temp->ea_ns->ns_edns0_size);
+    RES_IO_STAT_ADD(rs_fallbacks, 1);
 
     return 1;
 }
 
+/*
+ * the last transmission to the current address of ea went unanswered
+ */
+static void
+res_io_unanswered(struct expected_arrival *ea, struct timeval *now)
+{
+    struct timeval  waited;
+
+    if (ea->ea_sends <= 0)
+        return;
+
+    timersub(now, &ea->ea_sent_time, &waited);
+    res_srtt_failure(ea->ea_ns->ns_address[ea->ea_which_address],
+                     waited.tv_sec * 1000000L + waited.tv_usec);
+}
+
 static void
 res_io_next_address(struct expected_arrival *ea,
                     const char *more_prefix, const char *no_more_str)
@@ -725,6 +960,13 @@ res_io_next_address(struct expected_arrival *ea,
         }
         ea->ea_which_address++;
         ea->ea_remaining_attempts = ea->ea_ns->ns_retry+1;
+        ea->ea_sends = 0;
+        /* what was learned about the old address doesn't carry over */
+        ea->ea_edns0_size = 0;
+        if (ea->ea_udp_failed) {
+            ea->ea_udp_failed = 0;
+            ea->ea_using_stream = FALSE;
+        }
         set_alarms(ea, 0, res_get_timeout(ea->ea_ns));
         res_log(NULL, LOG_INFO,
                 "libsres: ""%s - SWITCHING TO NEW ADDRESS", more_prefix);
@@ -766,7 +1008,7 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
      */
     if (NULL == now) {
         now = &local_now;
-        gettimeofday(&local_now, NULL);
+        res_gettime(&local_now);
     }
     if (net_change)
         *net_change = 0;
@@ -798,6 +1040,8 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
              ((0 == ea->ea_remaining_attempts) && LTEQ(ea->ea_next_try, (*now)))) {
             if (net_change && ea->ea_socket != INVALID_SOCKET)
                 --(*net_change);
+            RES_IO_STAT_ADD(rs_timeouts, 1);
+            res_io_unanswered(ea, now);
             if (1 != res_nsfallback_ea(ea, next_evt, NULL))
                 res_io_next_address(ea, "TIMEOUTS", "TIMEOUT - CANCELING");
         }
@@ -808,6 +1052,7 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
         else if (LTEQ(ea->ea_next_try, (*now))) {
             int needed_new_socket = (ea->ea_socket == INVALID_SOCKET);
             res_log(NULL, LOG_DEBUG, "libsres: "" retry");
+            res_io_unanswered(ea, now);
             while (ea->ea_remaining_attempts != -1) {
                 if (res_io_send(ea) == SR_IO_SOCKET_ERROR) {
                     res_io_next_address(ea, "ERROR",
@@ -838,7 +1083,7 @@ res_io_check_ea_list(struct expected_arrival *ea, struct timeval *next_evt,
     }
     if (next_evt) {
         struct timeval  now,when;
-        gettimeofday(&now, NULL);
+        res_gettime(&now);
         timersub(next_evt, &now, &when);
         if (when.tv_sec < 0) {
             when.tv_sec = when.tv_usec = 0;
@@ -883,6 +1128,7 @@ _check_one_tid(int tid, struct timeval *next_evt, struct timeval *now)
     ea = transactions[tid];
     if (ea)
         res_io_check_ea_list(ea, next_evt, now, NULL, &active);
+    _alarm_update(tid);
 
     return (active > 0); /* have active queries */
 }
@@ -912,22 +1158,22 @@ res_io_check_one_tid(int tid, struct timeval *next_evt, struct timeval *now)
 }
 
 /*
- * for backwards compatability, this checks all transactions.
- * I'd like to have it call res_io_check_one_tid, but that'd
- * involve a mutex lock/unlock for each active transaction, which
- * seems wasteful...
+ * for backwards compatability, this checks all transactions that have
+ * a retry or cancel alarm due (plus the given transaction), and sets
+ * next_evt to the earliest alarm of any transaction.
  */
 int
 res_io_check(int transaction_id, struct timeval *next_evt)
 {
-    int             i, ret_val;
+    int             i, count, ret_val;
+    int             due[MAX_TRANSACTIONS];
     struct timeval  tv;
 
     if ((NULL == next_evt) || (transaction_id < 0) ||
         (transaction_id >= MAX_TRANSACTIONS))
         return 0;
 
-    gettimeofday(&tv, NULL);
+    res_gettime(&tv);
     res_log(NULL, LOG_DEBUG, "libsres: ""Checking tids at %ld.%ld", tv.tv_sec,
             tv.tv_usec);
 
@@ -939,14 +1185,28 @@ res_io_check(int transaction_id, struct timeval *next_evt)
 
     pthread_mutex_lock(&mutex);
 
+    /*
+     * collect the transactions that are due before checking them, since
+     * checking sets new alarms (possibly already due again).
+     */
+    for (count = 0; alarm_count > 0 && LTEQ(alarm_when[alarm_heap[0]], tv);
+         ++count) {
+        due[count] = alarm_heap[0];
+        _alarm_set(due[count], NULL);
+    }
+
     /** check all except specified transaction_id, ignore return */
-    for (i = 0; i < MAX_TRANSACTIONS; i++)
-        if ((i != transaction_id) && transactions[i])
-            _check_one_tid(i, next_evt, &tv);
+    for (i = 0; i < count; i++)
+        if (due[i] != transaction_id)
+            _check_one_tid(due[i], next_evt, &tv);
 
     /** check for remaining attempts for specified transaction */
     ret_val = _check_one_tid(transaction_id, next_evt, &tv);
 
+    /** the rest of the transactions aren't due until the top alarm */
+    if (alarm_count > 0)
+        UPDATE(next_evt, alarm_when[alarm_heap[0]]);
+
     pthread_mutex_unlock(&mutex);
 
     res_log(NULL, LOG_DEBUG, "libsres: "" next global event is at %ld.%ld",
@@ -1006,6 +1266,7 @@ res_io_queue_ea(int *transaction_id, struct expected_arrival *new_ea)
             temp = temp->ea_next;
         temp->ea_next = new_ea;
     }
+    _alarm_update(*transaction_id);
 
     pthread_mutex_unlock(&mutex);
 
@@ -1015,7 +1276,7 @@ res_io_queue_ea(int *transaction_id, struct expected_arrival *new_ea)
 void
 res_io_set_timeout(struct timeval *timeout, struct timeval *next_event)
 {
-    gettimeofday(timeout, NULL);
+    res_gettime(timeout);
  
     if (LTEQ((*timeout), (*next_event)))
         timersub(next_event, timeout, timeout);
@@ -1061,7 +1322,7 @@ res_io_select_info(struct expected_arrival *ea_list, int *nfds,
         res_log(NULL, LOG_DEBUG+1, "libsres: ""    orig timeout %ld,%ld",
                 timeout->tv_sec, timeout->tv_usec);
         memcpy(&orig, timeout, sizeof(orig));
-        gettimeofday(&now, NULL);
+        res_gettime(&now);
     }
     else
         res_log(NULL, LOG_DEBUG, "libsres: "" ea %p select info",
@@ -1086,7 +1347,7 @@ res_io_select_info(struct expected_arrival *ea_list, int *nfds,
         }
 
         if (read_descriptors &&
-            FD_ISSET(ea_list->ea_socket, read_descriptors)) {
+            FD_INSET(ea_list->ea_socket, read_descriptors)) {
             ++skipped;
             res_log(NULL,LOG_DEBUG+1, "libsres:""   fd %d already set",
                     ea_list->ea_socket);
@@ -1096,6 +1357,12 @@ res_io_select_info(struct expected_arrival *ea_list, int *nfds,
         ++count;
         res_log(NULL,LOG_DEBUG, "libsres:""   fd %d added, rem %d",
                 ea_list->ea_socket, ea_list->ea_remaining_attempts);
+#ifndef WIN32
+        if (read_descriptors && ea_list->ea_socket >= FD_SETSIZE)
+            res_log(NULL, LOG_WARNING, "libsres: "
+                    "fd %d too large for select()", ea_list->ea_socket);
+        else
+#endif
         if (read_descriptors)
             FD_SET(ea_list->ea_socket, read_descriptors);
         if (nfds && (ea_list->ea_socket >= *nfds))
@@ -1150,7 +1417,7 @@ res_io_select_sockets(fd_set * read_descriptors, struct timeval *timeout)
 #endif
 
     count = res_io_count_ready(read_descriptors, max_sock + 1);
-    gettimeofday(&in, NULL);
+    res_gettime(&in);
     res_log(NULL, LOG_DEBUG,
             "libsres: ""SELECT on %d fds, max %d, timeout %ld.%ld @ %ld.%ld",
             count, max_sock+1,timeout->tv_sec,timeout->tv_usec,
@@ -1163,7 +1430,7 @@ res_io_select_sockets(fd_set * read_descriptors, struct timeval *timeout)
 #else
     ready = select(max_sock + 1, read_descriptors, NULL, NULL, timeout);
 #endif
-    gettimeofday(&out, NULL);
+    res_gettime(&out);
     res_log(NULL, LOG_DEBUG, "libsres: "" %d ready fds @ %ld.%ld",
             ready,out.tv_sec,out.tv_usec);
     if (ready > 0)
@@ -1488,6 +1755,8 @@ res_switch_to_tcp(struct expected_arrival *ea)
     if (NULL == ea)
         return;
 
+    RES_IO_STAT_ADD(rs_tcp_switches, 1);
+
     if (ea->ea_response != NULL) {
         FREE(ea->ea_response);
     }
@@ -1504,6 +1773,7 @@ res_switch_to_tcp(struct expected_arrival *ea)
         ea->ea_socket = INVALID_SOCKET;
     }
     ea->ea_remaining_attempts = ea->ea_ns->ns_retry+1;
+    ea->ea_sends = 0;
     set_alarms(ea, 0, res_get_timeout(ea->ea_ns));
 }
 
@@ -1563,7 +1833,8 @@ res_io_read(fd_set * read_descriptors, struct expected_arrival *ea_list)
          */
         if ((ea_list->ea_remaining_attempts == -1) ||
             (ea_list->ea_socket == INVALID_SOCKET) ||
-            ! FD_ISSET(ea_list->ea_socket, read_descriptors))
+            (! ea_list->ea_readable &&
+             ! FD_INSET(ea_list->ea_socket, read_descriptors)))
             continue;
 
         { /* dummy block to preserve indentation; remove later */
@@ -1571,7 +1842,9 @@ res_io_read(fd_set * read_descriptors, struct expected_arrival *ea_list)
             res_log(NULL, LOG_DEBUG, "libsres: ""ACTIVITY on %d",
                     ea_list->ea_socket);
             ++handled;
-            FD_CLR(ea_list->ea_socket, read_descriptors);
+            ea_list->ea_readable = 0;
+            if (FD_INSET(ea_list->ea_socket, read_descriptors))
+                FD_CLR(ea_list->ea_socket, read_descriptors);
 
             arrival = ea_list;
             res_print_ea(arrival);
@@ -1615,6 +1888,55 @@ res_io_read(fd_set * read_descriptors, struct expected_arrival *ea_list)
                 continue;
             }
 
+            {
+                struct timeval now, rtt;
+                long rtt_us;
+
+                res_gettime(&now);
+                timersub(&now, &arrival->ea_sent_time, &rtt);
+                rtt_us = rtt.tv_sec * 1000000L + rtt.tv_usec;
+
+                /*
+                 * only sample the RTT when the response can't belong
+                 * to an earlier transmission (Karn's algorithm). TCP
+                 * times include connection setup, so skip those too.
+                 */
+                res_srtt_response(
+                    arrival->ea_ns->ns_address[arrival->ea_which_address],
+                    (arrival->ea_sends == 1 && !arrival->ea_using_stream) ?
+                    rtt_us : -1);
+
+                /*
+                 * a fallback got an answer: remember what the address
+                 * needed, so later queries don't have to find out again
+                 */
+                if (arrival->ea_udp_failed)
+                    res_srtt_set_tcp_only(
+                        arrival->ea_ns->ns_address[arrival->ea_which_address]);
+                else if (arrival->ea_edns0_size > 0 &&
+                         !arrival->ea_using_stream)
+                    res_srtt_set_edns0(
+                        arrival->ea_ns->ns_address[arrival->ea_which_address],
+                        (arrival->ea_ns->ns_options &
+                         SR_QUERY_VALIDATING_STUB_FLAGS) ?
+                        (int) arrival->ea_ns->ns_edns0_size : 0);
+
+                res_record_response(
+                    arrival->ea_ns->ns_address[arrival->ea_which_address],
+                    arrival->ea_signed, arrival->ea_signed_length,
+                    arrival->ea_response, arrival->ea_response_length,
+                    (arrival->ea_sends == 1) ? rtt_us : -1);
+
+                if (stats_on) {
+                    pthread_mutex_lock(&stats_mutex);
+                    io_stats.rs_responses++;
+                    io_stats.rs_bytes_rcvd += arrival->ea_response_length;
+                    io_stats.rs_rtt_hist[res_stats_bucket(rtt_us,
+                                                   RES_STATS_BUCKETS)]++;
+                    pthread_mutex_unlock(&stats_mutex);
+                }
+            }
+
             /*
              * See if the message was truncated
              * switch to TCP
@@ -1666,6 +1988,7 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
                               answer, answer_length,
                               respondent) == SR_IO_GOT_ANSWER) {
 
+        _alarm_update(transaction_id);
         pthread_mutex_unlock(&mutex);
         return SR_IO_GOT_ANSWER;
     }
@@ -1718,6 +2041,7 @@ res_io_accept(int transaction_id, fd_set *pending_desc,
      */
     ret_val = res_io_get_a_response(transactions[transaction_id],
                                     answer, answer_length, respondent);
+    _alarm_update(transaction_id);
     pthread_mutex_unlock(&mutex);
 
     if (ret_val == SR_IO_UNSET)
@@ -1741,6 +2065,7 @@ res_cancel(int *transaction_id)
     pthread_mutex_lock(&mutex);
     ea = transactions[*transaction_id];
     transactions[*transaction_id] = NULL;
+    _alarm_set(*transaction_id, NULL);
     pthread_mutex_unlock(&mutex);
 
     res_free_ea_list(ea);
@@ -1799,7 +2124,7 @@ res_print_ea(struct expected_arrival *ea)
             port = s->sin_port;
         }
 
-        gettimeofday(&now, NULL);
+        res_gettime(&now);
         timersub(&ea->ea_next_try, &now, &when_next);
         timersub(&ea->ea_cancel_time, &now, &when_cancel);
 
@@ -1836,7 +2161,7 @@ res_io_view(void)
     struct expected_arrival *ea;
     struct timeval  tv;
 
-    gettimeofday(&tv, NULL);
+    res_gettime(&tv);
     res_log(NULL, LOG_DEBUG, "libsres: ""Current time is %ld", tv.tv_sec);
 
     pthread_mutex_lock(&mutex);
@@ -1851,6 +2176,59 @@ res_io_view(void)
     pthread_mutex_unlock(&mutex);
 }
 
+void
+res_io_stats_enable(int enable)
+{
+    stats_on = enable ? 1 : 0;
+}
+
+void
+res_io_stats_get(struct res_io_stats *stats)
+{
+    if (NULL == stats)
+        return;
+
+    pthread_mutex_lock(&stats_mutex);
+    memcpy(stats, &io_stats, sizeof(*stats));
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void
+res_io_stats_reset(void)
+{
+    pthread_mutex_lock(&stats_mutex);
+    memset(&io_stats, 0, sizeof(io_stats));
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void
+res_io_stats_dump(FILE *fp)
+{
+    struct res_io_stats st;
+
+    if (NULL == fp)
+        return;
+
+    res_io_stats_get(&st);
+    fprintf(fp, "upstream queries sent:      %llu\n",
+            (unsigned long long) st.rs_sent);
+    fprintf(fp, "upstream retransmits:       %llu\n",
+            (unsigned long long) st.rs_retransmits);
+    fprintf(fp, "upstream EDNS0 fallbacks:   %llu\n",
+            (unsigned long long) st.rs_fallbacks);
+    fprintf(fp, "upstream switches to TCP:   %llu\n",
+            (unsigned long long) st.rs_tcp_switches);
+    fprintf(fp, "upstream timeouts:          %llu\n",
+            (unsigned long long) st.rs_timeouts);
+    fprintf(fp, "upstream responses:         %llu\n",
+            (unsigned long long) st.rs_responses);
+    fprintf(fp, "upstream bytes sent/rcvd:   %llu/%llu\n",
+            (unsigned long long) st.rs_bytes_sent,
+            (unsigned long long) st.rs_bytes_rcvd);
+    res_stats_dump_hist(fp, "upstream response time", st.rs_rtt_hist,
+                        RES_STATS_BUCKETS);
+}
+
 void
 res_io_stall(void)
 {
@@ -1917,6 +2295,35 @@ res_async_query_send(const char *name, const u_int16_t type_h,
     return head;
 }
 
+/*
+ * Set up a (private) name server for a new query the way its first
+ * address was recently found to need: with a smaller EDNS0 buffer, or
+ * without EDNS0 and DNSSEC flags. Returns TRUE if the query should go
+ * straight to TCP.
+ */
+static int
+res_ns_apply_caps(struct name_server *ns)
+{
+    int             edns0_size, tcp_only;
+
+    if (ns->ns_number_of_addresses <= 0 ||
+        !res_srtt_caps(ns->ns_address[0], &edns0_size, &tcp_only))
+        return FALSE;
+
+    if ((ns->ns_options & SR_QUERY_VALIDATING_STUB_FLAGS) &&
+        edns0_size >= 0 && ns->ns_edns0_size > edns0_size) {
+        res_log(NULL, LOG_DEBUG, "libsres: "
+                "using remembered edns0 size %d", edns0_size);
+        ns->ns_edns0_size = edns0_size;
+        if (0 == edns0_size)
+            ns->ns_options &= ~SR_QUERY_VALIDATING_STUB_FLAGS;
+    }
+    if (tcp_only)
+        res_log(NULL, LOG_DEBUG, "libsres: ""using remembered TCP only");
+
+    return tcp_only ? TRUE : FALSE;
+}
+
 struct expected_arrival *
 res_async_query_create(const char *name, const u_int16_t type_h,
                        const u_int16_t class_h, struct name_server *pref_ns,
@@ -1929,24 +2336,31 @@ res_async_query_create(const char *name, const u_int16_t type_h,
     struct name_server *ns;
     struct expected_arrival *head = NULL, *new_ea, *temp_ea;
     long                delay = 0;
+    int                 use_stream;
+    int                 hedge, i;
 
     if ((name == NULL) || (pref_ns == NULL))
         return NULL;
 
     /*
-     * clone nameservers and store to ns_list
+     * clone nameservers and store to ns_list, fastest first
      */
     if ((ret_val = clone_ns_list(&ns_list, pref_ns)) != SR_UNSET)
         return NULL;
+    res_srtt_order_ns(&ns_list);
+
+    hedge = flags & SR_HEDGE_SERVERS_MASK;
 
     /*
      * Loop through the list of destinations, form the query and send it
      */
-    for (ns = ns_list; ns; ns = ns->ns_next) {
+    for (ns = ns_list, i = 1; ns; ns = ns->ns_next, i++) {
 
         signed_query = NULL;
         signed_length = 0;
 
+        use_stream = res_ns_apply_caps(ns);
+
         /** create payload */
         ret_val = res_create_query_payload(ns, name, class_h, type_h,
                                            &signed_query, &signed_length);
@@ -1961,6 +2375,7 @@ res_async_query_create(const char *name, const u_int16_t type_h,
             ret_val = SR_IO_MEMORY_ERROR;
             break; /* fatal, bail */
         }
+        new_ea->ea_using_stream = use_stream;
 
         /** add to list */
         if (NULL != head) {
@@ -1971,7 +2386,19 @@ res_async_query_create(const char *name, const u_int16_t type_h,
         } else
             head = new_ea;
 
-        delay += LIBSRES_NS_STAGGER;
+        /*
+         * The first 'hedge' servers are all asked at once. With
+         * SR_HEDGE_RTT the next server is asked as soon as this one
+         * takes longer than it usually does, instead of after the
+         * fixed stagger.
+         */
+        if (i < hedge)
+            continue;
+        if ((flags & SR_HEDGE_RTT) && ns->ns_number_of_addresses > 0)
+            delay += res_srtt_hedge_delay(ns->ns_address[0],
+                                          LIBSRES_NS_STAGGER * 1000000L);
+        else
+            delay += LIBSRES_NS_STAGGER * 1000000L;
     }
 
     /** if bad ret_val, clear list, else send query */
@@ -2049,13 +2476,55 @@ res_async_ea_isset(struct expected_arrival *ea, fd_set *fds)
 
     for (; ea; ea = ea->ea_next) {
         if (ea->ea_socket != INVALID_SOCKET &&
-                FD_ISSET(ea->ea_socket, fds))
+            (ea->ea_readable || FD_INSET(ea->ea_socket, fds)))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Mark the expected arrival using socket fd as readable, for callers
+ * that learn about ready sockets from something other than an fd_set
+ * (e.g. epoll). The next res_io_read() on the list will read it even
+ * though it isn't set in the fd_set it is given.
+ * Returns 1 if the socket belongs to the list, 0 otherwise.
+ */
+int
+res_async_ea_set_readable(struct expected_arrival *ea, int fd)
+{
+    for (; ea; ea = ea->ea_next) {
+        if (ea->ea_remaining_attempts != -1 &&
+            ea->ea_socket != INVALID_SOCKET && (int) ea->ea_socket == fd) {
+            ea->ea_readable = 1;
             return 1;
+        }
     }
 
     return 0;
 }
 
+/*
+ * store the open sockets of an ea list in fds, up to max_fds of them.
+ * Returns the number of open sockets, which may be more than max_fds.
+ */
+int
+res_async_ea_sockets(struct expected_arrival *ea, int *fds, int max_fds)
+{
+    int             count = 0;
+
+    for (; ea; ea = ea->ea_next) {
+        if (ea->ea_remaining_attempts == -1 ||
+            ea->ea_socket == INVALID_SOCKET)
+            continue;
+        if (fds && count < max_fds)
+            fds[count] = (int) ea->ea_socket;
+        ++count;
+    }
+
+    return count;
+}
+
 int
 res_async_tid_isset(int tid, fd_set *fds)
 {
@@ -130,7 +130,7 @@ int             res_io_check(int transaction_id, struct timeval *next_evt);
  *  next_evt, as this function does not clear it as some other functions do.
  *
  *  now is an (optional) pointer to the current time. If not supplied,
- *  gettimeofday will be used as needed.  If you are calling this function
+ *  res_gettime() will be used as needed.  If you are calling this function
  *  in a loop, you should probably pass a now pointer.
  *
  * Return value
@@ -157,7 +157,7 @@ int             res_io_check_one(struct expected_arrival *ea,
  *  next_evt, as this function does not clear it as some other functions do.
  *
  *  now is an (optional) pointer to the current time. If not supplied,
- *  gettimeofday will be used as needed.  If you are calling this function
+ *  res_gettime() will be used as needed.  If you are calling this function
  *  in a loop, you should probably pass a now pointer.
  *
  *  net_change, if provided, will be set to the change in the number of
@@ -195,6 +195,10 @@ int             res_io_check_ea_list(struct expected_arrival *ea,
 int             res_io_check_one_tid(int tid, struct timeval *next_evt,
                                      struct timeval *now);
 
+/*
+ * switch an ea that is being processed to TCP
+ */
+void            res_switch_to_tcp(struct expected_arrival *ea);
 /*
  * switch a newly created/queued es chain to default to TCP
  */
@@ -285,4 +289,50 @@ res_io_get_max_fd(void);
 long
 res_io_get_open_sockets(void);
 
+/*
+ * Per-address round trip time estimates (res_srtt.c)
+ *
+ * res_srtt_rto returns the time to wait, in microseconds, after sending
+ * attempt number 'attempt' (starting at 0) to an address; 'last' is set
+ * for the final attempt. res_srtt_response records a response with the
+ * measured round trip time, or -1 if it is ambiguous. res_srtt_failure
+ * records a timeout or send error. res_srtt_order_ns sorts a name server
+ * list, and the addresses of each server, best first. res_srtt_hedge_delay
+ * returns how long a hedged query waits on an address before also asking
+ * the next server.
+ *
+ * The same table remembers, for a while, the EDNS0 size an address
+ * needed (res_srtt_set_edns0) and whether it only answers over TCP
+ * (res_srtt_set_tcp_only); res_srtt_caps looks these up for a new
+ * query. res_srtt_responsive tells whether an address has answered.
+ */
+long            res_srtt_rto(const struct sockaddr_storage *ss,
+                             int retrans, int attempt, int last);
+void            res_srtt_response(const struct sockaddr_storage *ss,
+                                  long rtt);
+void            res_srtt_failure(const struct sockaddr_storage *ss,
+                                 long penalty);
+void            res_srtt_order_ns(struct name_server **ns_list);
+long            res_srtt_hedge_delay(const struct sockaddr_storage *ss,
+                                     long max);
+int             res_srtt_responsive(const struct sockaddr_storage *ss);
+void            res_srtt_set_edns0(const struct sockaddr_storage *ss,
+                                   int edns0_size);
+void            res_srtt_set_tcp_only(const struct sockaddr_storage *ss);
+int             res_srtt_caps(const struct sockaddr_storage *ss,
+                              int *edns0_size, int *tcp_only);
+
+/*
+ * Recording of upstream traffic (res_record.c)
+ *
+ * res_record_response appends an accepted response, the query it
+ * answers, the server address and the round trip time (-1 if unknown)
+ * to the recording started with res_io_record_start(), if any.
+ */
+void            res_record_response(const struct sockaddr_storage *server,
+                                    const u_char *query,
+                                    size_t query_length,
+                                    const u_char *response,
+                                    size_t response_length, long rtt);
+
 #endif
@@ -273,18 +273,38 @@ clone_ns_list(struct name_server **ns_list,
 
 
 
+static int
+query_queue_flags(const char *name, const u_int16_t type_h,
+                  const u_int16_t class_h, struct name_server *pref_ns,
+                  u_int flags, int *trans_id);
+
 int
 query_send(const char *name,
            const u_int16_t type_h,
            const u_int16_t class_h,
            struct name_server *pref_ns, 
            int *trans_id)
+{
+    return query_send_flags(name, type_h, class_h, pref_ns, 0, trans_id);
+}
+
+/*
+ * same as query_send(), with res_async_query_create() flags (SR_HEDGE_*)
+ */
+int
+query_send_flags(const char *name,
+                 const u_int16_t type_h,
+                 const u_int16_t class_h,
+                 struct name_server *pref_ns,
+                 u_int flags,
+                 int *trans_id)
 {
     int             ret_val;
     struct timeval  dummy;
     struct timeval  now;
 
-    ret_val = query_queue(name, type_h, class_h, pref_ns, trans_id);
+    ret_val = query_queue_flags(name, type_h, class_h, pref_ns, flags,
+                                trans_id);
     if (SR_UNSET != ret_val)
         return ret_val;
 
@@ -308,6 +328,14 @@ query_send(const char *name,
 int
 query_queue(const char *name, const u_int16_t type_h, const u_int16_t class_h,
             struct name_server *pref_ns, int *trans_id)
+{
+    return query_queue_flags(name, type_h, class_h, pref_ns, 0, trans_id);
+}
+
+static int
+query_queue_flags(const char *name, const u_int16_t type_h,
+                  const u_int16_t class_h, struct name_server *pref_ns,
+                  u_int flags, int *trans_id)
 {
     struct expected_arrival *ea;
     int             ret_val;
@@ -317,7 +345,7 @@ query_queue(const char *name, const u_int16_t type_h, const u_int16_t class_h,
 
     *trans_id = -1;
 
-    ea = res_async_query_create(name, type_h, class_h, pref_ns, 0);
+    ea = res_async_query_create(name, type_h, class_h, pref_ns, flags);
     if (NULL == ea)
         return SR_MEMORY_ERROR;
 
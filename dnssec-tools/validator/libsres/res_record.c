@@ -0,0 +1,641 @@
+/*
+ * Copyright 2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * Recording and replay of upstream traffic.
+ *
+ * Once res_io_record_start() has been called, every response that the
+ * io manager accepts is appended to a recording file, together with the
+ * question that was asked, the address it was sent to and the round
+ * trip time. res_io_record_stop() appends an index and closes the
+ * file. A recording can later be loaded with res_replay_open(), and
+ * res_replay_lookup() then finds the recorded response for a query, so
+ * that a stand-in server can answer from it without network access.
+ *
+ * The file starts with an 8 byte header ("DTRR", a version and a
+ * reserved field) followed by the records. All integers are in network
+ * byte order.
+ *
+ *   reclen   16 bits  length of the rest of the record
+ *   family    8 bits  4 or 6
+ *   (unused)  8 bits
+ *   port     16 bits
+ *   address  4 or 16 bytes
+ *   rtt      32 bits  microseconds, 0 if not measured
+ *   qtype    16 bits
+ *   qclass   16 bits
+ *   qname    the question name, lower cased, in wire format
+ *   resplen  16 bits
+ *   response resplen bytes
+ *
+ * The index consists of one (hash, offset) pair of 32 bit words per
+ * record, sorted by hash, followed by a 12 byte trailer: the offset of
+ * the index, the number of entries and "DTRI". The hash covers qtype,
+ * qclass and qname. A file without the index (the recording process
+ * was killed) can still be replayed; the index is then rebuilt while
+ * loading.
+ */
+#include "validator-internal.h"
+
+#include "res_support.h"
+#include "res_io_manager.h"
+
+#define RES_RECORD_MAGIC        "DTRR"
+#define RES_RECORD_INDEX_MAGIC  "DTRI"
+#define RES_RECORD_VERSION      1
+#define RES_RECORD_HDRLEN       8
+#define RES_RECORD_TRAILERLEN   12
+#define RES_RECORD_MAX_SIZE     0x7fffffffL
+
+struct res_record_index {
+    u_int32_t       ri_hash;
+    u_int32_t       ri_offset;
+};
+
+struct res_replay {
+    u_char         *rp_data;
+    size_t          rp_length;
+    struct res_record_index *rp_index;
+    size_t          rp_count;
+};
+
+/* the recording in progress */
+static FILE    *record_fp = NULL;
+static long     record_offset = 0;
+static struct res_record_index *record_index = NULL;
+static size_t   record_count = 0;
+static size_t   record_alloc = 0;
+
+#ifdef VAL_NO_THREADS
+#define RECORD_LOCK()
+#define RECORD_UNLOCK()
+#else
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define RECORD_LOCK()     pthread_mutex_lock(&record_mutex)
+#define RECORD_UNLOCK()   pthread_mutex_unlock(&record_mutex)
+#endif
+
+/*
+ * copy the (uncompressed) question name of a message into name, lower
+ * cased, and return the offset of the question type, or 0 if the
+ * message has no usable question.
+ */
+static size_t
+record_question(const u_char *msg, size_t msglen, u_char *name,
+                size_t *namelen)
+{
+    size_t          i = NS_HFIXEDSZ, n = 0, j;
+
+    if (msglen < NS_HFIXEDSZ || ((msg[4] << 8) | msg[5]) < 1)
+        return 0;
+
+    for (;;) {
+        if (i >= msglen || (msg[i] & NS_CMPRSFLGS) != 0)
+            return 0;
+        if (n + msg[i] + 1 > NS_MAXCDNAME || i + msg[i] + 1 > msglen)
+            return 0;
+        name[n++] = msg[i];
+        for (j = 1; j <= msg[i]; j++) {
+            u_char          c = msg[i + j];
+            name[n++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+        if (msg[i] == 0)
+            break;
+        i += msg[i] + 1;
+    }
+    i++;
+    if (i + 2 * NS_INT16SZ > msglen)
+        return 0;
+    *namelen = n;
+    return i;
+}
+
+static u_int32_t
+record_hash(const u_char *qtc, const u_char *name, size_t namelen)
+{
+    u_int32_t       h = 2166136261U;
+    size_t          i;
+
+    /* FNV-1a over qtype, qclass and qname */
+    for (i = 0; i < 2 * NS_INT16SZ; i++)
+        h = (h ^ qtc[i]) * 16777619U;
+    for (i = 0; i < namelen; i++)
+        h = (h ^ name[i]) * 16777619U;
+    return h;
+}
+
+static int
+record_index_cmp(const void *a, const void *b)
+{
+    const struct res_record_index *x = a, *y = b;
+
+    if (x->ri_hash != y->ri_hash)
+        return (x->ri_hash < y->ri_hash) ? -1 : 1;
+    if (x->ri_offset != y->ri_offset)
+        return (x->ri_offset < y->ri_offset) ? -1 : 1;
+    return 0;
+}
+
+static int
+record_index_add(struct res_record_index **index, size_t *count,
+                 size_t *alloc, u_int32_t hash, u_int32_t offset)
+{
+    if (*count == *alloc) {
+        size_t          n = *alloc ? 2 * *alloc : 256;
+        struct res_record_index *p = (struct res_record_index *)
+            MALLOC(n * sizeof(struct res_record_index));
+        if (NULL == p)
+            return -1;
+        if (*index) {
+            memcpy(p, *index, *count * sizeof(struct res_record_index));
+            FREE(*index);
+        }
+        *index = p;
+        *alloc = n;
+    }
+    (*index)[*count].ri_hash = hash;
+    (*index)[*count].ri_offset = offset;
+    (*count)++;
+    return 0;
+}
+
+/*
+ * Function: res_io_record_start
+ *
+ * Purpose:  Start recording upstream responses to the given file,
+ *           which is truncated. A recording that is already in
+ *           progress is finished first.
+ *
+ * Returns:  0 on success, -1 if the file could not be written.
+ */
+int
+res_io_record_start(const char *path)
+{
+    u_char          hdr[RES_RECORD_HDRLEN];
+    FILE           *fp;
+
+    if (NULL == path)
+        return -1;
+
+    res_io_record_stop();
+
+    fp = fopen(path, "wb");
+    if (NULL == fp) {
+        res_log(NULL, LOG_ERR, "libsres: ""cannot open recording %s: %s",
+                path, strerror(errno));
+        return -1;
+    }
+    memcpy(hdr, RES_RECORD_MAGIC, 4);
+    hdr[4] = 0;
+    hdr[5] = RES_RECORD_VERSION;
+    hdr[6] = hdr[7] = 0;
+    if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) {
+        fclose(fp);
+        return -1;
+    }
+
+    RECORD_LOCK();
+    record_fp = fp;
+    record_offset = RES_RECORD_HDRLEN;
+    RECORD_UNLOCK();
+    return 0;
+}
+
+/*
+ * Function: res_io_record_stop
+ *
+ * Purpose:  Write the index of the recording in progress, if any, and
+ *           close it.
+ */
+void
+res_io_record_stop(void)
+{
+    u_char          buf[RES_RECORD_TRAILERLEN];
+    size_t          i;
+
+    RECORD_LOCK();
+    if (NULL == record_fp) {
+        RECORD_UNLOCK();
+        return;
+    }
+
+    if (record_count > 0)
+        qsort(record_index, record_count, sizeof(struct res_record_index),
+              record_index_cmp);
+    for (i = 0; i < record_count; i++) {
+        u_char         *cp = buf;
+        NS_PUT32(record_index[i].ri_hash, cp);
+        NS_PUT32(record_index[i].ri_offset, cp);
+        fwrite(buf, 1, 2 * NS_INT32SZ, record_fp);
+    }
+    {
+        u_char         *cp = buf;
+        NS_PUT32(record_offset, cp);
+        NS_PUT32(record_count, cp);
+        memcpy(cp, RES_RECORD_INDEX_MAGIC, 4);
+    }
+    fwrite(buf, 1, RES_RECORD_TRAILERLEN, record_fp);
+    if (fclose(record_fp) != 0)
+        res_log(NULL, LOG_ERR, "libsres: ""error closing recording: %s",
+                strerror(errno));
+
+    record_fp = NULL;
+    record_offset = 0;
+    if (record_index)
+        FREE(record_index);
+    record_index = NULL;
+    record_count = record_alloc = 0;
+    RECORD_UNLOCK();
+}
+
+/*
+ * Function: res_record_response
+ *
+ * Purpose:  Append an accepted response, and the query it answers, to
+ *           the recording in progress. Truncated responses are left
+ *           out; the answer over TCP is recorded instead.
+ */
+void
+res_record_response(const struct sockaddr_storage *server,
+                    const u_char *query, size_t query_length,
+                    const u_char *response, size_t response_length,
+                    long rtt)
+{
+    u_char          name[NS_MAXCDNAME];
+    u_char          hdr[2 * NS_INT16SZ + 16 + 4 * NS_INT16SZ +
+                        NS_INT32SZ];
+    u_char         *cp = hdr;
+    const u_char   *qtc;
+    size_t          namelen, off, addrlen, reclen;
+    u_int16_t       port;
+    int             family;
+
+    /* unlocked peek; checked again below */
+    if (NULL == record_fp || NULL == server || NULL == query ||
+        NULL == response || response_length > 0xffff ||
+        response_length < NS_HFIXEDSZ || ((HEADER *) response)->tc)
+        return;
+
+    if (server->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) server;
+        family = 4;
+        port = ntohs(sin->sin_port);
+        addrlen = sizeof(sin->sin_addr);
+    }
+#ifdef VAL_IPV6
+    else if (server->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 =
+            (const struct sockaddr_in6 *) server;
+        family = 6;
+        port = ntohs(sin6->sin6_port);
+        addrlen = sizeof(sin6->sin6_addr);
+    }
+#endif
+    else
+        return;
+
+    off = record_question(query, query_length, name, &namelen);
+    if (0 == off)
+        return;
+    qtc = &query[off];
+
+    if (rtt < 0)
+        rtt = 0;
+    reclen = 2 + NS_INT16SZ + addrlen + NS_INT32SZ + 2 * NS_INT16SZ +
+        namelen + NS_INT16SZ + response_length;
+    if (reclen > 0xffff)
+        return;
+
+    NS_PUT16(reclen, cp);
+    *cp++ = family;
+    *cp++ = 0;
+    NS_PUT16(port, cp);
+    if (family == 4)
+        memcpy(cp, &((const struct sockaddr_in *) server)->sin_addr,
+               addrlen);
+#ifdef VAL_IPV6
+    else
+        memcpy(cp, &((const struct sockaddr_in6 *) server)->sin6_addr,
+               addrlen);
+#endif
+    cp += addrlen;
+    NS_PUT32(rtt, cp);
+    memcpy(cp, qtc, 2 * NS_INT16SZ);
+    cp += 2 * NS_INT16SZ;
+
+    RECORD_LOCK();
+    if (NULL == record_fp ||
+        record_offset + NS_INT16SZ + (long) reclen > RES_RECORD_MAX_SIZE ||
+        record_index_add(&record_index, &record_count, &record_alloc,
+                         record_hash(qtc, name, namelen),
+                         (u_int32_t) record_offset) != 0) {
+        RECORD_UNLOCK();
+        return;
+    }
+    {
+        u_char          lenbuf[NS_INT16SZ], *lp = lenbuf;
+        NS_PUT16(response_length, lp);
+        fwrite(hdr, 1, cp - hdr, record_fp);
+        fwrite(name, 1, namelen, record_fp);
+        fwrite(lenbuf, 1, sizeof(lenbuf), record_fp);
+        fwrite(response, 1, response_length, record_fp);
+    }
+    record_offset += NS_INT16SZ + reclen;
+    RECORD_UNLOCK();
+}
+
+/*
+ * parse the record at off. Returns 0 and fills in the pointers if it
+ * is complete, -1 otherwise.
+ */
+static int
+replay_parse(const struct res_replay *rp, size_t off, size_t *next,
+             const u_char **addr, size_t *addrlen, const u_char **qtc,
+             const u_char **name, size_t *namelen,
+             const u_char **response, size_t *response_length)
+{
+    const u_char   *cp, *end;
+    size_t          reclen;
+
+    if (off + NS_INT16SZ > rp->rp_length)
+        return -1;
+    cp = rp->rp_data + off;
+    NS_GET16(reclen, cp);
+    if (off + NS_INT16SZ + reclen > rp->rp_length)
+        return -1;
+    end = cp + reclen;
+
+    if (end - cp < 4)
+        return -1;
+    *addrlen = (cp[0] == 4) ? 4 : (cp[0] == 6) ? 16 : 0;
+    if (0 == *addrlen ||
+        (size_t) (end - cp) < 4 + *addrlen + NS_INT32SZ + 2 * NS_INT16SZ)
+        return -1;
+    *addr = cp;                 /* family, unused, port, address */
+    cp += 4 + *addrlen + NS_INT32SZ;
+    *qtc = cp;
+    cp += 2 * NS_INT16SZ;
+    *name = cp;
+    while (cp < end && *cp != 0 && (*cp & NS_CMPRSFLGS) == 0)
+        cp += *cp + 1;
+    if (cp >= end || *cp != 0)
+        return -1;
+    cp++;
+    *namelen = cp - *name;
+    if (end - cp < NS_INT16SZ)
+        return -1;
+    NS_GET16(*response_length, cp);
+    if ((size_t) (end - cp) != *response_length ||
+        *response_length < NS_HFIXEDSZ)
+        return -1;
+    *response = cp;
+    *next = off + NS_INT16SZ + reclen;
+    return 0;
+}
+
+/*
+ * Function: res_replay_open
+ *
+ * Purpose:  Load a recording made with res_io_record_start().
+ *
+ * Returns:  The recording, or NULL if the file could not be read or
+ *           is not a recording.
+ */
+struct res_replay *
+res_replay_open(const char *path)
+{
+    struct res_replay *rp;
+    FILE           *fp;
+    long            size;
+    size_t          off, alloc = 0;
+
+    if (NULL == path || NULL == (fp = fopen(path, "rb")))
+        return NULL;
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+        size < RES_RECORD_HDRLEN || fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    rp = (struct res_replay *) MALLOC(sizeof(struct res_replay));
+    if (NULL == rp) {
+        fclose(fp);
+        return NULL;
+    }
+    memset(rp, 0, sizeof(*rp));
+    rp->rp_length = size;
+    rp->rp_data = (u_char *) MALLOC(size);
+    if (NULL == rp->rp_data ||
+        fread(rp->rp_data, 1, size, fp) != (size_t) size ||
+        memcmp(rp->rp_data, RES_RECORD_MAGIC, 4) != 0 ||
+        rp->rp_data[5] != RES_RECORD_VERSION) {
+        fclose(fp);
+        res_replay_close(rp);
+        return NULL;
+    }
+    fclose(fp);
+
+    /* use the index if the recording was finished */
+    if (rp->rp_length >= RES_RECORD_HDRLEN + RES_RECORD_TRAILERLEN &&
+        memcmp(rp->rp_data + rp->rp_length - 4, RES_RECORD_INDEX_MAGIC,
+               4) == 0) {
+        const u_char   *cp = rp->rp_data + rp->rp_length -
+            RES_RECORD_TRAILERLEN;
+        u_int32_t       start, count;
+
+        NS_GET32(start, cp);
+        NS_GET32(count, cp);
+        if (start >= RES_RECORD_HDRLEN &&
+            start + (size_t) count * 2 * NS_INT32SZ ==
+            rp->rp_length - RES_RECORD_TRAILERLEN) {
+            size_t          i;
+
+            rp->rp_length = start;
+            if (count > 0) {
+                rp->rp_index = (struct res_record_index *)
+                    MALLOC(count * sizeof(struct res_record_index));
+                if (NULL == rp->rp_index) {
+                    res_replay_close(rp);
+                    return NULL;
+                }
+            }
+            cp = rp->rp_data + start;
+            for (i = 0; i < count; i++) {
+                NS_GET32(rp->rp_index[i].ri_hash, cp);
+                NS_GET32(rp->rp_index[i].ri_offset, cp);
+                if (rp->rp_index[i].ri_offset >= start)
+                    break;
+            }
+            if (i == count) {
+                rp->rp_count = count;
+                return rp;
+            }
+            FREE(rp->rp_index);
+            rp->rp_index = NULL;
+        }
+    }
+
+    /* otherwise scan the records */
+    for (off = RES_RECORD_HDRLEN; off < rp->rp_length;) {
+        const u_char   *addr, *qtc, *name, *response;
+        size_t          addrlen, namelen, response_length, next;
+
+        if (replay_parse(rp, off, &next, &addr, &addrlen, &qtc, &name,
+                         &namelen, &response, &response_length) != 0)
+            break;
+        if (record_index_add(&rp->rp_index, &rp->rp_count, &alloc,
+                             record_hash(qtc, name, namelen),
+                             (u_int32_t) off) != 0) {
+            res_replay_close(rp);
+            return NULL;
+        }
+        off = next;
+    }
+    if (rp->rp_count > 0)
+        qsort(rp->rp_index, rp->rp_count, sizeof(struct res_record_index),
+              record_index_cmp);
+    return rp;
+}
+
+/*
+ * Function: res_replay_close
+ *
+ * Purpose:  Release a recording loaded with res_replay_open().
+ */
+void
+res_replay_close(struct res_replay *rp)
+{
+    if (NULL == rp)
+        return;
+    if (rp->rp_data)
+        FREE(rp->rp_data);
+    if (rp->rp_index)
+        FREE(rp->rp_index);
+    FREE(rp);
+}
+
+/*
+ * how complete a recorded response is: answers and name errors are
+ * preferred to empty authoritative answers, which are preferred to
+ * referrals and errors.
+ */
+static int
+replay_rank(const u_char *response)
+{
+    const HEADER   *hp = (const HEADER *) response;
+
+    if (hp->rcode == ns_r_nxdomain ||
+        (hp->rcode == ns_r_noerror && hp->ancount != 0))
+        return 3;
+    if (hp->rcode == ns_r_noerror && hp->aa)
+        return 2;
+    if (hp->rcode == ns_r_noerror)
+        return 1;
+    return 0;
+}
+
+/*
+ * Function: res_replay_lookup
+ *
+ * Purpose:  Find the recorded response to a query. If server is given,
+ *           a response from that address is preferred. Otherwise, or
+ *           if that address was not asked, the most complete response
+ *           to the question is returned: an answer or a name error
+ *           rather than a referral. Among equals, the earliest one
+ *           wins.
+ *
+ *           The response points into the recording and keeps the
+ *           recorded message ID; rtt is the recorded round trip time in
+ *           microseconds, or 0 if it is not known.
+ *
+ * Returns:  0 if a response was found, -1 otherwise.
+ */
+int
+res_replay_lookup(const struct res_replay *rp, const u_char *query,
+                  size_t query_length,
+                  const struct sockaddr_storage *server,
+                  const u_char **response, size_t *response_length,
+                  long *rtt)
+{
+    u_char          name[NS_MAXCDNAME];
+    u_char          saddr[16];
+    const u_char   *qtc;
+    size_t          namelen, off, lo, hi, saddrlen = 0;
+    u_int32_t       hash;
+    int             best = -1, sfamily = 0;
+    u_int16_t       sport = 0;
+
+    if (NULL == rp || NULL == query || NULL == response ||
+        NULL == response_length)
+        return -1;
+
+    off = record_question(query, query_length, name, &namelen);
+    if (0 == off)
+        return -1;
+    qtc = &query[off];
+    hash = record_hash(qtc, name, namelen);
+
+    if (server && server->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) server;
+        sfamily = 4;
+        sport = ntohs(sin->sin_port);
+        saddrlen = sizeof(sin->sin_addr);
+        memcpy(saddr, &sin->sin_addr, saddrlen);
+    }
+#ifdef VAL_IPV6
+    else if (server && server->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 =
+            (const struct sockaddr_in6 *) server;
+        sfamily = 6;
+        sport = ntohs(sin6->sin6_port);
+        saddrlen = sizeof(sin6->sin6_addr);
+        memcpy(saddr, &sin6->sin6_addr, saddrlen);
+    }
+#endif
+
+    /* first index entry with this hash */
+    lo = 0;
+    hi = rp->rp_count;
+    while (lo < hi) {
+        size_t          mid = lo + (hi - lo) / 2;
+        if (rp->rp_index[mid].ri_hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < rp->rp_count && rp->rp_index[lo].ri_hash == hash; lo++) {
+        const u_char   *addr, *rqtc, *rname, *resp, *cp;
+        size_t          addrlen, rnamelen, resplen, next;
+        int             score;
+        u_int16_t       rport;
+
+        if (replay_parse(rp, rp->rp_index[lo].ri_offset, &next, &addr,
+                         &addrlen, &rqtc, &rname, &rnamelen, &resp,
+                         &resplen) != 0 ||
+            rnamelen != namelen || memcmp(rname, name, namelen) != 0 ||
+            memcmp(rqtc, qtc, 2 * NS_INT16SZ) != 0)
+            continue;
+
+        score = replay_rank(resp);
+        cp = addr + 2;
+        NS_GET16(rport, cp);
+        if (sfamily == addr[0] && sport == rport &&
+            memcmp(cp, saddr, saddrlen) == 0)
+            score += 4;
+        if (score <= best)
+            continue;
+
+        best = score;
+        *response = resp;
+        *response_length = resplen;
+        if (rtt) {
+            u_int32_t       t;
+            cp += addrlen;
+            NS_GET32(t, cp);
+            *rtt = t;
+        }
+    }
+    return (best < 0) ? -1 : 0;
+}
@@ -0,0 +1,532 @@
+/*
+ * Copyright 2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * Per-address round trip time estimates.
+ *
+ * A process-wide table keeps a smoothed RTT and RTT variance (RFC 6298
+ * style) for every name server address that libsres talks to, together
+ * with a count of consecutive failures. The io manager uses the table
+ * to
+ *
+ *   - order the servers (and the addresses of each server) of a new
+ *     query so that the fastest responsive address is tried first,
+ *   - compute the retransmit delay for each attempt from the measured
+ *     RTT instead of the static ns_retrans,
+ *   - back off from addresses that keep timing out, so they are only
+ *     tried once the other candidates have been exhausted, and
+ *   - decide when a hedged query should also ask the next server.
+ *
+ * Addresses that have never been measured sort first, so that new
+ * servers get probed. The table has a fixed size; when a probe
+ * sequence is full, the least recently used entry is replaced.
+ *
+ * The table also remembers what an address was found to need after a
+ * fallback got an answer from it: a smaller EDNS0 buffer size (0 when
+ * EDNS0, and with it the DO bit, had to be turned off), or TCP when
+ * UDP went unanswered. New queries to the address start out that way
+ * instead of repeating the timeouts. These capabilities expire after
+ * RES_SRTT_CAPS_TTL seconds so that the address is probed again.
+ *
+ * Backoffs and capability ages are kept on the res_gettime() clock, so
+ * stepping the wall clock neither expires them early nor pins them.
+ */
+#include "validator-internal.h"
+
+#include "res_support.h"
+#include "res_io_manager.h"
+
+#define RES_SRTT_TABLE_SIZE     1024    /* must be a power of 2 */
+#define RES_SRTT_PROBE          4
+#define RES_SRTT_MAX_SORT       32      /* addresses sorted per server */
+#define RES_SRTT_MIN_RTO        250000L     /* us */
+#define RES_SRTT_MIN_HEDGE      10000L      /* us */
+#define RES_SRTT_FINAL_WAIT     1000000L    /* us, minimum wait after last try */
+#define RES_SRTT_MAX            (30 * 1000000L)
+#define RES_SRTT_FAIL_THRESHOLD 3           /* failures before backing off */
+#define RES_SRTT_BACKOFF_MIN    5           /* seconds */
+#define RES_SRTT_BACKOFF_MAX    300         /* seconds */
+#define RES_SRTT_CAPS_TTL       600         /* seconds */
+
+#define SRTT_CAP_EDNS0          0x01    /* se_edns0_size is valid */
+#define SRTT_CAP_TCP_ONLY       0x02    /* UDP is not answered */
+
+struct res_srtt_entry {
+    u_char          se_family;      /* 0 == unused */
+    u_int16_t       se_port;
+    u_char          se_addr[16];
+    long            se_srtt;        /* us, 0 if never measured */
+    long            se_rttvar;      /* us */
+    long            se_penalty;     /* us, added for unanswered tries */
+    int             se_failures;    /* consecutive */
+    time_t          se_backoff_until;
+    time_t          se_last_used;
+    int             se_caps;        /* SRTT_CAP_* */
+    int             se_edns0_size;  /* largest size that was answered */
+    time_t          se_caps_time;   /* last fallback */
+};
+
+static struct res_srtt_entry srtt_table[RES_SRTT_TABLE_SIZE];
+
+#ifdef VAL_NO_THREADS
+#define SRTT_LOCK()
+#define SRTT_UNLOCK()
+#else
+static pthread_mutex_t srtt_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define SRTT_LOCK()     pthread_mutex_lock(&srtt_mutex)
+#define SRTT_UNLOCK()   pthread_mutex_unlock(&srtt_mutex)
+#endif
+
+/*
+ * extract the lookup key from a socket address. Returns 0 for address
+ * families we don't track.
+ */
+static int
+srtt_key(const struct sockaddr_storage *ss, u_char *family, u_int16_t *port,
+         u_char *addr)
+{
+    memset(addr, 0, 16);
+    if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) ss;
+        *family = AF_INET;
+        *port = sin->sin_port;
+        memcpy(addr, &sin->sin_addr, sizeof(sin->sin_addr));
+        return 1;
+    }
+#ifdef VAL_IPV6
+    if (ss->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) ss;
+        *family = AF_INET6;
+        *port = sin6->sin6_port;
+        memcpy(addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * find the entry for an address; if create is set, allocate one
+ * (possibly evicting the least recently used entry in the probe
+ * sequence). Must be called with the table locked.
+ */
+static struct res_srtt_entry *
+srtt_lookup(const struct sockaddr_storage *ss, int create, time_t now)
+{
+    u_char          family, addr[16];
+    u_int16_t       port;
+    u_int32_t       h = 2166136261U;
+    struct res_srtt_entry *e, *victim = NULL;
+    int             i;
+
+    if (NULL == ss || !srtt_key(ss, &family, &port, addr))
+        return NULL;
+
+    /* FNV-1a */
+    for (i = 0; i < 16; i++)
+        h = (h ^ addr[i]) * 16777619U;
+    h = (h ^ port) * 16777619U;
+
+    for (i = 0; i < RES_SRTT_PROBE; i++) {
+        e = &srtt_table[(h + i) & (RES_SRTT_TABLE_SIZE - 1)];
+        if (e->se_family == family && e->se_port == port &&
+            memcmp(e->se_addr, addr, sizeof(addr)) == 0) {
+            e->se_last_used = now;
+            return e;
+        }
+        /* prefer a free slot, else the least recently used one */
+        if (NULL == victim)
+            victim = e;
+        else if (victim->se_family != 0 &&
+                 (e->se_family == 0 ||
+                  e->se_last_used < victim->se_last_used))
+            victim = e;
+    }
+    if (!create)
+        return NULL;
+
+    memset(victim, 0, sizeof(*victim));
+    victim->se_family = family;
+    victim->se_port = port;
+    memcpy(victim->se_addr, addr, sizeof(addr));
+    victim->se_last_used = now;
+    return victim;
+}
+
+/*
+ * sort key for an address; lower is better. Must be called with the
+ * table locked.
+ */
+static long
+srtt_score(const struct sockaddr_storage *ss, time_t now)
+{
+    struct res_srtt_entry *e = srtt_lookup(ss, 0, now);
+
+    if (NULL == e)
+        return 0;
+    if (e->se_backoff_until > now)
+        return RES_SRTT_MAX + e->se_srtt + e->se_penalty;
+    return e->se_srtt + e->se_penalty;
+}
+
+/*
+ * Function: res_srtt_rto
+ *
+ * Purpose:  Compute how long to wait (in microseconds) after sending
+ *           the given attempt (0 for the first transmission) to an
+ *           address, before retransmitting or giving up.
+ *
+ *           Addresses without a usable estimate get the configured
+ *           retransmit interval. Otherwise the timeout is
+ *           srtt + 4 * rttvar, doubled for each previous attempt and
+ *           never more than the configured interval. The wait after the
+ *           last attempt is at least RES_SRTT_FINAL_WAIT, so that a
+ *           server that is merely slow for a particular name is not
+ *           abandoned too eagerly.
+ */
+long
+res_srtt_rto(const struct sockaddr_storage *ss, int retrans, int attempt,
+             int last)
+{
+    struct res_srtt_entry *e;
+    long            max = (long) retrans * 1000000L;
+    long            rto = max;
+    struct timeval  now;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+    e = srtt_lookup(ss, 0, now.tv_sec);
+    if (e && e->se_srtt > 0) {
+        rto = e->se_srtt + 4 * e->se_rttvar;
+        if (rto < RES_SRTT_MIN_RTO)
+            rto = RES_SRTT_MIN_RTO;
+    }
+    SRTT_UNLOCK();
+
+    while (attempt-- > 0 && rto < max)
+        rto <<= 1;
+    if (last && rto < RES_SRTT_FINAL_WAIT)
+        rto = RES_SRTT_FINAL_WAIT;
+    if (rto > max)
+        rto = max;
+
+    return rto;
+}
+
+/*
+ * Function: res_srtt_hedge_delay
+ *
+ * Purpose:  Compute how long (in microseconds) to wait for an answer
+ *           from an address before also asking the next server.
+ *
+ *           This is srtt + 2 * rttvar, roughly the 95th percentile of
+ *           the round trip times seen from the address, so that only
+ *           unusually slow answers cause a second query. An address
+ *           that has recently lost a query gets just its srtt, and one
+ *           that is backed off gets no wait at all. Addresses without
+ *           an estimate, and all waits, are limited to max.
+ */
+long
+res_srtt_hedge_delay(const struct sockaddr_storage *ss, long max)
+{
+    struct res_srtt_entry *e;
+    long            delay = max;
+    struct timeval  now;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+    e = srtt_lookup(ss, 0, now.tv_sec);
+    if (e && e->se_backoff_until > now.tv_sec)
+        delay = 0;
+    else if (e && e->se_srtt > 0) {
+        delay = e->se_srtt;
+        if (0 == e->se_failures)
+            delay += 2 * e->se_rttvar;
+        if (delay < RES_SRTT_MIN_HEDGE)
+            delay = RES_SRTT_MIN_HEDGE;
+    }
+    SRTT_UNLOCK();
+
+    if (delay > max)
+        delay = max;
+
+    return delay;
+}
+
+/*
+ * Function: res_srtt_response
+ *
+ * Purpose:  Record a response from an address. rtt is the measured
+ *           round trip time in microseconds, or -1 if the response
+ *           can't be matched to a single transmission (Karn's rule);
+ *           in that case the address is only marked as responsive.
+ */
+void
+res_srtt_response(const struct sockaddr_storage *ss, long rtt)
+{
+    struct res_srtt_entry *e;
+    struct timeval  now;
+    long            delta;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+    e = srtt_lookup(ss, 1, now.tv_sec);
+    if (NULL == e) {
+        SRTT_UNLOCK();
+        return;
+    }
+    e->se_failures = 0;
+    e->se_penalty = 0;
+    e->se_backoff_until = 0;
+    if (rtt >= 0) {
+        if (rtt == 0)
+            rtt = 1;
+        if (e->se_srtt == 0) {
+            e->se_srtt = rtt;
+            e->se_rttvar = rtt / 2;
+        } else {
+            delta = e->se_srtt - rtt;
+            if (delta < 0)
+                delta = -delta;
+            e->se_rttvar += (delta - e->se_rttvar) / 4;
+            e->se_srtt += (rtt - e->se_srtt) / 8;
+        }
+    }
+    SRTT_UNLOCK();
+}
+
+/*
+ * Function: res_srtt_failure
+ *
+ * Purpose:  Record an unanswered transmission or a send error for an
+ *           address. The address accumulates a penalty (at least the
+ *           given number of microseconds, doubling with each further
+ *           failure) until it next responds, so that it sorts behind
+ *           responsive addresses; after repeated failures it is also
+ *           backed off for an exponentially growing period.
+ */
+void
+res_srtt_failure(const struct sockaddr_storage *ss, long penalty)
+{
+    struct res_srtt_entry *e;
+    struct timeval  now;
+    long            backoff;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+    e = srtt_lookup(ss, 1, now.tv_sec);
+    if (NULL == e) {
+        SRTT_UNLOCK();
+        return;
+    }
+    if (e->se_penalty * 2 > penalty)
+        penalty = e->se_penalty * 2;
+    if (penalty > RES_SRTT_MAX)
+        penalty = RES_SRTT_MAX;
+    e->se_penalty = penalty;
+    if (++e->se_failures >= RES_SRTT_FAIL_THRESHOLD) {
+        int             i;
+
+        backoff = RES_SRTT_BACKOFF_MIN;
+        for (i = RES_SRTT_FAIL_THRESHOLD;
+             i < e->se_failures && backoff < RES_SRTT_BACKOFF_MAX; i++)
+            backoff <<= 1;
+        if (backoff > RES_SRTT_BACKOFF_MAX)
+            backoff = RES_SRTT_BACKOFF_MAX;
+        e->se_backoff_until = now.tv_sec + backoff;
+        res_log(NULL, LOG_INFO, "libsres: "
+                "backing off from server address for %ld seconds "
+                "after %d failures", backoff, e->se_failures);
+    }
+    SRTT_UNLOCK();
+}
+
+/*
+ * Function: res_srtt_order_ns
+ *
+ * Purpose:  Reorder a (private) name server list by RTT estimate: the
+ *           addresses of each server are sorted best first, then the
+ *           servers are sorted by their best address. Both sorts are
+ *           stable, so servers and addresses without estimates keep
+ *           their configured order.
+ */
+void
+res_srtt_order_ns(struct name_server **ns_list)
+{
+    struct name_server *ns, *next, *sorted = NULL, **pp;
+    struct sockaddr_storage *tmp_addr;
+    long            scores[RES_SRTT_MAX_SORT], tmp_score;
+    struct timeval  now;
+    int             i, j, n;
+
+    if (NULL == ns_list || NULL == *ns_list)
+        return;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+
+    /*
+     * insertion sort of the address array of each server
+     */
+    for (ns = *ns_list; ns; ns = ns->ns_next) {
+        n = ns->ns_number_of_addresses;
+        if (n > RES_SRTT_MAX_SORT)
+            n = RES_SRTT_MAX_SORT;
+        for (i = 0; i < n; i++) {
+            scores[i] = srtt_score(ns->ns_address[i], now.tv_sec);
+            for (j = i; j > 0 && scores[j - 1] > scores[j]; j--) {
+                tmp_score = scores[j - 1];
+                scores[j - 1] = scores[j];
+                scores[j] = tmp_score;
+                tmp_addr = ns->ns_address[j - 1];
+                ns->ns_address[j - 1] = ns->ns_address[j];
+                ns->ns_address[j] = tmp_addr;
+            }
+        }
+    }
+
+    /*
+     * insertion sort of the server list by best address
+     */
+    for (ns = *ns_list; ns; ns = next) {
+        next = ns->ns_next;
+        tmp_score = (ns->ns_number_of_addresses > 0) ?
+            srtt_score(ns->ns_address[0], now.tv_sec) : RES_SRTT_MAX * 2;
+        for (pp = &sorted; *pp; pp = &(*pp)->ns_next) {
+            long            s = ((*pp)->ns_number_of_addresses > 0) ?
+                srtt_score((*pp)->ns_address[0], now.tv_sec) :
+                RES_SRTT_MAX * 2;
+            if (s > tmp_score)
+                break;
+        }
+        ns->ns_next = *pp;
+        *pp = ns;
+    }
+    *ns_list = sorted;
+
+    SRTT_UNLOCK();
+}
+
+/*
+ * Function: res_srtt_responsive
+ *
+ * Purpose:  Tell whether an address is known to have answered before,
+ *           i.e. whether a failure to get an answer from it now is
+ *           likely to be caused by the transport rather than the
+ *           server being gone.
+ */
+int
+res_srtt_responsive(const struct sockaddr_storage *ss)
+{
+    struct res_srtt_entry *e;
+    struct timeval  now;
+    int             rc = 0;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+    e = srtt_lookup(ss, 0, now.tv_sec);
+    if (e && (e->se_srtt > 0 || (e->se_caps & SRTT_CAP_TCP_ONLY)))
+        rc = 1;
+    SRTT_UNLOCK();
+
+    return rc;
+}
+
+/*
+ * Function: res_srtt_set_edns0
+ *
+ * Purpose:  Record that an address answered only after the EDNS0
+ *           buffer size was lowered to edns0_size; 0 means that EDNS0
+ *           (and the DO bit) had to be turned off.
+ */
+void
+res_srtt_set_edns0(const struct sockaddr_storage *ss, int edns0_size)
+{
+    struct res_srtt_entry *e;
+    struct timeval  now;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+    e = srtt_lookup(ss, 1, now.tv_sec);
+    if (e) {
+        e->se_caps |= SRTT_CAP_EDNS0;
+        e->se_edns0_size = edns0_size;
+        e->se_caps_time = now.tv_sec;
+        res_log(NULL, LOG_INFO, "libsres: "
+                "remembering EDNS0 size %d for server address", edns0_size);
+    }
+    SRTT_UNLOCK();
+}
+
+/*
+ * Function: res_srtt_set_tcp_only
+ *
+ * Purpose:  Record that an address answered over TCP after its UDP
+ *           queries went unanswered.
+ */
+void
+res_srtt_set_tcp_only(const struct sockaddr_storage *ss)
+{
+    struct res_srtt_entry *e;
+    struct timeval  now;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+    e = srtt_lookup(ss, 1, now.tv_sec);
+    if (e) {
+        e->se_caps |= SRTT_CAP_TCP_ONLY;
+        e->se_caps_time = now.tv_sec;
+        res_log(NULL, LOG_INFO, "libsres: "
+                "remembering server address as reachable over TCP only");
+    }
+    SRTT_UNLOCK();
+}
+
+/*
+ * Function: res_srtt_caps
+ *
+ * Purpose:  Look up what was learned about an address. edns0_size is
+ *           set to the EDNS0 size to use, or -1 if nothing is known;
+ *           tcp_only is set if queries should go straight to TCP.
+ *           Returns 1 if anything is known, 0 otherwise.
+ */
+int
+res_srtt_caps(const struct sockaddr_storage *ss, int *edns0_size,
+              int *tcp_only)
+{
+    struct res_srtt_entry *e;
+    struct timeval  now;
+    int             rc = 0;
+
+    *edns0_size = -1;
+    *tcp_only = 0;
+
+    res_gettime(&now);
+
+    SRTT_LOCK();
+    e = srtt_lookup(ss, 0, now.tv_sec);
+    if (e && e->se_caps) {
+        if (e->se_caps_time + RES_SRTT_CAPS_TTL <= now.tv_sec) {
+            /* stale; probe the address afresh */
+            e->se_caps = 0;
+        } else {
+            if (e->se_caps & SRTT_CAP_EDNS0)
+                *edns0_size = e->se_edns0_size;
+            if (e->se_caps & SRTT_CAP_TCP_ONLY)
+                *tcp_only = 1;
+            rc = 1;
+        }
+    }
+    SRTT_UNLOCK();
+
+    return rc;
+}
@@ -90,6 +90,143 @@ res_gettimeofday_buf(char *buf, size_t bufsize) {
     return 0;
 }
 
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+static struct timeval gettime_offset;
+#ifndef VAL_NO_THREADS
+static pthread_once_t gettime_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void
+gettime_init(void)
+{
+    struct timeval  wall;
+    struct timespec ts;
+
+    gettimeofday(&wall, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    gettime_offset.tv_sec = wall.tv_sec - ts.tv_sec;
+    gettime_offset.tv_usec = wall.tv_usec - ts.tv_nsec / 1000;
+    if (gettime_offset.tv_usec < 0) {
+        gettime_offset.tv_sec--;
+        gettime_offset.tv_usec += 1000000;
+    }
+}
+#endif
+
+/*
+ * Function: res_gettime
+ *
+ * Purpose:  Get the current time on the clock that libsres uses for
+ *           all of its event times (retry and cancel alarms, the next
+ *           event returned by the res_io_check* and select_info
+ *           functions). Where the system has a monotonic clock it is
+ *           used, offset so that it agrees with gettimeofday() when
+ *           first read; the event times are therefore unaffected by
+ *           the wall clock being stepped. Otherwise this is simply
+ *           gettimeofday().
+ *
+ *           Callers converting event times into relative timeouts
+ *           should use this rather than gettimeofday().
+ */
+void
+res_gettime(struct timeval *now)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+#ifndef VAL_NO_THREADS
+    pthread_once(&gettime_once, gettime_init);
+#else
+    if (!timerisset(&gettime_offset))
+        gettime_init();
+#endif
+    if (0 == clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        now->tv_sec = ts.tv_sec + gettime_offset.tv_sec;
+        now->tv_usec = ts.tv_nsec / 1000 + gettime_offset.tv_usec;
+        if (now->tv_usec >= 1000000) {
+            now->tv_sec++;
+            now->tv_usec -= 1000000;
+        }
+        return;
+    }
+#endif
+    gettimeofday(now, NULL);
+}
+
+/*
+ * Map a latency to its histogram bucket. Bucket 0 holds samples
+ * below 2us, bucket i samples in [2^i, 2^(i+1)) us and the last
+ * bucket everything larger.
+ */
+int
+res_stats_bucket(long usec, int nbuckets)
+{
+    int             b = 0;
+
+    while (usec > 1 && b < nbuckets - 1) {
+        usec >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/*
+ * Upper bound (in us) of the bucket containing the given percentile
+ * of samples
+ */
+static long
+res_stats_percentile(const u_int64_t *hist, int nbuckets,
+                     u_int64_t total, int pct)
+{
+    u_int64_t       want, seen = 0;
+    int             i;
+
+    want = (total * pct + 99) / 100;
+    for (i = 0; i < nbuckets - 1; i++) {
+        seen += hist[i];
+        if (seen >= want)
+            break;
+    }
+    return 2L << i;
+}
+
+void
+res_stats_dump_hist(FILE *fp, const char *title, const u_int64_t *hist,
+                    int nbuckets)
+{
+    u_int64_t       total = 0;
+    int             i;
+
+    if (fp == NULL || hist == NULL || nbuckets <= 0)
+        return;
+
+    for (i = 0; i < nbuckets; i++)
+        total += hist[i];
+
+    fprintf(fp, "%s: %llu samples", title ? title : "",
+            (unsigned long long) total);
+    if (total == 0) {
+        fprintf(fp, "\n");
+        return;
+    }
+    fprintf(fp, ", p50 < %ldus, p90 < %ldus, p99 < %ldus\n",
+            res_stats_percentile(hist, nbuckets, total, 50),
+            res_stats_percentile(hist, nbuckets, total, 90),
+            res_stats_percentile(hist, nbuckets, total, 99));
+
+    for (i = 0; i < nbuckets; i++) {
+        if (hist[i] == 0)
+            continue;
+        if (i < nbuckets - 1)
+            fprintf(fp, "    %10ld - %10ldus  %llu\n",
+                    (i == 0) ? 0L : (1L << i), (2L << i),
+                    (unsigned long long) hist[i]);
+        else
+            fprintf(fp, "    %10ld -           us  %llu\n", (1L << i),
+                    (unsigned long long) hist[i]);
+    }
+}
+
 
 void
 my_free(void *p, char *filename, int lineno)
@@ -14,6 +14,11 @@
 #include "val_assertion.h"
 #include "val_parse.h"
 
+#ifdef VAL_ASYNC_POLLFD
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 extern void res_print_ea(struct expected_arrival *ea);
 extern const char *p_query_status(int err);
 
@@ -298,6 +303,7 @@ init_query_chain_node(struct val_query_chain *q)
     q->qc_respondent_server = NULL;
     q->qc_respondent_server_options = 0;
     q->qc_trans_id = -1;
+    timerclear(&q->qc_sent_tv);
     q->qc_ea = NULL;
     q->qc_ans = NULL;
     q->qc_proof = NULL;
@@ -347,13 +353,22 @@ _release_query_chain_structure(struct val_query_chain *queries)
     }
 }
 
+#ifndef VAL_NO_ASYNC
+static void     _as_forget_query(val_context_t *context,
+                                 struct val_query_chain *qc);
+#endif
+
 void
-free_query_chain_structure(struct val_query_chain *queries)
+free_query_chain_structure(val_context_t *context,
+                           struct val_query_chain *queries)
 {
     if (NULL == queries)
        return;
 
     val_log(NULL, LOG_DEBUG, "qc %p free", queries);
+#ifndef VAL_NO_ASYNC
+    _as_forget_query(context, queries);
+#endif
     _release_query_chain_structure(queries);
     FREE(queries);
 }
@@ -441,9 +456,11 @@ add_to_query_chain(val_context_t *context, u_char * name_n,
                 old = temp;
                 temp = temp->qc_next;
                 old->qc_next = NULL;
-                free_query_chain_structure(old);
-            } else
+                free_query_chain_structure(context, old);
+            } else {
+                prev = temp;
                 temp = temp->qc_next;
+            }
             continue;
         }
 
@@ -527,6 +544,8 @@ add_to_query_chain(val_context_t *context, u_char * name_n,
     temp->qc_class_h = class_h;
     temp->qc_flags = flags | sticky_flags;
     temp->qc_last_sent = -1;
+    temp->qc_waiters = NULL;
+    temp->qc_fdmapped = 0;
 
     init_query_chain_node(temp);
     
@@ -577,7 +596,7 @@ remove_and_free_query_chain(val_context_t *context,
         temp->qc_next = NULL;
     }
 
-    free_query_chain_structure(temp);
+    free_query_chain_structure(context, temp);
     temp = NULL;
 
     return VAL_NO_ERROR;
@@ -764,10 +783,8 @@ find_dlv_trust_point(val_context_t * ctx, u_char * zone_n,
                  u_char ** dlv_tp, u_char ** dlv_target, u_int32_t *ttl_x)
 {
 
-    policy_entry_t *ta_pol, *ta_cur, *ta_tmphead;
-    size_t       name_len;
-    u_char       *zp = zone_n;
-    u_char       *ep;
+    policy_entry_t *ta_cur;
+    struct policy_match pm;
 
     /*
      * This function should never be called with a NULL zone_n, but still... 
@@ -778,66 +795,36 @@ find_dlv_trust_point(val_context_t * ctx, u_char * zone_n,
     *dlv_tp = NULL;
     *dlv_target = NULL;
 
-    name_len = wire_name_length(zp);
-    ep = zp + name_len;
-    
-    RETRIEVE_POLICY(ctx, P_DLV_TRUST_POINTS, ta_pol);
-    
-    if (ta_pol == NULL) {
-        return VAL_NO_ERROR;
-    }
-
     /*
-     * skip longer names 
+     * the longest matching zone with a trust point wins 
      */
-    for (ta_cur = ta_pol;
-         ta_cur && (wire_name_length(ta_cur->zone_n) > name_len);
-         ta_cur = ta_cur->next);
+    for (ta_cur = policy_match_first(ctx, P_DLV_TRUST_POINTS, zone_n, &pm);
+         ta_cur; ta_cur = policy_match_next(&pm)) {
 
-    /*
-     * for the remaining nodes, see if there is any hope 
-     */
-    ta_tmphead = ta_cur;
-    while (zp < ep) {
-        for (ta_cur = ta_tmphead; ta_cur; ta_cur = ta_cur->next) {
-            if (wire_name_length(zp) < wire_name_length(ta_cur->zone_n))
-                /** next time look from this point */
-                ta_tmphead = ta_cur->next;
-
-            if (namecmp(ta_cur->zone_n, zp) == 0) {
-                /** We have hope */
-                size_t len;
-
-                u_char *tp = ((struct dlv_policy *)(ta_cur->pol))->trust_point;
-                if (!tp)
-                    continue;
-                len = wire_name_length(tp);
-                *dlv_tp = (u_char *) MALLOC(len * sizeof(u_char));
-                if (*dlv_tp == NULL)
-                    return VAL_OUT_OF_MEMORY;
-                memcpy(*dlv_tp, tp, len);
-    
-                len = wire_name_length(zp);
-                *dlv_target =
-                    (u_char *) MALLOC(len * sizeof(u_char));
-                if (*dlv_target == NULL) {
-                    FREE(*dlv_tp);
-                    *dlv_tp = NULL;
-                    return VAL_OUT_OF_MEMORY;
-                }
-                memcpy(*dlv_target, zp, len);
-
-                if (ta_cur->exp_ttl > 0)
-                    *ttl_x = ta_cur->exp_ttl;
-
-                return VAL_NO_ERROR;
-            }
+        size_t len;
+        u_char *tp = ((struct dlv_policy *)(ta_cur->pol))->trust_point;
+        if (!tp)
+            continue;
+        len = wire_name_length(tp);
+        *dlv_tp = (u_char *) MALLOC(len * sizeof(u_char));
+        if (*dlv_tp == NULL)
+            return VAL_OUT_OF_MEMORY;
+        memcpy(*dlv_tp, tp, len);
+
+        len = wire_name_length(pm.pm_zone);
+        *dlv_target =
+            (u_char *) MALLOC(len * sizeof(u_char));
+        if (*dlv_target == NULL) {
+            FREE(*dlv_tp);
+            *dlv_tp = NULL;
+            return VAL_OUT_OF_MEMORY;
         }
+        memcpy(*dlv_target, pm.pm_zone, len);
 
-        /*
-         * trim the top label from our candidate zone 
-         */
-        zp += (int) zp[0] + 1;
+        if (ta_cur->exp_ttl > 0)
+            *ttl_x = ta_cur->exp_ttl;
+
+        return VAL_NO_ERROR;
     }
 
     return VAL_NO_ERROR;
@@ -888,9 +875,8 @@ int
 get_zse(val_context_t * ctx, u_char * name_n, u_int32_t flags, 
         u_int16_t *status, u_char ** match_ptr, u_int32_t *ttl_x)
 {
-    policy_entry_t *zse_pol, *zse_cur;
-    size_t          name_len;
-    u_char         *p;
+    policy_entry_t *zse_cur;
+    struct policy_match pm;
     int             retval;
 
     /*
@@ -905,62 +891,38 @@ get_zse(val_context_t * ctx, u_char * name_n, u_int32_t flags,
 
     retval = VAL_NO_ERROR;
 
-    name_len = wire_name_length(name_n);
-
     /*
      * Check if the zone is trusted 
      */
     
-    RETRIEVE_POLICY(ctx, P_ZONE_SECURITY_EXPECTATION, zse_pol);
-    if (zse_pol != NULL) {
-        for (zse_cur = zse_pol;
-             zse_cur && (wire_name_length(zse_cur->zone_n) > name_len);
-             zse_cur = zse_cur->next);
+    /*
+     * Matches are returned longest first 
+     */
+    for (zse_cur = policy_match_first(ctx, P_ZONE_SECURITY_EXPECTATION,
+                                      name_n, &pm);
+         zse_cur; zse_cur = policy_match_next(&pm)) {
 
-        /*
-         * for all zones which are shorter or as long, do a strstr 
-         */
-        /*
-         * Because of the ordering, the longest match is found first 
-         */
-        for (; zse_cur; zse_cur = zse_cur->next) {
-            int             root_zone = 0;
-            if (!namecmp(zse_cur->zone_n, (const u_char *) ""))
-                root_zone = 1;
-            else {
-                /*
-                 * Find the last occurrence of zse_cur->zone_n in name_n 
-                 */
-                p = name_n;
-                while (p && (*p != '\0')) {
-                    if (!namecmp(p, zse_cur->zone_n))
-                        break;
-                    p = p + *p + 1;
-                }
-            }
+        if (zse_cur->pol) {
+            struct zone_se_policy *pol = 
+                (struct zone_se_policy *)(zse_cur->pol);
 
-            if ((root_zone || (!namecmp(p, zse_cur->zone_n))) && zse_cur->pol) {
-                struct zone_se_policy *pol = 
-                    (struct zone_se_policy *)(zse_cur->pol);
-    
-                if (match_ptr) {
-                    *match_ptr = namename(name_n, zse_cur->zone_n);
-                }
+            if (match_ptr) {
+                *match_ptr = pm.pm_zone;
+            }
 
-                if (zse_cur->exp_ttl > 0)
-                    *ttl_x = zse_cur->exp_ttl;
-                
-                if (pol->trusted == ZONE_SE_UNTRUSTED) {
-                    *status = VAL_AC_UNTRUSTED_ZONE;
-                    goto done;
-                } else if (pol->trusted == ZONE_SE_DO_VAL) {
-                    *status = VAL_AC_WAIT_FOR_TRUST;
-                    goto done;
-                } else {
-                    /** ZONE_SE_IGNORE */
-                    *status = VAL_AC_IGNORE_VALIDATION;
-                    goto done;
-                }
+            if (zse_cur->exp_ttl > 0)
+                *ttl_x = zse_cur->exp_ttl;
+            
+            if (pol->trusted == ZONE_SE_UNTRUSTED) {
+                *status = VAL_AC_UNTRUSTED_ZONE;
+                goto done;
+            } else if (pol->trusted == ZONE_SE_DO_VAL) {
+                *status = VAL_AC_WAIT_FOR_TRUST;
+                goto done;
+            } else {
+                /** ZONE_SE_IGNORE */
+                *status = VAL_AC_IGNORE_VALIDATION;
+                goto done;
             }
         }
     }
@@ -978,10 +940,9 @@ find_trust_point(val_context_t * ctx, u_char * zone_n,
                  u_char ** matched_zone, u_int32_t *ttl_x)
 {
 
-    policy_entry_t *ta_pol, *ta_cur, *ta_tmphead;
-    size_t       name_len;
-    u_char       *zp = zone_n;
-    u_char       *ep;
+    policy_entry_t *ta_cur;
+    struct policy_match pm;
+    size_t       len;
 
     /*
      * This function should never be called with a NULL zone_n, but still... 
@@ -992,52 +953,20 @@ find_trust_point(val_context_t * ctx, u_char * zone_n,
     *matched_zone = NULL;
     *ttl_x = 0;
 
-    name_len = wire_name_length(zp);
-    ep = zp + name_len;
-    
-    RETRIEVE_POLICY(ctx, P_TRUST_ANCHOR, ta_pol);
-    
-    if (ta_pol == NULL) {
+    ta_cur = policy_match_first(ctx, P_TRUST_ANCHOR, zone_n, &pm);
+    if (ta_cur == NULL) {
         return VAL_NO_ERROR;
     }
 
-    /*
-     * skip longer names 
-     */
-    for (ta_cur = ta_pol;
-         ta_cur && (wire_name_length(ta_cur->zone_n) > name_len);
-         ta_cur = ta_cur->next);
-
-    /*
-     * for the remaining nodes, see if there is any hope 
-     */
-    ta_tmphead = ta_cur;
-    while (zp < ep) {
-        for (ta_cur = ta_tmphead; ta_cur; ta_cur = ta_cur->next) {
-            if (wire_name_length(zp) < wire_name_length(ta_cur->zone_n))
-                /** next time look from this point */
-                ta_tmphead = ta_cur->next;
-
-            if (namecmp(ta_cur->zone_n, zp) == 0) {
-                size_t len;
-                len = wire_name_length(zp);
-                /** We have hope */
-                *matched_zone =
-                   (u_char *) MALLOC( len * sizeof(u_char));
-                if (*matched_zone == NULL) {
-                    return VAL_OUT_OF_MEMORY;
-                }
-                memcpy(*matched_zone, zp, len);
-                if (ta_cur->exp_ttl > 0)
-                    *ttl_x = ta_cur->exp_ttl;
-                return VAL_NO_ERROR;
-            }
-        }
-        /*
-         * trim the top label from our candidate zone 
-         */
-        zp += (int) zp[0] + 1;
+    len = wire_name_length(pm.pm_zone);
+    *matched_zone =
+       (u_char *) MALLOC( len * sizeof(u_char));
+    if (*matched_zone == NULL) {
+        return VAL_OUT_OF_MEMORY;
     }
+    memcpy(*matched_zone, pm.pm_zone, len);
+    if (ta_cur->exp_ttl > 0)
+        *ttl_x = ta_cur->exp_ttl;
 
     return VAL_NO_ERROR;
 }
@@ -1046,9 +975,8 @@ static int
 is_trusted_key(val_context_t * ctx, u_char * zone_n, struct rrset_rr *key, 
                val_astatus_t * status, u_int32_t flags, u_int32_t *ttl_x)
 {
-    policy_entry_t *ta_pol, *ta_cur, *ta_tmphead;
-    size_t       name_len;
-    u_char       *ep; 
+    policy_entry_t *ta_cur;
+    struct policy_match pm;
     val_dnskey_rdata_t dnskey, *dnskey_p = &dnskey;
     struct rrset_rr  *curkey;
     u_char       *zp;
@@ -1068,76 +996,61 @@ is_trusted_key(val_context_t * ctx, u_char * zone_n, struct rrset_rr *key,
      */
     *status = VAL_AC_NO_LINK;
 
-    name_len = wire_name_length(zp);
-    ep = zp + name_len;
-
-    RETRIEVE_POLICY(ctx, P_TRUST_ANCHOR, ta_pol);
-    if (ta_pol == NULL) {
+    if (ctx == NULL || ctx->e_pol[P_TRUST_ANCHOR] == NULL) {
         val_log(ctx, LOG_INFO, "is_trusted_key(): No trust anchor policy available"); 
         *status = VAL_AC_NO_LINK;
         return VAL_NO_ERROR;
     }
 
     /*
-     * skip longer names 
-     */
-    for (ta_cur = ta_pol;
-         ta_cur && (wire_name_length(ta_cur->zone_n) > name_len);
-         ta_cur = ta_cur->next);
-
-    /*
-     * for the remaining nodes, if the length of the zones are 
-     * the same, look for an exact match 
+     * look at the trust anchors for exactly this zone first 
      */
     ta_specified = 0;
     found = 0;
-    for (; ta_cur &&
-         (wire_name_length(ta_cur->zone_n) == name_len);
-         ta_cur = ta_cur->next) {
+    for (ta_cur = policy_match_first(ctx, P_TRUST_ANCHOR, zp, &pm);
+         ta_cur && pm.pm_zone == zp;
+         ta_cur = policy_match_next(&pm)) {
 
-        if (!namecmp(ta_cur->zone_n, zp)) {
-
-            ta_specified = 1;
-            for (curkey = key; curkey; curkey = curkey->rr_next) {
-                /*
-                 * parse key and compare
-                 */
-                if (VAL_NO_ERROR != val_parse_dnskey_rdata(curkey->rr_rdata,
-                                       curkey->rr_rdata_length, &dnskey)) {
-                    val_log(ctx, LOG_INFO, "is_trusted_key(): could not parse DNSKEY");
-                    continue;
-                }
+        ta_specified = 1;
+        for (curkey = key; curkey; curkey = curkey->rr_next) {
+            /*
+             * parse key and compare
+             */
+            if (VAL_NO_ERROR != val_parse_dnskey_rdata(curkey->rr_rdata,
+                                   curkey->rr_rdata_length, &dnskey)) {
+                val_log(ctx, LOG_INFO, "is_trusted_key(): could not parse DNSKEY");
+                continue;
+            }
 
-                if (ta_cur->pol) {
-                    struct trust_anchor_policy *pol = 
-                        (struct trust_anchor_policy *)(ta_cur->pol);
-
-                    val_astatus_t tmp_status;
-                        /* check if the given dnskey matches the configured dnskey */
-                    if ((pol->publickey &&
-                            DNSKEY_MATCHES_DNSKEY(dnskey_p, pol->publickey)) ||
-                        /* check if the given dnskey matches the configured ds */
-                        (pol->ds &&
-                            DNSKEY_MATCHES_DS(ctx, &dnskey, pol->ds,
-                                               zp, curkey, &tmp_status))) {
-
-                        char            name_p[NS_MAXDNAME];
-                        if (-1 == ns_name_ntop(zp, name_p, sizeof(name_p)))
-                            snprintf(name_p, sizeof(name_p), "unknown/error");
-                        curkey->rr_status = VAL_AC_TRUST_POINT;
-                        if (ta_cur->exp_ttl > 0)
-                            *ttl_x = ta_cur->exp_ttl;
-                        val_log(ctx, LOG_DEBUG, "is_trusted_key(): key %s is trusted", name_p);
-                        found = 1;
-                    } 
-                }
-                if (dnskey.public_key != NULL) {
-                    FREE(dnskey.public_key);
-                    dnskey.public_key = NULL;
-                }
+            if (ta_cur->pol) {
+                struct trust_anchor_policy *pol = 
+                    (struct trust_anchor_policy *)(ta_cur->pol);
+
+                val_astatus_t tmp_status;
+                    /* check if the given dnskey matches the configured dnskey */
+                if ((pol->publickey &&
+                        DNSKEY_MATCHES_DNSKEY(dnskey_p, pol->publickey)) ||
+                    /* check if the given dnskey matches the configured ds */
+                    (pol->ds &&
+                        DNSKEY_MATCHES_DS(ctx, &dnskey, pol->ds,
+                                           zp, curkey, &tmp_status))) {
+
+                    char            name_p[NS_MAXDNAME];
+                    if (-1 == ns_name_ntop(zp, name_p, sizeof(name_p)))
+                        snprintf(name_p, sizeof(name_p), "unknown/error");
+                    curkey->rr_status = VAL_AC_TRUST_POINT;
+                    if (ta_cur->exp_ttl > 0)
+                        *ttl_x = ta_cur->exp_ttl;
+                    val_log(ctx, LOG_DEBUG, "is_trusted_key(): key %s is trusted", name_p);
+                    found = 1;
+                } 
+            }
+            if (dnskey.public_key != NULL) {
+                FREE(dnskey.public_key);
+                dnskey.public_key = NULL;
             }
-            /* we will continue as long as there is a trust anchor above this level */
         }
+        /* we will continue as long as there is a trust anchor above this level */
     }
 
     if (ta_specified) {
@@ -1165,24 +1078,12 @@ is_trusted_key(val_context_t * ctx, u_char * zone_n, struct rrset_rr *key,
     }
 
     /*
-     * for the remaining nodes, see if there is any hope 
+     * anything left is a trust anchor for an enclosing zone; 
+     * there is hope 
      */
-    ta_tmphead = ta_cur;
-    while (zp < ep) {
-        /*
-         * trim the top label from our candidate zone 
-         */
-        zp += zp[0] + 1;
-        for (ta_cur = ta_tmphead; ta_cur; ta_cur = ta_cur->next) {
-            if (wire_name_length(zp) < wire_name_length(ta_cur->zone_n))
-                /** next time look from this point */
-                ta_tmphead = ta_cur->next;
-
-            if (namecmp(ta_cur->zone_n, zp) == 0) {
-                *status = VAL_AC_WAIT_FOR_TRUST;
-                return VAL_NO_ERROR;
-            }
-        }
+    if (ta_cur != NULL) {
+        *status = VAL_AC_WAIT_FOR_TRUST;
+        return VAL_NO_ERROR;
     }
 
 #ifdef LIBVAL_DLV
@@ -2646,75 +2547,40 @@ compute_nsec3_hash(val_context_t * ctx, u_char * qname_n,
                    u_char saltlen, u_char * salt,
                    size_t * b32_hashlen, u_char ** b32_hash, u_int32_t *ttl_x)
 {
-    int             name_len;
-    policy_entry_t *pol, *cur;
-    u_char         *p;
-    char            name_p[NS_MAXDNAME];
+    policy_entry_t *cur;
+    struct policy_match pm;
     size_t          hashlen;
     u_char         *hash;
+    struct timeval  crypto_tv;
 
     if (alg != ALG_NSEC3_HASH_SHA1)
         return NULL;
 
-    pol = NULL;
-
-    if (soa_name_n != NULL) {
-        name_len = wire_name_length(soa_name_n);
-        RETRIEVE_POLICY(ctx, P_NSEC3_MAX_ITER, pol);
-
-        if (pol != NULL) {
-            /*
-             * go past longer names 
-             */
-            for (cur = pol;
-                 cur && (wire_name_length(cur->zone_n) > name_len);
-                 cur = cur->next);
-    
-            /*
-             * for all zones which are shorter or as long, do a strstr 
-             */
-            /*
-             * Because of the ordering, the longest match is found first 
-             */
-            for (; cur; cur = cur->next) {
-                int             root_zone = 0;
-                if (!namecmp(cur->zone_n, (const u_char *) ""))
-                    root_zone = 1;
-                else {
-                    /*
-                     * Find the last occurrence of cur->zone_n in soa_name_n 
-                     */
-                    p = soa_name_n;
-                    while (p && (*p != '\0')) {
-                        if (!namecmp(p, cur->zone_n))
-                            break;
-                        p = p + *p + 1;
-                    }
-                }
-    
-                if (root_zone || !namecmp(p, cur->zone_n)) {
-                    if (-1 == ns_name_ntop(soa_name_n, name_p, sizeof(name_p)))
-                        snprintf(name_p, sizeof(name_p), "unknown/error");
-    
-                    if (cur->pol != NULL) {
-                        int nsec3_pol_iter;
-
-                        if (cur->exp_ttl > 0)
-                            *ttl_x = cur->exp_ttl;
-                        nsec3_pol_iter = ((struct nsec3_max_iter_policy *)(cur->pol))->iter;
-                        
-                        if (nsec3_pol_iter > 0 && nsec3_pol_iter < iter) 
-                            return NULL;
-                    }
-                    break;
-                }
-            }
+    /*
+     * only the most specific policy counts 
+     */
+    if (soa_name_n != NULL &&
+        NULL != (cur = policy_match_first(ctx, P_NSEC3_MAX_ITER,
+                                          soa_name_n, &pm))) {
+        if (cur->pol != NULL) {
+            int nsec3_pol_iter;
+
+            if (cur->exp_ttl > 0)
+                *ttl_x = cur->exp_ttl;
+            nsec3_pol_iter = ((struct nsec3_max_iter_policy *)(cur->pol))->iter;
+            
+            if (nsec3_pol_iter > 0 && nsec3_pol_iter < iter) 
+                return NULL;
         }
     }
 
-    if (NULL ==
-        nsec3_sha_hash_compute(qname_n, salt, (size_t)saltlen, 
-                               (size_t)iter, &hash, &hashlen))
+    timerclear(&crypto_tv);
+    VAL_STATS_COUNT(VAL_STAT_NSEC3_HASHES, 1);
+    VAL_STATS_START(crypto_tv);
+    hash = nsec3_sha_hash_compute(qname_n, salt, (size_t)saltlen,
+                                  (size_t)iter, &hash, &hashlen);
+    VAL_STATS_STOP(VAL_STAGE_CRYPTO, crypto_tv);
+    if (NULL == hash)
         return NULL;
 
     base32hex_encode(hash, hashlen, b32_hash, b32_hashlen);
@@ -4243,58 +4109,31 @@ donefornow:
 static int
 is_pu_trusted(val_context_t *ctx, u_char *name_n, u_int32_t *ttl_x)
 {
-    policy_entry_t *pu_pol, *pu_cur;
-    u_char       *p;
+    policy_entry_t *pu_cur;
+    struct policy_match pm;
     char         name_p[NS_MAXDNAME];
-    size_t       name_len;
 
-    RETRIEVE_POLICY(ctx, P_PROV_INSECURE, pu_pol);
-    if (pu_pol) {
-
-        name_len = wire_name_length(name_n);
-        
-        for (pu_cur = pu_pol;
-             pu_cur && (wire_name_length(pu_cur->zone_n) > name_len);
-             pu_cur = pu_cur->next);
-
-        /*
-         * for all zones which are shorter or as long, do a strstr 
-         */
-        /*
-         * Because of the ordering, the longest match is found first 
-         */
-        for (; pu_cur; pu_cur = pu_cur->next) {
-            int             root_zone = 0;
-            if (!namecmp(pu_cur->zone_n, (const u_char *) ""))
-                root_zone = 1;
-            else {
-                /*
-                 * Find the last occurrence of zse_cur->zone_n in name_n 
-                 */
-                p = name_n;
-                while (p && (*p != '\0')) {
-                    if (!namecmp(p, pu_cur->zone_n))
-                        break;
-                    p = p + *p + 1;
-                }
-            }
-
-            if ((root_zone || (!namecmp(p, pu_cur->zone_n))) && pu_cur->pol) {
-                struct prov_insecure_policy *pol =
-                    (struct prov_insecure_policy *)(pu_cur->pol);
-                if (-1 == ns_name_ntop(name_n, name_p, sizeof(name_p)))
-                    snprintf(name_p, sizeof(name_p), "unknown/error");
-                if (pu_cur->exp_ttl > 0)
-                    *ttl_x = pu_cur->exp_ttl;
+    /*
+     * Matches are returned longest first 
+     */
+    for (pu_cur = policy_match_first(ctx, P_PROV_INSECURE, name_n, &pm);
+         pu_cur; pu_cur = policy_match_next(&pm)) {
 
-                if (pol->trusted == ZONE_PU_UNTRUSTED) {
-                    val_log(ctx, LOG_INFO, "is_pu_trusted(): zone %s provable insecure status is not trusted",
-                            name_p);
-                    return 0;
-                } else { 
-                    val_log(ctx, LOG_INFO, "is_pu_trusted(): zone %s provably insecure status is trusted", name_p);
-                    return 1;
-                }
+        if (pu_cur->pol) {
+            struct prov_insecure_policy *pol =
+                (struct prov_insecure_policy *)(pu_cur->pol);
+            if (-1 == ns_name_ntop(name_n, name_p, sizeof(name_p)))
+                snprintf(name_p, sizeof(name_p), "unknown/error");
+            if (pu_cur->exp_ttl > 0)
+                *ttl_x = pu_cur->exp_ttl;
+
+            if (pol->trusted == ZONE_PU_UNTRUSTED) {
+                val_log(ctx, LOG_INFO, "is_pu_trusted(): zone %s provable insecure status is not trusted",
+                        name_p);
+                return 0;
+            } else { 
+                val_log(ctx, LOG_INFO, "is_pu_trusted(): zone %s provably insecure status is trusted", name_p);
+                return 1;
             }
         }
     }
@@ -5433,6 +5272,9 @@ _ask_cache_one(val_context_t * context, struct queries_for_query **queries,
         (retval = get_cached_rrset(next_q->qfq_query, &response)))
         return retval;
 
+    if (response)
+        VAL_STATS_COUNT(VAL_STAT_CACHE_HITS, 1);
+
     if (!response) {
         if (next_q->qfq_query->qc_state > Q_SENT)
             *data_received = 1;
@@ -6411,13 +6253,17 @@ val_resolve_and_check(val_context_t * ctx,
     int done = 0;
     int data_received;
     int data_missing;
+    int glue_resumed;
     val_context_t  *context = NULL;
     u_char domain_name_n[NS_MAXCDNAME];
     u_int16_t q_class, q_type;
+    val_query_stats_t qstats, *prev_qstats = NULL;
     
     if ((results == NULL) || (domain_name == NULL))
         return VAL_BAD_ARGUMENT;
 
+    timerclear(&qstats.vqs_start);
+
     val_log(NULL, LOG_DEBUG, __FUNCTION__);
     /* 
      * Sanity check the values of class and type 
@@ -6443,6 +6289,11 @@ val_resolve_and_check(val_context_t * ctx,
     context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
     if (context == NULL)
         return VAL_INTERNAL_ERROR;
+
+    if (_val_stats_on) {
+        val_stats_start(&qstats);
+        prev_qstats = val_stats_attach(&qstats);
+    }
   
     CTX_LOCK_ACACHE(context);
    
@@ -6494,7 +6345,8 @@ val_resolve_and_check(val_context_t * ctx,
 
 
         if (VAL_NO_ERROR !=
-            (retval = fix_glue(context, &queries, &data_missing)))
+            (retval = fix_glue(context, &queries, &data_missing,
+                               &glue_resumed)))
             goto err;
         
         if (data_received || !data_missing) {
@@ -6514,9 +6366,10 @@ val_resolve_and_check(val_context_t * ctx,
         } 
         
         /*
-         * check if more queries have been added 
+         * check if more queries have been added, or if a referral
+         * can continue now that its glue has arrived
          */
-        if (last_q != queries) {
+        if (last_q != queries || glue_resumed) {
             /*
              * There are new queries to send out -- do this first; 
              * we may also find this data in the cache 
@@ -6574,6 +6427,11 @@ val_resolve_and_check(val_context_t * ctx,
     w_results = NULL;
     free_qfq_chain(context, queries);
 
+    if (timerisset(&qstats.vqs_start)) {
+        val_stats_detach(prev_qstats);
+        val_stats_finish(&qstats, domain_name, class_h, type_h);
+    }
+
     return retval;
 }
 
@@ -6663,6 +6521,432 @@ val_does_not_exist(val_status_t status)
  *
  ****************************************************************************/
 #ifndef VAL_NO_ASYNC
+/*
+ * Request scheduling.
+ *
+ * Rather than checking every pending request each time
+ * val_async_check_wait() is called, the context keeps track of what
+ * each request is waiting for:
+ *
+ *  - as_fdmap maps the socket of an in flight query to the query, and
+ *    the query's qc_waiters list holds the requests that wait on it;
+ *  - as_timers is a heap of requests, ordered by the next retry or
+ *    cancel time of their queries;
+ *  - as_ready is a FIFO of requests that need to be checked, either
+ *    because one of their sockets became readable, an alarm went off,
+ *    or nothing they could wait on is in flight.
+ *
+ * Requests that have completed move from as_list to as_done, which is
+ * drained by _handle_completed(). All of this is protected by
+ * CTX_LOCK_ACACHE.
+ */
+
+/* sockets per query that are mapped; further ones are polled */
+#define VAL_AS_MAX_QC_FDS  16
+
+/* epoll events handled per val_async_check_wait() call */
+#define VAL_AS_MAX_EVENTS  128
+
+#ifdef VAL_ASYNC_POLLFD
+/*
+ * The pollable descriptor returned by val_async_poll_info() is an epoll
+ * descriptor watching the sockets in as_fdmap, plus an eventfd that is
+ * signalled when requests become ready or complete, or when the next
+ * alarm moves closer.
+ */
+static void
+_as_signal(val_context_t *context)
+{
+    u_int64_t       one = 1;
+
+    if (context->as_eventfd < 0 || context->as_signalled)
+        return;
+
+    if (write(context->as_eventfd, &one, sizeof(one)) == sizeof(one))
+        context->as_signalled = 1;
+}
+
+/* reset the eventfd once there is nothing left to do */
+static void
+_as_unsignal(val_context_t *context)
+{
+    u_int64_t       val;
+
+    if (!context->as_signalled || context->as_ready || context->as_done)
+        return;
+
+    if (read(context->as_eventfd, &val, sizeof(val)) == sizeof(val) ||
+        errno == EAGAIN)
+        context->as_signalled = 0;
+}
+
+static void
+_as_poll_add(val_context_t *context, int fd)
+{
+    struct epoll_event ev;
+
+    if (context->as_pollfd < 0)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(context->as_pollfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+        errno != EEXIST)
+        val_log(context, LOG_WARNING,
+                "_as_poll_add(): cannot watch fd %d: %s", fd,
+                strerror(errno));
+}
+
+static void
+_as_poll_del(val_context_t *context, int fd)
+{
+    if (context->as_pollfd >= 0)
+        epoll_ctl(context->as_pollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+#else
+#define _as_signal(context)
+#define _as_unsignal(context)
+#define _as_poll_add(context, fd)
+#define _as_poll_del(context, fd)
+#endif
+
+/* add request to the ready queue, unless already there or completed */
+static void
+_as_ready(val_context_t *context, val_async_status *as)
+{
+    if (as->val_as_flags & (VAL_AS_READY | VAL_AS_COMPLETED))
+        return;
+
+    if (NULL == context->as_ready)
+        _as_signal(context);
+    as->val_as_flags |= VAL_AS_READY;
+    as->val_as_ready_next = NULL;
+    if (context->as_ready_tail)
+        context->as_ready_tail->val_as_ready_next = as;
+    else
+        context->as_ready = as;
+    context->as_ready_tail = as;
+}
+
+static void
+_as_unready(val_context_t *context, val_async_status *as)
+{
+    val_async_status *prev = NULL, *curr;
+
+    if (!(as->val_as_flags & VAL_AS_READY))
+        return;
+
+    for (curr = context->as_ready; curr;
+         prev = curr, curr = curr->val_as_ready_next) {
+        if (curr != as)
+            continue;
+        if (prev)
+            prev->val_as_ready_next = curr->val_as_ready_next;
+        else
+            context->as_ready = curr->val_as_ready_next;
+        if (context->as_ready_tail == curr)
+            context->as_ready_tail = prev;
+        break;
+    }
+    as->val_as_ready_next = NULL;
+    as->val_as_flags &= ~VAL_AS_READY;
+}
+
+/*
+ * timer heap helpers; val_as_timer is the heap index + 1, or 0 if the
+ * request is not in the heap.
+ */
+static void
+_as_timer_place(val_context_t *context, int i, val_async_status *as)
+{
+    context->as_timers[i] = as;
+    as->val_as_timer = i + 1;
+}
+
+static void
+_as_timer_sift(val_context_t *context, int i)
+{
+    val_async_status **heap = context->as_timers;
+    val_async_status *as = heap[i];
+    int             child;
+
+    /* up */
+    while (i > 0 &&
+           timercmp(&as->val_as_next_evt,
+                    &heap[(i - 1) / 2]->val_as_next_evt, <)) {
+        _as_timer_place(context, i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    /* down */
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= context->as_timers_count)
+            break;
+        if (child + 1 < context->as_timers_count &&
+            timercmp(&heap[child + 1]->val_as_next_evt,
+                     &heap[child]->val_as_next_evt, <))
+            ++child;
+        if (!timercmp(&heap[child]->val_as_next_evt,
+                      &as->val_as_next_evt, <))
+            break;
+        _as_timer_place(context, i, heap[child]);
+        i = child;
+    }
+    _as_timer_place(context, i, as);
+}
+
+static void
+_as_timer_remove(val_context_t *context, val_async_status *as)
+{
+    int             i = as->val_as_timer - 1;
+
+    if (i < 0)
+        return;
+
+    as->val_as_timer = 0;
+    if (--context->as_timers_count > i) {
+        _as_timer_place(context, i,
+                        context->as_timers[context->as_timers_count]);
+        _as_timer_sift(context, i);
+    }
+}
+
+static int
+_as_timer_set(val_context_t *context, val_async_status *as,
+              struct timeval *when)
+{
+    val_async_status **heap;
+    int             size;
+
+    memcpy(&as->val_as_next_evt, when, sizeof(struct timeval));
+    if (as->val_as_timer) {
+        _as_timer_sift(context, as->val_as_timer - 1);
+        if (1 == as->val_as_timer)
+            _as_signal(context);
+        return VAL_NO_ERROR;
+    }
+
+    if (context->as_timers_count == context->as_timers_size) {
+        size = context->as_timers_size ? context->as_timers_size * 2 : 64;
+        heap = (val_async_status **) MALLOC(size * sizeof(*heap));
+        if (NULL == heap)
+            return VAL_OUT_OF_MEMORY;
+        if (context->as_timers) {
+            memcpy(heap, context->as_timers,
+                   context->as_timers_count * sizeof(*heap));
+            FREE(context->as_timers);
+        }
+        context->as_timers = heap;
+        context->as_timers_size = size;
+    }
+
+    _as_timer_place(context, context->as_timers_count++, as);
+    _as_timer_sift(context, as->val_as_timer - 1);
+    if (1 == as->val_as_timer)
+        _as_signal(context); /* pollers need a new timeout */
+    return VAL_NO_ERROR;
+}
+
+/* remember that socket fd belongs to query qc */
+static int
+_as_fdmap_set(val_context_t *context, int fd, struct val_query_chain *qc)
+{
+    struct val_query_chain **map;
+    int             size;
+
+    if (fd < 0)
+        return VAL_BAD_ARGUMENT;
+
+    if (fd >= context->as_fdmap_size) {
+        size = context->as_fdmap_size ? context->as_fdmap_size : 64;
+        while (size <= fd)
+            size *= 2;
+        map = (struct val_query_chain **) MALLOC(size * sizeof(*map));
+        if (NULL == map)
+            return VAL_OUT_OF_MEMORY;
+        memset(map, 0, size * sizeof(*map));
+        if (context->as_fdmap) {
+            memcpy(map, context->as_fdmap,
+                   context->as_fdmap_size * sizeof(*map));
+            FREE(context->as_fdmap);
+        }
+        context->as_fdmap = map;
+        context->as_fdmap_size = size;
+    }
+
+    context->as_fdmap[fd] = qc;
+    qc->qc_fdmapped = 1;
+    /* the socket may be new even if the entry isn't */
+    _as_poll_add(context, fd);
+    return VAL_NO_ERROR;
+}
+
+static int
+_as_wait_on(val_async_status *as, struct val_query_chain *qc)
+{
+    struct val_async_waiter *w;
+
+    w = (struct val_async_waiter *) MALLOC(sizeof(struct val_async_waiter));
+    if (NULL == w)
+        return VAL_OUT_OF_MEMORY;
+
+    w->aw_as = as;
+    w->aw_qc = qc;
+    w->aw_as_next = as->val_as_waiting;
+    as->val_as_waiting = w;
+    w->aw_qc_next = qc->qc_waiters;
+    if (qc->qc_waiters)
+        qc->qc_waiters->aw_qc_prevp = &w->aw_qc_next;
+    w->aw_qc_prevp = &qc->qc_waiters;
+    qc->qc_waiters = w;
+
+    return VAL_NO_ERROR;
+}
+
+static void
+_as_unwait_all(val_async_status *as)
+{
+    struct val_async_waiter *w;
+
+    while (NULL != (w = as->val_as_waiting)) {
+        as->val_as_waiting = w->aw_as_next;
+        *w->aw_qc_prevp = w->aw_qc_next;
+        if (w->aw_qc_next)
+            w->aw_qc_next->aw_qc_prevp = w->aw_qc_prevp;
+        FREE(w);
+    }
+}
+
+/*
+ * drop all references to a query that is about to be freed
+ */
+static void
+_as_forget_query(val_context_t *context, struct val_query_chain *qc)
+{
+    struct val_async_waiter *w, **wp;
+    int             i;
+
+    while (NULL != (w = qc->qc_waiters)) {
+        qc->qc_waiters = w->aw_qc_next;
+        for (wp = &w->aw_as->val_as_waiting; *wp; wp = &(*wp)->aw_as_next) {
+            if (*wp == w) {
+                *wp = w->aw_as_next;
+                break;
+            }
+        }
+        FREE(w);
+    }
+
+    if (qc->qc_fdmapped && context) {
+        for (i = 0; i < context->as_fdmap_size; i++) {
+            if (context->as_fdmap[i] == qc)
+                context->as_fdmap[i] = NULL;
+        }
+    }
+    qc->qc_fdmapped = 0;
+}
+
+/*
+ * Register the sockets and alarms of a pending request's in flight
+ * queries, so that it gets checked again when one of them fires. If
+ * it isn't waiting on anything (or we can't keep track of what it is
+ * waiting on), it goes on the ready queue instead.
+ */
+static void
+_as_track(val_context_t *context, val_async_status *as)
+{
+    struct queries_for_query *qfq;
+    struct val_query_chain *qc;
+    struct timeval  when;
+    int             fds[VAL_AS_MAX_QC_FDS];
+    int             i, n, sockets = 0, poll = 0;
+
+    _as_unwait_all(as);
+
+    timerclear(&when);
+    for (qfq = as->val_as_queries; qfq; qfq = qfq->qfq_next) {
+        qc = qfq->qfq_query;
+        if (NULL == qc->qc_ea || (qc->qc_flags & VAL_QUERY_SKIP_RESOLVER))
+            continue;
+
+        if (VAL_NO_ERROR != _as_wait_on(as, qc)) {
+            poll = 1;
+            break;
+        }
+        res_async_query_select_info(qc->qc_ea, NULL, NULL, &when);
+
+        n = res_async_ea_sockets(qc->qc_ea, fds, VAL_AS_MAX_QC_FDS);
+        if (n > VAL_AS_MAX_QC_FDS) {
+            poll = 1;
+            n = VAL_AS_MAX_QC_FDS;
+        }
+        for (i = 0; i < n; i++) {
+            if (VAL_NO_ERROR != _as_fdmap_set(context, fds[i], qc))
+                poll = 1;
+        }
+        sockets += n;
+    }
+
+    if (!timerisset(&when))
+        _as_timer_remove(context, as);
+    else if (VAL_NO_ERROR != _as_timer_set(context, as, &when))
+        poll = 1;
+
+    if (poll || (0 == sockets && !timerisset(&when)))
+        _as_ready(context, as);
+}
+
+/* add a new request to the context async queries list */
+static void
+_context_as_add(val_context_t *context, val_async_status *as)
+{
+    as->val_as_next = context->as_list;
+    if (context->as_list)
+        context->as_list->val_as_prevp = &as->val_as_next;
+    as->val_as_prevp = &context->as_list;
+    context->as_list = as;
+    ++context->as_count;
+}
+
+/* unlink a request from as_list or as_done, whichever it is on */
+static void
+_context_as_unlink(val_context_t *context, val_async_status *as)
+{
+    if (NULL == as->val_as_prevp)
+        return;
+
+    *as->val_as_prevp = as->val_as_next;
+    if (as->val_as_next)
+        as->val_as_next->val_as_prevp = as->val_as_prevp;
+    as->val_as_next = NULL;
+    as->val_as_prevp = NULL;
+
+    if (as->val_as_flags & VAL_AS_COMPLETED)
+        as->val_as_flags &= ~VAL_AS_COMPLETED;
+    else
+        --context->as_count;
+}
+
+/* move a finished request to the done queue */
+static void
+_context_as_complete(val_context_t *context, val_async_status *as)
+{
+    _context_as_unlink(context, as);
+    _as_unready(context, as);
+    _as_timer_remove(context, as);
+    _as_unwait_all(as);
+
+    if (NULL == context->as_done)
+        _as_signal(context);
+    as->val_as_flags |= VAL_AS_COMPLETED;
+    as->val_as_next = context->as_done;
+    if (context->as_done)
+        context->as_done->val_as_prevp = &as->val_as_next;
+    as->val_as_prevp = &context->as_done;
+    context->as_done = as;
+}
+
 /*
  * remove asynchronous status from context async queries list.
  * caller must have CTX_LOCK_ACACHE.
@@ -6670,34 +6954,19 @@ val_does_not_exist(val_status_t status)
 static void
 _context_as_remove(val_context_t *context, val_async_status *as)
 {
-    val_async_status *prev, *curr = NULL;
-
     if ((NULL == context) || (NULL == as) ||
         (as->val_as_ctx && (as->val_as_ctx != context)))
         return;
 
     ASSERT_HAVE_AC_LOCK(context);
 
-    if (NULL == context->as_list)
-        return;
-
-    if (as == context->as_list) {
-        curr = context->as_list;
-        context->as_list = as->val_as_next;
-    } else {
-        prev = context->as_list;
-        curr = prev->val_as_next;
-        for (; curr; prev = curr, curr = curr->val_as_next) {
-            if (curr != as)
-                continue;
-            prev->val_as_next = curr->val_as_next;
-            break;
-        } /* for */
-    } /* as->val_as_ctx */
+    _as_unready(context, as);
+    _as_timer_remove(context, as);
+    _as_unwait_all(as);
 
-    if (curr) {
-        curr->val_as_next = NULL;
-        curr->val_as_ctx = NULL;
+    if (as->val_as_prevp) {
+        _context_as_unlink(context, as);
+        as->val_as_ctx = NULL;
     }
 }
 
@@ -6807,40 +7076,35 @@ _handle_completed(val_context_t *context)
 #ifndef VAL_NO_THREADS
     pthread_t                   self = pthread_self();
 #endif
-    val_async_status           *as, *next, *last = NULL, *completed = NULL;
+    val_async_status           *as, *next, *completed = NULL;
 
-    if ((NULL == context) || (NULL == context->as_list))
+    if ((NULL == context) || (NULL == context->as_done))
         return;
 
     CTX_LOCK_ACACHE(context);
 
-    /** find any completed requests and deal with them. */
-    for (as = context->as_list; as; as = next) {
+    /** take our completed requests off the done queue */
+    for (as = context->as_done; as; as = next) {
 
         next = as->val_as_next; /* save next in case we remove as */
 
-        if (! (as->val_as_flags & VAL_AS_DONE)
 #ifndef VAL_NO_THREADS
-            || (! (context->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
-                (! pthread_equal(self, as->val_as_tid)))
-#endif
-            ) {
-            last = as;
+        if (! (context->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
+            (! pthread_equal(self, as->val_as_tid)))
             continue;
-        }
+#endif
 
         /** remove from context */
         val_log(context, LOG_DEBUG, "as %p completed", as);
-        if (context->as_list == as)
-            context->as_list = as->val_as_next;
-        else
-            last->val_as_next = as->val_as_next;
+        _context_as_unlink(context, as);
 
         /** add to completed list for callbacks */
         as->val_as_next = completed;
         completed = as;
     }
 
+    _as_unsignal(context);
+
     CTX_UNLOCK_ACACHE(context);
 
     /*
@@ -6849,6 +7113,8 @@ _handle_completed(val_context_t *context)
     while (completed) {
         as = completed;
         completed = completed->val_as_next;
+        val_stats_finish(&as->val_as_stats, as->val_as_name,
+                         as->val_as_class, as->val_as_type);
         _call_callbacks(VAL_AS_EVENT_COMPLETED, as);
         as->val_as_ctx = NULL; /* we've already removed ourselves */
         _async_status_free(&as); /* no ctx, so no lock needed */
@@ -6873,6 +7139,8 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
     int data_missing = 1, more_data;
     u_char domain_name_n[NS_MAXCDNAME];
     u_int32_t tflags = 0;
+    val_query_stats_t *prev_qstats = NULL;
+    int qstats_attached = 0;
 
     if ((domain_name == NULL) || (async_status == NULL))
         return VAL_BAD_ARGUMENT;
@@ -6927,6 +7195,12 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
 
     as->val_as_ctx = context;
 
+    if (_val_stats_on) {
+        val_stats_start(&as->val_as_stats);
+        prev_qstats = val_stats_attach(&as->val_as_stats);
+        qstats_attached = 1;
+    }
+
     tflags = VAL_QFLAGS_USERMASK & (flags | VAL_QUERY_ASYNC | 
                 context->def_cflags | context->def_uflags);
 
@@ -7012,12 +7286,18 @@ val_async_submit(val_context_t * ctx,  const char * domain_name, int class_h,
         /* put in context async queries list */
         val_log(context,
                 LOG_DEBUG, "adding %s to context as_list", as->val_as_name);
-        as->val_as_next = context->as_list;
-        context->as_list = as;
+        _context_as_add(context, as);
+        if (as->val_as_flags & VAL_AS_DONE)
+            _context_as_complete(context, as);
+        else
+            _as_track(context, as);
     }
 
     CTX_UNLOCK_ACACHE(context);
 
+    if (qstats_attached)
+        val_stats_detach(prev_qstats);
+
     *async_status = as;
 
     return retval;
@@ -7036,7 +7316,10 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
     val_context_t              *context;
     struct timeval             closest_event, now;
     int retval, data_received, data_missing, done, checked = 0, as_remain;
+    int glue_resumed = 0;
     struct expected_arrival   *ea;
+    val_query_stats_t          *prev_qstats = NULL;
+    int                         qstats_attached = 0;
 #ifndef VAL_NO_THREADS
     pthread_t                   self = pthread_self();
 #endif
@@ -7059,6 +7342,11 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
             as->val_as_tid, remaining ? *remaining : 0);
 #endif
 
+    if (timerisset(&as->val_as_stats.vqs_start)) {
+        prev_qstats = val_stats_attach(&as->val_as_stats);
+        qstats_attached = 1;
+    }
+
     do { 
     done = 0;
     initial_q = qfq = as->val_as_queries;
@@ -7081,7 +7369,7 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
      * run through all queries, checking for responses/retries
      */
     timerclear(&closest_event);
-    gettimeofday(&now, NULL);
+    res_gettime(&now);
     for (; qfq; qfq = qfq->qfq_next) {
         int qfq_remain = 0;
 
@@ -7137,7 +7425,8 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
     }
 
     if (VAL_NO_ERROR !=
-        (retval = fix_glue(context, &as->val_as_queries, &data_missing)))
+        (retval = fix_glue(context, &as->val_as_queries, &data_missing,
+                           &glue_resumed)))
         goto done;
 
     if (data_received || !data_missing) {
@@ -7165,8 +7454,9 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
         data_received = 0;
     }
 
-    /* check if more queries have been added */
-    } while (!done && initial_q != as->val_as_queries);
+    /* check if more queries have been added or can be sent on */
+    } while (!done &&
+             (initial_q != as->val_as_queries || glue_resumed));
 
     if ((VAL_NO_ERROR == retval) && (NULL != as->val_as_results)) {
         val_log_authentication_chain(context, LOG_NOTICE,
@@ -7177,6 +7467,9 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
     }
 
   done:
+    if (qstats_attached)
+        val_stats_detach(prev_qstats);
+
     if (remaining)
         *remaining += as_remain ? as_remain : checked;
 
@@ -7185,6 +7478,235 @@ _async_check_one(val_async_status *as, fd_set *pending_desc,
     return retval;
 }
 
+#ifdef VAL_ASYNC_POLLFD
+/* check if the calling thread is the one to process a request */
+static int
+_as_is_mine(val_context_t *context, val_async_status *as)
+{
+#ifndef VAL_NO_THREADS
+    if (! (context->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
+        (! pthread_equal(pthread_self(), as->val_as_tid)))
+        return 0;
+#endif
+    return 1;
+}
+
+/*
+ * check if some other thread has requests pending in the context that
+ * the calling thread won't process. Caller must have CTX_LOCK_ACACHE.
+ */
+static int
+_as_others_pending(val_context_t *context)
+{
+    val_async_status *as;
+
+    for (as = context->as_list; as; as = as->val_as_next) {
+        if (!_as_is_mine(context, as))
+            return 1;
+    }
+    for (as = context->as_done; as; as = as->val_as_next) {
+        if (!_as_is_mine(context, as))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Lower the relative timeout to the time until the next event of the
+ * caller's requests; those of other threads are left to them. If *set
+ * is 0 there is no timeout yet, and one is only stored if there is an
+ * event. Caller must have CTX_LOCK_ACACHE.
+ */
+static void
+_as_poll_timeout(val_context_t *context, struct timeval *timeout, int *set)
+{
+    struct timeval  now, rel, *next = NULL;
+    val_async_status *as;
+    int             i, work = 0;
+
+    for (as = context->as_ready; as && !work; as = as->val_as_ready_next)
+        work = _as_is_mine(context, as);
+    for (as = context->as_done; as && !work; as = as->val_as_next)
+        work = _as_is_mine(context, as);
+
+    if (work)
+        timerclear(&rel);
+    else {
+        /* the heap top is the earliest alarm, if it is ours */
+        if (context->as_timers_count > 0 &&
+            _as_is_mine(context, context->as_timers[0])) {
+            next = &context->as_timers[0]->val_as_next_evt;
+        } else {
+            for (i = 1; i < context->as_timers_count; i++) {
+                as = context->as_timers[i];
+                if (_as_is_mine(context, as) &&
+                    (NULL == next || timercmp(&as->val_as_next_evt, next, <)))
+                    next = &as->val_as_next_evt;
+            }
+        }
+        if (NULL == next)
+            return;
+
+        res_gettime(&now);
+        if (timercmp(next, &now, <))
+            timerclear(&rel);
+        else
+            timersub(next, &now, &rel);
+    }
+
+    if (!*set || timercmp(&rel, timeout, <)) {
+        memcpy(timeout, &rel, sizeof(rel));
+        *set = 1;
+    }
+}
+
+/* create the pollable descriptor, and watch the sockets we know about */
+static int
+_as_poll_open(val_context_t *context)
+{
+    struct epoll_event ev;
+    int             fd;
+
+    context->as_pollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (context->as_pollfd < 0) {
+        val_log(context, LOG_ERR, "_as_poll_open(): epoll_create1: %s",
+                strerror(errno));
+        return VAL_RESOURCE_UNAVAILABLE;
+    }
+    context->as_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (context->as_eventfd < 0) {
+        val_log(context, LOG_ERR, "_as_poll_open(): eventfd: %s",
+                strerror(errno));
+        close(context->as_pollfd);
+        context->as_pollfd = -1;
+        return VAL_RESOURCE_UNAVAILABLE;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = context->as_eventfd;
+    if (epoll_ctl(context->as_pollfd, EPOLL_CTL_ADD, context->as_eventfd,
+                  &ev) < 0) {
+        val_log(context, LOG_ERR, "_as_poll_open(): epoll_ctl: %s",
+                strerror(errno));
+        close(context->as_eventfd);
+        close(context->as_pollfd);
+        context->as_eventfd = context->as_pollfd = -1;
+        return VAL_RESOURCE_UNAVAILABLE;
+    }
+    context->as_signalled = 0;
+
+    for (fd = 0; fd < context->as_fdmap_size; fd++) {
+        if (context->as_fdmap[fd] && context->as_fdmap[fd]->qc_waiters)
+            _as_poll_add(context, fd);
+    }
+    if (context->as_ready || context->as_done)
+        _as_signal(context);
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * wait on the pollable descriptor for at most tv (NULL for no limit),
+ * or until the next event of the context's requests.
+ * Returns the number of events, or -1 on error.
+ */
+static int
+_async_poll_wait(val_context_t *context, struct timeval *tv,
+                 struct epoll_event *events, int max_events)
+{
+    struct timeval  timeout;
+    int             set = 0, ms = -1, n;
+
+    if (tv) {
+        memcpy(&timeout, tv, sizeof(timeout));
+        set = 1;
+    }
+
+    CTX_LOCK_ACACHE(context);
+    _as_poll_timeout(context, &timeout, &set);
+    CTX_UNLOCK_ACACHE(context);
+
+    if (set) {
+        if (timeout.tv_sec < 0)
+            ms = 0;
+        else if (timeout.tv_sec > 86400)
+            ms = 86400 * 1000;
+        else
+            ms = timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000;
+    }
+
+    n = epoll_wait(context->as_pollfd, events, max_events, ms);
+    if (n < 0 && EINTR == errno)
+        n = 0;
+    val_log(context, LOG_DEBUG, "_async_poll_wait: %d events (timeout %d ms)",
+            n, ms);
+    return n;
+}
+#endif /* VAL_ASYNC_POLLFD */
+
+/*
+ * Function: val_async_poll_info
+ *
+ * Purpose:  get a single descriptor for use with an event loop instead
+ *           of val_async_select_info(). The descriptor stays the same
+ *           for the life of the context, and becomes readable whenever
+ *           val_async_check_wait() has work to do: a response arrived,
+ *           a request completed, or the next alarm moved closer.
+ *           Alarms themselves don't make it readable; the application
+ *           must also wake up after the returned timeout.
+ *
+ *           Once the descriptor has been requested, val_async_check_wait()
+ *           called with a NULL fd_set waits on it rather than on select().
+ *
+ * Parameters: context  -- context for pending async requests
+ *             fd -- set to the pollable descriptor. The application
+ *                   must not read from or close it.
+ *             timeout -- maximum time application wants to wait. May be
+ *                        NULL. Otherwise it is lowered to the time until
+ *                        the next event for the calling thread's pending
+ *                        async requests.
+ *
+ * Returns:  VAL_NO_ERROR on success, VAL_BAD_ARGUMENT for bad arguments,
+ *           VAL_RESOURCE_UNAVAILABLE if the descriptor couldn't be
+ *           created, or VAL_NOT_IMPLEMENTED on systems without epoll.
+ */
+int
+val_async_poll_info(val_context_t *ctx, int *fd, struct timeval *timeout)
+{
+    val_context_t  *context;
+    int             retval = VAL_NO_ERROR;
+#ifdef VAL_ASYNC_POLLFD
+    int             set = 1;
+#endif
+
+    if (NULL == fd)
+        return VAL_BAD_ARGUMENT;
+
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context)
+        return VAL_BAD_ARGUMENT;
+
+#ifdef VAL_ASYNC_POLLFD
+    CTX_LOCK_ACACHE(context);
+
+    if (context->as_pollfd < 0)
+        retval = _as_poll_open(context);
+    if (VAL_NO_ERROR == retval) {
+        *fd = context->as_pollfd;
+        if (timeout)
+            _as_poll_timeout(context, timeout, &set);
+    }
+
+    CTX_UNLOCK_ACACHE(context);
+#else
+    retval = VAL_NOT_IMPLEMENTED;
+#endif
+
+    CTX_UNLOCK_POL(context);
+    return retval;
+}
+
 /*
  * Function: val_async_select
  *
@@ -7269,8 +7791,17 @@ val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
 #ifndef VAL_NO_THREADS
     pthread_t                   self = pthread_self();
 #endif
-    val_async_status           *as;
-    int                         count = 0, completed = 0;
+    val_async_status           *as, *ready;
+    struct val_async_waiter    *w;
+    struct val_query_chain     *qc;
+    struct timeval              now;
+    int                         count = 0, completed = 0, remaining = 0;
+    int                         fd, max_fd;
+#ifdef VAL_ASYNC_POLLFD
+    struct epoll_event          events[VAL_AS_MAX_EVENTS];
+    int                         i;
+#endif
+    int                         nevents = 0;
     val_context_t *context;
     int retval = VAL_NO_ERROR;
     fd_set local_fdset;
@@ -7283,7 +7814,7 @@ val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
         return VAL_INTERNAL_ERROR;
     }
 
-    if (NULL == context->as_list) {
+    if (NULL == context->as_list && NULL == context->as_done) {
         retval = VAL_NO_ERROR;
         goto done;
     }
@@ -7308,7 +7839,7 @@ val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
     _handle_completed(context);
 
     /** might not be anything left to check now */
-    if (NULL == context->as_list) {
+    if (NULL == context->as_list && NULL == context->as_done) {
         retval = VAL_NO_ERROR;
         goto done;
     }
@@ -7317,14 +7848,40 @@ val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
     if ((pending_desc == NULL) || (NULL == nfds)) {
         int    local_nfds = 0;
         int    waiting;
+#ifdef VAL_ASYNC_POLLFD
+        int    use_poll = 0;
+#endif
 
         FD_ZERO(&local_fdset);
         pending_desc = &local_fdset;
         nfds = &local_nfds;
 
-        waiting = val_async_select(context, pending_desc, nfds, tv, 0);
-        if (waiting < 0 )
-            return VAL_INTERNAL_ERROR;
+#ifdef VAL_ASYNC_POLLFD
+        /*
+         * use the pollable descriptor once there is one. Its wakeups
+         * are shared by all threads using the context, though, so
+         * while other threads have requests we won't process, wait
+         * in select() on our own requests instead.
+         */
+        if (context->as_pollfd >= 0) {
+            CTX_LOCK_ACACHE(context);
+            use_poll = !_as_others_pending(context);
+            CTX_UNLOCK_ACACHE(context);
+        }
+        if (use_poll) {
+            nevents = _async_poll_wait(context, tv, events,
+                                       VAL_AS_MAX_EVENTS);
+            if (nevents < 0) {
+                retval = VAL_INTERNAL_ERROR;
+                goto done;
+            }
+        } else
+#endif
+        {
+            waiting = val_async_select(context, pending_desc, nfds, tv, 0);
+            if (waiting < 0 )
+                return VAL_INTERNAL_ERROR;
+        }
         /*
          * even if nothing waiting, keep going. queries might be
          * completed or waiting to be sent.
@@ -7333,24 +7890,96 @@ val_async_check_wait(val_context_t *ctx, fd_set *pending_desc,
 
     CTX_LOCK_ACACHE(context);
 
-    for (as = context->as_list; as; as = as->val_as_next) {
+    res_gettime(&now);
+
+    /** wake the requests waiting on readable sockets */
+    max_fd = context->as_fdmap_size;
+    if (max_fd > FD_SETSIZE)
+        max_fd = FD_SETSIZE;
+    for (fd = 0; fd < max_fd; fd++) {
+        qc = context->as_fdmap[fd];
+        if (NULL == qc || !FD_ISSET(fd, pending_desc))
+            continue;
+        /* the socket may since have been closed and reused */
+        if (NULL == qc->qc_ea || !res_async_ea_isset(qc->qc_ea, pending_desc)) {
+            context->as_fdmap[fd] = NULL;
+            continue;
+        }
+        for (w = qc->qc_waiters; w; w = w->aw_qc_next)
+            _as_ready(context, w->aw_as);
+    }
+
+#ifdef VAL_ASYNC_POLLFD
+    /** or on the sockets epoll reported */
+    for (i = 0; i < nevents; i++) {
+        fd = events[i].data.fd;
+        if (fd == context->as_eventfd)
+            continue; /* reset below, once the work is done */
+        qc = (fd < context->as_fdmap_size) ? context->as_fdmap[fd] : NULL;
+        if (NULL == qc || NULL == qc->qc_waiters || NULL == qc->qc_ea ||
+            !res_async_ea_set_readable(qc->qc_ea, fd)) {
+            /* nobody is waiting for this socket any more */
+            _as_poll_del(context, fd);
+            if (qc)
+                context->as_fdmap[fd] = NULL;
+            continue;
+        }
+        for (w = qc->qc_waiters; w; w = w->aw_qc_next)
+            _as_ready(context, w->aw_as);
+    }
+#endif
+
+    /** and those with an expired retry/cancel alarm */
+    while (context->as_timers_count > 0 &&
+           !timercmp(&context->as_timers[0]->val_as_next_evt, &now, >)) {
+        as = context->as_timers[0];
+        _as_timer_remove(context, as);
+        _as_ready(context, as);
+    }
+
+    /*
+     * check the ready requests. Requests that become ready while we
+     * are at it are left for the next pass.
+     */
+    ready = context->as_ready;
+    context->as_ready = context->as_ready_tail = NULL;
+    while (NULL != (as = ready)) {
+        ready = as->val_as_ready_next;
+        as->val_as_ready_next = NULL;
+        as->val_as_flags &= ~VAL_AS_READY;
 
 #ifndef VAL_NO_THREADS
         if (! (as->val_as_ctx->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
-            (! pthread_equal(self, as->val_as_tid)))
+            (! pthread_equal(self, as->val_as_tid))) {
+            _as_ready(context, as); /* for its own thread */
             continue;
+        }
 #endif
 
-        if (as->val_as_flags & VAL_AS_DONE)
-            ++completed;
-        else {
+        if (! (as->val_as_flags & VAL_AS_DONE)) {
             /* ignore errors, keep trying other requests */
-            _async_check_one(as, pending_desc, nfds, &count, flags);
-            if (as->val_as_flags & VAL_AS_DONE)
-                ++completed;
+            _async_check_one(as, pending_desc, nfds, &remaining, flags);
         }
+        if (as->val_as_flags & VAL_AS_DONE) {
+            _context_as_complete(context, as);
+            ++completed;
+        } else
+            _as_track(context, as);
     }
 
+    /** count our pending requests */
+#ifndef VAL_NO_THREADS
+    if (! (context->ctx_flags & CTX_PROCESS_ALL_THREADS)) {
+        for (as = context->as_list; as; as = as->val_as_next) {
+            if (pthread_equal(self, as->val_as_tid))
+                ++count;
+        }
+    } else
+#endif
+        count = context->as_count;
+
+    _as_unsignal(context);
+
     CTX_UNLOCK_ACACHE(context);
 
     if (completed)
@@ -7437,7 +8066,7 @@ val_async_cancel(val_context_t *context, val_async_status *as, unsigned int flag
 int
 val_async_cancel_all(val_context_t *context, unsigned int flags)
 {
-    val_async_status *as, *next;
+    val_async_status *as;
 
     if (NULL == context)
         return VAL_BAD_ARGUMENT;
@@ -7446,12 +8075,19 @@ val_async_cancel_all(val_context_t *context, unsigned int flags)
 
     CTX_LOCK_ACACHE(context);
 
-    for (as = context->as_list; as; as = next) {
-        next = as->val_as_next;
-        _async_cancel_one(context, as, flags | VAL_AS_CANCEL_CTX_REMOVED);
+    /** empty the ready queue and alarms wholesale */
+    while (NULL != (as = context->as_ready)) {
+        context->as_ready = as->val_as_ready_next;
+        as->val_as_ready_next = NULL;
+        as->val_as_flags &= ~VAL_AS_READY;
     }
+    context->as_ready_tail = NULL;
+    while (context->as_timers_count > 0)
+        context->as_timers[--context->as_timers_count]->val_as_timer = 0;
 
-    context->as_list = NULL;
+    while (NULL != (as = context->as_list) ||
+           NULL != (as = context->as_done))
+        _async_cancel_one(context, as, flags);
 
     CTX_UNLOCK_ACACHE(context);
 
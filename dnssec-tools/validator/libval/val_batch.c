@@ -0,0 +1,231 @@
+/*
+ * Copyright 2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * DESCRIPTION
+ * Validate a batch of questions in one call.
+ *
+ * The questions are submitted as async requests on a single context,
+ * at most a window's worth at a time, so that they share the context's
+ * query chain: a DNSKEY or DS set (or any other sub-query) needed by
+ * several of them is only fetched once. A question that repeats an
+ * earlier one in the batch is held back until the first copy has
+ * completed, and is then answered from the cache.
+ */
+#include "validator-internal.h"
+
+#ifndef VAL_NO_ASYNC
+
+#include "val_context.h"
+
+#define BATCH_WAITING   0
+#define BATCH_INFLIGHT  1
+#define BATCH_DONE      2
+
+struct batch_state;
+
+struct batch_slot {
+    val_batch_query_t  *query;
+    struct batch_state *batch;
+    val_async_status   *as;
+    int                 state;
+    int                 follower;   /* next repeat of this question, or -1 */
+};
+
+struct batch_state {
+    struct batch_slot  *slots;
+    int                *ready;      /* repeats whose first copy is done */
+    int                 num_ready;
+    int                 inflight;
+    int                 done;
+};
+
+static void
+_batch_finished(struct batch_state *batch, int i)
+{
+    struct batch_slot *slot = &batch->slots[i];
+
+    slot->state = BATCH_DONE;
+    slot->as = NULL;
+    batch->done++;
+
+    /* the repeats of this question can go now */
+    if (slot->follower >= 0)
+        batch->ready[batch->num_ready++] = slot->follower;
+}
+
+static int
+_batch_callback(val_async_status *as, int event, val_context_t *ctx,
+                void *cb_data, val_cb_params_t *cbp)
+{
+    struct batch_slot  *slot = (struct batch_slot *) cb_data;
+    struct batch_state *batch = slot->batch;
+
+    if (VAL_AS_EVENT_COMPLETED == event) {
+        slot->query->retval = cbp->retval;
+        /* keep the results; libval won't release them now */
+        slot->query->results = cbp->results;
+        cbp->results = NULL;
+    } else {
+        slot->query->retval = VAL_INTERNAL_ERROR;
+    }
+
+    batch->inflight--;
+    _batch_finished(batch, slot - batch->slots);
+    return VAL_NO_ERROR;
+}
+
+static int
+_batch_submit(val_context_t *context, struct batch_state *batch, int i)
+{
+    struct batch_slot *slot = &batch->slots[i];
+    val_batch_query_t *q = slot->query;
+    int                retval;
+
+    slot->state = BATCH_INFLIGHT;
+    batch->inflight++;
+    retval = val_async_submit(context, q->name, q->class_h, q->type_h,
+                              q->flags, &_batch_callback, slot, &slot->as);
+    if (VAL_NO_ERROR != retval) {
+        q->retval = retval;
+        batch->inflight--;
+        _batch_finished(batch, i);
+    }
+    return retval;
+}
+
+/*
+ * Resolve and validate count questions, keeping at most max_inflight
+ * (or VAL_BATCH_DEFAULT_WINDOW, if max_inflight is not positive) in
+ * flight. The outcome of each question is left in its retval and results
+ * members; the results must be released with val_free_result_chain().
+ */
+int
+val_resolve_and_check_batch(val_context_t *ctx, val_batch_query_t *queries,
+                            int count, int max_inflight)
+{
+    val_context_t      *context;
+    struct batch_state  batch;
+    u_char            (*names)[NS_MAXCDNAME] = NULL;
+    int                *last = NULL;
+    int                 next, i, j;
+    int                 retval = VAL_NO_ERROR;
+
+    if ((NULL == queries && count > 0) || count < 0)
+        return VAL_BAD_ARGUMENT;
+    if (0 == count)
+        return VAL_NO_ERROR;
+    if (max_inflight <= 0)
+        max_inflight = VAL_BATCH_DEFAULT_WINDOW;
+
+    val_log(ctx, LOG_DEBUG, "%s: %d questions", __FUNCTION__, count);
+
+    /*
+     * the async calls take the policy lock themselves; holding on to
+     * it here would stall a configuration reload for the whole batch
+     */
+    context = val_create_or_refresh_context(ctx); /* does CTX_LOCK_POL_SH */
+    if (NULL == context)
+        return VAL_INTERNAL_ERROR;
+    CTX_UNLOCK_POL(context);
+
+    memset(&batch, 0, sizeof(batch));
+    batch.slots = (struct batch_slot *) calloc(count, sizeof(struct batch_slot));
+    batch.ready = (int *) calloc(count, sizeof(int));
+    names = (u_char (*)[NS_MAXCDNAME]) malloc(count * sizeof(*names));
+    last = (int *) calloc(count, sizeof(int));
+    if (NULL == batch.slots || NULL == batch.ready || NULL == names ||
+        NULL == last) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    /*
+     * Link each repeated question to the copy before it; only the first
+     * copy of a question is submitted up front
+     */
+    for (i = 0; i < count; i++) {
+        batch.slots[i].query = &queries[i];
+        batch.slots[i].batch = &batch;
+        batch.slots[i].state = BATCH_WAITING;
+        batch.slots[i].follower = -1;
+        last[i] = i;
+        queries[i].retval = VAL_NO_ERROR;
+        queries[i].results = NULL;
+
+        if (NULL == queries[i].name ||
+            -1 == ns_name_pton(queries[i].name, names[i], NS_MAXCDNAME)) {
+            /* let val_async_submit() report it */
+            names[i][0] = 0xff;
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (-1 == last[j])
+                continue;   /* only compare with first copies */
+            if (queries[j].class_h == queries[i].class_h &&
+                queries[j].type_h == queries[i].type_h &&
+                queries[j].flags == queries[i].flags &&
+                names[j][0] != 0xff && !namecmp(names[j], names[i]))
+                break;
+        }
+        if (j < i) {
+            /* j is the first copy; append i to the end of its chain */
+            batch.slots[last[j]].follower = i;
+            last[j] = i;
+            last[i] = -1;   /* not a first copy */
+        }
+    }
+
+    next = 0;
+    while (batch.done < count) {
+
+        /* top up the window, repeats of finished questions first */
+        while (batch.inflight < max_inflight) {
+            if (batch.num_ready > 0) {
+                i = batch.ready[--batch.num_ready];
+            } else {
+                while (next < count && last[next] == -1)
+                    next++;
+                if (next >= count)
+                    break;
+                i = next++;
+            }
+            _batch_submit(context, &batch, i);
+        }
+
+        if (batch.done >= count)
+            break;
+
+        if (0 == batch.inflight) {
+            /* nothing left that could finish the rest */
+            retval = VAL_INTERNAL_ERROR;
+            break;
+        }
+
+        {
+            struct timeval tv;
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+            val_async_check_wait(context, NULL, NULL, &tv, 0);
+        }
+    }
+
+  done:
+    if (VAL_NO_ERROR != retval && NULL != batch.slots) {
+        for (i = 0; i < count; i++) {
+            if (BATCH_INFLIGHT == batch.slots[i].state)
+                val_async_cancel(context, batch.slots[i].as,
+                                 VAL_AS_CANCEL_NO_CALLBACKS);
+            if (BATCH_DONE != batch.slots[i].state)
+                queries[i].retval = retval;
+        }
+    }
+    FREE(batch.slots);
+    FREE(batch.ready);
+    FREE(names);
+    FREE(last);
+    return retval;
+}
+
+#endif /* VAL_NO_ASYNC */
@@ -37,6 +37,14 @@
 static struct rrset_rec *unchecked_hints = NULL;
 static struct rrset_rec *unchecked_answers = NULL;
 
+/*
+ * The hints cache holds the delegations (NS sets and their glue) that
+ * we have learned. It is indexed by owner name, so that the closest
+ * enclosing zone cut for a query, and the glue for its name servers,
+ * can be found without scanning the cache.
+ */
+static struct name_trie_node *hints_index = NULL;
+
 #ifndef VAL_NO_THREADS
 
 /*
@@ -81,12 +89,55 @@ static int ans_rwlock_init = -1;
      (q->qc_zonecut_n? (NULL != namename(name, q->qc_zonecut_n)) :\
       (NULL != namename(q->qc_name_n, name))))
 
+/*
+ * Look for an existing record in a cache that new_rr would replace 
+ */
+static struct rrset_rec *
+find_competitor(struct rrset_rec *unchecked_info, 
+                struct name_trie_node *index,
+                struct rrset_rec *new_rr,
+                struct rrset_rec **prev)
+{
+    struct rrset_rec *old;
+    struct name_trie_node *node;
+    int             i;
+
+    *prev = NULL;
+
+    if (index != NULL) {
+        node = name_trie_find(index, new_rr->rrs_name_n);
+        for (i = 0; node && i < node->ntn_ndata; i++) {
+            old = (struct rrset_rec *) node->ntn_data[i];
+            if (old->rrs_type_h == new_rr->rrs_type_h
+                && old->rrs_class_h == new_rr->rrs_class_h)
+                return old;
+        }
+        return NULL;
+    }
+
+    for (old = unchecked_info; old; old = old->rrs_next) {
+        if (
+            old->rrs_type_h == new_rr->rrs_type_h
+            && old->rrs_class_h == new_rr->rrs_class_h
+            && namecmp(old->rrs_name_n,
+                       new_rr->rrs_name_n) == 0) {
+            return old;
+        }
+        /* look at the next cached record */
+        *prev = old;
+    }
+    return NULL;
+}
+
 /*
  * Common routine to store data to a specific cache
+ * If index is given, it is the name index for the cache; new records
+ * are added to it and put at the head of the list.
  * NOTE: This assumes a read lock is alread held by the caller.
  */
 static int
-stow_info(struct rrset_rec **unchecked_info, struct rrset_rec **new_info, struct val_query_chain *matched_q)
+stow_info(struct rrset_rec **unchecked_info, struct name_trie_node **index,
+          struct rrset_rec **new_info, struct val_query_chain *matched_q)
 {
     struct rrset_rec *new_rr;
     struct rrset_rec *old, *prev;
@@ -113,46 +164,31 @@ stow_info(struct rrset_rec **unchecked_info, struct rrset_rec **new_info, struct
 #endif
             new_rr->rrs_type_h == ns_t_nsec) {
             delete_newrr = 1;
-        } else {
-          old = *unchecked_info;
-          prev = NULL;
-          while (old) {
-            if (
-                old->rrs_type_h == new_rr->rrs_type_h
-                && old->rrs_class_h == new_rr->rrs_class_h
-                && namecmp(old->rrs_name_n,
-                           new_rr->rrs_name_n) == 0) {
-
+        } else if (NULL != (old = find_competitor(*unchecked_info,
+                                    index ? *index : NULL, new_rr, &prev))) {
+            /*
+             * old and new are competitors 
+             */
+            if (old->rrs_cred >= new_rr->rrs_cred) {
                 /*
-                 * old and new are competitors 
+                 * exchange the two -
+                 * copy from new to old: cred, status, section, ans_kind
+                 * exchange: data, sig
                  */
-                if (old->rrs_cred >= new_rr->rrs_cred) {
-                    /*
-                     * exchange the two -
-                     * copy from new to old: cred, status, section, ans_kind
-                     * exchange: data, sig
-                     */
-                    struct rrset_rr  *rr_exchange;
-
-                    old->rrs_cred = new_rr->rrs_cred;
-                    old->rrs_section = new_rr->rrs_section;
-                    old->rrs_ans_kind = new_rr->rrs_ans_kind;
-                    rr_exchange = old->rrs_data;
-                    old->rrs_data = new_rr->rrs_data;
-                    new_rr->rrs_data = rr_exchange;
-                    rr_exchange = old->rrs_sig;
-                    old->rrs_sig = new_rr->rrs_sig;
-                    new_rr->rrs_sig = rr_exchange;
-                }
-
-                delete_newrr = 1;
-                break;
-            } 
+                struct rrset_rr  *rr_exchange;
+
+                old->rrs_cred = new_rr->rrs_cred;
+                old->rrs_section = new_rr->rrs_section;
+                old->rrs_ans_kind = new_rr->rrs_ans_kind;
+                rr_exchange = old->rrs_data;
+                old->rrs_data = new_rr->rrs_data;
+                new_rr->rrs_data = rr_exchange;
+                rr_exchange = old->rrs_sig;
+                old->rrs_sig = new_rr->rrs_sig;
+                new_rr->rrs_sig = rr_exchange;
+            }
 
-            /* look at the next cached record */
-            prev = old;
-            old = old->rrs_next;
-          }
+            delete_newrr = 1;
         }
 
         *new_info = new_rr->rrs_next;
@@ -162,10 +198,26 @@ stow_info(struct rrset_rec **unchecked_info, struct rrset_rec **new_info, struct
             snprintf(name_p, sizeof(name_p), "unknown/error");
         cachename = (*unchecked_info == unchecked_hints)?  "Hints" : "Answer";
 
+        if (!delete_newrr && index != NULL) {
+            if ((*index == NULL && NULL == (*index = name_trie_create())) ||
+                VAL_NO_ERROR != name_trie_insert(*index,
+                                                 new_rr->rrs_name_n, new_rr)) {
+                val_log(NULL, LOG_INFO,
+                        "stow_info(): Not enough memory to index {%s, %d, %d}",
+                        name_p, new_rr->rrs_class_h, new_rr->rrs_type_h);
+                delete_newrr = 1;
+            }
+        }
+
         if (delete_newrr) {
             val_log(NULL, LOG_INFO, "stow_info(): Refreshing {%s, %d, %d} in %s cache",
                    name_p, new_rr->rrs_class_h, new_rr->rrs_type_h, cachename);
             res_sq_free_rrset_recs(&new_rr);
+        } else if (index != NULL) {
+            val_log(NULL, LOG_INFO, "stow_info(): Storing new {%s, %d, %d} in %s cache",
+                   name_p, new_rr->rrs_class_h, new_rr->rrs_type_h, cachename);
+            new_rr->rrs_next = *unchecked_info;
+            *unchecked_info = new_rr;
         } else {
             /* add new data to the end of our cache */
             val_log(NULL, LOG_INFO, "stow_info(): Storing new {%s, %d, %d} in %s cache",
@@ -180,19 +232,64 @@ stow_info(struct rrset_rec **unchecked_info, struct rrset_rec **new_info, struct
     return VAL_NO_ERROR;
 }
 
+/*
+ * Check if a cached record can be used to answer a query 
+ */
+static int
+lookup_match(struct rrset_rec *next_answer, u_char *name_n,
+             u_int16_t class_h, u_int16_t type_h,
+             unsigned long ns_options, struct timeval *tv)
+{
+    if (tv->tv_sec < next_answer->rrs_ttl_x &&
+        next_answer->rrs_class_h == class_h) {
+
+        /* if matching type or cname indirection */
+        if (((next_answer->rrs_type_h == type_h ||
+            (next_answer->rrs_type_h == ns_t_cname &&
+            ALIAS_MATCH_TYPE(type_h))) &&
+            /* and name is an exact match */
+            (namecmp(next_answer->rrs_name_n, name_n) == 0)) ||
+            /* OR */
+            /* DNAME indirection */
+            ((next_answer->rrs_type_h == ns_t_dname &&
+            ALIAS_MATCH_TYPE(type_h)) &&
+            /* and name applies */
+            (NULL != (u_char *) namename(name_n, 
+                                next_answer->rrs_name_n)))) {
+
+            /* 
+             * if we want to match particular options, make sure
+             * they actually match
+             */
+            if((ns_options == 0 || 
+                ns_options == next_answer->rrs_ns_options) &&
+               (next_answer->rrs_data != NULL)) {
+                return 1;
+            }
+        } 
+    }
+    return 0;
+}
+
 /*
  * Common routine to read data from a specific cache
+ * If index is given, it is the name index over answer_head, and only
+ * the records stored under name_n and its ancestors are looked at.
  * NOTE: This assumes a read lock is alread held by the caller.
  */
 static int
 lookup_store(u_char *name_n, u_int16_t class_h, u_int16_t type_h,
              struct rrset_rec *answer_head, 
+             struct name_trie_node *index,
              struct rrset_rec **new_answer,
              unsigned long ns_options)
 {
 
     struct rrset_rec *next_answer;
+    struct name_trie_node *nodes[NAME_TRIE_MAX_LABELS + 1];
+    u_char         *names[NAME_TRIE_MAX_LABELS + 1];
     struct timeval  tv;
+    int             n, i;
 
     if (NULL == new_answer)
         return VAL_BAD_ARGUMENT;
@@ -201,44 +298,34 @@ lookup_store(u_char *name_n, u_int16_t class_h, u_int16_t type_h,
 
     gettimeofday(&tv, NULL);
 
-    next_answer = answer_head;
-    while (next_answer) {
-
-        if (tv.tv_sec < next_answer->rrs_ttl_x &&
-            next_answer->rrs_class_h == class_h) {
-
-            /* if matching type or cname indirection */
-            if (((next_answer->rrs_type_h == type_h ||
-                (next_answer->rrs_type_h == ns_t_cname &&
-                ALIAS_MATCH_TYPE(type_h))) &&
-                /* and name is an exact match */
-                (namecmp(next_answer->rrs_name_n, name_n) == 0)) ||
-                /* OR */
-                /* DNAME indirection */
-                ((next_answer->rrs_type_h == ns_t_dname &&
-                ALIAS_MATCH_TYPE(type_h)) &&
-                /* and name applies */
-                (NULL != (u_char *) namename(name_n, 
-                                    next_answer->rrs_name_n)))) {
-
-                /* 
-                 * if we want to match particular options, make sure
-                 * they actually match
-                 */
-                if((ns_options == 0 || 
-                    ns_options == next_answer->rrs_ns_options) &&
-                   (next_answer->rrs_data != NULL)) {
-                    *new_answer = copy_rrset_rec(next_answer);
-                    if (*new_answer) {
-                        /* Adjust the TTL */
-                        (*new_answer)->rrs_ttl_h = next_answer->rrs_ttl_x - tv.tv_sec; 
-                    }
+    next_answer = NULL;
+    if (index != NULL) {
+        /* closest name first */
+        n = name_trie_path(index, name_n, nodes, names);
+        while (n-- > 0 && next_answer == NULL) {
+            for (i = 0; i < nodes[n]->ntn_ndata; i++) {
+                next_answer = (struct rrset_rec *) nodes[n]->ntn_data[i];
+                if (lookup_match(next_answer, name_n, class_h, type_h,
+                                 ns_options, &tv))
                     break;
-                }
-            } 
+                next_answer = NULL;
+            }
         }
+    } else {
+        for (next_answer = answer_head; next_answer;
+             next_answer = next_answer->rrs_next) {
+            if (lookup_match(next_answer, name_n, class_h, type_h,
+                             ns_options, &tv))
+                break;
+        }
+    }
 
-        next_answer = next_answer->rrs_next;
+    if (next_answer) {
+        *new_answer = copy_rrset_rec(next_answer);
+        if (*new_answer) {
+            /* Adjust the TTL */
+            (*new_answer)->rrs_ttl_h = next_answer->rrs_ttl_x - tv.tv_sec; 
+        }
     }
 
     return VAL_NO_ERROR;
@@ -276,7 +363,8 @@ get_cached_rrset(struct val_query_chain *matched_q,
     VAL_CACHE_LOCK_SH(&ans_rwlock);
 
     if (VAL_NO_ERROR != (retval = lookup_store(name_n, class_h, type_h,
-                            unchecked_answers, &new_answer, ns_options))) {
+                            unchecked_answers, NULL, &new_answer,
+                            ns_options))) {
         VAL_CACHE_UNLOCK(&ans_rwlock);
         return retval;
     }
@@ -294,7 +382,7 @@ get_cached_rrset(struct val_query_chain *matched_q,
         VAL_CACHE_LOCK_SH(&ns_rwlock);
 
         if (VAL_NO_ERROR != (retval = lookup_store(name_n, class_h, type_h,
-                            unchecked_hints, &new_answer, 0))) {
+                            unchecked_hints, hints_index, &new_answer, 0))) {
             VAL_CACHE_UNLOCK(&ns_rwlock);
             return retval;
         }
@@ -401,7 +489,7 @@ stow_zone_info(struct rrset_rec **new_info, struct val_query_chain *matched_q)
     
     VAL_CACHE_LOCK_INIT(&ns_rwlock, ns_rwlock_init);
     VAL_CACHE_LOCK_EX(&ns_rwlock);
-    rc = stow_info(&unchecked_hints, new_info, matched_q);
+    rc = stow_info(&unchecked_hints, &hints_index, new_info, matched_q);
     VAL_CACHE_UNLOCK(&ns_rwlock);
 
     return rc;
@@ -417,7 +505,7 @@ stow_answers(struct rrset_rec **new_info, struct val_query_chain *matched_q)
 
     VAL_CACHE_LOCK_INIT(&ans_rwlock, ans_rwlock_init);
     VAL_CACHE_LOCK_EX(&ans_rwlock);
-    rc = stow_info(&unchecked_answers, new_info, matched_q);
+    rc = stow_info(&unchecked_answers, NULL, new_info, matched_q);
     VAL_CACHE_UNLOCK(&ans_rwlock);
 
     return rc;
@@ -427,6 +515,9 @@ stow_answers(struct rrset_rec **new_info, struct val_query_chain *matched_q)
 /*
  * Get zone information: this could either be from 
  * the zone name to ns mapping cache or the hints cache
+ *
+ * The closest enclosing zone cut is found by walking the hints index
+ * along the labels of the query name.
  */
 int
 get_nslist_from_cache(val_context_t *ctx,
@@ -440,13 +531,13 @@ get_nslist_from_cache(val_context_t *ctx,
      * find closest matching name zone_n 
      */
     struct rrset_rec *nsrrset;
+    struct name_trie_node *nodes[NAME_TRIE_MAX_LABELS + 1];
+    u_char       *names[NAME_TRIE_MAX_LABELS + 1];
     u_char       *name_n = NULL;
-    u_char       *tname_n = NULL;
-    u_char       *p;
     u_int16_t     qtype;
     u_char       *qname_n;
-    u_char       *tmp_zonecut_n = NULL;
     struct timeval  tv;
+    int           n, i;
 
     if (matched_qfq == NULL || queries == NULL || ref_ns_list == NULL || ns_cred == NULL)
         return VAL_BAD_ARGUMENT;
@@ -461,58 +552,47 @@ get_nslist_from_cache(val_context_t *ctx,
     *zonecut_n = NULL;
     gettimeofday(&tv, NULL);
     
-    tmp_zonecut_n = NULL;
-
 
     /* Check in the NS store */
 
     VAL_CACHE_LOCK_INIT(&ns_rwlock, ns_rwlock_init);
     VAL_CACHE_LOCK_SH(&ns_rwlock);
 
-    nsrrset = unchecked_hints;
-    while (nsrrset) {
-
-        if (tv.tv_sec < nsrrset->rrs_ttl_x &&
-            nsrrset->rrs_type_h == ns_t_ns) {
-
-            tname_n = nsrrset->rrs_name_n;
+    /*
+     * Find the closest name with the best credibility;
+     * nodes[] goes from the root towards qname_n
+     */
+    n = name_trie_path(hints_index, qname_n, nodes, names);
+    for (i = 0; i < n; i++) {
+        int j;
 
-            /*
-             * Find the closest name with the best credibility
-             */
-            if ((*ns_cred == SR_CRED_UNSET || nsrrset->rrs_cred <= *ns_cred) &&
-                    NULL != (p = namename(qname_n, tname_n))) {
-
-                if (!name_n ||
-                    nsrrset->rrs_cred < *ns_cred ||
-                    (wire_name_length(tname_n) > wire_name_length(name_n))) {
-
-                    /*
-                     * If type is DS, you don't want an exact match
-                     * since that will lead you to the child zone
-                     */
-                    if ((qtype != ns_t_ds) || (p != qname_n)) {
-                        /*
-                         * New name is longer than old name 
-                         */
-                        name_n = tname_n;
-                        *ns_cred = nsrrset->rrs_cred;
-                        tmp_zonecut_n = nsrrset->rrs_name_n;
-                    }
-                }
+        /*
+         * If type is DS, you don't want an exact match
+         * since that will lead you to the child zone
+         */
+        if (qtype == ns_t_ds && names[i] == qname_n)
+            continue;
+
+        for (j = 0; j < nodes[i]->ntn_ndata; j++) {
+            nsrrset = (struct rrset_rec *) nodes[i]->ntn_data[j];
+            if (tv.tv_sec < nsrrset->rrs_ttl_x &&
+                nsrrset->rrs_type_h == ns_t_ns &&
+                (*ns_cred == SR_CRED_UNSET || 
+                 nsrrset->rrs_cred < *ns_cred ||
+                 (nsrrset->rrs_cred == *ns_cred && names[i] != name_n))) {
+                name_n = names[i];
+                *ns_cred = nsrrset->rrs_cred;
             }
         }
-        nsrrset = nsrrset->rrs_next;
     }
 
+    if (name_n) {
 
-    if (name_n && tmp_zonecut_n) {
-
-        bootstrap_referral(ctx, name_n, unchecked_hints, matched_qfq, queries,
-                           ref_ns_list);
+        bootstrap_referral(ctx, name_n, unchecked_hints, hints_index,
+                           matched_qfq, queries, ref_ns_list);
 
         if (*ref_ns_list) {
-            *zonecut_n = (u_char *) MALLOC (wire_name_length(tmp_zonecut_n) *
+            *zonecut_n = (u_char *) MALLOC (wire_name_length(name_n) *
                     sizeof (u_char));
             if (*zonecut_n == NULL) {
                 VAL_CACHE_UNLOCK(&ns_rwlock);
@@ -520,7 +600,7 @@ get_nslist_from_cache(val_context_t *ctx,
                 *ref_ns_list = NULL;
                 return VAL_OUT_OF_MEMORY;
             } 
-            memcpy(*zonecut_n, tmp_zonecut_n, wire_name_length(tmp_zonecut_n));
+            memcpy(*zonecut_n, name_n, wire_name_length(name_n));
         }
     }
     
@@ -536,6 +616,8 @@ free_validator_cache(void)
     VAL_CACHE_LOCK_EX(&ns_rwlock);
     res_sq_free_rrset_recs(&unchecked_hints);
     unchecked_hints = NULL;
+    name_trie_free(hints_index);
+    hints_index = NULL;
     VAL_CACHE_UNLOCK(&ns_rwlock);
     
     VAL_CACHE_LOCK_INIT(&ans_rwlock, ans_rwlock_init);
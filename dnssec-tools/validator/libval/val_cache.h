@@ -12,6 +12,7 @@ int             stow_ds_info(struct rrset_rec **new_info, struct val_query_chain
 int             stow_answers(struct rrset_rec **new_info, struct val_query_chain *matched_q);
 int             get_cached_rrset(struct val_query_chain *matched_q, struct domain_info **response);
 int             free_validator_cache(void);
+void            free_dane_cache(void);
 int             get_nslist_from_cache(val_context_t *ctx,
                                       struct queries_for_query *matched_qfq,
                                       struct queries_for_query **queries,
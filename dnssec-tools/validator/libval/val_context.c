@@ -162,69 +162,272 @@ _have_addrs(int *have4, int *have6) {
 #endif
 }
 
+#define SWAP_POLICY_FIELD(type, a, b) do { \
+    type _tmp = (a);\
+    (a) = (b);\
+    (b) = _tmp;\
+} while (0)
+
 /*
- * re-read resolver policy into the context
+ * Release a policy generation: the configuration it was read into,
+ * or the one it replaced once it has been published.
  */
-static int 
-val_refresh_resolver_policy(val_context_t * context)
+static void
+val_free_policy_gen(val_context_t *gen)
 {
-    if (context == NULL) 
-        return VAL_NO_ERROR;
+    val_log_t *logp;
 
-    if (read_res_config_file(context) != VAL_NO_ERROR) {
-        context->r_timestamp = -1;
-        val_log(context, LOG_WARNING, 
-                "val_refresh_resolver_policy(): Resolver configuration could not be read; using older values");
+    if (gen == NULL)
+        return;
+
+    if (gen->label)
+        FREE(gen->label);
+
+    if (gen->e_pol) {
+        destroy_valpol(gen);
+        FREE(gen->e_pol);
     }
-    return VAL_NO_ERROR; 
-}
+    if (gen->e_pol_idx)
+        FREE(gen->e_pol_idx);
 
+    while (NULL != (logp = gen->val_log_targets)) {
+        gen->val_log_targets = logp->next;
+        FREE(logp);
+    }
+
+    destroy_respol(gen);
+    if (gen->search)
+        FREE(gen->search);
+    if (gen->zone_ns_map)
+        _val_free_zone_nslist(gen->zone_ns_map);
+    if (gen->resolv_conf)
+        FREE(gen->resolv_conf);
+    if (gen->root_ns)
+        free_name_servers(&gen->root_ns);
+
+    FREE(gen);
+}
 
 /*
- * re-read validator policy into the context
+ * Function: val_read_policy_gen
+ *
+ * Purpose:   Read the given parts of the configuration of context into
+ *            a new policy generation, without holding the policy lock.
+ *            Parts that cannot be read are left out and keep their
+ *            older values.
+ *
+ * Parameter: context -- the context
+ *            parts -- VAL_POL_GEN_* parts to read; on return, the
+ *                     parts that were read
+ *
+ * Returns:   The generation, or NULL if nothing could be read
+ *
+ * NOTE: The caller must hold the context's reload lock.
  */
-static int 
-val_refresh_validator_policy(val_context_t * context)
+static val_context_t *
+val_read_policy_gen(val_context_t *context, unsigned int *parts)
 {
+    val_context_t *gen;
     struct dnsval_list *dnsval_l;
+    val_log_t *logp;
 
-    if (context == NULL) 
-        return VAL_NO_ERROR;
+    gen = (val_context_t *) MALLOC(sizeof(val_context_t));
+    if (gen == NULL) {
+        *parts = 0;
+        return NULL;
+    }
+    memset(gen, 0, sizeof(val_context_t));
 
-    if (read_val_config_file(context, context->label) != VAL_NO_ERROR) {
+    /*
+     * The generation borrows the inputs of the parsers from the
+     * context; they are only changed under the reload lock, which
+     * val_create_context_internal() also takes before it replaces
+     * the dynamic policies of the default context.
+     */
+    memcpy(gen->id, context->id, sizeof(gen->id));
+    gen->have_ipv4 = context->have_ipv4;
+    gen->have_ipv6 = context->have_ipv6;
+    gen->dyn_polflags = context->dyn_polflags;
+    gen->dyn_valpolopt = context->dyn_valpolopt;
+    gen->dyn_valpol = context->dyn_valpol;
+    gen->dyn_nslist = context->dyn_nslist;
+    gen->base_dnsval_conf = context->base_dnsval_conf;
+    gen->root_conf = context->root_conf;
+    gen->val_log_max_level = -1;
+
+    gen->e_pol =
+        (policy_entry_t **) MALLOC(MAX_POL_TOKEN * sizeof(policy_entry_t *));
+    gen->e_pol_idx = (struct policy_index *)
+        MALLOC(MAX_POL_TOKEN * sizeof(struct policy_index));
+    if (gen->e_pol == NULL || gen->e_pol_idx == NULL ||
+        (context->resolv_conf &&
+         NULL == (gen->resolv_conf = strdup(context->resolv_conf))) ||
+        (context->label && NULL == (gen->label = strdup(context->label)))) {
+        *parts = 0;
+        goto done;
+    }
+    memset(gen->e_pol, 0, MAX_POL_TOKEN * sizeof(policy_entry_t *));
+    memset(gen->e_pol_idx, 0, MAX_POL_TOKEN * sizeof(struct policy_index));
+
+    /*
+     * Read the validator configuration first, as for a new context
+     */
+    if ((*parts & VAL_POL_GEN_VAL) &&
+        read_val_config_file(gen, gen->label) != VAL_NO_ERROR) {
         for(dnsval_l = context->dnsval_l; dnsval_l; dnsval_l=dnsval_l->next)
             dnsval_l->v_timestamp = -1;
         val_log(context, LOG_WARNING, 
-                "val_refresh_validator_policy(): Validator configuration could not be read; using older values");
+                "val_read_policy_gen(): Validator configuration could not be read; using older values");
+        *parts &= ~VAL_POL_GEN_VAL;
+    }
+    if (!(*parts & VAL_POL_GEN_VAL)) {
+        destroy_valpol(gen);
+        while (NULL != (logp = gen->val_log_targets)) {
+            gen->val_log_targets = logp->next;
+            FREE(logp);
+        }
+        gen->g_opt = context->g_opt;
+        gen->val_log_targets = context->val_log_targets;
+        gen->val_log_max_level = context->val_log_max_level;
     }
 
-    return VAL_NO_ERROR; 
+    if ((*parts & VAL_POL_GEN_HINTS) &&
+        read_root_hints_file(gen) != VAL_NO_ERROR) {
+        context->h_timestamp = -1;
+        val_log(context, LOG_WARNING, 
+                "val_read_policy_gen(): Root Hints could not be read; using older values");
+        *parts &= ~VAL_POL_GEN_HINTS;
+    }
+    if (!(*parts & VAL_POL_GEN_HINTS)) {
+        if (gen->root_ns)
+            free_name_servers(&gen->root_ns);
+        gen->root_ns = context->root_ns;
+    }
+
+    if ((*parts & VAL_POL_GEN_RES) &&
+        read_res_config_file(gen) != VAL_NO_ERROR) {
+        context->r_timestamp = -1;
+        val_log(context, LOG_WARNING, 
+                "val_read_policy_gen(): Resolver configuration could not be read; using older values");
+        *parts &= ~VAL_POL_GEN_RES;
+    }
+    if (!(*parts & VAL_POL_GEN_RES)) {
+        destroy_respol(gen);
+        if (gen->search) {
+            FREE(gen->search);
+            gen->search = NULL;
+        }
+        if (gen->zone_ns_map) {
+            _val_free_zone_nslist(gen->zone_ns_map);
+            gen->zone_ns_map = NULL;
+        }
+    }
+
+  done:
+    /* hand back what was borrowed */
+    gen->dyn_valpolopt = NULL;
+    gen->dyn_valpol = NULL;
+    gen->dyn_nslist = NULL;
+    gen->base_dnsval_conf = NULL;
+    gen->root_conf = NULL;
+    if (!(*parts & VAL_POL_GEN_VAL)) {
+        gen->g_opt = NULL;
+        gen->val_log_targets = NULL;
+    }
+    if (!(*parts & VAL_POL_GEN_HINTS))
+        gen->root_ns = NULL;
+
+    if (*parts == 0) {
+        val_free_policy_gen(gen);
+        return NULL;
+    }
+    return gen;
 }
 
 /*
- * re-read root.hints policy into the context
+ * Function: val_publish_policy_gen
+ *
+ * Purpose:   Swap the given parts of a policy generation into the
+ *            context. On return gen holds the configuration that was
+ *            replaced, which queries that are under way may still be
+ *            using.
+ *
+ * NOTE: The caller must hold the context's cache lock, which also
+ *       keeps dynamic policy changes out.
  */
-static int 
-val_refresh_root_hints(val_context_t * context)
+static void
+val_publish_policy_gen(val_context_t *context, val_context_t *gen,
+                       unsigned int parts)
 {
-    if (context == NULL)
-        return VAL_NO_ERROR;
+    struct zone_ns_map_t *map_e;
+    struct name_server *ns, *ns_next;
+    struct val_query_chain *q;
 
-    if (read_root_hints_file(context) != VAL_NO_ERROR) {
-        context->h_timestamp = -1;
-        val_log(context, LOG_WARNING, 
-                "val_refresh_root_hints(): Root Hints could not be read; using older values");
+    if (parts & VAL_POL_GEN_VAL) {
+        /* keep the cached queries that the new policy doesn't affect */
+        mark_policy_changes(context, gen);
+
+        SWAP_POLICY_FIELD(char *, context->label, gen->label);
+        SWAP_POLICY_FIELD(struct dnsval_list *,
+                          context->dnsval_l, gen->dnsval_l);
+        SWAP_POLICY_FIELD(policy_entry_t **, context->e_pol, gen->e_pol);
+        SWAP_POLICY_FIELD(struct policy_index *,
+                          context->e_pol_idx, gen->e_pol_idx);
+        SWAP_POLICY_FIELD(val_global_opt_t *, context->g_opt, gen->g_opt);
+        SWAP_POLICY_FIELD(val_log_t *,
+                          context->val_log_targets, gen->val_log_targets);
+        context->val_log_max_level = gen->val_log_max_level;
     }
 
-    return VAL_NO_ERROR;
+    if (parts & VAL_POL_GEN_HINTS) {
+        SWAP_POLICY_FIELD(struct name_server *,
+                          context->root_ns, gen->root_ns);
+        context->h_timestamp = gen->h_timestamp;
+    }
+
+    if (parts & VAL_POL_GEN_RES) {
+        SWAP_POLICY_FIELD(struct name_server *,
+                          context->nslist, gen->nslist);
+        SWAP_POLICY_FIELD(char *, context->search, gen->search);
+        SWAP_POLICY_FIELD(char *, context->resolv_conf, gen->resolv_conf);
+        context->r_timestamp = gen->r_timestamp;
+
+        /* 
+         * Forwarders are added to the context's zone map, like 
+         * val_context_store_ns_for_zone() does; flush queries below them 
+         */
+        for (map_e = gen->zone_ns_map; map_e; map_e = map_e->next) {
+            for (ns = map_e->nslist; ns; ns = ns_next) {
+                ns_next = ns->ns_next;
+                ns->ns_next = NULL;
+                _val_store_ns_in_map(map_e->zone_n, ns, &context->zone_ns_map);
+                ns->ns_next = ns_next;
+            }
+            for(q=context->q_list; q; q=q->qc_next) {
+                if (NULL != namename(q->qc_name_n, map_e->zone_n)) {
+                    q->qc_flags |= VAL_QUERY_MARK_FOR_DELETION;
+                }
+            }
+        }
+    }
 }
+
 /*
  * Function: val_refresh_context
  *
- * Purpose:   set up context for a query
+ * Purpose:   Re-read the configuration files of the context that have
+ *            changed.
  *
- * Parameter: results -- results for query
- *            ctx -- user supplied context, if any
+ *            The files are parsed into a new policy generation without
+ *            holding any of the context's locks, so that queries carry
+ *            on while they are read. The generation is then published by
+ *            swapping its pointers into the context under the cache
+ *            lock, and only the cached queries that the new policy can
+ *            affect are flushed. Queries that are under way keep the
+ *            structures of the old generation that they are using: it
+ *            is retired, and freed once nobody holds the policy lock.
+ *
+ * Parameter: context -- the context
  *
  * Returns:   VAL_NO_ERROR or error code to return to user
  *
@@ -234,52 +437,88 @@ val_refresh_context(val_context_t *context)
 {
     struct stat rsb, vsb, hsb;
     struct dnsval_list *dnsval_l;
-    int retval;
+    val_context_t *gen, *retired;
+    unsigned int parts;
 
     if (NULL == context)
         return VAL_BAD_ARGUMENT;
 
     /* 
-     * Don't refresh the context if someone else is using it
+     * Don't wait if another thread is already re-reading the files
      */
-    if (!CTX_LOCK_POL_EX_TRY(context)) {
+    if (!CTX_LOCK_RELOAD_TRY(context)) {
         return VAL_NO_ERROR;
     }
-    CTX_LOCK_COUNT_INC(context,pol_count); /* only needed for EX_TRY */
 
-    GET_LATEST_TIMESTAMP(context, context->resolv_conf, context->r_timestamp,
-                         rsb);
-    if (rsb.st_mtime != 0 &&  rsb.st_mtime != context->r_timestamp) {
-        if (VAL_NO_ERROR != (retval = val_refresh_resolver_policy(context))) {
-            goto err;
+    gen = context->pol_pending;
+    parts = context->pol_pending_parts;
+
+    if (gen == NULL) {
+        parts = 0;
+        GET_LATEST_TIMESTAMP(context, context->resolv_conf,
+                             context->r_timestamp, rsb);
+        if (rsb.st_mtime != 0 &&  rsb.st_mtime != context->r_timestamp)
+            parts |= VAL_POL_GEN_RES;
+        GET_LATEST_TIMESTAMP(context, context->root_conf,
+                             context->h_timestamp, hsb);
+        if (hsb.st_mtime != 0 &&  hsb.st_mtime != context->h_timestamp)
+            parts |= VAL_POL_GEN_HINTS;
+
+        /* dnsval.conf can point to a list of files */
+        for (dnsval_l = context->dnsval_l; dnsval_l; dnsval_l=dnsval_l->next) {
+            GET_LATEST_TIMESTAMP(context,  dnsval_l->dnsval_conf, 
+                                 dnsval_l->v_timestamp, vsb);
+            if (vsb.st_mtime != 0 &&  vsb.st_mtime != dnsval_l->v_timestamp) {
+                parts |= VAL_POL_GEN_VAL;
+                break;
+            }
         }
-    }    
-    GET_LATEST_TIMESTAMP(context, context->root_conf, context->h_timestamp, hsb);
-    if (hsb.st_mtime != 0 &&  hsb.st_mtime != context->h_timestamp){
-        if (VAL_NO_ERROR != (retval = val_refresh_root_hints(context))) {
-            goto err;
+
+        if (parts != 0) {
+            gen = val_read_policy_gen(context, &parts);
         }
     }
 
-    /* dnsval.conf can point to a list of files */
-    for (dnsval_l = context->dnsval_l; dnsval_l; dnsval_l=dnsval_l->next) {
-        GET_LATEST_TIMESTAMP(context,  dnsval_l->dnsval_conf, 
-                             dnsval_l->v_timestamp, vsb);
-        if (vsb.st_mtime != 0 &&  vsb.st_mtime != dnsval_l->v_timestamp) {
-            retval = val_refresh_validator_policy(context);
-            if (VAL_NO_ERROR != retval) {
-                goto err;
-            }
-            break;
+    /* 
+     * Publish the new generation. If this thread holds the cache
+     * lock further up, keep it for the next call.
+     */
+    if (gen != NULL) {
+        if (CTX_LOCK_ACACHE_TRY(context)) {
+            CTX_LOCK_COUNT_INC(context,ac_count); /* only needed for TRY */
+            val_publish_policy_gen(context, gen, parts);
+            CTX_UNLOCK_ACACHE(context);
+
+            gen->pol_retired = context->pol_retired;
+            context->pol_retired = gen;
+            context->pol_pending = NULL;
+            context->pol_pending_parts = 0;
+            val_log(context, LOG_INFO,
+                    "val_refresh_context(): Published new configuration");
+        } else {
+            context->pol_pending = gen;
+            context->pol_pending_parts = parts;
         }
     }
 
-    retval = VAL_NO_ERROR;
+    /* 
+     * Free the retired generations once no query can be using them
+     */
+    retired = NULL;
+    if (context->pol_retired && CTX_LOCK_POL_EX_TRY(context)) {
+        CTX_LOCK_COUNT_INC(context,pol_count); /* only needed for EX_TRY */
+        retired = context->pol_retired;
+        context->pol_retired = NULL;
+        CTX_UNLOCK_POL(context);
+    }
+    CTX_UNLOCK_RELOAD(context);
 
-err:
-    CTX_UNLOCK_POL(context);
-    return retval;
+    while (NULL != (gen = retired)) {
+        retired = gen->pol_retired;
+        val_free_policy_gen(gen);
+    }
 
+    return VAL_NO_ERROR;
 }
 
 /*
@@ -432,15 +671,20 @@ val_create_context_internal( const char *label,
     /* Check if the request is for the default context, and we have one available */
     /* 
      *  either label should be NULL, or if label is not NULL, our global policy should
-     *  be set so that environment overrides what ever is passed by the app
+     *  be set so that environment overrides what ever is passed by the app.
+     *  A private context is never shared.
      */
-    if (the_default_context && 
+    if (the_default_context && !(polflags & CTX_DYN_POL_PRIVATE) &&
         (label == NULL || 
          (the_default_context->g_opt && 
           (the_default_context->g_opt->env_policy == VAL_POL_GOPT_OVERRIDE || 
            the_default_context->g_opt->app_policy == VAL_POL_GOPT_OVERRIDE)))) {
 
-        /* Update the dynamic policies */
+        /* 
+         * Update the dynamic policies. A reload that is reading the
+         * configuration borrows them, so wait for it to finish.
+         */
+        CTX_LOCK_RELOAD(the_default_context);
         if (the_default_context->dyn_valpolopt != NULL) {
             if (the_default_context->dyn_valpolopt->log_target)
                 FREE(the_default_context->dyn_valpolopt->log_target);
@@ -462,6 +706,7 @@ val_create_context_internal( const char *label,
         dyn_nslist = NULL;
 
         the_default_context->dyn_polflags = polflags;
+        CTX_UNLOCK_RELOAD(the_default_context);
 
         *newcontext = the_default_context;
 
@@ -509,11 +754,20 @@ val_create_context_internal( const char *label,
         retval = VAL_INTERNAL_ERROR;
         goto err;
     }
+    if (0 != pthread_mutex_init(&(*newcontext)->reload_lock, NULL)) {
+        pthread_rwlock_destroy(&(*newcontext)->pol_rwlock);
+        pthread_mutex_destroy(&(*newcontext)->ac_lock);
+        FREE(*newcontext);
+        *newcontext = NULL;
+        retval = VAL_INTERNAL_ERROR;
+        goto err;
+    }
 
 #ifdef HAVE_PTHREAD_H
     if (0 != pthread_mutex_init(&(*newcontext)->ref_lock, NULL)) {
         pthread_rwlock_destroy(&(*newcontext)->pol_rwlock);
         pthread_mutex_destroy(&(*newcontext)->ac_lock);
+        pthread_mutex_destroy(&(*newcontext)->reload_lock);
         FREE(*newcontext);
         *newcontext = NULL;
         retval = VAL_INTERNAL_ERROR;
@@ -558,10 +812,21 @@ val_create_context_internal( const char *label,
     }
     memset(((*newcontext)->e_pol), 0,
            MAX_POL_TOKEN * sizeof(policy_entry_t *));
+    (*newcontext)->e_pol_idx = (struct policy_index *)
+        MALLOC(MAX_POL_TOKEN * sizeof(struct policy_index));
+    if ((*newcontext)->e_pol_idx == NULL) {
+        retval = VAL_OUT_OF_MEMORY;
+        goto err;
+    }
+    memset(((*newcontext)->e_pol_idx), 0,
+           MAX_POL_TOKEN * sizeof(struct policy_index));
    
     (*newcontext)->val_log_targets = NULL;
+    (*newcontext)->val_log_max_level = -1;
     (*newcontext)->q_list = NULL;
     (*newcontext)->as_list = NULL;
+    (*newcontext)->as_pollfd = -1;
+    (*newcontext)->as_eventfd = -1;
     (*newcontext)->def_cflags = 0; 
     (*newcontext)->def_uflags = flags & VAL_QFLAGS_USERMASK; 
 
@@ -599,7 +864,7 @@ val_create_context_internal( const char *label,
             (*newcontext)->resolv_conf,
             (*newcontext)->root_conf);
 
-    if (label == NULL) {
+    if (label == NULL && !(polflags & CTX_DYN_POL_PRIVATE)) {
         /*
          * Set the default context if this was not set earlier.
          * We do not override a previously set default context,
@@ -727,6 +992,8 @@ void
 val_free_context(val_context_t * context)
 {
     struct val_query_chain *q;
+    val_context_t *gen;
+    val_log_t *logp;
     int has_refs = 0;
 
     if (context == NULL)
@@ -771,8 +1038,16 @@ val_free_context(val_context_t * context)
 #ifndef VAL_NO_THREADS
     pthread_rwlock_destroy(&context->pol_rwlock);
     pthread_mutex_destroy(&context->ac_lock);
+    pthread_mutex_destroy(&context->reload_lock);
 #endif
 
+    if (context->pol_pending)
+        val_free_policy_gen(context->pol_pending);
+    while (NULL != (gen = context->pol_retired)) {
+        context->pol_retired = gen->pol_retired;
+        val_free_policy_gen(gen);
+    }
+
     if (context->label)
         FREE(context->label);
 
@@ -791,6 +1066,11 @@ val_free_context(val_context_t * context)
     if (context->root_ns)
         free_name_servers(&context->root_ns);
 
+    while (NULL != (logp = context->val_log_targets)) {
+        context->val_log_targets = logp->next;
+        FREE(logp);
+    }
+
     if (context->dyn_valpolopt) {
         if (context->dyn_valpolopt->log_target)
             FREE(context->dyn_valpolopt->log_target);
@@ -806,12 +1086,25 @@ val_free_context(val_context_t * context)
     destroy_respol(context);
     destroy_valpol(context);
     FREE(context->e_pol);
+    FREE(context->e_pol_idx);
 
     while (NULL != (q = context->q_list)) {
         context->q_list = q->qc_next;
-        free_query_chain_structure(q);
+        free_query_chain_structure(context, q);
         q = NULL;
     }
+#ifndef VAL_NO_ASYNC
+    if (context->as_timers)
+        FREE(context->as_timers);
+    if (context->as_fdmap)
+        FREE(context->as_fdmap);
+#ifdef VAL_ASYNC_POLLFD
+    if (context->as_pollfd >= 0)
+        close(context->as_pollfd);
+    if (context->as_eventfd >= 0)
+        close(context->as_eventfd);
+#endif
+#endif
     if (context->base_dnsval_conf)
         FREE(context->base_dnsval_conf);
     
@@ -831,6 +1124,10 @@ val_free_validator_state()
     val_context_t * saved_ctx = NULL;
 
     free_validator_cache();
+    free_dane_cache();
+
+    /* flush and stop the asynchronous log writer */
+    val_log_async_shutdown();
 
     LOCK_DEFAULT_CONTEXT();
     if (the_default_context != NULL) {
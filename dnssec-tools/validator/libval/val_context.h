@@ -51,6 +51,14 @@
         CTX_LOCK_COUNT_DEC(ctx,ac_count);       \
         pthread_mutex_unlock(&ctx->ac_lock);    \
     } while (0)
+#define CTX_LOCK_ACACHE_TRY(ctx) \
+       (0 == pthread_mutex_trylock(&ctx->ac_lock))
+#define CTX_LOCK_RELOAD(ctx) \
+       pthread_mutex_lock(&ctx->reload_lock)
+#define CTX_LOCK_RELOAD_TRY(ctx) \
+       (0 == pthread_mutex_trylock(&ctx->reload_lock))
+#define CTX_UNLOCK_RELOAD(ctx) \
+       pthread_mutex_unlock(&ctx->reload_lock)
 
 #else
 
@@ -60,6 +68,10 @@
 #define CTX_UNLOCK_POL(ctx) 
 #define CTX_LOCK_ACACHE(ctx) 
 #define CTX_UNLOCK_ACACHE(ctx)
+#define CTX_LOCK_ACACHE_TRY(ctx) (1 == 1)
+#define CTX_LOCK_RELOAD(ctx)
+#define CTX_LOCK_RELOAD_TRY(ctx) (1 == 1)
+#define CTX_UNLOCK_RELOAD(ctx)
 
 #define CTX_LOCK_COUNT_INC(ctx,it)
 #define CTX_LOCK_COUNT_DEC(ctx,it)
@@ -163,8 +163,9 @@ dsasha1_sigverify(val_context_t * ctx,
     }
 
     gen_evp_hash(VAL_EVP_DGST_SHA1, data, data_len, sha1_hash, SHA_DIGEST_LENGTH); 
-    val_log(ctx, LOG_DEBUG, "dsasha1_sigverify(): SHA-1 hash = %s",
-            get_hex_string(sha1_hash, SHA_DIGEST_LENGTH, buf, buflen));
+    if (VAL_LOG_ENABLED(ctx, LOG_DEBUG))
+        val_log(ctx, LOG_DEBUG, "dsasha1_sigverify(): SHA-1 hash = %s",
+                get_hex_string(sha1_hash, SHA_DIGEST_LENGTH, buf, buflen));
 
     val_log(ctx, LOG_DEBUG,
             "dsasha1_sigverify(): verifying DSA signature...");
@@ -336,8 +337,9 @@ rsamd5_sigverify(val_context_t * ctx,
 
     memset(md5_hash, 0, MD5_DIGEST_LENGTH);
     MD5(data, data_len, (u_char *) md5_hash);
-    val_log(ctx, LOG_DEBUG, "rsamd5_sigverify(): MD5 hash = %s",
-            get_hex_string(md5_hash, MD5_DIGEST_LENGTH, buf, buflen));
+    if (VAL_LOG_ENABLED(ctx, LOG_DEBUG))
+        val_log(ctx, LOG_DEBUG, "rsamd5_sigverify(): MD5 hash = %s",
+                get_hex_string(md5_hash, MD5_DIGEST_LENGTH, buf, buflen));
 
     val_log(ctx, LOG_DEBUG,
             "rsamd5_sigverify(): verifying RSA signature...");
@@ -467,8 +469,9 @@ rsasha_sigverify(val_context_t * ctx,
         return;
     } 
 
-    val_log(ctx, LOG_DEBUG, "rsasha_sigverify(): SHA hash = %s",
-            get_hex_string(sha_hash, hashlen, buf, buflen));
+    if (VAL_LOG_ENABLED(ctx, LOG_DEBUG))
+        val_log(ctx, LOG_DEBUG, "rsasha_sigverify(): SHA hash = %s",
+                get_hex_string(sha_hash, hashlen, buf, buflen));
     val_log(ctx, LOG_DEBUG,
             "rsasha_sigverify(): verifying RSA signature...");
 
@@ -547,8 +550,9 @@ ecdsa_sigverify(val_context_t * ctx,
     }
 
 
-    val_log(ctx, LOG_DEBUG, "ecdsa_sigverify(): SHA hash = %s",
-            get_hex_string(sha_hash, hashlen, buf, buflen));
+    if (VAL_LOG_ENABLED(ctx, LOG_DEBUG))
+        val_log(ctx, LOG_DEBUG, "ecdsa_sigverify(): SHA hash = %s",
+                get_hex_string(sha_hash, hashlen, buf, buflen));
     val_log(ctx, LOG_DEBUG,
             "ecdsa_sigverify(): verifying ECDSA signature...");
 
@@ -13,6 +13,7 @@
 
 #include "validator-internal.h"
 #include "val_context.h"
+#include "val_cache.h"
 #include "validator/val_dane.h"
 
 /*
@@ -26,6 +27,56 @@ typedef struct _val_dane_async_status {
     val_async_status *das; /* helps us cancel this lookup */
 } _val_dane_async_status_t;
 
+/*
+ * A certificate that is being matched against TLSA records. Its DER
+ * encoding, SubjectPublicKeyInfo and their digests are computed when
+ * they are first needed, so that each is computed once per chain no
+ * matter how many TLSA records are checked.
+ */
+#define DANE_HAVE_DER       0x01
+#define DANE_HAVE_SPKI      0x02
+#define DANE_HAVE_SHA256    0x04    /* shifted left by the selector */
+#define DANE_HAVE_SHA512    0x10    /* likewise */
+
+struct dane_cert {
+    X509           *cert;
+    const unsigned char *der;
+    int             derlen;
+    unsigned char  *der_alloc;      /* if we encoded it ourselves */
+    unsigned char  *spki;
+    int             spkilen;
+    int             have;           /* DANE_HAVE_* */
+    unsigned char   sha256[2][SHA256_DIGEST_LENGTH];
+    unsigned char   sha512[2][SHA512_DIGEST_LENGTH];
+};
+
+/*
+ * DANE verdicts, keyed on the TLSA RRset, the certificate and (for
+ * connection checks) the name, and kept for the TTL of the RRset. The
+ * table is direct mapped; a new verdict replaces whatever was in its
+ * slot.
+ */
+#define DANE_VERDICT_CACHE_SIZE 256     /* must be a power of 2 */
+
+struct dane_verdict {
+    u_int32_t       dv_hash;
+    unsigned char  *dv_key;
+    size_t          dv_keylen;
+    time_t          dv_expires;
+    int             dv_verdict;
+};
+
+static struct dane_verdict dane_verdicts[DANE_VERDICT_CACHE_SIZE];
+
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t dane_verdict_lock = PTHREAD_MUTEX_INITIALIZER;
+#define DANE_VERDICT_LOCK()     pthread_mutex_lock(&dane_verdict_lock)
+#define DANE_VERDICT_UNLOCK()   pthread_mutex_unlock(&dane_verdict_lock)
+#else
+#define DANE_VERDICT_LOCK()
+#define DANE_VERDICT_UNLOCK()
+#endif
+
 /* 
  * Free up the list of DANE TLSA records 
  */
@@ -528,6 +579,226 @@ int get_pkeybuf(X509 *cert, int *pkeyLen, unsigned char **pkeybuf)
     return rv;
 }
 
+static void
+dane_cert_init(struct dane_cert *dc, X509 *cert,
+               const unsigned char *der, int derlen)
+{
+    memset(dc, 0, sizeof(*dc));
+    dc->cert = cert;
+    if (der != NULL && derlen > 0) {
+        dc->der = der;
+        dc->derlen = derlen;
+        dc->have = DANE_HAVE_DER;
+    }
+}
+
+static void
+dane_cert_free(struct dane_cert *dc)
+{
+    if (dc->der_alloc)
+        OPENSSL_free(dc->der_alloc);
+    if (dc->spki)
+        FREE(dc->spki);
+    memset(dc, 0, sizeof(*dc));
+}
+
+/*
+ * Return the part of the certificate that a TLSA record with the given
+ * selector and matching type is compared against, or NULL if it cannot
+ * be computed.
+ */
+static const unsigned char *
+dane_cert_data(struct dane_cert *dc, int selector, int type, size_t *len)
+{
+    const unsigned char *data;
+    int datalen;
+
+    if (selector == DANE_SEL_FULLCERT) {
+        if (!(dc->have & DANE_HAVE_DER)) {
+            unsigned char *c;
+
+            dc->derlen = i2d_X509(dc->cert, NULL);
+            if (dc->derlen <= 0 ||
+                (dc->der_alloc = OPENSSL_malloc(dc->derlen)) == NULL)
+                return NULL;
+            c = dc->der_alloc;
+            if (i2d_X509(dc->cert, &c) <= 0)
+                return NULL;
+            dc->der = dc->der_alloc;
+            dc->have |= DANE_HAVE_DER;
+        }
+        data = dc->der;
+        datalen = dc->derlen;
+    } else if (selector == DANE_SEL_PUBKEY) {
+        if (!(dc->have & DANE_HAVE_SPKI)) {
+            if (0 != get_pkeybuf(dc->cert, &dc->spkilen, &dc->spki))
+                return NULL;
+            dc->have |= DANE_HAVE_SPKI;
+        }
+        data = dc->spki;
+        datalen = dc->spkilen;
+    } else {
+        return NULL;
+    }
+
+    switch (type) {
+    case DANE_MATCH_EXACT:
+        *len = datalen;
+        return data;
+
+    case DANE_MATCH_SHA256:
+        if (!(dc->have & (DANE_HAVE_SHA256 << selector))) {
+            SHA256(data, datalen, dc->sha256[selector]);
+            dc->have |= DANE_HAVE_SHA256 << selector;
+        }
+        *len = SHA256_DIGEST_LENGTH;
+        return dc->sha256[selector];
+
+    case DANE_MATCH_SHA512:
+        if (!(dc->have & (DANE_HAVE_SHA512 << selector))) {
+            SHA512(data, datalen, dc->sha512[selector]);
+            dc->have |= DANE_HAVE_SHA512 << selector;
+        }
+        *len = SHA512_DIGEST_LENGTH;
+        return dc->sha512[selector];
+
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Build the verdict cache key for a TLSA RRset (or, if single is set,
+ * just its first record), a DER encoded certificate and a name. Also
+ * returns the smallest TTL of the records.
+ */
+static unsigned char *
+dane_verdict_key(const char *qname, struct val_danestatus *dane_head,
+                 int single, const unsigned char *der, int derlen,
+                 size_t *keylen, long *ttl)
+{
+    struct val_danestatus *dane_cur;
+    unsigned char *key, *cp;
+    size_t len, namelen;
+
+    namelen = qname ? strlen(qname) : 0;
+    len = namelen + 1 + sizeof(int) + derlen;
+    *ttl = -1;
+    for (dane_cur = dane_head; dane_cur; dane_cur = dane_cur->next) {
+        len += 3 + sizeof(size_t) + dane_cur->datalen;
+        if (*ttl < 0 || dane_cur->ttl < *ttl)
+            *ttl = dane_cur->ttl;
+        if (single)
+            break;
+    }
+
+    key = (unsigned char *) MALLOC(len);
+    if (key == NULL)
+        return NULL;
+
+    cp = key;
+    if (namelen)
+        memcpy(cp, qname, namelen);
+    cp += namelen;
+    *cp++ = '\0';
+    for (dane_cur = dane_head; dane_cur; dane_cur = dane_cur->next) {
+        *cp++ = dane_cur->usage;
+        *cp++ = dane_cur->selector;
+        *cp++ = dane_cur->type;
+        memcpy(cp, &dane_cur->datalen, sizeof(size_t));
+        cp += sizeof(size_t);
+        memcpy(cp, dane_cur->data, dane_cur->datalen);
+        cp += dane_cur->datalen;
+        if (single)
+            break;
+    }
+    memcpy(cp, &derlen, sizeof(int));
+    cp += sizeof(int);
+    memcpy(cp, der, derlen);
+
+    *keylen = len;
+    return key;
+}
+
+static u_int32_t
+dane_verdict_hash(const unsigned char *key, size_t keylen)
+{
+    u_int32_t h = 2166136261U;
+    size_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < keylen; i++)
+        h = (h ^ key[i]) * 16777619U;
+    return h;
+}
+
+/*
+ * Look up a verdict. Returns VAL_DANE_NOERROR or VAL_DANE_CHECK_FAILED
+ * if one is cached, -1 otherwise.
+ */
+static int
+dane_verdict_get(const unsigned char *key, size_t keylen, u_int32_t hash)
+{
+    struct dane_verdict *dv;
+    int verdict = -1;
+
+    DANE_VERDICT_LOCK();
+    dv = &dane_verdicts[hash & (DANE_VERDICT_CACHE_SIZE - 1)];
+    if (dv->dv_key != NULL && dv->dv_hash == hash &&
+        dv->dv_keylen == keylen && !memcmp(dv->dv_key, key, keylen)) {
+        if (dv->dv_expires > time(NULL))
+            verdict = dv->dv_verdict;
+        else {
+            FREE(dv->dv_key);
+            memset(dv, 0, sizeof(*dv));
+        }
+    }
+    DANE_VERDICT_UNLOCK();
+    return verdict;
+}
+
+/*
+ * Store a verdict; the cache takes over the key.
+ */
+static void
+dane_verdict_put(unsigned char *key, size_t keylen, u_int32_t hash,
+                 long ttl, int verdict)
+{
+    struct dane_verdict *dv;
+
+    if (ttl <= 0) {
+        FREE(key);
+        return;
+    }
+
+    DANE_VERDICT_LOCK();
+    dv = &dane_verdicts[hash & (DANE_VERDICT_CACHE_SIZE - 1)];
+    if (dv->dv_key)
+        FREE(dv->dv_key);
+    dv->dv_hash = hash;
+    dv->dv_key = key;
+    dv->dv_keylen = keylen;
+    dv->dv_expires = time(NULL) + ttl;
+    dv->dv_verdict = verdict;
+    DANE_VERDICT_UNLOCK();
+}
+
+/*
+ * Release all cached DANE verdicts
+ */
+void
+free_dane_cache(void)
+{
+    int i;
+
+    DANE_VERDICT_LOCK();
+    for (i = 0; i < DANE_VERDICT_CACHE_SIZE; i++) {
+        if (dane_verdicts[i].dv_key)
+            FREE(dane_verdicts[i].dv_key);
+    }
+    memset(dane_verdicts, 0, sizeof(dane_verdicts));
+    DANE_VERDICT_UNLOCK();
+}
 
 /*
  * check if the qname matches any of the names provided in the given
@@ -642,24 +913,20 @@ val_dane_cert_namechk(val_context_t *context,
 
 /*
  * Matches a DANE record against the correct part of a key, either in
- * raw or a calculated hash of the part.
+ * raw or a calculated hash of the part. The caller holds the policy
+ * lock of ctx.
  */
 static int 
-val_dane_match_internal(val_context_t *context,
+val_dane_match_internal(val_context_t *ctx,
                            struct val_danestatus *dane_cur, 
-                           const unsigned char *data,
-                           int len,
-                           X509 *cert)
+                           struct dane_cert *dc)
 {
-    val_context_t *ctx;
+    const unsigned char *cert_data;
+    size_t cert_datalen = 0;
 
-    if (cert == NULL || data == NULL || len <= 0 || dane_cur == NULL)
+    if (dc == NULL || dc->cert == NULL || dane_cur == NULL)
         return VAL_DANE_CHECK_FAILED;
 
-    ctx = val_create_or_refresh_context(context);/* does CTX_LOCK_POL_SH */
-    if (ctx == NULL)
-        return VAL_DANE_INTERNAL_ERROR;
-
     val_log(ctx, LOG_DEBUG,
             "val_dane_match(): checking for DANE cert match - sel:%d type:%d", 
             dane_cur->selector, dane_cur->type);
@@ -669,159 +936,34 @@ val_dane_match_internal(val_context_t *context,
         val_log(ctx, LOG_NOTICE,
             "val_dane_match(): Unknown DANE selector:%d",
             dane_cur->selector);
-        CTX_UNLOCK_POL(ctx);
         return VAL_DANE_CHECK_FAILED;
     }
 
-    if (dane_cur->type == DANE_MATCH_EXACT) {
-#if 0
-    {
-        char buf1[1028];
-        char buf2[1028];
-        size_t buflen1 = 1024;
-        size_t buflen2 = 1024;
-        fprintf(stderr,
-            "val_dane_match(): checking for exact DANE cert match %s \n\n %s", 
-            get_hex_string(data, len, buf1, buflen1),
-            get_hex_string(dane_cur->data, dane_cur->datalen, buf2, buflen2));
-    }
-#endif
-
-        if (dane_cur->selector == DANE_SEL_FULLCERT) {
-            if (len == dane_cur->datalen &&
-                    !memcmp(data, dane_cur->data, len)) {
-
-                val_log(ctx, LOG_INFO, "val_dane_match(): DANE_SEL_FULLCERT/DANE_MATCH_EXACT success");
-                CTX_UNLOCK_POL(ctx);
-                return VAL_DANE_NOERROR;
-            }
-
-            val_log(ctx, LOG_NOTICE, "val_dane_match(): DANE_SEL_FULLCERT/DANE_MATCH_EXACT failed");
-            CTX_UNLOCK_POL(ctx);
-            return VAL_DANE_CHECK_FAILED;
-
-        } else {
-            int pkeyLen = 0;
-            unsigned char *pkeybuf = NULL;
-
-            if (0 != get_pkeybuf(cert, &pkeyLen, &pkeybuf)) {
-                CTX_UNLOCK_POL(ctx);
-                return VAL_DANE_CHECK_FAILED;
-            }
-
-            if (pkeyLen == dane_cur->datalen &&
-                0 == memcmp(pkeybuf, dane_cur->data, pkeyLen)) {
-
-                val_log(ctx, LOG_INFO, "val_dane_match(): DANE_SEL_PUBKEY/DANE_MATCH_EXACT success");
-                FREE(pkeybuf);
-                CTX_UNLOCK_POL(ctx);
-                return VAL_DANE_NOERROR;
-            }
-            val_log(ctx, LOG_NOTICE, "val_dane_match(): DANE_SEL_PUBKEY/DANE_MATCH_EXACT failed");
-            FREE(pkeybuf);
-            CTX_UNLOCK_POL(ctx);
-            return VAL_DANE_CHECK_FAILED;
-
-        }
-
-    } else if (dane_cur->type == DANE_MATCH_SHA256) {
-
-        unsigned char cert_sha[SHA256_DIGEST_LENGTH];
-        memset(cert_sha, 0, SHA256_DIGEST_LENGTH);
-
-        if (dane_cur->selector == DANE_SEL_FULLCERT) {
-            SHA256(data, len, cert_sha);
-        } else {
-            int pkeyLen = 0;
-            unsigned char *pkeybuf = NULL;
-            if (0 != get_pkeybuf(cert, &pkeyLen, &pkeybuf)) {
-                CTX_UNLOCK_POL(ctx);
-                return VAL_DANE_CHECK_FAILED;
-            }
-#if 0
-            {
-                char buf1[1028];
-                size_t buflen1 = 1024;
-                fprintf(stderr, "pkeylen = %d, pkeybuf = %s\n",
-                        pkeyLen, 
-                        get_hex_string(pkeybuf, pkeyLen, buf1, buflen1));
-            }
-#endif
-            SHA256(pkeybuf, pkeyLen, cert_sha);
-            FREE(pkeybuf);
-        }
-
-#if 0
-        {
-        char buf1[1028];
-        char buf2[1028];
-        size_t buflen1 = 1024;
-        size_t buflen2 = 1024;
-        fprintf(stderr,
-            "val_dane_match(): checking for DANE SHA256 match %s with %s", 
-            get_hex_string(cert_sha, SHA256_DIGEST_LENGTH, buf1, buflen1),
-            get_hex_string(dane_cur->data, dane_cur->datalen, buf2, buflen2));
-        }
-#endif
-
-        if (dane_cur->datalen == SHA256_DIGEST_LENGTH && 
-            0 == memcmp(cert_sha, dane_cur->data, SHA256_DIGEST_LENGTH)) {
-            val_log(ctx, LOG_INFO, "val_dane_match(): DANE_MATCH_SHA256 success");
-            CTX_UNLOCK_POL(ctx);
-            return VAL_DANE_NOERROR;
-        }
-        val_log(ctx, LOG_NOTICE, 
-                "val_dane_match(): DANE SHA256 does NOT match (len = %d)", 
-                dane_cur->datalen);
-        CTX_UNLOCK_POL(ctx);
+    if ((dane_cur->type != DANE_MATCH_EXACT) &&
+        (dane_cur->type != DANE_MATCH_SHA256) &&
+        (dane_cur->type != DANE_MATCH_SHA512)) {
+        val_log(ctx, LOG_NOTICE,
+                "val_dane_match(): Error - Unknown DANE type:%d",
+                dane_cur->type);
         return VAL_DANE_CHECK_FAILED;
+    }
 
-    } else if (dane_cur->type == DANE_MATCH_SHA512) {
-
-        unsigned char cert_sha[SHA512_DIGEST_LENGTH];
-        memset(cert_sha, 0, SHA512_DIGEST_LENGTH);
-
-        if (dane_cur->selector  == DANE_SEL_FULLCERT) {
-            SHA512(data, len, cert_sha);
-        } else {
-            int pkeyLen = 0;
-            unsigned char *pkeybuf = NULL;
-            if (0 != get_pkeybuf(cert, &pkeyLen, &pkeybuf)) {
-                CTX_UNLOCK_POL(ctx);
-                return VAL_DANE_CHECK_FAILED;
-            }
-            SHA512(pkeybuf, pkeyLen, cert_sha);
-            FREE(pkeybuf);
-        }
-
-#if 0
-        {
-        char buf1[1028];
-        char buf2[1028];
-        size_t buflen1 = 1024;
-        size_t buflen2 = 1024;
-        fprintf(stderr,
-            "val_dane_match(): checking for DANE SHA512 match %s with %s", 
-            get_hex_string(cert_sha, SHA512_DIGEST_LENGTH, buf1, buflen1),
-            get_hex_string(dane_cur->data, dane_cur->datalen, buf2, buflen2));
-        }
-#endif
-
-        if (dane_cur->datalen == SHA512_DIGEST_LENGTH &&
-            0 == memcmp(cert_sha, dane_cur->data, SHA512_DIGEST_LENGTH)) {
-            val_log(ctx, LOG_INFO, "val_dane_match(): DANE_MATCH_SHA512 success");
-            CTX_UNLOCK_POL(ctx);
-            return VAL_DANE_NOERROR;
-        }
-        val_log(ctx, LOG_NOTICE, "val_dane_match(): DANE_MATCH_SHA512 failed");
-        CTX_UNLOCK_POL(ctx);
+    cert_data = dane_cert_data(dc, dane_cur->selector, dane_cur->type,
+                               &cert_datalen);
+    if (cert_data == NULL)
         return VAL_DANE_CHECK_FAILED;
 
-    } 
+    if (cert_datalen == dane_cur->datalen &&
+        0 == memcmp(cert_data, dane_cur->data, cert_datalen)) {
+        val_log(ctx, LOG_INFO,
+                "val_dane_match(): DANE sel:%d type:%d match success",
+                dane_cur->selector, dane_cur->type);
+        return VAL_DANE_NOERROR;
+    }
 
     val_log(ctx, LOG_NOTICE,
-            "val_dane_match(): Error - Unknown DANE type:%d", dane_cur->type);
-    CTX_UNLOCK_POL(ctx);
+            "val_dane_match(): DANE sel:%d type:%d does NOT match (len = %d)",
+            dane_cur->selector, dane_cur->type, (int)dane_cur->datalen);
     return VAL_DANE_CHECK_FAILED;
 }
 
@@ -833,23 +975,57 @@ int val_dane_match(val_context_t *context,
                    const unsigned char *data, 
                    int len) 
 {
+    val_context_t *ctx;
+    struct dane_cert dc;
     X509 *cert;
     const unsigned char *tmp = data;
+    unsigned char *key;
+    size_t keylen = 0;
+    u_int32_t hash = 0;
+    long ttl;
     int ret;
 
     if (data == NULL)
         return 0;
 
+    if (dane_cur == NULL || len <= 0)
+        return VAL_DANE_CHECK_FAILED;
+
+    /* a repeated check needs neither the certificate nor its digests */
+    key = dane_verdict_key(NULL, dane_cur, 1, data, len, &keylen, &ttl);
+    if (key != NULL) {
+        hash = dane_verdict_hash(key, keylen);
+        if ((ret = dane_verdict_get(key, keylen, hash)) != -1) {
+            FREE(key);
+            return ret;
+        }
+    }
+
     cert = d2i_X509(NULL, &tmp, len);
-    if (cert == NULL)
+    if (cert == NULL) {
+        if (key)
+            FREE(key);
         return 0;
+    }
 
-    ret = val_dane_match_internal(context, dane_cur, 
-                                  data, len, cert);
+    ctx = val_create_or_refresh_context(context);/* does CTX_LOCK_POL_SH */
+    if (ctx == NULL) {
+        X509_free(cert);
+        if (key)
+            FREE(key);
+        return VAL_DANE_INTERNAL_ERROR;
+    }
 
+    dane_cert_init(&dc, cert, data, len);
+    ret = val_dane_match_internal(ctx, dane_cur, &dc);
+    dane_cert_free(&dc);
+    CTX_UNLOCK_POL(ctx);
 
     X509_free(cert);
 
+    if (key)
+        dane_verdict_put(key, keylen, hash, ttl, ret);
+
     return ret;
 }
 
@@ -870,6 +1046,13 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
     int cert_datalen = 0;
     unsigned char *cert_data = NULL;
     unsigned char *c = NULL;
+    int ee_only = 1;
+    unsigned char *key = NULL;
+    size_t keylen = 0;
+    u_int32_t hash = 0;
+    long ttl = 0;
+    struct dane_cert ee;
+    struct dane_cert *chain = NULL;
 
     ssl_dane_data = (struct val_ssl_data *) arg;
     if (x509ctx == NULL || ssl_dane_data == NULL)
@@ -877,6 +1060,7 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
 
     
     cert = X509_STORE_CTX_get0_cert(x509ctx);
+    dane_cert_init(&ee, cert, NULL, 0);
     context = ssl_dane_data->context;
 
     /* 
@@ -893,6 +1077,45 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
 
     X509_NAME_oneline(X509_get_subject_name(cert), buf, sizeof(buf));
 
+    if (((cert_datalen = i2d_X509(cert, NULL)) <= 0) ||
+         ((cert_data = OPENSSL_malloc(cert_datalen)) == NULL) ||
+         (((c = cert_data)) && (cert_datalen = i2d_X509(cert, &c)) <= 0)) {
+
+        if (cert_data)
+            OPENSSL_free(cert_data);
+        return 0;
+    } 
+
+    /*
+     * If none of the TLSA records needs PKIX validation, the outcome
+     * only depends on the records, the name and this certificate, and
+     * an earlier verdict can be reused.
+     */
+    for (dane_cur = ssl_dane_data->danestatus; dane_cur; 
+            dane_cur = dane_cur->next) {
+        if (dane_cur->usage != DANE_USE_DOMAIN_ISSUED)
+            ee_only = 0;
+    }
+    if (ee_only) {
+        key = dane_verdict_key(ssl_dane_data->qname,
+                               ssl_dane_data->danestatus, 0,
+                               cert_data, cert_datalen, &keylen, &ttl);
+        if (key != NULL) {
+            hash = dane_verdict_hash(key, keylen);
+            rv = dane_verdict_get(key, keylen, hash);
+            if (rv != -1) {
+                FREE(key);
+                key = NULL;
+                val_log(context, LOG_INFO,
+                        "DANE: using cached verdict for %s", buf);
+                goto done;
+            }
+            rv = VAL_DANE_CHECK_FAILED;
+        }
+    }
+
+    dane_cert_init(&ee, cert, cert_data, cert_datalen);
+
     /* 
      * Do PKIX checks only if we need to.
      * PKIX checks requried for all types except DANE_USE_DOMAIN_ISSUED 
@@ -915,7 +1138,7 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
 
                 val_log(context,
                         LOG_INFO, "DANE: cert PKIX verification failed = %s", buf);
-                return 0;
+                goto done;
             }
 
             certList = X509_STORE_CTX_get_chain(x509ctx);
@@ -950,7 +1173,7 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
                  */
                 val_log(context,
                         LOG_WARNING, "DANE: BADSTATE X509 error depth different from cert length = %s", buf);
-                return 0;
+                goto done;
             }
 
             /* we only need to do PKIX checks once */
@@ -970,21 +1193,12 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
     if (!do_cert_namechk(context, ssl_dane_data->qname, cert)) {
         val_log(context,
                 LOG_WARNING, "DANE: Cert namecheck failed for %s", buf);
-        return 0;
+        goto done;
     }
 
 
     dane_cur = ssl_dane_data->danestatus;
 
-    if (((cert_datalen = i2d_X509(cert, NULL)) <= 0) ||
-         ((cert_data = OPENSSL_malloc(cert_datalen)) == NULL) ||
-         (((c = cert_data)) && (cert_datalen = i2d_X509(cert, &c)) <= 0)) {
-
-        if (cert_data)
-            OPENSSL_free(cert_data);
-        return 0;
-    } 
-
     /*
      * Keep looking for a good TLSA match
      */
@@ -1005,8 +1219,7 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
                 }
                 /* fall through */
             case DANE_USE_DOMAIN_ISSUED: /*3*/
-                if (val_dane_match_internal(context,
-                        dane_cur, cert_data, cert_datalen, cert) == 0) {
+                if (val_dane_match_internal(context, dane_cur, &ee) == 0) {
                     val_log(context, LOG_INFO, 
                             "DANE: passed EE certificate checks = %s", buf);
                     rv = VAL_DANE_NOERROR;
@@ -1027,10 +1240,22 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
                  * Check that the TLSA cert matches one of the certs
                  * in the chain
                  */
+                if (chain == NULL && depth >= 0) {
+                    chain = (struct dane_cert *)
+                        MALLOC((depth + 1) * sizeof(struct dane_cert));
+                    if (chain == NULL)
+                        goto done;
+                    for (i = 0; i <= depth; i++)
+                        dane_cert_init(&chain[i],
+                                       sk_X509_value(certList, i), NULL, 0);
+                }
                 for (i = 0; i <= depth; i++) {
-                    cert = sk_X509_value(certList, i);
-                    if (val_dane_match_internal(context,
-                            dane_cur, cert_data, cert_datalen, cert) == 0) {
+                    struct dane_cert *dc = &chain[i];
+
+                    /* the peer's own certificate is usually first */
+                    if (dc->cert == cert)
+                        dc = &ee;
+                    if (val_dane_match_internal(context, dane_cur, dc) == 0) {
                         /* reset err status */
                         val_log(context, 
                                 LOG_INFO, "DANE: skipping TA PKIX validation = %s", buf);
@@ -1052,6 +1277,15 @@ val_X509_peer_cert_verify_cb(X509_STORE_CTX *x509ctx, void *arg)
 
 done:
 
+    if (key)
+        dane_verdict_put(key, keylen, hash, ttl, rv);
+
+    if (chain) {
+        for (i = 0; i <= depth; i++)
+            dane_cert_free(&chain[i]);
+        FREE(chain);
+    }
+    dane_cert_free(&ee);
     if (cert_data)
         OPENSSL_free(cert_data);
 
@@ -17,6 +17,12 @@
 static int      debug_level = LOG_INFO;
 static val_log_t *default_log_head = NULL;
 
+/*
+ * Cached maximum of the levels on default_log_head (-1 when empty),
+ * kept up to date by val_log_insert(); see VAL_LOG_ENABLED().
+ */
+int             _val_log_max_level = -1;
+
 int
 val_log_debug_level(void)
 {
@@ -31,12 +37,22 @@ val_log_set_debug_level(int level)
 
 int
 val_log_highest_debug_level(void)
+{
+    return (_val_log_max_level < 0) ? 0 : _val_log_max_level;
+}
+
+/*
+ * Return the highest level accepted by any target in the given
+ * list, or -1 if the list is empty
+ */
+int
+val_log_list_max_level(val_log_t *log_head)
 {
     val_log_t      *tmp_log;
-    int             level = 0;
+    int             level = -1;
 
-    for (tmp_log = default_log_head; tmp_log; tmp_log = tmp_log->next)
-        if (tmp_log->level > level)
+    for (tmp_log = log_head; tmp_log; tmp_log = tmp_log->next)
+        if (tmp_log->logf && tmp_log->level > level)
             level = tmp_log->level;
 
     return level;
@@ -94,7 +110,7 @@ val_log_val_rrset_pfx(const val_context_t * ctx, int level,
 {
     char            buf1[2049], buf2[2049];
 
-    if (!val_rrset_rec)
+    if (!val_rrset_rec || !VAL_LOG_ENABLED(ctx, level))
         return;
 
     val_log(ctx, level, "%srrs->val_rrset_name=%s rrs->val_rrset_type=%s "
@@ -156,6 +172,9 @@ val_log_rrsig_rdata(const val_context_t * ctx, int level,
     char            buf[1028];
     struct timeval  tv_sig1, tv_sig2;
 
+    if (!VAL_LOG_ENABLED(ctx, level))
+        return;
+
     if (rdata) {
         if (!prefix)
             prefix = "";
@@ -185,6 +204,10 @@ val_log_dnskey_rdata(val_context_t * ctx, int level, const char *prefix,
                      val_dnskey_rdata_t * rdata)
 {
     char            buf[1028];
+
+    if (!VAL_LOG_ENABLED(ctx, level))
+        return;
+
     if (rdata) {
         if (!prefix)
             prefix = "";
@@ -251,7 +274,7 @@ val_log_assertion_pfx(const val_context_t * ctx, int level,
 #endif
 
 
-    if (next_as == NULL)
+    if (next_as == NULL || !VAL_LOG_ENABLED(ctx, level))
         return;
 
     class_h = next_as->val_ac_rrset->val_rrset_class;
@@ -363,7 +386,7 @@ val_log_authentication_chain(const val_context_t * ctx, int level,
     int real_type_h;
     int real_class_h;
 
-    if (results == NULL) { 
+    if (results == NULL || !VAL_LOG_ENABLED(ctx, level)) { 
         return;
     } 
     
@@ -728,6 +751,241 @@ val_log_insert(val_log_t **log_head, val_log_t * logp)
         *log_head = logp;
     else
         tmp_log->next = logp;
+
+    if (log_head == &default_log_head && logp->level > _val_log_max_level)
+        _val_log_max_level = logp->level;
+}
+
+static void
+val_log_write_file(FILE *fp, const char *buf)
+{
+    fprintf(fp, "%s\n", buf);
+    fflush(fp);
+}
+
+static void
+val_log_write_udp(SOCKET sock, struct sockaddr_in *server, const char *buf)
+{
+    sendto(sock, buf, strlen(buf), 0, (struct sockaddr *) server,
+           sizeof(struct sockaddr_in));
+}
+
+#if !defined(VAL_NO_THREADS) && defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+#define VAL_LOG_ASYNC
+#endif
+
+#ifdef VAL_LOG_ASYNC
+/*
+ * Asynchronous log sink.
+ *
+ * File and UDP targets flagged with VAL_LOG_F_ASYNC do not write from
+ * the logging thread. The message is formatted into a slot of a
+ * bounded multi-producer/single-consumer ring and a writer thread
+ * does the actual I/O. Slots are claimed with a compare-and-swap on
+ * the head index and published through a per-slot sequence number, so
+ * producers never take a lock or wait on the writer; when the ring is
+ * full the message is dropped and counted. Each slot carries a copy
+ * of its destination, so targets may be freed while messages for them
+ * are still queued.
+ */
+#define VAL_LOG_RING_SIZE   1024    /* must be a power of 2 */
+#define VAL_LOG_MSG_SIZE    1028
+#define VAL_LOG_WRITER_NAP  10000000L   /* ns between idle polls */
+
+#define VAL_LOG_MSG_FILE    1
+#define VAL_LOG_MSG_UDP     2
+
+struct val_log_msg {
+    volatile size_t     seq;
+    int                 kind;
+    FILE               *fp;
+    SOCKET              sock;
+    struct sockaddr_in  server;
+    char                buf[VAL_LOG_MSG_SIZE];
+};
+
+static struct val_log_msg *log_ring = NULL;
+static volatile size_t log_ring_head = 0;
+static size_t   log_ring_tail = 0;  /* writer thread only */
+static volatile int log_ring_dropped = 0;
+
+static pthread_mutex_t log_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t log_writer_tid;
+static volatile int log_writer_running = 0;
+static volatile int log_writer_stop = 0;
+
+static void
+val_log_async_write(struct val_log_msg *m, const char *buf)
+{
+    if (m->kind == VAL_LOG_MSG_UDP)
+        val_log_write_udp(m->sock, &m->server, buf);
+    else
+        val_log_write_file(m->fp, buf);
+}
+
+/*
+ * Write out everything that has been published so far.
+ * Must only be called by the (single) consumer.
+ */
+static int
+val_log_async_drain(void)
+{
+    struct val_log_msg *m;
+    int             count = 0;
+    int             dropped;
+    char            note[128];
+
+    for (;;) {
+        m = &log_ring[log_ring_tail & (VAL_LOG_RING_SIZE - 1)];
+        if (m->seq != log_ring_tail + 1)
+            break;
+        __sync_synchronize();
+
+        if (log_ring_dropped) {
+            dropped = __sync_fetch_and_and(&log_ring_dropped, 0);
+            res_gettimeofday_buf(note, sizeof(note) - 2);
+            snprintf(&note[19], sizeof(note) - 21,
+                     "libval: %d log message(s) dropped%s", dropped,
+                     (m->kind == VAL_LOG_MSG_UDP) ? "\n" : "");
+            val_log_async_write(m, note);
+        }
+        val_log_async_write(m, m->buf);
+
+        __sync_synchronize();
+        m->seq = log_ring_tail + VAL_LOG_RING_SIZE;
+        log_ring_tail++;
+        count++;
+    }
+    return count;
+}
+
+static void *
+val_log_async_writer(void *arg)
+{
+    struct timespec nap;
+
+    while (!log_writer_stop) {
+        if (0 == val_log_async_drain()) {
+            nap.tv_sec = 0;
+            nap.tv_nsec = VAL_LOG_WRITER_NAP;
+            nanosleep(&nap, NULL);
+        }
+    }
+    val_log_async_drain();
+    return NULL;
+}
+
+/*
+ * Make sure the ring and the writer thread exist.
+ * Returns 1 if messages can be queued, 0 otherwise.
+ */
+static int
+val_log_async_start(void)
+{
+    int             i;
+    int             running;
+
+    if (log_writer_running)
+        return 1;
+
+    pthread_mutex_lock(&log_writer_lock);
+    if (!log_writer_running) {
+        if (log_ring == NULL) {
+            log_ring = (struct val_log_msg *)
+                MALLOC(VAL_LOG_RING_SIZE * sizeof(struct val_log_msg));
+            if (log_ring != NULL) {
+                for (i = 0; i < VAL_LOG_RING_SIZE; i++)
+                    log_ring[i].seq = i;
+                log_ring_head = 0;
+                log_ring_tail = 0;
+            }
+        }
+        log_writer_stop = 0;
+        if (log_ring != NULL &&
+            0 == pthread_create(&log_writer_tid, NULL,
+                                val_log_async_writer, NULL)) {
+            __sync_synchronize();
+            log_writer_running = 1;
+        }
+    }
+    running = log_writer_running;
+    pthread_mutex_unlock(&log_writer_lock);
+
+    return running;
+}
+
+/*
+ * Queue a message for the writer thread. Returns 0 if the message was
+ * consumed (queued or dropped), -1 if the caller should write it out
+ * synchronously.
+ */
+static int
+val_log_async_put(val_log_t *logp, int kind, const char *template,
+                  va_list ap)
+{
+    struct val_log_msg *m;
+    size_t          pos;
+    long            dif;
+
+    if (!val_log_async_start())
+        return -1;
+
+    pos = log_ring_head;
+    for (;;) {
+        m = &log_ring[pos & (VAL_LOG_RING_SIZE - 1)];
+        dif = (long) m->seq - (long) pos;
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(&log_ring_head, pos, pos + 1))
+                break;
+            pos = log_ring_head;
+        } else if (dif < 0) {
+            /* ring is full; don't wait for the writer */
+            __sync_fetch_and_add(&log_ring_dropped, 1);
+            return 0;
+        } else {
+            pos = log_ring_head;
+        }
+    }
+
+    m->kind = kind;
+    res_gettimeofday_buf(m->buf, sizeof(m->buf) - 2);
+    vsnprintf(&m->buf[19], sizeof(m->buf) - 21, template, ap);
+    if (kind == VAL_LOG_MSG_UDP) {
+        strcat(m->buf, "\n");
+        m->sock = logp->opt.udp.sock;
+        memcpy(&m->server, &logp->opt.udp.server, sizeof(m->server));
+    } else {
+        m->fp = logp->opt.file.fp;
+    }
+
+    __sync_synchronize();
+    m->seq = pos + 1;
+
+    return 0;
+}
+#endif /* VAL_LOG_ASYNC */
+
+/*
+ * Stop the asynchronous log writer after flushing any queued
+ * messages. Logging to async targets falls back to synchronous
+ * writes until the writer is restarted by the next message.
+ */
+void
+val_log_async_shutdown(void)
+{
+#ifdef VAL_LOG_ASYNC
+    pthread_mutex_lock(&log_writer_lock);
+    if (log_writer_running) {
+        log_writer_running = 0;
+        log_writer_stop = 1;
+        pthread_join(log_writer_tid, NULL);
+    }
+    if (log_ring != NULL) {
+        FREE(log_ring);
+        log_ring = NULL;
+    }
+    pthread_mutex_unlock(&log_writer_lock);
+#endif
 }
 
 void
@@ -754,17 +1012,21 @@ val_log_udp(val_log_t * logp, const val_context_t * ctx, int level,
 {
     /** Needs to be at least two characters larger than message size */
     char            buf[1028];
-    int             length = sizeof(struct sockaddr_in);
 
     if (NULL == logp)
         return;
 
+#ifdef VAL_LOG_ASYNC
+    if ((logp->lflags & VAL_LOG_F_ASYNC) &&
+        0 == val_log_async_put(logp, VAL_LOG_MSG_UDP, template, ap))
+        return;
+#endif
+
     res_gettimeofday_buf(buf, sizeof(buf) - 2);
     vsnprintf(&buf[19], sizeof(buf) - 21, template, ap);
     strcat(buf, "\n");
 
-    sendto(logp->opt.udp.sock, buf, strlen(buf), 0,
-           (struct sockaddr *) &logp->opt.udp.server, length);
+    val_log_write_udp(logp->opt.udp.sock, &logp->opt.udp.server, buf);
 
     return;
 }
@@ -778,16 +1040,22 @@ val_log_filep(val_log_t * logp, const val_context_t * ctx, int level,
     if (NULL == logp)
         return;
 
-    res_gettimeofday_buf(buf, sizeof(buf) - 2);
     if (NULL == logp->opt.file.fp) {
         logp->opt.file.fp = fopen(logp->opt.file.name, "a");
         if (NULL == logp->opt.file.fp)
             return;
     }
+
+#ifdef VAL_LOG_ASYNC
+    if ((logp->lflags & VAL_LOG_F_ASYNC) &&
+        0 == val_log_async_put(logp, VAL_LOG_MSG_FILE, template, ap))
+        return;
+#endif
+
+    res_gettimeofday_buf(buf, sizeof(buf) - 2);
     vsnprintf(&buf[19], sizeof(buf) - 21, template, ap);
 
-    fprintf(logp->opt.file.fp, "%s\n", buf);
-    fflush(logp->opt.file.fp);
+    val_log_write_file(logp->opt.file.fp, buf);
 }
 
 #ifdef HAVE_SYSLOG_H
@@ -842,12 +1110,10 @@ val_log_add_udp(val_log_t **log_head, int level, char *host, int port)
     if (NULL == logp)
         return NULL;
 
-    if (-1 == logp->opt.udp.sock) {
-        logp->opt.udp.sock = socket(AF_INET, SOCK_DGRAM, 0);
-        if (logp->opt.udp.sock == INVALID_SOCKET) {
-            FREE(logp);
-            return NULL;
-        }
+    logp->opt.udp.sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (logp->opt.udp.sock == INVALID_SOCKET) {
+        FREE(logp);
+        return NULL;
     }
 
     logp->opt.udp.server.sin_family = AF_INET;
@@ -958,6 +1224,7 @@ val_log_add_optarg_to_list(val_log_t **log_head, const char *str_in, int use_std
     val_log_t      *logp = NULL;
     char           *l, *copy, *str;
     int             level;
+    int             async = 0;
 
     if ((NULL == str_in) || (NULL == (copy = strdup(str_in))))
         return NULL;
@@ -972,6 +1239,12 @@ val_log_add_optarg_to_list(val_log_t **log_head, const char *str_in, int use_std
     level = (int)strtol(copy, (char **)NULL, 10);
     str = l;
 
+    /* async:<dest-type>... hands file/net output to the writer thread */
+    if (0 == strncmp(str, "async:", 6) && str[6] != 0) {
+        async = 1;
+        str += 6;
+    }
+
     switch (*str) {
 
     case 'f':                  /* file */
@@ -1031,7 +1304,7 @@ val_log_add_optarg_to_list(val_log_t **log_head, const char *str_in, int use_std
                 goto err;
             }
             *l++ = 0;
-            port = (int)strtol(str, (char **)NULL, 10);
+            port = (int)strtol(l, (char **)NULL, 10);
 
             logp = val_log_add_udp(log_head, level, host, port);
         }
@@ -1042,6 +1315,10 @@ val_log_add_optarg_to_list(val_log_t **log_head, const char *str_in, int use_std
         break;
     }
 
+    if (async && logp &&
+        (logp->logf == val_log_filep || logp->logf == val_log_udp))
+        logp->lflags |= VAL_LOG_F_ASYNC;
+
 err:
     free(copy);
     return logp;
@@ -1056,7 +1333,7 @@ val_log_ap(const val_context_t * ctx, int level, const char *log_template,
     va_list         aq;
     val_log_t      *logp = default_log_head;
 
-    if (NULL == log_template)
+    if (NULL == log_template || !VAL_LOG_ENABLED(ctx, level))
         return;
 
     for (; NULL != logp; logp = logp->next) {
@@ -1092,7 +1369,7 @@ val_log(const val_context_t * ctx, int level, const char *format, ...)
     va_list         ap;
     val_log_t      *logp = default_log_head;
 
-    if (NULL == format)
+    if (NULL == format || !VAL_LOG_ENABLED(ctx, level))
         return;
 
     for (; NULL != logp; logp = logp->next) {
@@ -230,6 +230,278 @@ int free_policy_entry(policy_entry_t *pol_entry, int index)
 
 }
 
+/*
+ * FNV-1a hash of the text a policy entry was parsed from, ignoring
+ * white space. mark_policy_changes() tells changed entries by it.
+ */
+static u_int32_t
+policy_text_hash(const char *start, const char *end)
+{
+    u_int32_t       h = 2166136261U;
+
+    for (; start < end; start++) {
+        if (isspace((unsigned char) *start))
+            continue;
+        h = (h ^ (u_char) *start) * 16777619U;
+    }
+    return h;
+}
+
+/*
+ ***************************************************************
+ * Policy index
+ ***************************************************************
+ */
+
+/*
+ * Function: build_policy_index
+ *
+ * Purpose:  (Re)build the index for the policy list ctx->e_pol[index].
+ *           Must be called whenever the list changes. On failure the
+ *           previous index is left in place.
+ */
+int
+build_policy_index(val_context_t * ctx, int index)
+{
+    struct name_trie_node *root;
+    policy_entry_t *cur;
+    long            expiry = 0;
+
+    if (ctx == NULL || ctx->e_pol_idx == NULL ||
+        index < 0 || index >= MAX_POL_TOKEN)
+        return VAL_BAD_ARGUMENT;
+
+    root = name_trie_create();
+    if (root == NULL)
+        return VAL_OUT_OF_MEMORY;
+
+    for (cur = ctx->e_pol[index]; cur; cur = cur->next) {
+        if (VAL_NO_ERROR != name_trie_insert(root, cur->zone_n, cur)) {
+            name_trie_free(root);
+            return VAL_OUT_OF_MEMORY;
+        }
+        if (cur->exp_ttl > 0 && (expiry == 0 || cur->exp_ttl < expiry))
+            expiry = cur->exp_ttl;
+    }
+
+    name_trie_free(ctx->e_pol_idx[index].pi_root);
+    ctx->e_pol_idx[index].pi_root = root;
+    ctx->e_pol_idx[index].pi_expiry = expiry;
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: unindex_policy_entry
+ *
+ * Purpose:  Drop an entry that is about to be removed from the list
+ *           ctx->e_pol[index] from the index. This never allocates.
+ */
+void
+unindex_policy_entry(val_context_t * ctx, int index,
+                     policy_entry_t * pol_entry)
+{
+    if (ctx == NULL || ctx->e_pol_idx == NULL || pol_entry == NULL ||
+        index < 0 || index >= MAX_POL_TOKEN)
+        return;
+
+    name_trie_remove(ctx->e_pol_idx[index].pi_root, pol_entry->zone_n,
+                     pol_entry);
+}
+
+void
+free_policy_index(val_context_t * ctx, int index)
+{
+    if (ctx == NULL || ctx->e_pol_idx == NULL ||
+        index < 0 || index >= MAX_POL_TOKEN)
+        return;
+
+    name_trie_free(ctx->e_pol_idx[index].pi_root);
+    ctx->e_pol_idx[index].pi_root = NULL;
+    ctx->e_pol_idx[index].pi_expiry = 0;
+}
+
+/*
+ * Function: policy_match_first
+ *
+ * Purpose:  Start a lookup of the policies of the given kind that apply
+ *           to name_n, and return the first (most specific) one. Use
+ *           policy_match_next() for the rest.
+ *
+ *           Entries whose ttl has passed are skipped; the clock is
+ *           only consulted if the index holds entries with a ttl.
+ */
+policy_entry_t *
+policy_match_first(val_context_t * ctx, int index, u_char * name_n,
+                   struct policy_match *pm)
+{
+    struct policy_index *pi;
+
+    if (pm == NULL)
+        return NULL;
+
+    pm->pm_count = 0;
+    pm->pm_pos = 0;
+    pm->pm_now = 0;
+    pm->pm_zone = NULL;
+
+    if (ctx == NULL || ctx->e_pol_idx == NULL || name_n == NULL ||
+        index < 0 || index >= MAX_POL_TOKEN)
+        return NULL;
+
+    pi = &ctx->e_pol_idx[index];
+    if (pi->pi_root == NULL)
+        return NULL;
+
+    if (pi->pi_expiry > 0) {
+        struct timeval  tv;
+
+        gettimeofday(&tv, NULL);
+        if (pi->pi_expiry <= tv.tv_sec)
+            pm->pm_now = tv.tv_sec;
+    }
+
+    pm->pm_count = name_trie_path(pi->pi_root, name_n, pm->pm_node,
+                                  pm->pm_name);
+
+    return policy_match_next(pm);
+}
+
+policy_entry_t *
+policy_match_next(struct policy_match *pm)
+{
+    struct name_trie_node *node;
+    policy_entry_t *cur;
+
+    if (pm == NULL)
+        return NULL;
+
+    while (pm->pm_count > 0) {
+        node = pm->pm_node[pm->pm_count - 1];
+        while (pm->pm_pos < node->ntn_ndata) {
+            cur = (policy_entry_t *) node->ntn_data[pm->pm_pos++];
+            if (pm->pm_now && cur->exp_ttl > 0 &&
+                cur->exp_ttl <= pm->pm_now)
+                continue;
+            pm->pm_zone = pm->pm_name[pm->pm_count - 1];
+            return cur;
+        }
+        pm->pm_count--;
+        pm->pm_pos = 0;
+    }
+
+    pm->pm_zone = NULL;
+    return NULL;
+}
+
+/*
+ * Check if ctx has a policy entry of the given kind for the same zone
+ * and with the same text as pol_entry
+ */
+static int
+policy_entry_unchanged(val_context_t * ctx, int index,
+                       policy_entry_t * pol_entry)
+{
+    struct name_trie_node *node;
+    int             i;
+
+    node = name_trie_find(ctx->e_pol_idx[index].pi_root, pol_entry->zone_n);
+    if (node == NULL)
+        return 0;
+    for (i = 0; i < node->ntn_ndata; i++) {
+        if (((policy_entry_t *) node->ntn_data[i])->src_hash ==
+            pol_entry->src_hash)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Check if two sets of global options would validate the same way;
+ * the log target, time outs and retries don't matter to the cache.
+ */
+static int
+global_options_equal(val_global_opt_t *a, val_global_opt_t *b)
+{
+    if (a == NULL || b == NULL)
+        return (a == b);
+
+    return (a->local_is_trusted == b->local_is_trusted &&
+            a->edns0_size == b->edns0_size &&
+            a->env_policy == b->env_policy &&
+            a->app_policy == b->app_policy &&
+            a->closest_ta_only == b->closest_ta_only &&
+            a->rec_fallback == b->rec_fallback &&
+            a->max_refresh == b->max_refresh &&
+            a->proto == b->proto);
+}
+
+/*
+ * Function: mark_policy_changes
+ *
+ * Purpose:  Before the validator policy of ctx is replaced with the one
+ *           read into gen, mark the cached queries that the change can
+ *           affect for deletion: those for names at or below a zone
+ *           whose policy entries were added, dropped or changed, or all
+ *           of them if the policy label or the global options changed.
+ *           The rest of the query cache stays valid.
+ *
+ *           The caller must hold the cache lock of ctx, under which
+ *           its query list and policy are changed.
+ */
+void
+mark_policy_changes(val_context_t * ctx, val_context_t * gen)
+{
+    struct name_trie_node *changed;
+    struct name_trie_node *nodes[NAME_TRIE_MAX_LABELS + 1];
+    u_char         *names[NAME_TRIE_MAX_LABELS + 1];
+    struct val_query_chain *q;
+    policy_entry_t *cur;
+    int             i, all = 0, count = 0;
+
+    if (ctx == NULL || gen == NULL)
+        return;
+
+    changed = name_trie_create();
+    if (changed == NULL ||
+        (ctx->label == NULL) != (gen->label == NULL) ||
+        (ctx->label && strcmp(ctx->label, gen->label)) ||
+        !global_options_equal(ctx->g_opt, gen->g_opt)) {
+        all = 1;
+        goto mark;
+    }
+
+    for (i = 0; i < MAX_POL_TOKEN && !all; i++) {
+        for (cur = gen->e_pol[i]; cur && !all; cur = cur->next) {
+            if (!policy_entry_unchanged(ctx, i, cur)) {
+                if (VAL_NO_ERROR != name_trie_insert(changed, cur->zone_n, cur))
+                    all = 1;
+                count++;
+            }
+        }
+        for (cur = ctx->e_pol[i]; cur && !all; cur = cur->next) {
+            if (!policy_entry_unchanged(gen, i, cur)) {
+                if (VAL_NO_ERROR != name_trie_insert(changed, cur->zone_n, cur))
+                    all = 1;
+                count++;
+            }
+        }
+    }
+
+  mark:
+    if (all || count > 0) {
+        for (q = ctx->q_list; q; q = q->qc_next) {
+            if (all || name_trie_path(changed, q->qc_name_n, nodes, names) > 0)
+                q->qc_flags |= VAL_QUERY_MARK_FOR_DELETION;
+        }
+    }
+    val_log(ctx, LOG_INFO,
+            "mark_policy_changes(): %s", all ? "flushing the query cache" :
+            count ? "flushing queries below changed policies" :
+            "policy unchanged; keeping the query cache");
+
+    name_trie_free(changed);
+}
+
 static void
 set_global_opt_defaults(val_global_opt_t *gopt)
 {
@@ -247,6 +519,8 @@ set_global_opt_defaults(val_global_opt_t *gopt)
     gopt->proto = VAL_POL_GOPT_PROTO_ANY;
     gopt->timeout = RES_TIMEOUT;
     gopt->retry = RES_RETRY;
+    gopt->search_parallel = 0;
+    gopt->hedge = VAL_POL_GOPT_HEDGE_NONE;
 }
 
 int 
@@ -285,6 +559,10 @@ update_dynamic_gopt(val_global_opt_t **g_new, val_global_opt_t *g)
         (*g_new)->timeout = g->timeout;        
     if (g->retry != VAL_POL_GOPT_UNSET)
         (*g_new)->retry = g->retry;        
+    if (g->search_parallel != VAL_POL_GOPT_UNSET)
+        (*g_new)->search_parallel = g->search_parallel;        
+    if (g->hedge != VAL_POL_GOPT_UNSET)
+        (*g_new)->hedge = g->hedge;
 
     return VAL_NO_ERROR;
 }
@@ -1165,6 +1443,81 @@ parse_retry(char **buf_ptr, char *end_ptr, int *line_number,
     return VAL_NO_ERROR;
 }
 
+static int
+parse_search_parallel(char **buf_ptr, char *end_ptr, int *line_number,
+                      int *endst, val_global_opt_t *g_opt)
+{
+    char            token[TOKEN_MAX];
+    int retval;
+
+    if ((buf_ptr == NULL) || (*buf_ptr == NULL) || (end_ptr == NULL) || 
+        (g_opt == NULL) || (endst == NULL) || (line_number == NULL))
+        return VAL_BAD_ARGUMENT;
+
+    /* read the next token */
+    if (VAL_NO_ERROR != (retval = 
+        val_get_token(buf_ptr, end_ptr, line_number, 
+                      token, sizeof(token), endst,
+                      CONF_COMMENT, CONF_END_STMT, 0))) {
+        return retval;
+    }
+    if ((endst && (strlen(token) == 0)) ||
+        (*buf_ptr >= end_ptr)) { 
+        return VAL_CONF_PARSE_ERROR;
+    }
+
+    if (!strncmp(token, GOPT_YES_STR, strlen(GOPT_YES_STR))) {
+        g_opt->search_parallel = 1;
+    } else if (!strncmp(token, GOPT_NO_STR, strlen(GOPT_NO_STR))) {
+        g_opt->search_parallel = 0;
+    } else {
+        return VAL_CONF_PARSE_ERROR;
+    }
+    return VAL_NO_ERROR;
+}
+
+/*
+ * hedge no | rtt | <number of servers to ask at once>
+ */
+static int
+parse_hedge(char **buf_ptr, char *end_ptr, int *line_number,
+            int *endst, val_global_opt_t *g_opt)
+{
+    char            token[TOKEN_MAX];
+    char           *end;
+    long            n;
+    int retval;
+
+    if ((buf_ptr == NULL) || (*buf_ptr == NULL) || (end_ptr == NULL) || 
+        (g_opt == NULL) || (endst == NULL) || (line_number == NULL))
+        return VAL_BAD_ARGUMENT;
+
+    /* read the next token */
+    if (VAL_NO_ERROR != (retval = 
+        val_get_token(buf_ptr, end_ptr, line_number, 
+                      token, sizeof(token), endst,
+                      CONF_COMMENT, CONF_END_STMT, 0))) {
+        return retval;
+    }
+    if ((endst && (strlen(token) == 0)) ||
+        (*buf_ptr >= end_ptr)) { 
+        return VAL_CONF_PARSE_ERROR;
+    }
+
+    if (!strcmp(token, GOPT_NO_STR)) {
+        g_opt->hedge = VAL_POL_GOPT_HEDGE_NONE;
+    } else if (!strcmp(token, GOPT_HEDGE_RTT_STR)) {
+        g_opt->hedge = VAL_POL_GOPT_HEDGE_RTT;
+    } else {
+        n = strtol(token, &end, 10);
+        if (*end != '\0' || n < 1 || n > VAL_POL_GOPT_HEDGE_MAX)
+            return VAL_CONF_PARSE_ERROR;
+        /* asking one server at a time is no hedging */
+        g_opt->hedge = (n == 1) ? VAL_POL_GOPT_HEDGE_NONE : (int) n;
+    }
+    return VAL_NO_ERROR;
+}
+
 static int
 get_global_options(char **buf_ptr, char *end_ptr, 
                    int *line_number, val_global_opt_t **g_opt) 
@@ -1273,6 +1626,20 @@ get_global_options(char **buf_ptr, char *end_ptr,
                 goto err;
             }
 
+        } else if (!strcmp(token, GOPT_SEARCH_PARALLEL)) {
+            if (VAL_NO_ERROR != 
+                    (retval = parse_search_parallel(buf_ptr, end_ptr,
+                                                    line_number, &endst, *g_opt))) {
+                goto err;
+            }
+
+        } else if (!strcmp(token, GOPT_HEDGE)) {
+            if (VAL_NO_ERROR != 
+                    (retval = parse_hedge(buf_ptr, end_ptr,
+                                          line_number, &endst, *g_opt))) {
+                goto err;
+            }
+
         } else {
             retval = VAL_CONF_PARSE_ERROR;
             goto err;
@@ -1306,6 +1673,7 @@ get_next_policy_fragment(char **buf_ptr, char *end_ptr, const char *scope,
     int             index = 0;
     u_char          zone_n[NS_MAXCDNAME];
     policy_entry_t *pol_entry;
+    char           *pol_start;
 
     if ((buf_ptr == NULL) || (*buf_ptr == NULL) || (end_ptr == NULL) || 
         (pol_frag == NULL) || (line_number == NULL))
@@ -1421,6 +1789,7 @@ get_next_policy_fragment(char **buf_ptr, char *end_ptr, const char *scope,
             memcpy(pol_entry->zone_n, zone_n, wire_name_length(zone_n));
             pol_entry->exp_ttl = 0;
             pol_entry->next = NULL;
+            pol_start = *buf_ptr;
 
             /*
              * parse the remaining contents according to the keyword 
@@ -1433,6 +1802,7 @@ get_next_policy_fragment(char **buf_ptr, char *end_ptr, const char *scope,
                 FREE(label);
                 return VAL_CONF_PARSE_ERROR;
             }
+            pol_entry->src_hash = policy_text_hash(pol_start, *buf_ptr);
 
             STORE_POLICY_ENTRY_IN_LIST(pol_entry, pol);
         }
@@ -1603,6 +1973,7 @@ destroy_valpol(val_context_t * ctx)
     
     for (i = 0; i < MAX_POL_TOKEN; i++) {
         /* Free this list */
+        free_policy_index(ctx, i);
         if (ctx->e_pol[i]) {
             free_policy_entry(ctx->e_pol[i], i);
         }
@@ -2008,9 +2379,9 @@ read_val_config_file(val_context_t * ctx, const char *scope)
     struct policy_overrides *t;
     struct dnsval_list *dnsval_c;
     int             retval;
+    int             i;
     const char *label;
     char *newctxlab;
-    struct val_query_chain *q;
     char *logtarget = NULL;
     val_global_opt_t *g_opt = NULL;
     struct dnsval_list *dlist = NULL;
@@ -2124,6 +2495,13 @@ skipfileread:
         }
     }
 
+    for (i = 0; i < MAX_POL_TOKEN; i++) {
+        if (VAL_NO_ERROR != (retval = build_policy_index(ctx, i))) {
+            destroy_valpol(ctx);
+            goto err;
+        }
+    }
+
     /* if there are no global options defined set defaults here */
     if (g_opt == NULL) {
         g_opt = (val_global_opt_t *) MALLOC (sizeof (val_global_opt_t));
@@ -2136,6 +2514,7 @@ skipfileread:
 
     /* Process Global options */
     ctx->g_opt = g_opt;
+    g_opt = NULL;
 
     /* free up older log targets */
     while (ctx->val_log_targets) {
@@ -2144,6 +2523,7 @@ skipfileread:
         ctx->val_log_targets = temp;
     }
     ctx->val_log_targets = NULL;
+    ctx->val_log_max_level = -1;
     
     /* enable logging as specified by global options */
     if (ctx->g_opt && ctx->g_opt->log_target) {
@@ -2159,6 +2539,7 @@ skipfileread:
     if (logtarget) {
         val_log_add_optarg_to_list(&ctx->val_log_targets, logtarget, 1);
     }
+    ctx->val_log_max_level = val_log_list_max_level(ctx->val_log_targets);
 
     /* 
      * Merge other dynamic global options into the context 
@@ -2169,15 +2550,6 @@ skipfileread:
             goto err;
     }
 
-    /* 
-     * Free the query cache 
-     */
-    while (NULL != (q = ctx->q_list)) {
-        ctx->q_list = q->qc_next;
-        free_query_chain_structure(q);
-        q = NULL;
-    }
-
     ctx->dnsval_l = dlist;
 
     val_log(ctx, LOG_DEBUG, "read_val_config_file(): Done reading validator configuration");
@@ -2846,7 +3218,7 @@ read_root_hints_file(val_context_t * ctx)
     if (VAL_NO_ERROR !=
         (retval =
          res_zi_unverified_ns_list(ctx, &ns_list, root_zone_n, root_info,
-                                   &pending_glue))) {
+                                   NULL, &pending_glue))) {
 
         goto err;
     }
@@ -3107,6 +3479,7 @@ val_add_valpolicy(val_context_t *context,
     }
     memcpy(pol_entry->zone_n, zone_n, wire_name_length(zone_n));
     pol_entry->exp_ttl = ttl_x;
+    pol_entry->src_hash = policy_text_hash(buf_ptr, end_ptr);
     pol_entry->next = NULL;
     
     /*
@@ -3140,6 +3513,23 @@ val_add_valpolicy(val_context_t *context,
 
     /* Merge this policy into the context */
     STORE_POLICY_ENTRY_IN_LIST(pol_entry, ctx->e_pol[index]);
+    if (VAL_NO_ERROR != build_policy_index(ctx, index)) {
+        /* take it out again; the old index is still valid */
+        policy_entry_t *p, *prev = NULL;
+        for (p = ctx->e_pol[index]; p && p != (*pol)->pe; p = p->next)
+            prev = p;
+        if (prev)
+            prev->next = (*pol)->pe->next;
+        else
+            ctx->e_pol[index] = (*pol)->pe->next;
+        (*pol)->pe->next = NULL;
+        free_policy_entry((*pol)->pe, index);
+        FREE(*pol);
+        *pol = NULL;
+        CTX_UNLOCK_ACACHE(ctx);
+        CTX_UNLOCK_POL(ctx);
+        return VAL_OUT_OF_MEMORY;
+    }
 
     /* Flush queries that match this name */
     for(q=ctx->q_list; q; q=q->qc_next) {
@@ -3186,6 +3576,7 @@ val_remove_valpolicy(val_context_t *context, val_policy_handle_t *pol)
     }
 
     /* unlink the policy */
+    unindex_policy_entry(ctx, pol->index, p);
     if (prev) {
         prev->next = p->next;
     } else {
@@ -49,38 +49,42 @@
 #define ZONE_SE_DO_VAL 2
 #define ZONE_SE_UNTRUSTED 3
 
-#define RETRIEVE_POLICY(ctx, index, pol) do {\
-    pol = (ctx == NULL) ? NULL :\
-          (!ctx->e_pol[index])? NULL:(ctx->e_pol[index]);\
-    /* check if policies are still the same */\
-    if (pol) {\
-        policy_entry_t *cur, *next, *prev;\
-        struct timeval  tv;\
-        /* Get current time */\
-        gettimeofday(&tv, NULL);\
-        /* Remove expired policies */\
-        prev = NULL;\
-        cur = pol;\
-        while (cur) {\
-            next = cur->next;\
-            if (cur->exp_ttl > 0 &&\
-                cur->exp_ttl <= tv.tv_sec) {\
-                if (prev) {\
-                    prev->next = next;\
-                } else {\
-                    pol = next;\
-                }\
-                cur->next = NULL;\
-                free_policy_entry(cur, index);\
-                cur = next;\
-            } else {\
-                prev = cur;\
-                cur = cur->next;\
-            }\
-        }\
-    }\
-} while(0)
-    
+/*
+ * Per-keyword index of the policy lists in ctx->e_pol[], so that the
+ * policy applicable to a name can be found without walking the list.
+ * The lists remain the owners of the entries; the index is a name trie
+ * holding pointers to them.
+ */
+struct policy_index {
+    struct name_trie_node *pi_root;
+    long            pi_expiry;  /* earliest entry expiry, 0 if none */
+};
+
+/*
+ * Lookup state for policy_match_first()/policy_match_next(). Matches
+ * are returned longest zone first; entries for the same zone are
+ * returned in list order. pm_zone points to the suffix of the looked up
+ * name that the returned entry applies to.
+ */
+struct policy_match {
+    struct name_trie_node *pm_node[NAME_TRIE_MAX_LABELS + 1];
+    u_char         *pm_name[NAME_TRIE_MAX_LABELS + 1];
+    int             pm_count;
+    int             pm_pos;
+    long            pm_now;
+    u_char         *pm_zone;
+};
+
+int             build_policy_index(val_context_t * ctx, int index);
+void            unindex_policy_entry(val_context_t * ctx, int index,
+                                     policy_entry_t * pol_entry);
+void            free_policy_index(val_context_t * ctx, int index);
+policy_entry_t *policy_match_first(val_context_t * ctx, int index,
+                                   u_char * name_n,
+                                   struct policy_match *pm);
+policy_entry_t *policy_match_next(struct policy_match *pm);
+void            mark_policy_changes(val_context_t * ctx, val_context_t * gen);
+
 int             free_policy_entry(policy_entry_t *pol_entry, int index);
 int             read_root_hints_file(val_context_t * ctx);
 int             read_res_config_file(val_context_t * ctx);
@@ -121,16 +121,86 @@ extract_glue_from_rdata(struct rrset_rr *addr_rr, struct name_server *ns)
 }
 
 
+/*
+ * Move name servers from the pending glue list of pc to the list of
+ * those whose glue is being fetched, until MAX_GLUE_FETCH_PARALLEL of
+ * them are in flight, and issue the address queries for each.
+ */
+static int
+start_glue_fetch(val_context_t *context,
+                 struct val_query_chain *pc,
+                 struct queries_for_query **queries,
+                 u_int32_t flags)
+{
+    int             retval;
+    int             count = 0;
+    struct delegation_info *ref = pc->qc_referral;
+    struct name_server *ns;
+    struct name_server **tail;
+    struct queries_for_query *added_q = NULL;
+
+    flags |= pc->qc_flags | 
+             (VAL_QUERY_GLUE_REQUEST | VAL_QUERY_DONT_VALIDATE);
+
+    for (tail = &ref->cur_pending_glue_ns; *tail; tail = &(*tail)->ns_next)
+        count++;
+
+    while (count < MAX_GLUE_FETCH_PARALLEL && ref->pending_glue_ns) {
+
+        ns = ref->pending_glue_ns;
+        ref->pending_glue_ns = ns->ns_next;
+        ns->ns_next = NULL;
+        *tail = ns;
+        tail = &ns->ns_next;
+        count++;
+
+        /*
+         * Create a query for glue for ns 
+         */
+        if (_val_context_ip4(context)) {
+            if (VAL_NO_ERROR != (retval = add_to_qfq_chain(context,
+                                           queries, ns->ns_name_n, ns_t_a,
+                                           ns_c_in, flags, &added_q)))
+                return retval;
+        }
+#ifdef VAL_IPV6
+        if (_val_context_ip6(context)) {
+            if (VAL_NO_ERROR != (retval = add_to_qfq_chain(context,
+                                           queries, ns->ns_name_n, ns_t_aaaa,
+                                           ns_c_in, flags, &added_q)))
+                return retval;
+        }
+#endif
+    }
+
+    if (ref->cur_pending_glue_ns) {
+        if (_val_context_ip4(context))
+            pc->qc_state |= Q_WAIT_FOR_A_GLUE;
+#ifdef VAL_IPV6
+        if (_val_context_ip6(context))
+            pc->qc_state |= Q_WAIT_FOR_AAAA_GLUE;
+#endif
+    }
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Look at the glue query of the given type for pending_ns and add any
+ * addresses it returned to pending_ns. *waiting is set if the query
+ * is still outstanding.
+ */
 static int
 find_matching_glue(val_context_t *context,
-                   u_int16_t find_glue_type,
+                   u_int16_t glue_type,
                    struct queries_for_query *qfq_pc,
+                   struct name_server *pending_ns,
                    struct glue_fetch_bucket **bucket,
-                   struct queries_for_query **queries)
+                   struct queries_for_query **queries,
+                   int *waiting)
 {
     int             retval;
     struct val_query_chain *pc;
-    struct name_server *pending_ns;
     char name_p[NS_MAXDNAME];
     u_int32_t flags;
 
@@ -141,125 +211,108 @@ find_matching_glue(val_context_t *context,
     struct glue_fetch_bucket *gcb = NULL;
     struct queries_for_query *qfq[MAX_GLUE_FETCH_DEPTH];
     int glue_loop_count = 0;
-    u_int16_t glue_type;
 
     /*
      * check if we have data to merge 
      */
-    if ((queries == NULL) || (qfq_pc == NULL) || (bucket == NULL)) 
+    if ((queries == NULL) || (qfq_pc == NULL) || (bucket == NULL) ||
+        (pending_ns == NULL) || (waiting == NULL)) 
         return VAL_BAD_ARGUMENT; 
 
     pc = qfq_pc->qfq_query; /* Can never be NULL if qfq_pc is not NULL */
 
-    if ((pc->qc_state & find_glue_type) && 
-        pc->qc_referral && pc->qc_referral->cur_pending_glue_ns) {
-
-        pending_ns = pc->qc_referral->cur_pending_glue_ns;
-        if (ns_name_ntop(pending_ns->ns_name_n, name_p,
-                     sizeof(name_p)) < 0) {
-            strncpy(name_p, "unknown/error", sizeof(name_p)-1); 
-        }
-
-        /*
-         * Identify the query in the query chain 
-         */
-        flags = pc->qc_flags | (VAL_QUERY_GLUE_REQUEST | VAL_QUERY_DONT_VALIDATE);
+    if (ns_name_ntop(pending_ns->ns_name_n, name_p,
+                 sizeof(name_p)) < 0) {
+        strncpy(name_p, "unknown/error", sizeof(name_p)-1); 
+    }
 
-        if (find_glue_type == Q_WAIT_FOR_A_GLUE) {
-            glue_type = ns_t_a;
-#ifdef VAL_IPV6
-        } else  {/* Q_WAIT_FOR_AAAA_GLUE) */ 
-            glue_type = ns_t_aaaa;
-#endif
+    /*
+     * Identify the query in the query chain 
+     */
+    flags = pc->qc_flags | (VAL_QUERY_GLUE_REQUEST | VAL_QUERY_DONT_VALIDATE);
+
+    if (VAL_NO_ERROR != (retval = 
+            add_to_qfq_chain(context,
+                             queries, pending_ns->ns_name_n, glue_type, 
+                             ns_c_in, flags, &glue_qfq))) 
+        return retval;
+    glueptr = glue_qfq->qfq_query;/* Can never be NULL if glue_qfq is not NULL */
+
+
+    /* Add pc and gluptr to our dependency list */
+    for (b=*bucket; b; b=b->next_bucket) {
+        if (b->qfq == qfq_pc) {
+            pcb = b;
+        } else if (b->qfq == glue_qfq) {
+            gcb = b;
         }
-        if (VAL_NO_ERROR != (retval = 
-                add_to_qfq_chain(context,
-                                 queries, pending_ns->ns_name_n, glue_type, 
-                                 ns_c_in, flags, &glue_qfq))) 
-            return retval;
-        glueptr = glue_qfq->qfq_query;/* Can never be NULL if glue_qfq is not NULL */
-
+    }
+    if (gcb == NULL) {
+        gcb = (struct glue_fetch_bucket *) MALLOC (sizeof (struct glue_fetch_bucket));
+        if (gcb == NULL)
+            return VAL_OUT_OF_MEMORY;
+        gcb->qfq = glue_qfq;
+        /* add to head of list */
+        gcb->next_bucket = *bucket;
+        gcb->next_dep = NULL;
+        *bucket = gcb;
+    }
 
-        /* Add pc and gluptr to our dependency list */
-        for (b=*bucket; b; b=b->next_bucket) {
-            if (b->qfq == qfq_pc) {
-                pcb = b;
-            } else if (b->qfq == glue_qfq) {
-                gcb = b;
+    if (pcb == NULL) {
+        pcb = (struct glue_fetch_bucket *) MALLOC (sizeof (struct glue_fetch_bucket));
+        if (pcb == NULL)
+            return VAL_OUT_OF_MEMORY;
+        pcb->qfq = qfq_pc;
+        /* add to head of list */
+        pcb->next_bucket = *bucket;
+        pcb->next_dep = NULL;
+        *bucket = pcb;
+    }
+    pcb->next_dep = gcb;
+
+    while (pcb) {
+        int i;
+        for (i = 0; i < glue_loop_count; i++) {
+            if (qfq[i] == pcb->qfq) {
+                /* loop detected */
+                val_log(context, LOG_DEBUG, 
+                    "find_matching_glue(): Loop detected while fetching glue (%s) for %s",
+                    p_type(glue_type), name_p);
+                glueptr->qc_state = Q_REFERRAL_ERROR;
+                pcb = NULL;
+                break; 
             }
         }
-        if (gcb == NULL) {
-            gcb = (struct glue_fetch_bucket *) MALLOC (sizeof (struct glue_fetch_bucket));
-            if (gcb == NULL)
-                return VAL_OUT_OF_MEMORY;
-            gcb->qfq = glue_qfq;
-            /* add to head of list */
-            gcb->next_bucket = *bucket;
-            gcb->next_dep = NULL;
-            *bucket = gcb;
+        if (pcb) {
+            qfq[glue_loop_count++] = pcb->qfq;
+            pcb = pcb->next_dep;
         }
+    }
 
-        if (pcb == NULL) {
-            pcb = (struct glue_fetch_bucket *) MALLOC (sizeof (struct glue_fetch_bucket));
-            if (pcb == NULL)
-                return VAL_OUT_OF_MEMORY;
-            pcb->qfq = qfq_pc;
-            /* add to head of list */
-            pcb->next_bucket = *bucket;
-            pcb->next_dep = NULL;
-            *bucket = pcb;
-        }
-        pcb->next_dep = gcb;
-
-        while (pcb) {
-            int i;
-            for (i = 0; i < glue_loop_count; i++) {
-                if (qfq[i] == pcb->qfq) {
-                    /* loop detected */
-                    val_log(context, LOG_DEBUG, 
-                        "find_matching_glue(): Loop detected while fetching glue (%s) for %s",
-                        p_type(glue_type), name_p);
-                    glueptr->qc_state = Q_REFERRAL_ERROR;
-                    pcb = NULL;
-                    break; 
-                }
-            }
-            if (pcb) {
-                qfq[glue_loop_count++] = pcb->qfq;
-                pcb = pcb->next_dep;
-            }
+    if (glueptr->qc_state >= Q_ANSWERED) { 
+        /* This could be a cname or dname alias; search for the A or AAAA record */
+        struct val_digested_auth_chain *as;
+        for (as=glueptr->qc_ans; as; as=as->val_ac_rrset.val_ac_rrset_next) {
+            if (as->val_ac_rrset.ac_data && 
+                as->val_ac_rrset.ac_data->rrs_type_h == glue_type)
+                break;
         }
-
-        if (glueptr->qc_state >= Q_ANSWERED) { 
-            /* This could be a cname or dname alias; search for the A or AAAA record */
-            struct val_digested_auth_chain *as;
-            for (as=glueptr->qc_ans; as; as=as->val_ac_rrset.val_ac_rrset_next) {
-                if (as->val_ac_rrset.ac_data && 
-                    as->val_ac_rrset.ac_data->rrs_type_h == glue_type)
-                    break;
-            }
-       
-            if (as && glueptr->qc_state == Q_ANSWERED &&
-               (VAL_NO_ERROR == (retval =
-                        extract_glue_from_rdata(as->val_ac_rrset.ac_data->rrs_data,
-                                            pending_ns)))) {
-                    val_log(context, LOG_DEBUG,
-                            "find_matching_glue(): successfully fetched glue (%s) for %s", 
-                            p_type(glue_type), name_p);
-            } else {
-                val_log(context, LOG_DEBUG, 
-                        "find_matching_glue(): Could not fetch glue (%s) for %s", 
+   
+        if (as && glueptr->qc_state == Q_ANSWERED &&
+           (VAL_NO_ERROR == (retval =
+                    extract_glue_from_rdata(as->val_ac_rrset.ac_data->rrs_data,
+                                        pending_ns)))) {
+                val_log(context, LOG_DEBUG,
+                        "find_matching_glue(): successfully fetched glue (%s) for %s", 
                         p_type(glue_type), name_p);
-                glueptr->qc_state = Q_REFERRAL_ERROR;
-            }
-
-            if (glue_type == ns_t_a)
-                pc->qc_state ^= Q_WAIT_FOR_A_GLUE;
-#ifdef VAL_IPV6
-            else 
-                pc->qc_state ^= Q_WAIT_FOR_AAAA_GLUE;
-#endif
-        } 
+        } else {
+            val_log(context, LOG_DEBUG, 
+                    "find_matching_glue(): Could not fetch glue (%s) for %s", 
+                    p_type(glue_type), name_p);
+            glueptr->qc_state = Q_REFERRAL_ERROR;
+        }
+    } else {
+        *waiting = 1;
     }
 
     return VAL_NO_ERROR;
@@ -269,6 +322,12 @@ find_matching_glue(val_context_t *context,
 /*
  * merge the data received from a glue fetch operation into
  * the original query. Also check for glue fetch loops.
+ *
+ * Glue is fetched for several name servers at once; the referral
+ * continues with the first one for which an address comes back, and
+ * the others go back on the pending list in case that server fails.
+ * Each name server that turns out to have no address makes room for
+ * the next pending one.
  */
 static int
 merge_glue_in_referral(val_context_t *context,
@@ -277,8 +336,11 @@ merge_glue_in_referral(val_context_t *context,
                        struct queries_for_query **queries)
 {
     int             retval;
+    int             waiting;
     struct val_query_chain *pc;
     struct name_server *pending_ns;
+    struct name_server *usable_ns = NULL;
+    struct name_server **ns_p;
     char name_p[NS_MAXDNAME];
     u_char *cur_ref_n;
 
@@ -294,43 +356,79 @@ merge_glue_in_referral(val_context_t *context,
     if (pc->qc_referral == NULL) 
         return VAL_NO_ERROR;
     
-    pending_ns = pc->qc_referral->cur_pending_glue_ns;
-    if (pending_ns) {
+    if (pc->qc_referral->cur_pending_glue_ns) {
 
-        if (_val_context_ip4(context)) {
-            if (VAL_NO_ERROR != (retval = find_matching_glue(context, Q_WAIT_FOR_A_GLUE, qfq_pc, bucket, queries)))
-                return retval;
-        }
+        ns_p = &pc->qc_referral->cur_pending_glue_ns;
+        while (*ns_p) {
 
-        if (_val_context_ip6(context)) {
-            if (VAL_NO_ERROR != (retval = find_matching_glue(context, Q_WAIT_FOR_AAAA_GLUE, qfq_pc, bucket, queries)))
-                return retval;
-        }
+            pending_ns = *ns_p;
+            waiting = 0;
 
-        if (pc->qc_state & Q_WAIT_FOR_GLUE) {
-            /* we're not done with fetching glue  */
-            return VAL_NO_ERROR;
-        }
+            if (_val_context_ip4(context)) {
+                if (VAL_NO_ERROR != (retval = find_matching_glue(context, ns_t_a, qfq_pc, pending_ns, bucket, queries, &waiting)))
+                    return retval;
+            }
+#ifdef VAL_IPV6
+            if (pending_ns->ns_number_of_addresses == 0 &&
+                _val_context_ip6(context)) {
+                if (VAL_NO_ERROR != (retval = find_matching_glue(context, ns_t_aaaa, qfq_pc, pending_ns, bucket, queries, &waiting)))
+                    return retval;
+            }
+#endif
 
-        /*
-         * If we reach here we've processed both A and AAAA glue.
-         * check if we have at least some data to work with 
-         */
-        if (ns_name_ntop(pending_ns->ns_name_n, name_p,
-                     sizeof(name_p)) < 0) {
-            strncpy(name_p, "unknown/error", sizeof(name_p)-1); 
+            if (pending_ns->ns_number_of_addresses > 0) {
+                /* take it out of the list of fetches in flight */
+                *ns_p = pending_ns->ns_next;
+                pending_ns->ns_next = NULL;
+                usable_ns = pending_ns;
+                break;
+            }
+
+            if (waiting) {
+                ns_p = &pending_ns->ns_next;
+                continue;
+            }
+
+            /* no address for this one */
+            *ns_p = pending_ns->ns_next;
+            pending_ns->ns_next = NULL;
+            free_name_server(&pending_ns);
         }
 
-        if (pending_ns->ns_number_of_addresses > 0) {
+        if (usable_ns != NULL) {
+
+            /*
+             * check if we have at least some data to work with 
+             */
+            if (ns_name_ntop(usable_ns->ns_name_n, name_p,
+                         sizeof(name_p)) < 0) {
+                strncpy(name_p, "unknown/error", sizeof(name_p)-1); 
+            }
 
             /* continue referral using the fetched glue records */
             val_log(context, LOG_DEBUG,
                     "merge_glue_in_referral(): continuing referral using glue fetched for %s", 
                     name_p);
+
+            /*
+             * put the name servers whose glue is still outstanding back
+             * at the head of the pending list, so that they can still be
+             * tried if the server picked here doesn't work out
+             */
+            if (pc->qc_referral->cur_pending_glue_ns) {
+                for (ns_p = &pc->qc_referral->cur_pending_glue_ns; *ns_p;
+                     ns_p = &(*ns_p)->ns_next)
+                    ; /* no body. ';' on new line to suppress warning. */
+                *ns_p = pc->qc_referral->pending_glue_ns;
+                pc->qc_referral->pending_glue_ns =
+                    pc->qc_referral->cur_pending_glue_ns;
+                pc->qc_referral->cur_pending_glue_ns = NULL;
+            }
             
             /* save learned zone information */
             if (VAL_NO_ERROR != (retval = 
                     stow_zone_info(&pc->qc_referral->learned_zones, pc))) {
+                free_name_server(&usable_ns);
                 return retval;
             }
             pc->qc_referral->learned_zones = NULL;
@@ -345,9 +443,7 @@ merge_glue_in_referral(val_context_t *context,
                 pc->qc_ns_list = NULL;
             }
 
-            pc->qc_ns_list = pending_ns;
-            /* release older reference to pending_ns */
-            pc->qc_referral->cur_pending_glue_ns = NULL;
+            pc->qc_ns_list = usable_ns;
 
             if (pc->qc_zonecut_n != NULL) {
                 FREE(pc->qc_zonecut_n);
@@ -367,9 +463,14 @@ merge_glue_in_referral(val_context_t *context,
             return VAL_NO_ERROR;            
         }
 
-        free_name_server(&pending_ns);
-        pending_ns = NULL;
-        pc->qc_referral->cur_pending_glue_ns = NULL;
+        if (pc->qc_referral->cur_pending_glue_ns != NULL) {
+            /* 
+             * we're not done with fetching glue; keep the number of
+             * fetches in flight up 
+             */
+            return start_glue_fetch(context, pc, queries, 0);
+        }
+
         pc->qc_state = Q_MISSING_GLUE;
     } 
 
@@ -377,38 +478,10 @@ merge_glue_in_referral(val_context_t *context,
         pc->qc_referral->pending_glue_ns != NULL) {
 
         /* there is more glue to fetch */
-        u_int32_t flags;
-        struct queries_for_query *added_q = NULL;
-
-        pc->qc_referral->cur_pending_glue_ns = pc->qc_referral->pending_glue_ns;
-        pending_ns = pc->qc_referral->cur_pending_glue_ns;
-
-        pc->qc_referral->pending_glue_ns = pending_ns->ns_next;
-        pending_ns->ns_next = NULL;
-        /*
-         * Create a query for glue for pending_ns 
-         */
-        flags = pc->qc_flags | 
-                (VAL_QUERY_GLUE_REQUEST | VAL_QUERY_DONT_VALIDATE);
-
         pc->qc_state = Q_INIT;
-        if (_val_context_ip4(context)) {
-            if (VAL_NO_ERROR != (retval = add_to_qfq_chain(context,
-                                           queries, pending_ns->ns_name_n, ns_t_a,
-                                           ns_c_in, flags, &added_q)))
-                return retval;
-            pc->qc_state |= Q_WAIT_FOR_A_GLUE;
-        }
-#ifdef VAL_IPV6
-        if (_val_context_ip6(context)) {
-            if (VAL_NO_ERROR != (retval = add_to_qfq_chain(context,
-                                           queries, pending_ns->ns_name_n, ns_t_aaaa,
-                                           ns_c_in, flags, &added_q)))
-                return retval;
-            pc->qc_state |= Q_WAIT_FOR_AAAA_GLUE;
-        }
-#endif
-
+        if (VAL_NO_ERROR != (retval = 
+                    start_glue_fetch(context, pc, queries, 0)))
+            return retval;
     } 
 
     return VAL_NO_ERROR;
@@ -419,11 +492,13 @@ merge_glue_in_referral(val_context_t *context,
  * Merge any glue that is available into the relevant query
  * Set *data_missing if some query in the list still remains
  * unanswered or received an error response
+ * Set *resumed if some query can now be sent on using fetched glue
  */
 int
 fix_glue(val_context_t * context,
          struct queries_for_query **queries,
-         int *data_missing)
+         int *data_missing,
+         int *resumed)
 {
     struct queries_for_query *next_q;
     struct glue_fetch_bucket *depn_bucket = NULL;
@@ -432,10 +507,12 @@ fix_glue(val_context_t * context,
 
     retval = VAL_NO_ERROR;
    
-    if (context == NULL || queries == NULL || data_missing == NULL)
+    if (context == NULL || queries == NULL || data_missing == NULL ||
+        resumed == NULL)
         return VAL_BAD_ARGUMENT;
 
     *data_missing = 0;
+    *resumed = 0;
     for (next_q = *queries; next_q; next_q = next_q->qfq_next) {
         /* 
          * if query state is an error, we may still want to 
@@ -458,6 +535,8 @@ fix_glue(val_context_t * context,
                                                queries))) {
                 goto err;
             }
+            if (next_q->qfq_query->qc_state == Q_INIT)
+                *resumed = 1;
             if (next_q->qfq_query->qc_state >= Q_ERROR_BASE) {
                 val_log(context, LOG_DEBUG,
                         "fix_glue(): Error fetching {%s %s(%d) %s(%d)} and no pending glue (state: %d flags :%x)", name_p,
@@ -485,28 +564,138 @@ err:
     return retval;
 }
 
+/*
+ * Add the name servers in an NS rrset to the end of *ns_list 
+ */
+static int
+zi_add_ns_set(struct rrset_rec *ns_set, struct name_server **ns_list,
+              u_char *ns_cred)
+{
+    struct rrset_rr  *ns_rr;
+    struct name_server *temp_ns;
+    struct name_server *tail_ns;
+    size_t          name_len;
+
+    ns_rr = ns_set->rrs_data;
+    /* 
+     * find the ns with the best credibility
+     */
+    if (*ns_cred == SR_CRED_UNSET ||
+            ns_set->rrs_cred < *ns_cred) {
+        *ns_cred = ns_set->rrs_cred;
+    }
+
+    while (ns_rr) {
+        /*
+         * Create the structure for the name server 
+         */
+        name_len = wire_name_length(ns_rr->rr_rdata);
+        if (name_len > NS_MAXCDNAME) {
+            free_name_servers(ns_list);
+            *ns_list = NULL;
+            return VAL_OUT_OF_MEMORY;
+        }
+        temp_ns = create_name_server();
+        if (temp_ns == NULL) {
+            /*
+             * Since we're in trouble, free up just in case 
+             */
+            free_name_servers(ns_list);
+            *ns_list = NULL;
+            return VAL_OUT_OF_MEMORY;
+        }
+
+        memcpy(temp_ns->ns_name_n, ns_rr->rr_rdata, name_len);
+
+        /*
+         * Initialize the rest of the fields 
+         */
+        temp_ns->ns_status = SR_ZI_STATUS_LEARNED;
+        /* 
+         * Ensure that recursion is disabled by default 
+         */
+         if (temp_ns->ns_options & SR_QUERY_RECURSE)
+            temp_ns->ns_options ^= SR_QUERY_RECURSE;
+
+        /*
+         * Add the name server record to the list 
+         */
+        if (*ns_list == NULL)
+            *ns_list = temp_ns;
+        else {
+            /*
+             * Preserving order in case of round robin 
+             */
+            tail_ns = *ns_list;
+            while (tail_ns->ns_next != NULL)
+                tail_ns = tail_ns->ns_next;
+            tail_ns->ns_next = temp_ns;
+        }
+        ns_rr = ns_rr->rr_next;
+    }
+    return VAL_NO_ERROR;
+}
+
+/*
+ * If addr_set holds addresses for a name server in ns_list, 
+ * add them to the first such name server 
+ */
+static int
+zi_add_glue_set(val_context_t *context, struct rrset_rec *addr_set,
+                struct name_server *ns_list, u_char ns_cred)
+{
+    struct name_server *ns;
+
+    if (!((_val_context_ip4(context) && addr_set->rrs_type_h == ns_t_a) ||
+          (_val_context_ip6(context) && addr_set->rrs_type_h == ns_t_aaaa)))
+        return VAL_NO_ERROR;
+
+    /*
+     * credibility of A/AAAA should match that of the NS
+     */
+    if (ns_cred < SR_CRED_NONAUTH &&
+        addr_set->rrs_cred > SR_CRED_NONAUTH)
+        return VAL_NO_ERROR;
+
+    /*
+     * If the owner name matches the name in an *ns_list entry...
+     */
+    for (ns = ns_list; ns; ns = ns->ns_next) {
+        if (namecmp(addr_set->rrs_name_n, ns->ns_name_n) == 0) {
+            /*
+             * Found that address set is for an NS 
+             */
+            return extract_glue_from_rdata(addr_set->rrs_data, ns);
+        }
+    }
+    return VAL_NO_ERROR;
+}
+
 /*
  * Identify the referral name servers from the rrsets 
  * returned in the response. The glue may be missing,
  * in which case we save the incomplete name server information
  * in "pending glue"
+ *
+ * If unchecked_zone_index is given, it is a name trie over
+ * unchecked_zone_info (as kept for the hints cache), and is used
+ * to find the NS and address rrsets instead of scanning the list.
  */ 
 int
 res_zi_unverified_ns_list(val_context_t *context,
                           struct name_server **ns_list,
                           u_char * zone_name,
                           struct rrset_rec *unchecked_zone_info,
+                          struct name_trie_node *unchecked_zone_index,
                           struct name_server **pending_glue)
 {
     struct rrset_rec *unchecked_set;
-    struct rrset_rr  *ns_rr;
-    struct name_server *temp_ns;
-    struct name_server *ns;
+    struct name_trie_node *node;
+    struct name_server *ns, *prev_ns;
     struct name_server *pending_glue_last;
     struct name_server *outer_trailer;
-    struct name_server *tail_ns;
-    size_t          name_len;
     int             retval;
+    int             i;
     u_char ns_cred = SR_CRED_UNSET;
 
     if ((context == NULL) || (ns_list == NULL) || (pending_glue == NULL))
@@ -515,118 +704,60 @@ res_zi_unverified_ns_list(val_context_t *context,
     *ns_list = NULL;
     *pending_glue = NULL;
 
-    /*
-     * Look through the unchecked_zone stuff for NS records 
-     */
-    unchecked_set = unchecked_zone_info;
-    while (unchecked_set != NULL) {
-        if (unchecked_set->rrs_type_h == ns_t_ns &&
-            (namecmp(zone_name, unchecked_set->rrs_name_n) == 0))
-        {
-                ns_rr = unchecked_set->rrs_data;
-                /* 
-                 * find the ns with the best credibility
-                 */
-                if (ns_cred == SR_CRED_UNSET ||
-                        unchecked_set->rrs_cred < ns_cred) {
-                    ns_cred = unchecked_set->rrs_cred;
-                }
-
-                while (ns_rr) {
-                    /*
-                     * Create the structure for the name server 
-                     */
-                    name_len = wire_name_length(ns_rr->rr_rdata);
-                    if (name_len > NS_MAXCDNAME) {
-                        free_name_servers(ns_list);
-                        *ns_list = NULL;
-                        return VAL_OUT_OF_MEMORY;
-                    }
-                    temp_ns = create_name_server();
-                    if (temp_ns == NULL) {
-                        /*
-                         * Since we're in trouble, free up just in case 
-                         */
-                        free_name_servers(ns_list);
-                        *ns_list = NULL;
-                        return VAL_OUT_OF_MEMORY;
-                    }
-
-                    memcpy(temp_ns->ns_name_n, ns_rr->rr_rdata, name_len);
-
-                    /*
-                     * Initialize the rest of the fields 
-                     */
-                    temp_ns->ns_status = SR_ZI_STATUS_LEARNED;
-                    /* 
-                     * Ensure that recursion is disabled by default 
-                     */
-                     if (temp_ns->ns_options & SR_QUERY_RECURSE)
-                        temp_ns->ns_options ^= SR_QUERY_RECURSE;
-
-                    /*
-                     * Add the name server record to the list 
-                     */
-                    if (*ns_list == NULL)
-                        *ns_list = temp_ns;
-                    else {
-                        /*
-                         * Preserving order in case of round robin 
-                         */
-                        tail_ns = *ns_list;
-                        while (tail_ns->ns_next != NULL)
-                            tail_ns = tail_ns->ns_next;
-                        tail_ns->ns_next = temp_ns;
-                    }
-                    ns_rr = ns_rr->rr_next;
-                }
+    if (unchecked_zone_index != NULL) {
+        /*
+         * Everything we need is stored under the zone name and
+         * the name server names
+         */
+        node = name_trie_find(unchecked_zone_index, zone_name);
+        for (i = 0; node && i < node->ntn_ndata; i++) {
+            unchecked_set = (struct rrset_rec *) node->ntn_data[i];
+            if (unchecked_set->rrs_type_h == ns_t_ns &&
+                VAL_NO_ERROR != (retval = zi_add_ns_set(unchecked_set,
+                                                        ns_list, &ns_cred)))
+                return retval;
         }
-        unchecked_set = unchecked_set->rrs_next;
-    }
 
-    /*
-     * Now, we need the addresses 
-     */
-    /*
-     * This is ugly - loop through unchecked data for address records,
-     * then through the name server records to find a match,
-     * then through the (possibly multiple) addresses under the A set
-     */
-
-    unchecked_set = unchecked_zone_info;
-    while (unchecked_set != NULL) {
-        if ((_val_context_ip4(context) && unchecked_set->rrs_type_h == ns_t_a) ||
-            (_val_context_ip6(context) && unchecked_set->rrs_type_h == ns_t_aaaa)) {
-            /*
-             * If the owner name matches the name in an *ns_list entry...
-             */
-            ns = *ns_list;
-            while (ns) {
-                int matching_cred = 1;
-                /*
-                 * credibility of A/AAAA should match that of the NS
-                 */
-                if (ns_cred < SR_CRED_NONAUTH &&
-                    unchecked_set->rrs_cred > SR_CRED_NONAUTH) {
-                    matching_cred = 0;
-                }
-                if (matching_cred &&
-                    namecmp(unchecked_set->rrs_name_n, ns->ns_name_n) == 0) {
-                    /*
-                     * Found that address set is for an NS 
-                     */
-                    if (VAL_NO_ERROR !=
-                        (retval =
-                         extract_glue_from_rdata(unchecked_set->
-                                                 rrs_data, ns)))
-                        return retval;
+        for (ns = *ns_list; ns; ns = ns->ns_next) {
+            /* look up each name server name only once */
+            for (prev_ns = *ns_list; prev_ns != ns; prev_ns = prev_ns->ns_next)
+                if (namecmp(prev_ns->ns_name_n, ns->ns_name_n) == 0)
                     break;
-                } else {
-                    ns = ns->ns_next;
-                }
+            if (prev_ns != ns)
+                continue;
+
+            node = name_trie_find(unchecked_zone_index, ns->ns_name_n);
+            for (i = 0; node && i < node->ntn_ndata; i++) {
+                if (VAL_NO_ERROR !=
+                    (retval = zi_add_glue_set(context,
+                                   (struct rrset_rec *) node->ntn_data[i],
+                                   *ns_list, ns_cred)))
+                    return retval;
             }
         }
-        unchecked_set = unchecked_set->rrs_next;
+    } else {
+        /*
+         * Look through the unchecked_zone stuff for NS records 
+         */
+        for (unchecked_set = unchecked_zone_info; unchecked_set;
+             unchecked_set = unchecked_set->rrs_next) {
+            if (unchecked_set->rrs_type_h == ns_t_ns &&
+                (namecmp(zone_name, unchecked_set->rrs_name_n) == 0) &&
+                VAL_NO_ERROR != (retval = zi_add_ns_set(unchecked_set,
+                                                        ns_list, &ns_cred)))
+                return retval;
+        }
+
+        /*
+         * Now, we need the addresses 
+         */
+        for (unchecked_set = unchecked_zone_info; unchecked_set;
+             unchecked_set = unchecked_set->rrs_next) {
+            if (VAL_NO_ERROR != (retval = zi_add_glue_set(context,
+                                                unchecked_set, *ns_list,
+                                                ns_cred)))
+                return retval;
+        }
     }
 
     ns = *ns_list;
@@ -834,15 +965,14 @@ int
 bootstrap_referral(val_context_t *context,
                    u_char * referral_zone_n,
                    struct rrset_rec *learned_zones,
+                   struct name_trie_node *learned_index,
                    struct queries_for_query *matched_qfq,
                    struct queries_for_query **queries,
                    struct name_server **ref_ns_list)
 {
     struct name_server *pending_glue;
     int             ret_val;
-    struct queries_for_query *added_q = NULL;
     struct val_query_chain *matched_q;
-    u_int32_t flags;
 
     if ((context == NULL) || (matched_qfq == NULL) ||
         (queries == NULL) || (ref_ns_list == NULL))
@@ -873,7 +1003,8 @@ bootstrap_referral(val_context_t *context,
     
     if ((ret_val =
          res_zi_unverified_ns_list(context, ref_ns_list, referral_zone_n,
-                                   learned_zones, &pending_glue))
+                                   learned_zones, learned_index,
+                                   &pending_glue))
         != VAL_NO_ERROR) {
         return ret_val;
     }
@@ -903,7 +1034,12 @@ bootstrap_referral(val_context_t *context,
             }
         } 
             
+        /* a new referral supersedes any glue left over from the last */
+        if (matched_q->qc_referral->cur_pending_glue_ns)
+            free_name_servers(&matched_q->qc_referral->cur_pending_glue_ns);
         matched_q->qc_referral->cur_pending_glue_ns = NULL;
+        if (matched_q->qc_referral->pending_glue_ns)
+            free_name_servers(&matched_q->qc_referral->pending_glue_ns);
         matched_q->qc_referral->pending_glue_ns = NULL;
 
         if (matched_q->qc_referral->saved_zonecut_n) {
@@ -949,33 +1085,15 @@ bootstrap_referral(val_context_t *context,
 
         } else {
 
-            matched_q->qc_referral->cur_pending_glue_ns = pending_glue;
-            matched_q->qc_referral->pending_glue_ns = pending_glue->ns_next;
-            pending_glue->ns_next = NULL;
+            matched_q->qc_referral->pending_glue_ns = pending_glue;
 
             /*
-             * Create a query for glue for pending_ns 
+             * Create queries for glue for the first few pending name servers
              */
-            flags = matched_q->qc_flags | VAL_QUERY_ITERATE | 
-                        (VAL_QUERY_GLUE_REQUEST | VAL_QUERY_DONT_VALIDATE);
             matched_q->qc_state = Q_INIT;
-
-            if (_val_context_ip4(context)) {
-                matched_q->qc_state |= Q_WAIT_FOR_A_GLUE;
-                if (VAL_NO_ERROR != (ret_val = add_to_qfq_chain(context,
-                                       queries, pending_glue->ns_name_n, ns_t_a,
-                                       ns_c_in, flags, &added_q)))
-                    return ret_val;
-            }
-#ifdef VAL_IPV6
-            if (_val_context_ip6(context)) {
-                matched_q->qc_state |= Q_WAIT_FOR_AAAA_GLUE;
-                if (VAL_NO_ERROR != (ret_val = add_to_qfq_chain(context,
-                                       queries, pending_glue->ns_name_n, ns_t_aaaa,
-                                       ns_c_in, flags, &added_q)))
-                    return ret_val;
-            }
-#endif
+            if (VAL_NO_ERROR != (ret_val = start_glue_fetch(context,
+                                    matched_q, queries, VAL_QUERY_ITERATE)))
+                return ret_val;
         }
     } else if (*ref_ns_list != NULL) {
         matched_q->qc_state = Q_INIT;
@@ -1124,7 +1242,7 @@ follow_referral_or_alias_link(val_context_t * context,
     res_sq_free_rrset_recs(proofs);
     *proofs = NULL;
 
-    if (referral_zone_n) {
+    if (referral_zone_n && VAL_LOG_ENABLED(context, LOG_DEBUG)) {
         char            debug_name1[NS_MAXDNAME];
         char            debug_name2[NS_MAXDNAME];
         memset(debug_name1, 0, 1024);
@@ -1161,6 +1279,7 @@ follow_referral_or_alias_link(val_context_t * context,
     if (VAL_NO_ERROR != (ret_val = bootstrap_referral(context,
                                                     referral_zone_n,
                                                     *learned_zones,
+                                                    NULL,
                                                     matched_qfq,
                                                     queries,
                                                     &ref_ns_list))) 
@@ -1260,7 +1379,6 @@ follow_referral_or_alias_link(val_context_t * context,
                         zonecut_n)                                      \
     do {                                                                \
         struct rrset_rec *rr_set;                                       \
-        int ret_val;                                                    \
         u_char *r;                                                      \
         rr_set = find_rr_set (respondent_server, listtype, name_n,  \
                               type_h, set_type_h, class_h, ttl_h, hptr, \
@@ -1291,9 +1409,7 @@ follow_referral_or_alias_link(val_context_t * context,
             }                                                           \
         }                                                               \
         if (ret_val != VAL_NO_ERROR) {                                  \
-            res_sq_free_rrset_recs(&learned_zones);                     \
-            FREE(rdata);                                                \
-            return ret_val;                                             \
+            goto done;                                                  \
         }                                                               \
     } while (0)
 
@@ -1553,6 +1669,66 @@ static void consume_referral_data(struct delegation_info **qc_referral,
     *qc_referral = NULL;
 }
 
+/*
+ * Up to this many RRs are indexed on the stack in digest_response()
+ */
+#define RR_INDEX_STACK_SIZE 64
+
+/*
+ * Check if digest_response() stores RRs of this type found in the given
+ * section. Answers are kept only if they turn out to be relevant to
+ * the question, but that can't be told from the type alone.
+ */
+static int
+rr_is_kept(val_context_t * context, int from_section, u_int16_t set_type_h)
+{
+    switch (from_section) {
+    case VAL_FROM_ANSWER:
+        return TRUE;
+    case VAL_FROM_AUTHORITY:
+        return (set_type_h == ns_t_nsec ||
+#ifdef LIBVAL_NSEC3
+                set_type_h == ns_t_nsec3 ||
+#endif
+                set_type_h == ns_t_soa ||
+                set_type_h == ns_t_ns ||
+                set_type_h == ns_t_ds);
+    default:
+        return (set_type_h == ns_t_dnskey ||
+                (_val_context_ip4(context) && set_type_h == ns_t_a) ||
+                (_val_context_ip6(context) && set_type_h == ns_t_aaaa));
+    }
+}
+
+/*
+ * Get hold of the RDATA of an indexed RR. Only RDATA with domain names
+ * in it is copied, so that the names can be expanded; for all other
+ * types *rdata points into the response itself. *rdata_buf receives
+ * the copy, if one was made, and must be released by the caller.
+ */
+static int
+get_rr_rdata(u_char * response_data,
+             u_char * end,
+             struct rr_index *rri,
+             u_char ** rdata,
+             u_char ** rdata_buf,
+             size_t * rdata_len_h)
+{
+    int             ret_val;
+
+    *rdata_len_h = rri->rri_rdata_len_h;
+    if (!rdata_has_names(rri->rri_type_h)) {
+        *rdata = (*rdata_len_h > 0) ?
+                    &response_data[rri->rri_rdata_index] : NULL;
+        return VAL_NO_ERROR;
+    }
+
+    ret_val = decompress(rdata_buf, response_data, rri->rri_rdata_index,
+                         end, rri->rri_type_h, rdata_len_h);
+    *rdata = *rdata_buf;
+    return ret_val;
+}
+
 /*
  * The main routine for processing response data
  *  
@@ -1567,6 +1743,11 @@ static void consume_referral_data(struct delegation_info **qc_referral,
  * 
  * The validator keeps track of nameservers that it actually used while following
  * referrals.  These are re-used in future requests for data in the same zone.
+ *
+ * The response is gone over twice. The first pass only notes where each RR
+ * is in the response. The second pass then unpacks the owner names of
+ * the RRs that may be used, and copies out the RDATA of those that are
+ * actually stored; everything else is never copied at all.
  */
 static int
 digest_response(val_context_t * context,
@@ -1577,7 +1758,7 @@ digest_response(val_context_t * context,
                 struct domain_info *di_response)
 {
     u_int16_t       answer, authority, additional;
-    u_int16_t       rrs_to_go;
+    int             rrs_to_go;
     int             i;
     size_t          response_index;
     u_char          name_n[NS_MAXCDNAME];
@@ -1586,10 +1767,10 @@ digest_response(val_context_t * context,
     u_int16_t       class_h;
     u_int32_t       ttl_h;
     size_t          rdata_len_h;
-    size_t          rdata_index;
     int             authoritive = 0;
     int             iterative = 0;
     u_char         *rdata;
+    u_char         *rdata_buf;
     u_char         *hptr;
     int             ret_val;
     int             nothing_other_than_alias;
@@ -1619,6 +1800,10 @@ digest_response(val_context_t * context,
     int isrelv = 0;
     char name_buf[INET6_ADDRSTRLEN + 1];
     struct qname_chain *qc = NULL;
+    struct rr_index rr_stack[RR_INDEX_STACK_SIZE];
+    struct rr_index *rr_list = NULL;
+    struct rr_index *rri;
+    int             keep;
 
     if ((matched_qfq == NULL) || (queries == NULL) ||
         (di_response == NULL) || (response_data == NULL))
@@ -1638,6 +1823,7 @@ digest_response(val_context_t * context,
     di_response->di_proofs = NULL;
     hptr = NULL;
     rdata = NULL;
+    rdata_buf = NULL;
 
     answer = ntohs(header->ancount);
     authority = ntohs(header->nscount);
@@ -1678,17 +1864,19 @@ digest_response(val_context_t * context,
        goto done;
     }
 
-    strcpy(name_buf, "");
-    if (resp_ns && resp_ns->ns_number_of_addresses > 0) {
-        val_get_ns_string((struct sockaddr *)resp_ns->ns_address[0],
-                          name_buf, sizeof(name_buf));
-    }
+    if (VAL_LOG_ENABLED(context, LOG_DEBUG)) {
+        strcpy(name_buf, "");
+        if (resp_ns && resp_ns->ns_number_of_addresses > 0) {
+            val_get_ns_string((struct sockaddr *)resp_ns->ns_address[0],
+                              name_buf, sizeof(name_buf));
+        }
 
-    val_log(context, LOG_DEBUG, 
-            "digest_response(): Processing response for {%s %s(%d) %s(%d)}"
-            "from zonecut: %s (%s)",
-            query_name_p, p_class(query_class_h), query_class_h,
-            p_type(query_type_h), query_type_h, rrs_zonecut_p, name_buf); 
+        val_log(context, LOG_DEBUG, 
+                "digest_response(): Processing response for {%s %s(%d) %s(%d)}"
+                "from zonecut: %s (%s)",
+                query_name_p, p_class(query_class_h), query_class_h,
+                p_type(query_type_h), query_type_h, rrs_zonecut_p, name_buf); 
+    }
 
     /*
      *  Skip question section 
@@ -1734,10 +1922,47 @@ digest_response(val_context_t * context,
     }
 
     /*
-     * Now start processing each RRSet in the response
+     * First pass: find out where each RR lies in the response, without
+     * copying any of it. A response that doesn't hold as many RRs as
+     * its header claims is thrown out before any of it is acted upon.
+     */
+    if (rrs_to_go <= RR_INDEX_STACK_SIZE) {
+        rr_list = rr_stack;
+    } else {
+        /* each RR takes up at least a root name and the fixed fields */
+        if (response_index + (size_t) rrs_to_go * (NS_RRFIXEDSZ + 1) >
+                response_length) {
+            matched_q->qc_state = Q_RESPONSE_ERROR;
+            ret_val = VAL_NO_ERROR;
+            goto done;
+        }
+        rr_list = (struct rr_index *)
+            MALLOC(rrs_to_go * sizeof(struct rr_index));
+        if (rr_list == NULL) {
+            ret_val = VAL_OUT_OF_MEMORY;
+            goto done;
+        }
+    }
+    for (i = 0; i < rrs_to_go; i++) {
+        if (VAL_NO_ERROR !=
+                index_rr(response_data, &response_index, end, &rr_list[i])) {
+            matched_q->qc_state = Q_RESPONSE_ERROR;
+            ret_val = VAL_NO_ERROR;
+            goto done;
+        }
+    }
+
+    /*
+     * Second pass: process each RRSet in the response
      */
     for (i = 0; i < rrs_to_go; i++) {
 
+        rri = &rr_list[i];
+        type_h = rri->rri_type_h;
+        set_type_h = rri->rri_set_type_h;
+        class_h = rri->rri_class_h;
+        ttl_h = rri->rri_ttl_h;
+        rdata_len_h = rri->rri_rdata_len_h;
         rdata = NULL;
 
         /*
@@ -1751,29 +1976,32 @@ digest_response(val_context_t * context,
             from_section = VAL_FROM_ADDITIONAL;
 
         /*
-         * Response_index points to the beginning of an RR 
-         * Grab the uncompressed name, type, class, ttl, rdata_len 
-         * If the type is a signature, get the type_covered 
-         * Leave a pointer to the rdata 
-         * Advance the response_index 
+         * If we've received a CNAME/DNAME response for a type that cannot be followed using cnames/dnames
+         * we're not going to follow it
          */
-        if ((ret_val =
-             extract_from_rr(response_data, &response_index, end, name_n,
-                             &type_h, &set_type_h, &class_h, &ttl_h,
-                             &rdata_len_h, &rdata_index)) != VAL_NO_ERROR) {
-            matched_q->qc_state = Q_RESPONSE_ERROR;
+        if ((set_type_h == ns_t_cname || set_type_h == ns_t_dname) &&
+             !ALIAS_MATCH_TYPE(query_type_h)) {
+            val_log(context, LOG_DEBUG, 
+                    "digest_response(): Won't follow alias for type %d.", 
+                    query_type_h);
+            matched_q->qc_state = Q_WRONG_ANSWER;
             ret_val = VAL_NO_ERROR;
             goto done;
         }
 
         /*
-         * response[rdata_index] is the first byte of the RDATA of the
-         * record.  The data may contain domain names in compressed format,
-         * so they need to be expanded.  This is type-dependent...
+         * Nothing below looks at RRs that are not kept, other than
+         * an SOA that comes back for a DS query; leave the rest alone
          */
-        if ((ret_val =
-             decompress(&rdata, response_data, rdata_index, end, type_h,
-                        &rdata_len_h)) != VAL_NO_ERROR) {
+        keep = rr_is_kept(context, from_section, set_type_h);
+        if (!keep &&
+            !(set_type_h == ns_t_soa && query_type_h == ns_t_ds)) {
+            continue;
+        }
+
+        if (ns_name_unpack(response_data, end,
+                           &response_data[rri->rri_name_index],
+                           name_n, sizeof(name_n)) == -1) {
             matched_q->qc_state = Q_RESPONSE_ERROR;
             ret_val = VAL_NO_ERROR;
             goto done;
@@ -1798,6 +2026,21 @@ digest_response(val_context_t * context,
             isrelv = 0;
         }
 
+        /*
+         * Only now get the RDATA, and only for RRs that will be stored.
+         * The data may contain domain names in compressed format,
+         * so they need to be expanded.  This is type-dependent...
+         */
+        if (keep && (from_section != VAL_FROM_ANSWER || isrelv)) {
+            if ((ret_val =
+                 get_rr_rdata(response_data, end, rri, &rdata, &rdata_buf,
+                              &rdata_len_h)) != VAL_NO_ERROR) {
+                matched_q->qc_state = Q_RESPONSE_ERROR;
+                ret_val = VAL_NO_ERROR;
+                goto done;
+            }
+        }
+
         authoritive = (matched_q->qc_flags & VAL_QUERY_IS_ITERATING) &&
                       (header->aa == 1);
 
@@ -1948,20 +2191,6 @@ digest_response(val_context_t * context,
             ret_val = VAL_NO_ERROR;
             goto done;
         }
-        /*
-         * If we've received a CNAME/DNAME response for a type that cannot be followed using cnames/dnames
-         * we're not going to follow it
-         */
-        if ((set_type_h == ns_t_cname || set_type_h == ns_t_dname) &&
-             !ALIAS_MATCH_TYPE(query_type_h)) {
-            val_log(context, LOG_DEBUG, 
-                    "digest_response(): Won't follow alias for type %d.", 
-                    query_type_h);
-            matched_q->qc_state = Q_WRONG_ANSWER;
-            ret_val = VAL_NO_ERROR;
-            goto done;
-        }
-
         /*
          * if we have an SOA in the ans/auth section
          *  or if we have a DNSKEY in the ans section
@@ -2081,7 +2310,10 @@ digest_response(val_context_t * context,
             }
         }
 
-        FREE(rdata);
+        if (rdata_buf) {
+            FREE(rdata_buf);
+            rdata_buf = NULL;
+        }
         rdata = NULL;
 
     } 
@@ -2206,11 +2438,15 @@ digest_response(val_context_t * context,
         goto done;
     }
 
+    if (rr_list && rr_list != rr_stack)
+        FREE(rr_list);
     return ret_val;
 
   done:
-    if (rdata)
-        FREE(rdata);
+    if (rdata_buf)
+        FREE(rdata_buf);
+    if (rr_list && rr_list != rr_stack)
+        FREE(rr_list);
     res_sq_free_rrset_recs(&learned_answers);
     res_sq_free_rrset_recs(&learned_proofs);
     res_sq_free_rrset_recs(&learned_zones);
@@ -2219,6 +2455,27 @@ digest_response(val_context_t * context,
 }
 
 
+/*
+ * Work out the libsres hedging flags for a query from the hedge global
+ * option and the VAL_QUERY_HEDGE query flag. The flag asks for RTT based
+ * hedging when the global option doesn't already hedge.
+ */
+static u_int
+val_hedge_flags(val_context_t * context, struct val_query_chain *q)
+{
+    int             hedge = (context && context->g_opt) ?
+                                context->g_opt->hedge : VAL_POL_GOPT_HEDGE_NONE;
+
+    if (hedge == VAL_POL_GOPT_HEDGE_NONE && (q->qc_flags & VAL_QUERY_HEDGE))
+        hedge = VAL_POL_GOPT_HEDGE_RTT;
+
+    if (hedge == VAL_POL_GOPT_HEDGE_RTT)
+        return SR_HEDGE_RTT;
+    if (hedge > 1)
+        return hedge & SR_HEDGE_SERVERS_MASK;
+    return 0;
+}
+
 /*
  * This is the interface between libval and libsres for sending queries
  */
@@ -2255,21 +2512,23 @@ val_resquery_send(val_context_t * context,
     if (ns_name_ntop(matched_q->qc_name_n, name_p, sizeof(name_p)) == -1) {
         return VAL_BAD_ARGUMENT;
     }
-    if (matched_q->qc_zonecut_n == NULL || 
-        ns_name_ntop(matched_q->qc_zonecut_n, zone_p, sizeof(zone_p)) == -1) {
-        strncpy(zone_p, "", sizeof(zone_p)-1); 
-    }
+    if (VAL_LOG_ENABLED(context, LOG_DEBUG)) {
+        if (matched_q->qc_zonecut_n == NULL || 
+            ns_name_ntop(matched_q->qc_zonecut_n, zone_p, sizeof(zone_p)) == -1) {
+            strncpy(zone_p, "", sizeof(zone_p)-1); 
+        }
 
-    val_log(context, LOG_DEBUG, "val_resquery_send(): Sending query for {%s %s(%d) %s(%d)} to: %s", 
-            name_p, p_class(matched_q->qc_class_h), matched_q->qc_class_h,
-            p_type(matched_q->qc_type_h), matched_q->qc_type_h, zone_p);
-    for (tempns = nslist; tempns; tempns = tempns->ns_next) {
-        int i, addr_count;
-        addr_count = tempns->ns_number_of_addresses;
-        for (i=0; i < addr_count; i++) {
-            val_log(context, LOG_DEBUG, "    %s",
-                val_get_ns_string((struct sockaddr *)tempns->ns_address[i],
-                                  name_buf, sizeof(name_buf)));
+        val_log(context, LOG_DEBUG, "val_resquery_send(): Sending query for {%s %s(%d) %s(%d)} to: %s", 
+                name_p, p_class(matched_q->qc_class_h), matched_q->qc_class_h,
+                p_type(matched_q->qc_type_h), matched_q->qc_type_h, zone_p);
+        for (tempns = nslist; tempns; tempns = tempns->ns_next) {
+            int i, addr_count;
+            addr_count = tempns->ns_number_of_addresses;
+            for (i=0; i < addr_count; i++) {
+                val_log(context, LOG_DEBUG, "    %s",
+                    val_get_ns_string((struct sockaddr *)tempns->ns_address[i],
+                                      name_buf, sizeof(name_buf)));
+            }
         }
     }
 
@@ -2278,10 +2537,17 @@ val_resquery_send(val_context_t * context,
      */
     gettimeofday(&now, NULL);
     matched_q->qc_last_sent = now.tv_sec;
+    if (_val_stats_on) {
+        matched_q->qc_sent_tv = now;
+        val_stats_count(VAL_STAT_QUERIES_SENT, 1);
+        if (matched_q->qc_flags & VAL_QUERY_GLUE_REQUEST)
+            val_stats_count(VAL_STAT_GLUE_FETCHES, 1);
+    }
 
     if ((ret_val =
-         query_send(name_p, matched_q->qc_type_h, matched_q->qc_class_h,
-                    nslist, &(matched_q->qc_trans_id))) == SR_UNSET)
+         query_send_flags(name_p, matched_q->qc_type_h, matched_q->qc_class_h,
+                          nslist, val_hedge_flags(context, matched_q),
+                          &(matched_q->qc_trans_id))) == SR_UNSET)
         return VAL_NO_ERROR;
 
     /*
@@ -2425,6 +2691,12 @@ _process_rcvd_response(val_context_t * context,
 
     matched_q->qc_respondent_server = server;
 
+    VAL_STATS_COUNT(VAL_STAT_BYTES_RCVD, (long) response_length);
+    VAL_STATS_STOP(VAL_STAGE_UPSTREAM, matched_q->qc_sent_tv);
+    if (matched_q->qc_flags & VAL_QUERY_GLUE_REQUEST)
+        VAL_STATS_STOP(VAL_STAGE_GLUE, matched_q->qc_sent_tv);
+    timerclear(&matched_q->qc_sent_tv);
+
     *response = (struct domain_info *) MALLOC(sizeof(struct domain_info));
     if (*response == NULL) {
         if (response_data)
@@ -2520,7 +2792,7 @@ val_resquery_async_send(val_context_t * context,
     if (ns_name_ntop(matched_q->qc_name_n, name_p, sizeof(name_p)) == -1)
         return VAL_BAD_ARGUMENT;
 
-    if (val_log_debug_level() >= LOG_DEBUG ) {
+    if (VAL_LOG_ENABLED(context, LOG_DEBUG)) {
         struct name_server *tempns;
         struct name_server *nslist = matched_q->qc_ns_list;
 
@@ -2540,12 +2812,22 @@ val_resquery_async_send(val_context_t * context,
      */
     gettimeofday(&now, NULL);
     matched_q->qc_last_sent = now.tv_sec;
-
-    matched_q->qc_ea = res_async_query_send(name_p, matched_q->qc_type_h,
-                                            matched_q->qc_class_h, 
-                                            matched_q->qc_ns_list);
+    if (_val_stats_on) {
+        matched_q->qc_sent_tv = now;
+        val_stats_count(VAL_STAT_QUERIES_SENT, 1);
+        if (matched_q->qc_flags & VAL_QUERY_GLUE_REQUEST)
+            val_stats_count(VAL_STAT_GLUE_FETCHES, 1);
+    }
+
+    matched_q->qc_ea = res_async_query_create(name_p, matched_q->qc_type_h,
+                                              matched_q->qc_class_h, 
+                                              matched_q->qc_ns_list,
+                                              val_hedge_flags(context,
+                                                              matched_q));
     if (!matched_q->qc_ea)
         matched_q->qc_state = Q_QUERY_ERROR;
+    else
+        res_io_check_ea_list(matched_q->qc_ea, NULL, NULL, NULL, NULL);
 
     return VAL_NO_ERROR;
 }
@@ -2638,9 +2920,9 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
         return VAL_BAD_ARGUMENT;
 
     val_log(NULL, LOG_DEBUG, __FUNCTION__);
-    gettimeofday(&now, NULL);
+    res_gettime(&now);
 
-    /** need to adjust relative timeout to absolute time used by libval */
+    /** need to adjust relative timeout to absolute time used by libsres */
     if (timeout) {
         if(timeout->tv_sec < LONG_MAX) {
             /* add current time to delay */
@@ -2675,22 +2957,28 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
         for (qfq = as->val_as_queries; qfq; qfq = qfq->qfq_next) {
 
             char         name_p[NS_MAXDNAME];
-            if (-1 == ns_name_ntop(qfq->qfq_query->qc_name_n, name_p, sizeof(name_p)))
+            int          logging = VAL_LOG_ENABLED(NULL, LOG_DEBUG);
+
+            /* the name is only needed for the debug output */
+            if (logging &&
+                -1 == ns_name_ntop(qfq->qfq_query->qc_name_n, name_p, sizeof(name_p)))
                 snprintf(name_p, sizeof(name_p), "unknown/error");
             if (!qfq->qfq_query->qc_ea || (qfq->qfq_query->qc_flags & VAL_QUERY_SKIP_RESOLVER)) {
-                val_log(NULL, LOG_DEBUG+1, " as %p query %p {%s %s(%d) %s(%d)} ea %p", as, qfq,
+                if (VAL_LOG_ENABLED(NULL, LOG_DEBUG+1))
+                    val_log(NULL, LOG_DEBUG+1, " as %p query %p {%s %s(%d) %s(%d)} ea %p", as, qfq,
+                            name_p, p_class(qfq->qfq_query->qc_class_h),
+                            qfq->qfq_query->qc_class_h,
+                            p_type(qfq->qfq_query->qc_type_h),
+                            qfq->qfq_query->qc_type_h, qfq->qfq_query->qc_ea);
+                continue;
+            }
+            cache_only = 0;
+            if (logging)
+                val_log(NULL, LOG_DEBUG, " as %p query %p {%s %s(%d) %s(%d)} ea %p", as, qfq,
                         name_p, p_class(qfq->qfq_query->qc_class_h),
                         qfq->qfq_query->qc_class_h,
                         p_type(qfq->qfq_query->qc_type_h),
                         qfq->qfq_query->qc_type_h, qfq->qfq_query->qc_ea);
-                continue;
-            }
-            cache_only = 0;
-            val_log(NULL, LOG_DEBUG, " as %p query %p {%s %s(%d) %s(%d)} ea %p", as, qfq,
-                    name_p, p_class(qfq->qfq_query->qc_class_h),
-                    qfq->qfq_query->qc_class_h,
-                    p_type(qfq->qfq_query->qc_type_h),
-                    qfq->qfq_query->qc_type_h, qfq->qfq_query->qc_ea);
             res_async_query_select_info(qfq->qfq_query->qc_ea, nfds, activefds,
                                         closest_event);
         }
@@ -2700,6 +2988,28 @@ val_async_select_info(val_context_t *ctx, fd_set *activefds,
         }
     }
 
+    /** don't wait if any of our requests are ready or completed */
+    for (as = context->as_ready; as; as = as->val_as_ready_next) {
+#ifndef VAL_NO_THREADS
+        if (! (context->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
+            (! pthread_equal(self, as->val_as_tid)))
+            continue;
+#endif
+        closest.tv_sec = 0;
+        closest.tv_usec = 0;
+        break;
+    }
+    for (as = context->as_done; as; as = as->val_as_next) {
+#ifndef VAL_NO_THREADS
+        if (! (context->ctx_flags & CTX_PROCESS_ALL_THREADS) &&
+            (! pthread_equal(self, as->val_as_tid)))
+            continue;
+#endif
+        closest.tv_sec = 0;
+        closest.tv_usec = 0;
+        break;
+    }
+
     CTX_UNLOCK_ACACHE(context);
     CTX_UNLOCK_POL(context);
 
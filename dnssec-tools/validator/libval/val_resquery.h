@@ -20,12 +20,15 @@ struct glue_fetch_bucket {
 
 int             fix_glue(val_context_t * context,
                          struct queries_for_query **queries,
-                         int *data_missing);
+                         int *data_missing, int *resumed);
 int             res_zi_unverified_ns_list(val_context_t *context,
                                           struct name_server **ns_list,
                                           u_char * zone_name,
                                           struct rrset_rec
-                                          *unchecked_zone_info, struct name_server
+                                          *unchecked_zone_info,
+                                          struct name_trie_node
+                                          *unchecked_zone_index,
+                                          struct name_server
                                           **pending_glue);
 int             find_nslist_for_query(val_context_t * context,
                                       struct queries_for_query *next_qfq,
@@ -33,6 +36,7 @@ int             find_nslist_for_query(val_context_t * context,
 int             bootstrap_referral(val_context_t *context,
                                    u_char * referral_zone_n,
                                    struct rrset_rec *learned_zones,
+                                   struct name_trie_node *learned_index,
                                    struct queries_for_query *matched_qfq,
                                    struct queries_for_query **queries,
                                    struct name_server **ref_ns_list);
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2013 SPARTA, Inc.  All rights reserved.
+ * See the COPYING file distributed with this software for details.
+ */
+/*
+ * DESCRIPTION
+ * Per-query statistics and aggregated latency histograms.
+ *
+ * A query (a val_resolve_and_check() call or an async request) owns a
+ * val_query_stats_t. While libval works on behalf of that query the
+ * record is attached to the current thread, so that code deep in the
+ * validator (signature verification, NSEC3 hashing, response
+ * processing) can account for its work without the record being
+ * passed around. When the query completes its record is folded into
+ * the process-wide totals and handed to the optional callback.
+ *
+ * Everything here is skipped unless _val_stats_on is set; see the
+ * VAL_STATS_* macros in validator-internal.h.
+ */
+#include "validator-internal.h"
+
+int             _val_stats_on = 0;
+
+static val_stats_t stats_totals;
+static val_stats_cb_t stats_cb = NULL;
+static void    *stats_cb_data = NULL;
+
+#ifndef VAL_NO_THREADS
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static void
+stats_key_init(void)
+{
+    pthread_key_create(&stats_key, NULL);
+}
+
+#define STATS_LOCK()    pthread_mutex_lock(&stats_lock)
+#define STATS_UNLOCK()  pthread_mutex_unlock(&stats_lock)
+#else
+static val_query_stats_t *stats_current = NULL;
+
+#define STATS_LOCK()
+#define STATS_UNLOCK()
+#endif
+
+static val_query_stats_t *
+stats_get_current(void)
+{
+#ifndef VAL_NO_THREADS
+    pthread_once(&stats_key_once, stats_key_init);
+    return (val_query_stats_t *) pthread_getspecific(stats_key);
+#else
+    return stats_current;
+#endif
+}
+
+static void
+stats_set_current(val_query_stats_t *qs)
+{
+#ifndef VAL_NO_THREADS
+    pthread_once(&stats_key_once, stats_key_init);
+    pthread_setspecific(stats_key, qs);
+#else
+    stats_current = qs;
+#endif
+}
+
+static long
+stats_elapsed(struct timeval *start)
+{
+    struct timeval  now, diff;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    if (diff.tv_sec < 0)
+        return 0;
+    return diff.tv_sec * 1000000L + diff.tv_usec;
+}
+
+/*
+ * Function: val_stats_enable
+ *
+ * Purpose:  Turn statistics collection on or off. This also controls
+ *           the upstream statistics kept by libsres.
+ */
+void
+val_stats_enable(int enable)
+{
+    _val_stats_on = enable ? 1 : 0;
+    res_io_stats_enable(_val_stats_on);
+}
+
+/*
+ * Function: val_stats_set_callback
+ *
+ * Purpose:  Register a function that is given the statistics of each
+ *           query as it completes. Pass NULL to remove it.
+ */
+void
+val_stats_set_callback(val_stats_cb_t cb, void *cb_data)
+{
+    STATS_LOCK();
+    stats_cb = cb;
+    stats_cb_data = cb_data;
+    STATS_UNLOCK();
+}
+
+void
+val_stats_get(val_stats_t *stats)
+{
+    if (NULL == stats)
+        return;
+
+    STATS_LOCK();
+    memcpy(stats, &stats_totals, sizeof(*stats));
+    STATS_UNLOCK();
+}
+
+void
+val_stats_reset(void)
+{
+    STATS_LOCK();
+    memset(&stats_totals, 0, sizeof(stats_totals));
+    STATS_UNLOCK();
+    res_io_stats_reset();
+}
+
+void
+val_stats_dump(FILE *fp)
+{
+    val_stats_t     st;
+    u_int64_t       hist[VAL_STATS_BUCKETS];
+    static const char *count_names[VAL_STAT_COUNTERS] = {
+        "cache hits", "sub-queries sent", "glue fetches",
+        "bytes received", "signatures verified", "NSEC3 hashes"
+    };
+    static const char *stage_names[VAL_STAGES] = {
+        "query time", "upstream wait", "glue wait", "crypto time"
+    };
+    int             i, j;
+
+    if (NULL == fp)
+        return;
+
+    val_stats_get(&st);
+
+    fprintf(fp, "queries:                    %llu\n",
+            (unsigned long long) st.vs_queries);
+    for (i = 0; i < VAL_STAT_COUNTERS; i++) {
+        fprintf(fp, "%-27s %llu\n", count_names[i],
+                (unsigned long long) st.vs_count[i]);
+    }
+    for (i = 0; i < VAL_STAGES; i++) {
+        fprintf(fp, "%-27s %llu us total\n", stage_names[i],
+                (unsigned long long) st.vs_usec[i]);
+    }
+    for (i = 0; i < VAL_STAGES; i++) {
+        for (j = 0; j < VAL_STATS_BUCKETS; j++)
+            hist[j] = st.vs_hist[i][j];
+        res_stats_dump_hist(fp, stage_names[i], hist, VAL_STATS_BUCKETS);
+    }
+
+    res_io_stats_dump(fp);
+}
+
+/*
+ * Internal interfaces
+ */
+
+/* reset a per-query record and mark its start time */
+void
+val_stats_start(val_query_stats_t *qs)
+{
+    memset(qs, 0, sizeof(*qs));
+    gettimeofday(&qs->vqs_start, NULL);
+}
+
+/*
+ * Make qs the record that work on this thread is accounted to.
+ * Returns the previous record, to be handed to val_stats_detach().
+ */
+val_query_stats_t *
+val_stats_attach(val_query_stats_t *qs)
+{
+    val_query_stats_t *prev = stats_get_current();
+
+    stats_set_current(qs);
+    return prev;
+}
+
+void
+val_stats_detach(val_query_stats_t *prev)
+{
+    stats_set_current(prev);
+}
+
+/*
+ * Record the total time for a query, fold its record into the totals
+ * and report it to the callback
+ */
+void
+val_stats_finish(val_query_stats_t *qs, const char *name, int class_h,
+                 int type_h)
+{
+    int             i;
+
+    if (NULL == qs || !timerisset(&qs->vqs_start))
+        return;
+
+    qs->vqs_usec[VAL_STAGE_TOTAL] = stats_elapsed(&qs->vqs_start);
+
+    STATS_LOCK();
+    stats_totals.vs_queries++;
+    for (i = 0; i < VAL_STAT_COUNTERS; i++)
+        stats_totals.vs_count[i] += qs->vqs_count[i];
+    for (i = 0; i < VAL_STAGES; i++) {
+        stats_totals.vs_usec[i] += qs->vqs_usec[i];
+        /* stages a query never entered don't count as samples */
+        if (i == VAL_STAGE_TOTAL || qs->vqs_usec[i] > 0)
+            stats_totals.vs_hist[i][res_stats_bucket(qs->vqs_usec[i],
+                                                     VAL_STATS_BUCKETS)]++;
+    }
+    STATS_UNLOCK();
+
+    if (stats_cb)
+        (*stats_cb)(stats_cb_data, name, class_h, type_h, qs);
+
+    timerclear(&qs->vqs_start);
+}
+
+void
+val_stats_count(int stat, long n)
+{
+    val_query_stats_t *qs = stats_get_current();
+
+    if (qs && stat >= 0 && stat < VAL_STAT_COUNTERS)
+        qs->vqs_count[stat] += n;
+}
+
+/* charge the time elapsed since start to the given stage */
+void
+val_stats_time(int stage, struct timeval *start)
+{
+    val_query_stats_t *qs = stats_get_current();
+
+    if (qs && stage >= 0 && stage < VAL_STAGES)
+        qs->vqs_usec[stage] += stats_elapsed(start);
+}
@@ -642,6 +642,40 @@ find_rr_set(struct name_server *respondent_server,
     return new_one;
 }
 
+/*
+ * Return TRUE if RDATA of the given type carries domain names that
+ * decompress() has to expand. The RDATA of any other type can be used
+ * just as it is found in the response.
+ */
+int
+rdata_has_names(u_int16_t type_h)
+{
+    switch (type_h) {
+    case ns_t_soa:
+    case ns_t_minfo:
+    case ns_t_rp:
+    case ns_t_ns:
+    case ns_t_cname:
+    case ns_t_dname:
+    case ns_t_mb:
+    case ns_t_mg:
+    case ns_t_mr:
+    case ns_t_md:
+    case ns_t_mf:
+    case ns_t_ptr:
+    case ns_t_srv:
+    case ns_t_rt:
+    case ns_t_mx:
+    case ns_t_afsdb:
+    case ns_t_kx:
+    case ns_t_px:
+    case ns_t_rrsig:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
 int
 decompress(u_char ** rdata,
            u_char * response,
@@ -1009,6 +1043,95 @@ extract_from_rr(u_char * response,
     return VAL_NO_ERROR;
 }
 
+/*
+ * Like extract_from_rr(), but only records where the pieces of the RR
+ * are in the response: the owner name is skipped over instead of being
+ * unpacked, and nothing is copied. The RDATA is checked to lie within
+ * the response, so that it can be used in place later on.
+ */
+int
+index_rr(u_char * response,
+         size_t *response_index,
+         u_char * end,
+         struct rr_index *rri)
+{
+    u_int16_t       net_short;
+    u_int32_t       net_int;
+    size_t          index;
+    u_char          label_len;
+
+    if ((response == NULL) || (response_index == NULL) || (end == NULL)
+        || (rri == NULL))
+        return VAL_BAD_ARGUMENT;
+
+    /*
+     * Step over the owner name; it ends at the root label or at the
+     * first compression pointer
+     */
+    index = *response_index;
+    rri->rri_name_index = index;
+    for (;;) {
+        if (response + index >= end)
+            return VAL_BAD_ARGUMENT;
+        label_len = response[index];
+        if (label_len == 0) {
+            index++;
+            break;
+        }
+        if ((label_len & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+            index += sizeof(u_int16_t);
+            break;
+        }
+        if (label_len & NS_CMPRSFLGS)
+            return VAL_BAD_ARGUMENT;    /* unknown label type */
+        index += label_len + 1;
+    }
+
+    /* check if we have enough data to read the envelope */
+    if (response + index +
+        sizeof(u_int16_t) +
+        sizeof(u_int16_t) +
+        sizeof(u_int32_t) +
+        sizeof(u_int16_t) > end) {
+            return VAL_BAD_ARGUMENT;
+    }
+
+    memcpy(&net_short, &response[index], sizeof(u_int16_t));
+    rri->rri_type_h = ntohs(net_short);
+    index += sizeof(u_int16_t);
+
+    memcpy(&net_short, &response[index], sizeof(u_int16_t));
+    rri->rri_class_h = ntohs(net_short);
+    index += sizeof(u_int16_t);
+
+    memcpy(&net_int, &response[index], sizeof(u_int32_t));
+    rri->rri_ttl_h = ntohl(net_int);
+    index += sizeof(u_int32_t);
+
+    memcpy(&net_short, &response[index], sizeof(u_int16_t));
+    rri->rri_rdata_len_h = ntohs(net_short);
+    index += sizeof(u_int16_t);
+
+    rri->rri_rdata_index = index;
+    if (response + index + rri->rri_rdata_len_h > end)
+        return VAL_BAD_ARGUMENT;
+
+    /*
+     * The set type of a signature is the type that it covers 
+     */
+    if (rri->rri_type_h == ns_t_rrsig) {
+        if (rri->rri_rdata_len_h < sizeof(u_int16_t))
+            return VAL_BAD_ARGUMENT;
+        memcpy(&net_short, &response[index], sizeof(u_int16_t));
+        rri->rri_set_type_h = ntohs(net_short);
+    } else
+        rri->rri_set_type_h = rri->rri_type_h;
+
+    *response_index = index + rri->rri_rdata_len_h;
+
+    return VAL_NO_ERROR;
+}
+
 void
 lower_name(u_char rdata[], size_t * index)
 {
@@ -1657,3 +1780,241 @@ val_create_rr_otw( char *name,
 
 }
 
+
+/*
+ * Name trie. Each node stands for one domain name and carries an
+ * array of caller data for that name; the children of a node are kept
+ * sorted by label, so that finding a name costs one binary search per
+ * label. Labels are compared without regard to case.
+ */
+
+/*
+ * compare a (lower case) node label with a label from a name
+ */
+static int
+name_trie_labelcmp(const u_char *node_label, const u_char *label)
+{
+    int             i, d;
+
+    if (node_label[0] != label[0])
+        return (int) node_label[0] - (int) label[0];
+    for (i = 1; i <= label[0]; i++) {
+        d = (int) node_label[i] - tolower(label[i]);
+        if (d)
+            return d;
+    }
+    return 0;
+}
+
+/*
+ * find the child of node for the given label. Returns the child, or
+ * NULL with *pos set to where it would be inserted.
+ */
+static struct name_trie_node *
+name_trie_child(struct name_trie_node *node, const u_char *label, int *pos)
+{
+    int             lo = 0, hi = node->ntn_nchild - 1, mid, d;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        d = name_trie_labelcmp(node->ntn_child[mid]->ntn_label, label);
+        if (d == 0) {
+            if (pos)
+                *pos = mid;
+            return node->ntn_child[mid];
+        }
+        if (d < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    if (pos)
+        *pos = lo;
+    return NULL;
+}
+
+/*
+ * remember the start of each label in name_n; returns the label count 
+ */
+static int
+name_trie_labels(const u_char *name_n, const u_char **labels,
+                 const u_char **root)
+{
+    const u_char   *p = name_n;
+    int             n = 0;
+
+    while (*p != '\0' && n < NAME_TRIE_MAX_LABELS) {
+        labels[n++] = p;
+        p += *p + 1;
+    }
+    *root = p;
+    return n;
+}
+
+struct name_trie_node *
+name_trie_create(void)
+{
+    struct name_trie_node *root;
+
+    root = (struct name_trie_node *) MALLOC(sizeof(struct name_trie_node));
+    if (root)
+        memset(root, 0, sizeof(struct name_trie_node));
+    return root;
+}
+
+void
+name_trie_free(struct name_trie_node *node)
+{
+    int             i;
+
+    if (node == NULL)
+        return;
+    for (i = 0; i < node->ntn_nchild; i++)
+        name_trie_free(node->ntn_child[i]);
+    if (node->ntn_child)
+        FREE(node->ntn_child);
+    if (node->ntn_data)
+        FREE(node->ntn_data);
+    FREE(node);
+}
+
+/*
+ * Add data for name_n, after any data already stored for that name
+ */
+int
+name_trie_insert(struct name_trie_node *root, const u_char *name_n,
+                 void *data)
+{
+    struct name_trie_node *node, *child, **children;
+    const u_char   *labels[NAME_TRIE_MAX_LABELS], *rootlabel;
+    void          **newdata;
+    int             n, i, pos;
+
+    if (root == NULL || name_n == NULL)
+        return VAL_BAD_ARGUMENT;
+
+    n = name_trie_labels(name_n, labels, &rootlabel);
+
+    node = root;
+    while (n-- > 0) {
+        child = name_trie_child(node, labels[n], &pos);
+        if (child == NULL) {
+            if (node->ntn_nchild == node->ntn_csize) {
+                children = (struct name_trie_node **)
+                    MALLOC((node->ntn_csize * 2 + 2) *
+                           sizeof(struct name_trie_node *));
+                if (children == NULL)
+                    return VAL_OUT_OF_MEMORY;
+                if (node->ntn_child) {
+                    memcpy(children, node->ntn_child, node->ntn_nchild *
+                           sizeof(struct name_trie_node *));
+                    FREE(node->ntn_child);
+                }
+                node->ntn_child = children;
+                node->ntn_csize = node->ntn_csize * 2 + 2;
+            }
+            child = name_trie_create();
+            if (child == NULL)
+                return VAL_OUT_OF_MEMORY;
+            child->ntn_label[0] = labels[n][0];
+            for (i = 1; i <= labels[n][0]; i++)
+                child->ntn_label[i] = tolower(labels[n][i]);
+            for (i = node->ntn_nchild; i > pos; i--)
+                node->ntn_child[i] = node->ntn_child[i - 1];
+            node->ntn_child[pos] = child;
+            node->ntn_nchild++;
+        }
+        node = child;
+    }
+
+    if (node->ntn_ndata == node->ntn_dsize) {
+        newdata = (void **) MALLOC((node->ntn_dsize * 2 + 2) *
+                                   sizeof(void *));
+        if (newdata == NULL)
+            return VAL_OUT_OF_MEMORY;
+        if (node->ntn_data) {
+            memcpy(newdata, node->ntn_data, node->ntn_ndata * sizeof(void *));
+            FREE(node->ntn_data);
+        }
+        node->ntn_data = newdata;
+        node->ntn_dsize = node->ntn_dsize * 2 + 2;
+    }
+    node->ntn_data[node->ntn_ndata++] = data;
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Return the node for exactly name_n, or NULL 
+ */
+struct name_trie_node *
+name_trie_find(struct name_trie_node *root, const u_char *name_n)
+{
+    const u_char   *labels[NAME_TRIE_MAX_LABELS], *rootlabel;
+    int             n;
+
+    if (root == NULL || name_n == NULL)
+        return NULL;
+
+    n = name_trie_labels(name_n, labels, &rootlabel);
+    while (root && n-- > 0)
+        root = name_trie_child(root, labels[n], NULL);
+    return root;
+}
+
+/*
+ * Drop data stored for name_n. This never allocates; nodes that
+ * become empty are left in place.
+ */
+void
+name_trie_remove(struct name_trie_node *root, const u_char *name_n,
+                 void *data)
+{
+    struct name_trie_node *node = name_trie_find(root, name_n);
+    int             i;
+
+    if (node == NULL)
+        return;
+
+    for (i = 0; i < node->ntn_ndata; i++) {
+        if (node->ntn_data[i] == data) {
+            node->ntn_ndata--;
+            memmove(&node->ntn_data[i], &node->ntn_data[i + 1],
+                    (node->ntn_ndata - i) * sizeof(void *));
+            return;
+        }
+    }
+}
+
+/*
+ * Find the nodes holding data for name_n and each of its ancestors.
+ * They are returned in nodes[], starting with the root; names[] gets
+ * the matching suffix of name_n for each. Both arrays must have room
+ * for NAME_TRIE_MAX_LABELS + 1 entries. Returns the number of nodes
+ * found.
+ */
+int
+name_trie_path(struct name_trie_node *root, u_char *name_n,
+               struct name_trie_node **nodes, u_char **names)
+{
+    const u_char   *labels[NAME_TRIE_MAX_LABELS], *rootlabel;
+    int             n, count = 0;
+
+    if (root == NULL || name_n == NULL)
+        return 0;
+
+    n = name_trie_labels(name_n, labels, &rootlabel);
+    if (root->ntn_ndata > 0) {
+        nodes[count] = root;
+        names[count++] = (u_char *) rootlabel;
+    }
+    while (n-- > 0) {
+        root = name_trie_child(root, labels[n], NULL);
+        if (root == NULL)
+            break;
+        if (root->ntn_ndata > 0) {
+            nodes[count] = root;
+            names[count++] = (u_char *) labels[n];
+        }
+    }
+    return count;
+}
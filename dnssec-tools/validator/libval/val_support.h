@@ -51,6 +51,20 @@
 } while(0)
 
 
+/*
+ * The envelope of an RR, as found by index_rr(). All indexes are byte
+ * offsets into the response; the owner name may still be compressed.
+ */
+struct rr_index {
+    size_t          rri_name_index;
+    size_t          rri_rdata_index;
+    size_t          rri_rdata_len_h;
+    u_int32_t       rri_ttl_h;
+    u_int16_t       rri_type_h;
+    u_int16_t       rri_set_type_h;
+    u_int16_t       rri_class_h;
+};
+
 #define ITS_BEEN_DONE   0
 #define IT_HASNT        1
 #define IT_WONT         (-1)
@@ -120,6 +134,11 @@ int             extract_from_rr(u_char * response,
                                 u_int32_t * ttl_h,
                                 size_t * rdata_length_h,
                                 size_t *rdata_index);
+int             index_rr(u_char * response,
+                         size_t *response_index,
+                         u_char * end,
+                         struct rr_index *rri);
+int             rdata_has_names(u_int16_t type_h);
 void            lower_name(u_char rdata[], size_t * index);
 void            lower(u_int16_t type_h, u_char * rdata, size_t len);
 struct rrset_rr  *copy_rr_rec(u_int16_t type_h, struct rrset_rr *r,
@@ -137,4 +156,17 @@ void            deregister_queries(struct query_list **q);
 void            merge_rrset_recs(struct rrset_rec **dest,
                                  struct rrset_rec *new_info);
 
+struct name_trie_node *name_trie_create(void);
+void            name_trie_free(struct name_trie_node *root);
+int             name_trie_insert(struct name_trie_node *root,
+                                 const u_char * name_n, void *data);
+void            name_trie_remove(struct name_trie_node *root,
+                                 const u_char * name_n, void *data);
+struct name_trie_node *name_trie_find(struct name_trie_node *root,
+                                      const u_char * name_n);
+int             name_trie_path(struct name_trie_node *root,
+                               u_char * name_n,
+                               struct name_trie_node **nodes,
+                               u_char ** names);
+
 #endif                          /* VAL_SUPPORT_H */
@@ -28,53 +28,25 @@ get_clock_skew(val_context_t *ctx,
                int *skew,
                u_int32_t *ttl_x)
 {
-    policy_entry_t *cs_pol, *cs_cur;
-    u_char       *p;
-    size_t       name_len;
+    policy_entry_t *cs_cur;
+    struct policy_match pm;
 
     if (ctx == NULL || name_n == NULL || skew == NULL || ttl_x == NULL) {
         val_log(ctx, LOG_DEBUG, "get_clock_skew(): Cannot check for clock skew policy, bad args"); 
         return; 
     }
     
-    RETRIEVE_POLICY(ctx, P_CLOCK_SKEW, cs_pol);
-    if (cs_pol) {
-
-        name_len = wire_name_length(name_n);
-
-        for (cs_cur = cs_pol;
-             cs_cur && (wire_name_length(cs_cur->zone_n) > name_len);
-             cs_cur = cs_cur->next);
-        /*
-         * for all zones which are shorter or as long, do a strstr 
-         */
-        /*
-         * Because of the ordering, the longest match is found first 
-         */
-        for (; cs_cur; cs_cur = cs_cur->next) {
-            int             root_zone = 0;
-            if (!namecmp(cs_cur->zone_n, (const u_char *) ""))
-                root_zone = 1;
-            else {
-                /*
-                 * Find the last occurrence of cs_cur->zone_n in name_n 
-                 */
-                p = name_n;
-                while (p && (*p != '\0')) {
-                    if (!namecmp(p, cs_cur->zone_n))
-                        break;
-                    p = p + *p + 1;
-                }
-            }
-            if (root_zone || (!namecmp(p, cs_cur->zone_n))) {
-                val_log(ctx, LOG_DEBUG, "get_clock_skew(): Found clock skew policy"); 
-                if (cs_cur->pol) {
-                    *skew = ((struct clock_skew_policy *)(cs_cur->pol))->clock_skew;
-                    if (cs_cur->exp_ttl > 0)
-                        *ttl_x = cs_cur->exp_ttl;
-                    return;
-                }
-            }
+    /*
+     * Matches are returned longest first 
+     */
+    for (cs_cur = policy_match_first(ctx, P_CLOCK_SKEW, name_n, &pm);
+         cs_cur; cs_cur = policy_match_next(&pm)) {
+        val_log(ctx, LOG_DEBUG, "get_clock_skew(): Found clock skew policy"); 
+        if (cs_cur->pol) {
+            *skew = ((struct clock_skew_policy *)(cs_cur->pol))->clock_skew;
+            if (cs_cur->exp_ttl > 0)
+                *ttl_x = cs_cur->exp_ttl;
+            return;
         }
     }
     val_log(ctx, LOG_DEBUG, "get_clock_skew(): No clock skew policy found"); 
@@ -477,6 +449,7 @@ do_verify(val_context_t * ctx,
     val_rrsig_rdata_t rrsig_rdata;
     int clock_skew = 0;
     u_int32_t ttl_x = 0;
+    struct timeval crypto_tv;
 
     /*
      * Wildcard expansions for DNSKEYs and DSs are not permitted
@@ -532,8 +505,12 @@ do_verify(val_context_t * ctx,
     /*
      * Perform the verification 
      */
+    timerclear(&crypto_tv);
+    VAL_STATS_COUNT(VAL_STAT_SIGS_VERIFIED, 1);
+    VAL_STATS_START(crypto_tv);
     ret_val = val_sigverify(ctx, is_a_wildcard, ver_field, ver_length, the_key,
                   &rrsig_rdata, dnskey_status, sig_status, clock_skew);
+    VAL_STATS_STOP(VAL_STAGE_CRYPTO, crypto_tv);
 
     if (rrsig_rdata.signature != NULL) {
         FREE(rrsig_rdata.signature);
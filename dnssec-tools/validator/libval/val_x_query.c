@@ -83,38 +83,95 @@ determine_size(struct val_result_chain *res)
 
 
 /*
- * Update the response buffer with the contents of an rrset.
+ * Map an rrset to the response section it is written to
+ */
+static int
+rrset_section(struct val_rrset_rec *rrset)
+{
+    if (rrset->val_rrset_section == VAL_FROM_ANSWER ||
+        rrset->val_rrset_section == VAL_FROM_AUTHORITY)
+        return rrset->val_rrset_section;
+    return VAL_FROM_ADDITIONAL;
+}
+
+/*
+ * Forget any compression pointers that refer to data at or beyond
+ * cp, e.g. after a record has been backed out of the response.
+ */
+static void
+reset_dnptrs(const u_char **dnptrs, const u_char *cp)
+{
+    const u_char  **dpp;
+
+    for (dpp = dnptrs + 1; *dpp != NULL; dpp++) {
+        if (*dpp >= cp) {
+            *dpp = NULL;
+            break;
+        }
+    }
+}
+
+/*
+ * Write one resource record at *cp, compressing the owner name
+ * against the names already in the message.
+ *
+ * Returns 0 on success, 1 if the record does not fit in the space
+ * remaining, and -1 on error.
+ */
+static int
+encode_response_rr(const u_char *name_n, u_int16_t type_h,
+                   u_int16_t class_h, u_int32_t ttl_h,
+                   struct val_rr_rec *rr, u_char **cp, u_char *eom,
+                   const u_char **dnptrs, const u_char **lastdnptr)
+{
+    u_char *start = *cp;
+    u_int16_t rr_data_length_n = (u_int16_t)rr->rr_rdata_length;
+    int n;
+
+    if (rr->rr_rdata_length > rr_data_length_n)
+        return -1;
+
+    n = ns_name_pack(name_n, start, eom - start, dnptrs, lastdnptr);
+    if (n < 0)
+        return 1;               /* ns_name_pack resets dnptrs itself */
+
+    if ((size_t)(eom - start) < n + 10 + (size_t)rr_data_length_n) {
+        reset_dnptrs(dnptrs, start);
+        return 1;
+    }
+
+    *cp = start + n;
+    NS_PUT16(type_h, *cp);
+    NS_PUT16(class_h, *cp);
+    NS_PUT32(ttl_h, *cp);
+    NS_PUT16(rr_data_length_n, *cp);
+    memcpy(*cp, rr->rr_rdata, rr_data_length_n);
+    *cp += rr_data_length_n;
+
+    return 0;
+}
+
+/*
+ * Write the contents of an rrset into the response at *cp.
  *
- * Update one of anbuf, nsbuf and arbuf depending on whether
- * the rrset was present in the answer, authority or additional
- * section.
+ * count is incremented for each record written. Once a record
+ * does not fit, *truncated is set and no further records are
+ * written, although seen is still updated with the number of
+ * records the rrset contains.
  *
  * Returns 0 on success and -1 on error
  */
 static int
 encode_response_rrset(struct val_rrset_rec *rrset,
-                      val_status_t val_rc_status,
-                      size_t resp_len,
-                      u_char **anbuf,
-                      size_t *anbufindex,
-                      size_t *ancount,
-                      u_char **nsbuf,
-                      size_t *nsbufindex,
-                      size_t *nscount,
-                      u_char **arbuf,
-                      size_t *arbufindex,
-                      size_t *arcount, 
-                      int *an_auth, 
-                      int *ns_auth)
+                      u_char **cp, u_char *eom,
+                      const u_char **dnptrs, const u_char **lastdnptr,
+                      size_t *count, size_t *seen, int *truncated)
 {
-    u_char  *cp;
-    size_t *bufindex = NULL;
     struct val_rr_rec  *rr;
-    size_t rrset_name_n_len;
-    size_t *count;
     u_int16_t class_h, type_h;
     u_int32_t ttl_h;
     u_char name_n[NS_MAXCDNAME];
+    int rc;
 
     if (rrset == NULL)
         return 0;
@@ -133,136 +190,95 @@ encode_response_rrset(struct val_rrset_rec *rrset,
         return 0;
     }
 
-    rrset_name_n_len = wire_name_length(name_n);
     class_h = (u_int16_t) rrset->val_rrset_class;
     type_h = (u_int16_t) rrset->val_rrset_type;
     ttl_h = (u_int32_t) rrset->val_rrset_ttl;
-    
-
-    /** other inputs are checked by the calling method **/
-    
-    if (rrset->val_rrset_section == VAL_FROM_ANSWER) {
-        cp = *anbuf + *anbufindex;
-        bufindex = anbufindex;
-        count = ancount;
-        if (!val_istrusted(val_rc_status)) {
-            *an_auth = 0;
-        }
-    } else if (rrset->val_rrset_section == VAL_FROM_AUTHORITY) {
-        cp = *nsbuf + *nsbufindex;
-        bufindex = nsbufindex;
-        count = nscount;
-        if (!val_istrusted(val_rc_status)) {
-            *ns_auth = 0;
-        }
-    } else {                    /* VAL_FROM_ADDITIONAL */
-        cp = *arbuf + *arbufindex;
-        bufindex = arbufindex;
-        count = arcount;
-    }
 
-    /*
-     * Answer/Authority/Additional section 
-     */
     /* for each data */
     for (rr = rrset->val_rrset_data; rr; rr = rr->rr_next) {
-
-        u_int16_t rr_data_length_n = (u_int16_t)rr->rr_rdata_length;
-        if (rr->rr_rdata_length > rr_data_length_n)
+        (*seen)++;
+        if (*truncated)
+            continue;
+        rc = encode_response_rr(name_n, type_h, class_h, ttl_h, rr,
+                                cp, eom, dnptrs, lastdnptr);
+        if (rc < 0)
             return -1;
-        if ((*bufindex + rrset_name_n_len + 10 +
-             rr_data_length_n) > resp_len) {
-            /** log error message?  */
-            return -1;
-        }
-
-        (*count)++;
-
-        memcpy(cp, name_n, rrset_name_n_len);
-        cp += rrset_name_n_len;
-
-        NS_PUT16(type_h, cp);
-        NS_PUT16(class_h, cp);
-        NS_PUT32(ttl_h, cp);
-        NS_PUT16(rr_data_length_n, cp);
-        memcpy(cp, rr->rr_rdata, rr_data_length_n);
-        cp += rr_data_length_n;
-
+        if (rc > 0)
+            *truncated = 1;
+        else
+            (*count)++;
     }  
     /* for each rrsig */
     for (rr = rrset->val_rrset_sig; rr; rr = rr->rr_next) {
-
-        u_int16_t rr_data_length_n = (u_int16_t)rr->rr_rdata_length;
-        if (rr->rr_rdata_length > rr_data_length_n)
-            return -1;
-
-        if ((*bufindex + rrset_name_n_len + 10 +
-             rr_data_length_n) > resp_len) {
-            /** log error message?  */
+        (*seen)++;
+        if (*truncated)
+            continue;
+        rc = encode_response_rr(name_n, ns_t_rrsig, class_h, ttl_h, rr,
+                                cp, eom, dnptrs, lastdnptr);
+        if (rc < 0)
             return -1;
-        }
-
-        (*count)++;
-
-        memcpy(cp, name_n, rrset_name_n_len);
-        cp += rrset_name_n_len;
-        NS_PUT16(ns_t_rrsig, cp);
-        NS_PUT16(class_h, cp);
-        NS_PUT32(ttl_h, cp);
-        NS_PUT16(rr_data_length_n, cp);
-        memcpy(cp, rr->rr_rdata, rr_data_length_n);
-        cp += rr_data_length_n;
-
+        if (rc > 0)
+            *truncated = 1;
+        else
+            (*count)++;
     }                           // end for each rr
 
-    *bufindex += find_rrset_len(rrset);
-    if (*bufindex > resp_len) {
-        /** log error message?  */
-        return -1;
-    }
-
     return 0;
 }
 
 /*
- * Function: compose_answer
+ * Function: compose_answer_buf
  *
  * Purpose: Convert the list of val_result_chain structures returned 
- *          by the validator into a linked list of val_response structures
+ *          by the validator into a DNS response message, written 
+ *          directly into the caller-supplied buffer. Owner names are
+ *          compressed.
  *
  * Parameters:
- *              name_n -- The domain name.
+ *                name -- The domain name.
  *              type_h -- The DNS type.
  *             class_h -- The DNS class.
  *             results -- A linked list of val_result_chain structures returned
  *                        by the validator's val_resolve_and_check function.
- *                resp -- The structures within which answers are to be returned 
+ *              answer -- The buffer in which the response is constructed.
+ *             anslen  -- The size of answer.
+ *            resp_len -- On return, the length of the response. If the 
+ *                        response did not fit, the records that did fit are
+ *                        left in answer with the TC bit set, and resp_len is
+ *                        set to a size that is large enough for the complete
+ *                        response.
+ *          val_status -- On return, the merged validation status of the answer.
+ *
  * Return value: VAL_NO_ERROR on success, and a negative valued error code 
  *               (see val_errors.h) on failure.
  */
-
 int
-compose_answer(const char * name,
-               int type_h,
-               int class_h,
-               struct val_result_chain *results,
-               struct val_response *f_resp)
+compose_answer_buf(const char * name,
+                   int type_h,
+                   int class_h,
+                   struct val_result_chain *results,
+                   u_char * answer,
+                   size_t anslen,
+                   size_t * resp_len,
+                   val_status_t * val_status)
 {
     struct val_result_chain *res = NULL;
     size_t ancount = 0;        // Answer Count
     size_t nscount = 0;        // Authority Count
     size_t arcount = 0;        // Additional Count
-    size_t anbufindex = 0, nsbufindex = 0, arbufindex = 0;
-    u_char  *anbuf = NULL, *nsbuf = NULL, *arbuf = NULL;
-    int an_auth = 1;
-    int ns_auth = 1;
+    size_t an_seen = 0, ns_seen = 0, ar_seen = 0;
+    size_t *count, *seen;
     u_char  *rp = NULL;
-    size_t          resp_len = 0;
+    u_char  *eom = NULL;
     HEADER         *hp = NULL;
     size_t          len;
     int             retval;
+    int             truncated = 0;
+    int             section;
     u_char name_n[NS_MAXCDNAME];
     u_int16_t class_n, type_n;
+    const u_char   *dnptrs[64];
+    const u_char  **lastdnptr;
 
     struct val_rrset_rec *rrset;
     int validated = 1;
@@ -270,29 +286,15 @@ compose_answer(const char * name,
 
     SET_LAST_ERR(0);
 
-    ancount = 0;
-    nscount = 0;
-    arcount = 0;
-    anbufindex = 0;
-    nsbufindex = 0;
-    arbufindex = 0;
-    anbuf = NULL;
-    nsbuf = NULL;
-    arbuf = NULL;
-    an_auth = 1;
-    ns_auth = 1;
-
-    rp = NULL;
-    resp_len = 0;
-
-    retval = VAL_NO_ERROR;
     //SET_LAST_ERR(NETDB_INTERNAL);
     SET_LAST_ERR(NO_RECOVERY);
     
-    if ((f_resp == NULL) || (name == NULL))
+    if ((answer == NULL) || (name == NULL) || (resp_len == NULL) ||
+        (val_status == NULL))
         return VAL_BAD_ARGUMENT;
 
-    memset(f_resp, 0, sizeof(struct val_response));
+    *resp_len = 0;
+    *val_status = VAL_UNTRUSTED_ANSWER;
 
     /* 
      * Sanity check the values of class and type 
@@ -309,62 +311,96 @@ compose_answer(const char * name,
         return VAL_BAD_ARGUMENT;
     }
 
-    for (res = results; res; res = res->val_rc_next) {
-        resp_len += determine_size(res);
-    }
-
-    f_resp->vr_val_status = VAL_UNTRUSTED_ANSWER;
-    f_resp->vr_length = (resp_len + OUTER_HEADER_LEN);
-    f_resp->vr_response = (u_char *) MALLOC(f_resp->vr_length *
-                                     sizeof(u_char));
-    if (f_resp->vr_response == NULL) {
-            f_resp->vr_length = 0;
-            return VAL_OUT_OF_MEMORY;
+    /* header and question must fit */
+    if (anslen < OUTER_HEADER_LEN) {
+        return VAL_BAD_ARGUMENT;
     }
-    memset(f_resp->vr_response, 0, f_resp->vr_length * sizeof(u_char));
     
     /*
      * Header 
      */
-    rp = f_resp->vr_response;
+    rp = answer;
+    eom = answer + anslen;
     hp = (HEADER *) rp;
     memset(hp, 0, sizeof(HEADER));
     rp += sizeof(HEADER);
 
+    dnptrs[0] = answer;
+    dnptrs[1] = NULL;
+    lastdnptr = dnptrs + sizeof(dnptrs) / sizeof(dnptrs[0]);
+
     /*
      * Question section 
      */
     len = wire_name_length(name_n);
-    memcpy(rp, name_n, len);
+    if (ns_name_pack(name_n, rp, eom - rp, dnptrs, lastdnptr) != (int)len) {
+        /* nothing to compress against, so the name is written verbatim */
+        return VAL_BAD_ARGUMENT;
+    }
     rp += len;
     NS_PUT16(type_n, rp);
     NS_PUT16(class_n, rp);
     hp->qdcount = htons(1);
 
     if (results == NULL) {
+        *resp_len = rp - answer;
         return VAL_NO_ERROR;
     }
 
     /*
-     * temporary buffers for different sections 
+     * Answer/Authority/Additional sections; each section is written
+     * in turn straight into the response.
      */
-    anbuf = (u_char *) MALLOC(resp_len * sizeof(u_char));
-    nsbuf = (u_char *) MALLOC(resp_len * sizeof(u_char));
-    arbuf = (u_char *) MALLOC(resp_len * sizeof(u_char));
-    if ((anbuf == NULL) || (nsbuf == NULL) || (arbuf == NULL)) {
-        if (anbuf)
-            FREE(anbuf);
-        if (nsbuf)
-            FREE(nsbuf);
-        if (arbuf)
-            FREE(arbuf);
-        return VAL_OUT_OF_MEMORY;
+    for (section = VAL_FROM_ANSWER; section <= VAL_FROM_ADDITIONAL; section++) {
+
+        if (section == VAL_FROM_ANSWER) {
+            count = &ancount;
+            seen = &an_seen;
+        } else if (section == VAL_FROM_AUTHORITY) {
+            count = &nscount;
+            seen = &ns_seen;
+        } else {
+            count = &arcount;
+            seen = &ar_seen;
+        }
+
+        for (res = results; res; res = res->val_rc_next) {
+
+            rrset = res->val_rc_rrset;
+            if (rrset && rrset_section(rrset) == section) {
+                if (-1 == encode_response_rrset(rrset, &rp, eom, 
+                                                dnptrs, lastdnptr,
+                                                count, seen, &truncated)) {
+                    return VAL_BAD_ARGUMENT;
+                }
+            } 
+
+            if (res->val_rc_proof_count) {
+                int             i;
+                for (i = 0; i < res->val_rc_proof_count; i++) {
+                    if (res->val_rc_proofs[i] == NULL)
+                        continue;
+                    rrset = res->val_rc_proofs[i]->val_ac_rrset;
+                    if (rrset == NULL || rrset_section(rrset) != section)
+                        continue;
+                    if (-1 == encode_response_rrset(rrset, &rp, eom, 
+                                                    dnptrs, lastdnptr,
+                                                    count, seen, &truncated)) {
+                        return VAL_BAD_ARGUMENT;
+                    }
+                }
+            }
+        }
     }
 
+    hp->ancount = htons(ancount);
+    hp->nscount = htons(nscount);
+    hp->arcount = htons(arcount);
+    hp->tc = truncated ? 1 : 0;
 
     for (res = results; res; res = res->val_rc_next) {
 
-        f_resp->vr_val_status = res->val_rc_status;
+        *val_status = res->val_rc_status;
 
         /* set the value of merged trusted and validated status values */
         if (!(validated && val_isvalidated(res->val_rc_status))) 
@@ -372,43 +408,8 @@ compose_answer(const char * name,
         if (!(trusted && val_istrusted(res->val_rc_status))) 
             trusted = 0;
 
-        if (res->val_rc_rrset) {
-            rrset = res->val_rc_rrset;
-            if (-1 ==
-                encode_response_rrset(rrset,
-                                      res->val_rc_status, resp_len,
-                                      &anbuf, &anbufindex, &ancount,
-                                      &nsbuf, &nsbufindex, &nscount,
-                                      &arbuf, &arbufindex, &arcount,
-                                      &an_auth, &ns_auth)) {
-                retval = VAL_BAD_ARGUMENT;
-                goto err;
-            }
-        } 
-
-        if (res->val_rc_proof_count) {
-            int             i;
-            for (i = 0; i < res->val_rc_proof_count; i++) {
-                rrset = res->val_rc_proofs[i]->val_ac_rrset;
-                if (-1 ==
-                    encode_response_rrset(rrset,
-                                          res->val_rc_status,
-                                          resp_len, &anbuf, &anbufindex,
-                                          &ancount, &nsbuf, &nsbufindex,
-                                          &nscount, &arbuf, &arbufindex,
-                                          &arcount, &an_auth, &ns_auth)) {
-                    retval = VAL_BAD_ARGUMENT;
-                    goto err;
-                }
-            }
-        }
-
         hp->ad = trusted ? 1:0; 
 
-        hp->ancount = htons(ancount);
-        hp->nscount = htons(nscount);
-        hp->arcount = htons(arcount);
-
         switch (res->val_rc_status) {
             case VAL_NONEXISTENT_TYPE:
             case VAL_NONEXISTENT_TYPE_NOCHAIN: 
@@ -428,7 +429,7 @@ compose_answer(const char * name,
                 break;
                 
             default:
-                if (hp->ancount > 0) {
+                if (an_seen > 0) {
                     hp->rcode = ns_r_noerror;
                     SET_LAST_ERR(NETDB_SUCCESS);
                 }
@@ -440,48 +441,116 @@ compose_answer(const char * name,
         }
     }
 
-    if (anbuf) {
-        memcpy(rp, anbuf, anbufindex);
-        rp += anbufindex;
-    }
-
-    if (nsbuf) {
-        memcpy(rp, nsbuf, nsbufindex);
-        rp += nsbufindex;
-    }
-
-    if (arbuf) {
-        memcpy(rp, arbuf, arbufindex);
-        rp += arbufindex;
-    }
-    FREE(anbuf);
-    FREE(nsbuf);
-    FREE(arbuf);
-
     /* 
      * we lose a level of granularity in the validation status
      * when we do a "merge"
      */
     if (validated)
-        f_resp->vr_val_status = VAL_VALIDATED_ANSWER;
+        *val_status = VAL_VALIDATED_ANSWER;
     else if (trusted)
-        f_resp->vr_val_status = VAL_TRUSTED_ANSWER;
+        *val_status = VAL_TRUSTED_ANSWER;
     else
-        f_resp->vr_val_status = VAL_UNTRUSTED_ANSWER;
+        *val_status = VAL_UNTRUSTED_ANSWER;
+
+    if (truncated) {
+        /* uncompressed size is an upper bound on what is needed */
+        *resp_len = OUTER_HEADER_LEN;
+        for (res = results; res; res = res->val_rc_next) {
+            *resp_len += determine_size(res);
+        }
+        if (*resp_len <= anslen)
+            *resp_len = anslen + 1;
+    } else {
+        *resp_len = rp - answer;
+    }
 
     return VAL_NO_ERROR;
+}
+
+/*
+ * Function: compose_answer
+ *
+ * Purpose: Convert the list of val_result_chain structures returned 
+ *          by the validator into a linked list of val_response structures
+ *
+ * Parameters:
+ *              name_n -- The domain name.
+ *              type_h -- The DNS type.
+ *             class_h -- The DNS class.
+ *             results -- A linked list of val_result_chain structures returned
+ *                        by the validator's val_resolve_and_check function.
+ *                resp -- The structures within which answers are to be returned 
+ * Return value: VAL_NO_ERROR on success, and a negative valued error code 
+ *               (see val_errors.h) on failure.
+ */
+
+int
+compose_answer(const char * name,
+               int type_h,
+               int class_h,
+               struct val_result_chain *results,
+               struct val_response *f_resp)
+{
+    struct val_result_chain *res = NULL;
+    size_t          resp_len = 0;
+    size_t          buf_len;
+    int             retval;
+    u_char name_n[NS_MAXCDNAME];
+
+    if ((f_resp == NULL) || (name == NULL))
+        return VAL_BAD_ARGUMENT;
 
-  err:
-    FREE(anbuf);
-    FREE(nsbuf);
-    FREE(arbuf);
-    FREE(f_resp->vr_response);
-    f_resp->vr_response = NULL;
-    f_resp->vr_length = 0;
+    memset(f_resp, 0, sizeof(struct val_response));
     f_resp->vr_val_status = VAL_UNTRUSTED_ANSWER;
 
+    if (ns_name_pton(name, name_n, sizeof(name_n)) == -1) {
+        return VAL_BAD_ARGUMENT;
+    }
+
+    /* 
+     * size the buffer for the uncompressed response; 
+     * the compressed one is never larger 
+     */
+    for (res = results; res; res = res->val_rc_next) {
+        resp_len += determine_size(res);
+    }
+    buf_len = resp_len + OUTER_HEADER_LEN;
+
+    f_resp->vr_response = (u_char *) MALLOC(buf_len * sizeof(u_char));
+    if (f_resp->vr_response == NULL) {
+        return VAL_OUT_OF_MEMORY;
+    }
+    memset(f_resp->vr_response, 0, buf_len * sizeof(u_char));
+
+    retval = compose_answer_buf(name, type_h, class_h, results,
+                                f_resp->vr_response, buf_len,
+                                &f_resp->vr_length, &f_resp->vr_val_status);
+    if (retval != VAL_NO_ERROR) {
+        FREE(f_resp->vr_response);
+        f_resp->vr_response = NULL;
+        f_resp->vr_length = 0;
+        f_resp->vr_val_status = VAL_UNTRUSTED_ANSWER;
+    }
+
     return retval;
+}
+
+/*
+ * Map a composed response to the value returned by val_res_query():
+ * the length of the response, or -1 if it does not contain a 
+ * positive answer.
+ */
+static int
+answer_retval(u_char * answer, size_t resp_len)
+{
+    HEADER *hp = (HEADER *) answer;
+
+    if (!hp || (hp->rcode != ns_r_noerror) || 
+        (hp->ancount == 0 && !hp->tc)) {
+        return -1;
+    }
 
+    return resp_len;
 }
 
 /*
@@ -514,11 +583,8 @@ val_res_query(val_context_t * context,
               int anslen,
               val_status_t * val_status)
 {
-    struct val_response resp;
     int    retval = VAL_NO_ERROR;
-    size_t bytestocopy = 0;
-    size_t totalbytes = 0;
-    HEADER *hp = NULL;
+    size_t resp_len = 0;
     struct val_result_chain *results;
     val_context_t *ctx = NULL;
 
@@ -542,10 +608,12 @@ val_res_query(val_context_t * context,
          val_resolve_and_check(ctx, dname, class_h, type, 
                         0, &results))) {
         /*
-         * Construct the answer response in resp 
+         * Construct the answer response directly in answer 
          */
         retval =
-            compose_answer(dname, type, class_h, results, &resp);
+            compose_answer_buf(dname, type, class_h, results, answer,
+                               (anslen > 0) ? (size_t) anslen : 0,
+                               &resp_len, val_status);
 
         val_free_result_chain(results);
         results = NULL;
@@ -557,19 +625,7 @@ val_res_query(val_context_t * context,
         goto err;
     }
     
-    totalbytes = resp.vr_length;
-
-    bytestocopy = (resp.vr_length > anslen) ? anslen : resp.vr_length;
-    memcpy(answer, resp.vr_response, bytestocopy);
-    *val_status = resp.vr_val_status;
-    FREE(resp.vr_response);
-
-    hp = (HEADER *) answer;
-    if (!hp || (hp->rcode != ns_r_noerror) || hp->ancount <= 0) {
-        return -1;
-    }
-
-    return totalbytes;
+    return answer_retval(answer, resp_len);
 
 err:
     val_log(ctx, LOG_ERR, "val_res_query(%s, %d, %d): Error - %s", 
@@ -580,6 +636,200 @@ err:
     return -1;
 }
 
+#ifndef VAL_NO_ASYNC
+/*
+ * State for a single search-list candidate in val_res_search_parallel()
+ */
+struct val_search_cand {
+    char                     sc_name[NS_MAXDNAME];
+    val_async_status        *sc_as;
+    int                      sc_done;
+    int                      sc_retval;
+    struct val_result_chain *sc_results;
+};
+
+static int
+_search_cand_callback(val_async_status *as, int event,
+                      val_context_t *ctx, void *cb_data, val_cb_params_t *cbp)
+{
+    struct val_search_cand *cand = (struct val_search_cand *)cb_data;
+
+    if (NULL == cand)
+        return VAL_NO_ERROR;
+
+    /*
+     * clear async_status ptr, as it will be freed after this callback 
+     * completes.
+     */
+    cand->sc_as = NULL;
+    cand->sc_done = 1;
+
+    if (VAL_AS_EVENT_COMPLETED == event && cbp != NULL) {
+        cand->sc_retval = cbp->retval;
+        /* take ownership of the results */
+        cand->sc_results = cbp->results;
+        cbp->results = NULL;
+    } else {
+        cand->sc_retval = VAL_INTERNAL_ERROR;
+    }
+
+    val_log(ctx, LOG_DEBUG, "val_res_search(): candidate %s completed (%d)",
+            cand->sc_name, cand->sc_retval);
+
+    return VAL_NO_ERROR;
+}
+
+/*
+ * Function: val_res_search_parallel
+ *
+ * Purpose: Submit queries for every name in the search list concurrently
+ *          and return the first successful answer, in search-list order.
+ *          Queries for candidates that are no longer needed are cancelled.
+ *
+ * Parameters: ctx -- The validation context, with CTX_LOCK_POL_SH held.
+ *             dname -- The unqualified name being searched for.
+ *             search -- Writable copy of the space/tab separated search list.
+ *             answer_len -- On success, set to the value that val_res_query()
+ *                           would have returned for the deciding candidate.
+ *                           If no candidate produced an answer and no hard
+ *                           error was seen, set to -1 with the last error
+ *                           set to HOST_NOT_FOUND or TRY_AGAIN.
+ *
+ * Returns: VAL_NO_ERROR if the search list was processed, or an error code
+ *          if the queries could not be submitted (in which case the caller
+ *          may fall back to the sequential search).
+ */
+static int
+val_res_search_parallel(val_context_t *ctx, const char *dname, char *search,
+                        int class_h, int type, u_char * answer, int anslen,
+                        val_status_t * val_status, int *answer_len)
+{
+    struct val_search_cand *cands = NULL;
+    size_t          resp_len;
+    struct timeval  tv;
+    char           *pos;
+    int             count, i, j;
+    int             retval = VAL_NO_ERROR;
+    int             last_err;
+
+    *answer_len = -1;
+
+    /*
+     * count the candidates 
+     */
+    count = 0;
+    for (pos = search; *pos; ) {
+        while (*pos == ' ' || *pos == '\t')
+            ++pos;
+        if (*pos == '\0')
+            break;
+        ++count;
+        while (*pos && *pos != ' ' && *pos != '\t')
+            ++pos;
+    }
+    if (count == 0)
+        return VAL_NO_ERROR;
+
+    cands = (struct val_search_cand *)
+        MALLOC(count * sizeof(struct val_search_cand));
+    if (cands == NULL)
+        return VAL_OUT_OF_MEMORY;
+    memset(cands, 0, count * sizeof(struct val_search_cand));
+
+    /*
+     * submit all candidates 
+     */
+    i = 0;
+    for (pos = search; *pos && i < count; ) {
+        char *start;
+        while (*pos == ' ' || *pos == '\t')
+            ++pos;
+        start = pos;
+        while (*pos && *pos != ' ' && *pos != '\t')
+            ++pos;
+        if (*pos)
+            *pos++ = 0;
+
+        snprintf(cands[i].sc_name, sizeof(cands[i].sc_name), "%s.%s",
+                 dname, start);
+        retval = val_async_submit(ctx, cands[i].sc_name, class_h, type, 0,
+                                  &_search_cand_callback, &cands[i],
+                                  &cands[i].sc_as);
+        if (VAL_NO_ERROR != retval) {
+            val_log(ctx, LOG_INFO,
+                    "val_res_search(): could not submit query for %s: %s",
+                    cands[i].sc_name, p_val_err(retval));
+            count = i;
+            goto done;
+        }
+        ++i;
+    }
+
+    /*
+     * Walk the candidates in search order. All queries are in flight,
+     * so by the time an earlier candidate has failed, later ones may
+     * already have completed.
+     */
+    for (i = 0; i < count; i++) {
+
+        while (!cands[i].sc_done) {
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+            if ((retval = val_async_check_wait(ctx, NULL, NULL, &tv, 0)) < 0) {
+                val_log(ctx, LOG_ERR, 
+                        "val_res_search(): error waiting for %s: %s",
+                        cands[i].sc_name, p_val_err(retval));
+                SET_LAST_ERR(NO_RECOVERY);
+                *answer_len = -1;
+                retval = VAL_NO_ERROR;
+                goto done;
+            }
+        }
+
+        if (VAL_NO_ERROR == cands[i].sc_retval &&
+            VAL_NO_ERROR == compose_answer_buf(cands[i].sc_name, type, class_h,
+                                               cands[i].sc_results, answer,
+                                               (anslen > 0) ? (size_t) anslen : 0,
+                                               &resp_len, val_status)) {
+            *answer_len = answer_retval(answer, resp_len);
+        } else {
+            SET_LAST_ERR(NO_RECOVERY);
+            *answer_len = -1;
+        }
+
+        /*
+         * Continue looking if we don't have a valid result
+         * and we haven't run into any hard error.
+         */
+        if (*answer_len >= 0)
+            break;
+        last_err = GET_LAST_ERR();
+        if (last_err != HOST_NOT_FOUND && last_err != TRY_AGAIN)
+            break;
+    }
+
+done:
+    /*
+     * cancel any queries that are still outstanding and release results
+     */
+    for (j = 0; j < count; j++) {
+        if (cands[j].sc_as != NULL) {
+            val_log(ctx, LOG_DEBUG, "val_res_search(): cancelling query for %s",
+                    cands[j].sc_name);
+            val_async_cancel(ctx, cands[j].sc_as, VAL_AS_CANCEL_NO_CALLBACKS);
+            cands[j].sc_as = NULL;
+        }
+        if (cands[j].sc_results != NULL) {
+            val_free_result_chain(cands[j].sc_results);
+            cands[j].sc_results = NULL;
+        }
+    }
+    FREE(cands);
+
+    return retval;
+}
+#endif /* VAL_NO_ASYNC */
+
 /*
  * wrapper around val_res_query() that is closer to res_search() 
  */
@@ -589,7 +839,7 @@ val_res_search(val_context_t * context, const char *dname, int class_h,
               val_status_t * val_status)
 {
     int             retval = -1;
-    char           *dot, *search, *pos;
+    char           *dot, *search, *search_list, *pos;
     char            buf[NS_MAXDNAME];
     int             last_err;
     val_context_t *ctx = NULL;
@@ -618,10 +868,33 @@ val_res_search(val_context_t * context, const char *dname, int class_h,
      * if there are no dots and we have a search path, use it
      */
     dot = strchr(dname, '.');
-    if ( (NULL == dot) && ctx->search) {
+    search_list = ctx->search; /* may be replaced by a reload */
+    if ( (NULL == dot) && search_list) {
 
         /** dup list so we can modify it */
-        char *save = search = strdup(ctx->search);
+        char *save = search = strdup(search_list);
+
+#ifndef VAL_NO_ASYNC
+        if (search && ctx->g_opt && ctx->g_opt->search_parallel) {
+            if (VAL_NO_ERROR == 
+                    val_res_search_parallel(ctx, dname, search, class_h,
+                                            type, answer, anslen,
+                                            val_status, &retval)) {
+                free(save);
+                if (retval >= 0)
+                    goto done;
+                last_err = GET_LAST_ERR();
+                if (last_err != HOST_NOT_FOUND &&/* name does not exist */
+                    last_err != TRY_AGAIN) /* DNS error */
+                    goto done;
+                /* try dname as-is */
+                search = save = NULL;
+            } else {
+                /* could not run in parallel; fall back to sequential */
+                strcpy(save, search_list);
+            }
+        }
+#endif
 
         while (search) {
 
@@ -3,6 +3,8 @@
 #include <validator/resolver.h>
 
 #include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef __linux__
 #define getprogname() program_invocation_short_name 
@@ -10,23 +12,130 @@
 
 typedef struct libval_context ValContext;
 
+/*
+ * By default every thread of the process shares one validator context.
+ * Setting LIBVAL_SHIM_CONTEXTS to "thread" gives each thread a context
+ * of its own, and setting it to a number N spreads the threads over a
+ * pool of N contexts, so that busy threaded programs don't queue up on
+ * the locks of a single context.  All contexts share the process-wide
+ * answer and name server caches.
+ */
+#define LIBVAL_SHIM_CONTEXTS "LIBVAL_SHIM_CONTEXTS"
+
 static ValContext *libval_shim_ctx = NULL;
+static int         libval_shim_pool_size = 0;  /* 0: shared, -1: per thread */
+
+#ifndef VAL_NO_THREADS
+#include <pthread.h>
+
+static pthread_once_t  libval_shim_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   libval_shim_key;
+static pthread_mutex_t libval_shim_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static ValContext    **libval_shim_pool = NULL;
+static unsigned int    libval_shim_next = 0;
+
+static void
+libval_shim_thread_done(void *ctx)
+{
+  /* only contexts of their own are freed; pooled ones are shared */
+  if (libval_shim_pool_size < 0 && ctx != NULL)
+      val_free_context((ValContext *)ctx);
+}
+
+static void
+libval_shim_setup(void)
+{
+  const char *mode = getenv(LIBVAL_SHIM_CONTEXTS);
+
+  if (mode != NULL && strcmp(mode, "thread") == 0) {
+      libval_shim_pool_size = -1;
+  } else if (mode != NULL && atoi(mode) > 1) {
+      libval_shim_pool_size = atoi(mode);
+      libval_shim_pool = (ValContext **) calloc(libval_shim_pool_size,
+                                                sizeof(ValContext *));
+      if (libval_shim_pool == NULL)
+          libval_shim_pool_size = 0;
+  }
+
+  if (libval_shim_pool_size != 0 &&
+      pthread_key_create(&libval_shim_key, libval_shim_thread_done) != 0)
+      libval_shim_pool_size = 0;
+}
+
+static ValContext *
+libval_shim_private_context(void)
+{
+  val_context_opt_t opt;
+  ValContext       *ctx = NULL;
+
+  memset(&opt, 0, sizeof(opt));
+  opt.vc_polflags = CTX_DYN_POL_PRIVATE;
+  if (val_create_context_ex(NULL, &opt, &ctx) != VAL_NO_ERROR)
+      return NULL;
+  return ctx;
+}
+
+/*
+ * Find the context for the calling thread
+ */
+static ValContext *
+libval_shim_context(void)
+{
+  ValContext   *ctx;
+  unsigned int  slot;
+
+  pthread_once(&libval_shim_once, libval_shim_setup);
+
+  /* created here rather than once, so a failure is retried next call */
+  if (libval_shim_pool_size == 0) {
+      pthread_mutex_lock(&libval_shim_pool_lock);
+      if (libval_shim_ctx == NULL &&
+          val_create_context(NULL, &libval_shim_ctx) != VAL_NO_ERROR)
+          libval_shim_ctx = NULL;
+      ctx = libval_shim_ctx;
+      pthread_mutex_unlock(&libval_shim_pool_lock);
+      return ctx;
+  }
+
+  ctx = (ValContext *) pthread_getspecific(libval_shim_key);
+  if (ctx != NULL)
+      return ctx;
+
+  if (libval_shim_pool_size < 0) {
+      ctx = libval_shim_private_context();
+  } else {
+      pthread_mutex_lock(&libval_shim_pool_lock);
+      slot = libval_shim_next++ % libval_shim_pool_size;
+      if (libval_shim_pool[slot] == NULL)
+          libval_shim_pool[slot] = libval_shim_private_context();
+      ctx = libval_shim_pool[slot];
+      pthread_mutex_unlock(&libval_shim_pool_lock);
+  }
+
+  if (ctx != NULL)
+      pthread_setspecific(libval_shim_key, ctx);
+  return ctx;
+}
 
-static int
+#else /* VAL_NO_THREADS */
+
+static ValContext *
 libval_shim_context(void)
 {
   if (libval_shim_ctx == NULL) {
       if (val_create_context(NULL, &libval_shim_ctx) != VAL_NO_ERROR)
-	return -1;
+	return NULL;
   }
-  return 0;
+  return libval_shim_ctx;
 }
 
+#endif /* VAL_NO_THREADS */
+
 static int 
 libval_shim_init(void)
 {
 
-  return (libval_shim_context());
+  return (libval_shim_context() == NULL ? -1 : 0);
 }
 
 
@@ -34,14 +143,15 @@ struct hostent *
 gethostbyname(const char *name)
 {
   val_status_t          val_status;
+  ValContext           *ctx;
   struct hostent *      res;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return NULL;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: gethostbyname(%s) called: wrapper\n", name);
   
-  res = val_gethostbyname(libval_shim_ctx, name, &val_status);
+  res = val_gethostbyname(ctx, name, &val_status);
 
   if (val_istrusted(val_status) && !val_does_not_exist(val_status)) {
       return res;
@@ -57,16 +167,17 @@ gethostbyname_r(const char * name,struct hostent * result_buf, char * buf,
 		int buflen, int * h_errnop)
 {
   val_status_t          val_status;
+  ValContext           *ctx;
   int                   ret;
   struct hostent *result = NULL;
   
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
       return NULL;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: gethostbyname_r(%s) called: wrapper\n", name);
 
   ret = 
-    val_gethostbyname_r(libval_shim_ctx, name, result_buf, buf, buflen, 
+    val_gethostbyname_r(ctx, name, result_buf, buf, buflen, 
 			&result, h_errnop,
 			&val_status);
 
@@ -83,15 +194,16 @@ gethostbyname_r(__const char * name,struct hostent * result_buf, char * buf,
                 size_t buflen, struct hostent ** result, int * h_errnop)
 {
   val_status_t          val_status;
+  ValContext           *ctx;
   int                   ret;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return NO_RECOVERY;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: gethostbyname_r(%s) called: wrapper\n", name);
 
   ret = 
-    val_gethostbyname_r(libval_shim_ctx, name, result_buf, buf, buflen, 
+    val_gethostbyname_r(ctx, name, result_buf, buf, buflen, 
 			result, h_errnop,
 			&val_status);
 
@@ -157,15 +269,16 @@ getaddrinfo(const char *node, const char *service, const struct addrinfo *hints,
 	    struct addrinfo **res)
 {
   val_status_t          val_status;
+  ValContext           *ctx;
   int                   ret;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return EAI_FAIL;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: getaddrinfo(%s, %s) called: wrapper\n",
 	  node, service);
 
-  ret = val_getaddrinfo(libval_shim_ctx, node, service, hints, res, &val_status);
+  ret = val_getaddrinfo(ctx, node, service, hints, res, &val_status);
 
   if (val_istrusted(val_status) && !val_does_not_exist(val_status)) {
       return ret;
@@ -196,11 +309,12 @@ getnameinfo(const struct sockaddr * sa, socklen_t salen, char * host,
 #endif
 {
   val_status_t          val_status;
+  ValContext           *ctx;
   char addrbuf[INET6_ADDRSTRLEN + 1];
   const char *addr;
   int ret;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return EAI_FAIL;
 
   if (sa->sa_family == AF_INET) {
@@ -215,7 +329,7 @@ getnameinfo(const struct sockaddr * sa, socklen_t salen, char * host,
   val_log(NULL, LOG_DEBUG, "libval_shim: getnameinfo(%s) called: wrapper\n", 
           addr);
 
-  ret = val_getnameinfo(libval_shim_ctx, sa, salen, host, hostlen, 
+  ret = val_getnameinfo(ctx, sa, salen, host, hostlen, 
 			            serv, servlen, flags,
 			            &val_status);
 
@@ -246,15 +360,16 @@ res_query(const char *dname, int class_h, int type_h,
 	  unsigned char *answer, int anslen)
 {
   val_status_t          val_status;
+  ValContext           *ctx;
   int ret;
 
-  if (libval_shim_init())
+  if ((ctx = libval_shim_context()) == NULL)
     return -1;
 
   val_log(NULL, LOG_DEBUG, "libval_shim: res_query(%s,%d,%d) called: wrapper\n",
 	  dname, class_h, type_h);
 
-  ret = val_res_query(libval_shim_ctx, dname, class_h, type_h, answer, anslen,
+  ret = val_res_query(ctx, dname, class_h, type_h, answer, anslen,
 			&val_status);
 
   if (val_istrusted(val_status) && !val_does_not_exist(val_status)) {
@@ -38,6 +38,8 @@ LIBSRES_OBJS = $(TMP_LIBSRES_D)\base64.obj \
 	$(TMP_LIBSRES_D)\res_io_manager.obj \
 	$(TMP_LIBSRES_D)\res_mkquery.obj \
 	$(TMP_LIBSRES_D)\res_query.obj \
+	$(TMP_LIBSRES_D)\res_srtt.obj \
+	$(TMP_LIBSRES_D)\res_record.obj \
 	$(TMP_LIBSRES_D)\res_support.obj \
 	$(TMP_LIBSRES_D)\res_tsig.obj
 
@@ -55,6 +57,8 @@ LIBVAL_OBJS = $(TMP_LIBVAL_D)\dllmain.obj \
 	$(TMP_LIBVAL_D)\val_parse.obj \
 	$(TMP_LIBVAL_D)\val_policy.obj \
 	$(TMP_LIBVAL_D)\val_resquery.obj \
+	$(TMP_LIBVAL_D)\val_stats.obj \
+	$(TMP_LIBVAL_D)\val_batch.obj \
 	$(TMP_LIBVAL_D)\val_support.obj \
 	$(TMP_LIBVAL_D)\val_verify.obj \
 	$(TMP_LIBVAL_D)\val_x_query.obj